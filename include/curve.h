@@ -0,0 +1,27 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Per channel fan curves between the tach counts the host asks for and the
+ * ones the fan chips are set to. Each curve is a list of breakpoints, linear
+ * in between and flat past both ends.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define CURVE_CHANNELS (14)
+#define CURVE_POINTS (8)
+
+typedef struct {
+    uint16_t in;  // Host side tach count
+    uint16_t out; // Fan chip tach count
+} CURVE_POINT;
+
+// Load the built in curves
+void curve_init(void);
+// Replace the curve of a channel, 2 to CURVE_POINTS breakpoints strictly
+// increasing on both sides. Returns 0, or -1 with the old curve kept.
+int curve_set(uint32_t channel, const CURVE_POINT *points, uint32_t count);
+// Host tach count to fan chip tach count and back
+uint32_t curve_forward(uint32_t channel, uint32_t val);
+uint32_t curve_backward(uint32_t channel, uint32_t val);
@@ -0,0 +1,35 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Closed loop fan speed control. A timer interrupt paces a PID per channel
+ * on the tach read back from the fan chips, which moves the setpoint the
+ * chips get, so the fans end up at the speed the host asked for even when
+ * they do not follow their setpoint exactly. The PID itself runs from the
+ * main loop.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define FANCTL_HZ (20)
+
+// Gains in 1/256, output and error in tach counts
+typedef struct {
+    int32_t kp;
+    int32_t ki;
+    int32_t kd;
+} FANCTL_GAINS;
+
+extern FANCTL_GAINS fanctl_gains;
+// Set by the control interrupt every period, time for fanctl_run()
+extern volatile uint32_t fanctl_update_req;
+
+void fanctl_init(void);
+// Start the control period, with fresh tach readings available
+void fanctl_start(void);
+void fanctl_stop(void);
+// One control period: new fm_requested_tach from the request and the last
+// tach reading
+void fanctl_run(void);
+// Bit per channel whose fm_requested_tach moved since the last call
+uint32_t fanctl_take_changed(void);
@@ -5,8 +5,25 @@
 
 extern uint32_t fm_requested_tach[14];
 extern uint32_t fm_actual_tach[14];
+// Bit per channel, set while its chip is not answering. fm_actual_tach
+// keeps the last good reading.
+extern uint32_t fm_failed;
+// Set once all chips of a fanmaster_get_tach_async() answered or failed
+extern volatile uint32_t fm_tach_req;
+// Move both channels of a chip in one block transaction, default on
+extern bool fm_burst;
 
 void fanmaster_init(void);
 void fanmaster_start(void);
+// Blocking, return once every chip has been updated
 void fanmaster_set_tach(void);
-void fanmaster_get_tach(void);
\ No newline at end of file
+void fanmaster_get_tach(void);
+// Queue the update on both buses and return, fm_actual_tach is filled in
+// as the reads complete. Wait for the previous update of the same kind when
+// still running, setpoints and tach reads queue up behind each other.
+void fanmaster_set_tach_async(void);
+// Same for the chips with a channel in mask only, failed chips included
+void fanmaster_set_tach_mask_async(uint32_t mask);
+void fanmaster_get_tach_async(void);
+bool fanmaster_busy(void);
+void fanmaster_wait(void);
\ No newline at end of file
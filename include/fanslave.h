@@ -3,11 +3,30 @@
  */
 #pragma once
 
-extern bool fs_enabled[14];
-extern uint32_t fs_requested_tach[14];
-extern uint32_t fs_actual_tach[14];
+#include <stdint.h>
+
+#define FS_CHANNELS (14)
+
+// What the SMC asked for, written from the slave ISR. Read them through
+// fanslave_get_request() anywhere the ISR can come in.
+extern bool fs_enabled[FS_CHANNELS];
+extern uint32_t fs_requested_tach[FS_CHANNELS];
+
+typedef struct {
+    uint32_t tach[FS_CHANNELS];
+    bool enabled[FS_CHANNELS];
+    uint32_t gen[FS_CHANNELS]; // Moves on every change of the channel
+} FS_REQUEST;
 
 extern volatile uint32_t start_req;
+// Set whenever a setpoint or enable bit changes, see fanslave_take_dirty()
+// for which
 extern volatile uint32_t rpm_update_req;
 
-void fanslave_init(void);
\ No newline at end of file
+void fanslave_init(void);
+// All channels as of one point in time, from any context
+void fanslave_get_request(FS_REQUEST *request);
+// Bit per channel changed since the last call
+uint32_t fanslave_take_dirty(void);
+// Publish the tach readback of all channels at once, from the main loop
+void fanslave_set_actual(const uint32_t tach[FS_CHANNELS]);
\ No newline at end of file
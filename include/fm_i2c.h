@@ -0,0 +1,48 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Queued, interrupt driven I2C master transactions. Each bus works through
+ * its own queue from the event/error interrupts, payloads move by DMA, so
+ * both buses run at the same time and the CPU is free meanwhile.
+ * Transactions have a deadline, a bus that hangs or errors out is clocked
+ * free, reset and the transaction tried once more.
+ */
+#pragma once
+
+#include <stdint.h>
+
+typedef enum {
+    FM_I2C_PENDING,
+    FM_I2C_DONE,
+    FM_I2C_NACK, // Address or data byte not acknowledged
+    FM_I2C_ERROR, // Bus error or arbitration lost
+    FM_I2C_TIMEOUT // Not done before its deadline, bus stuck
+} FM_I2C_STATUS;
+
+typedef struct FM_I2C_XFER FM_I2C_XFER;
+// Called from interrupt context once the transaction is over
+typedef void (*FM_I2C_DONE_CB)(FM_I2C_XFER *xfer);
+
+// Writes tx, then reads rx after a repeated START. Leave tx empty for a
+// plain read or rx for a plain write.
+// Owned by the engine from submit until the status leaves FM_I2C_PENDING.
+struct FM_I2C_XFER {
+    FM_I2C_XFER *next;
+    uint8_t addr; // 7-bit
+    const uint8_t *tx;
+    uint32_t tx_size;
+    uint8_t *rx;
+    uint32_t rx_size;
+    FM_I2C_DONE_CB done_cb;
+    uint8_t tries; // Used by the engine
+    volatile FM_I2C_STATUS status;
+};
+
+// speed in Hz up to 400 kHz, duty I2C_DTCY_2 or (fast mode) I2C_DTCY_16_9
+void fm_i2c_init(uint32_t i2c, uint32_t speed, uint32_t duty);
+void fm_i2c_submit(uint32_t i2c, FM_I2C_XFER *xfer);
+bool fm_i2c_busy(uint32_t i2c);
+// Sleep until both buses have run out of transactions
+void fm_i2c_wait(void);
+// Sleep until one transaction is over, the rest of the queue carries on
+void fm_i2c_wait_xfer(FM_I2C_XFER *xfer);
@@ -0,0 +1,21 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * ECLIC levels of every interrupt the firmware takes, with the priority
+ * group at ECLIC_PRIGROUP_LEVEL3_PRIO1. A higher level preempts a lower one.
+ *
+ * The soft I2C slave has to catch every SCL edge of the SMC, a few hundred
+ * nanoseconds to a few microseconds each, so it has the top level to itself.
+ * Everything else (LCD DMA, control and scheduler timers, I2C masters) can
+ * be late without harm and shares the bottom level, where it runs as long
+ * as it takes without holding up the slave.
+ *
+ * With SI2C_WRITE_BEHIND the slave hands finished writes to a handler in
+ * between. The register side effects then come in ahead of the main loop
+ * and the other interrupts, still without holding up the slave.
+ */
+#pragma once
+
+#define IRQ_LEVEL_SLAVE (3)
+#define IRQ_LEVEL_FLUSH (2)
+#define IRQ_LEVEL_DEFAULT (1)
@@ -5,6 +5,10 @@
  */
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+#include "ui.h"
+
 //#define LCD_HORIZONTAL
 #define LCD_VERTICAL
 
@@ -20,9 +24,49 @@
 #define LCD_OFFSET_Y (1)
 #endif
 
-extern uint16_t framebuffer[LCD_WIDTH * LCD_HEIGHT];
+// Frame rate governor, shortest time between the start of two frames
+#define LCD_FRAME_MS (50)
+
+// Framebuffer holds palette indices, packed MSB first. The small UI has
+// 2 colours, the large one 5.
+#ifdef LARGE_UI
+#define LCD_BPP (4)
+#else
+#define LCD_BPP (1)
+#endif
+#define LCD_COLORS (1 << LCD_BPP)
+#define LCD_PPB (8 / LCD_BPP)
+#define LCD_STRIDE (LCD_WIDTH / LCD_PPB)
+
+extern uint8_t framebuffer[LCD_STRIDE * LCD_HEIGHT];
+
+static inline uint8_t lcd_get_pixel(size_t x, size_t y) {
+    uint32_t shift = (LCD_PPB - 1 - x % LCD_PPB) * LCD_BPP;
+    return (framebuffer[y * LCD_STRIDE + x / LCD_PPB] >> shift) &
+            (LCD_COLORS - 1);
+}
+
+static inline void lcd_put_pixel(size_t x, size_t y, uint8_t index) {
+    uint32_t shift = (LCD_PPB - 1 - x % LCD_PPB) * LCD_BPP;
+    uint8_t *p = &framebuffer[y * LCD_STRIDE + x / LCD_PPB];
+    *p = (*p & ~((LCD_COLORS - 1) << shift)) | (index << shift);
+}
 
 void lcd_init(void);
 void lcd_set_window(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2);
-void lcd_clear(uint16_t color);
-void lcd_update(void);
\ No newline at end of file
+// RGB565 colour of a palette index, a change redraws the whole screen
+void lcd_set_palette(uint8_t index, uint16_t color);
+uint16_t lcd_get_palette(uint8_t index);
+// Fill the framebuffer and mark all of it dirty
+void lcd_clear(uint8_t index);
+// Framebuffer area that has to go out with the next update, inclusive
+void lcd_mark_dirty(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2);
+// Start sending the dirty parts of the framebuffer by DMA and return. Waits
+// for the previous frame if still going out, check lcd_ready() to avoid that.
+void lcd_update(void);
+// Frame still going out, the framebuffer should be left alone as it gets
+// expanded into the DMA buffers band by band
+bool lcd_busy(void);
+// Previous frame is out and the governor allows the next one
+bool lcd_ready(void);
+void lcd_wait(void);
\ No newline at end of file
@@ -0,0 +1,40 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Run to completion task scheduler for the main loop. A task runs when its
+ * flag is set, either by an interrupt handler (the request flags the other
+ * modules export) or by its software timer, which the machine timer compare
+ * interrupt drives. Tasks never preempt each other, the one registered first
+ * goes first. With nothing to run the core sleeps in WFI.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define SCHED_TASKS (8)
+
+typedef void (*SCHED_FUNC)(void);
+
+typedef struct {
+    uint64_t start; // mtime at sched_init() / sched_stats_reset()
+    uint64_t idle; // mtime ticks spent in WFI
+    uint32_t wakeups;
+    uint32_t runs[SCHED_TASKS];
+} SCHED_STATS;
+
+extern SCHED_STATS sched_stats;
+
+void sched_init(void);
+// Add a task, in priority order. flag is cleared before each run, NULL
+// gives the task a flag of its own for sched_post() and its timer.
+// Returns the task id, -1 when full.
+int sched_add(SCHED_FUNC func, volatile uint32_t *flag);
+// Set the flag of a task every period_ms from now on, 0 stops the timer
+void sched_every(int id, uint32_t period_ms);
+void sched_post(int id);
+// Run the first ready task, or sleep until an interrupt if there is none
+void sched_step(void);
+void sched_run(void) __attribute__((noreturn));
+void sched_stats_reset(void);
+// Share of the time since sched_stats_reset() spent asleep, in 1/1000
+uint32_t sched_idle_permille(void);
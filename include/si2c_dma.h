@@ -0,0 +1,59 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Soft I2C slave receiving from an oversampled copy of the bus. A timer
+ * makes the DMA copy the port input register into a ring at a fixed rate,
+ * and the samples get decoded in bulk. SDA stays in open drain output mode
+ * and is only driven from SCL falling edge interrupts, which are skipped
+ * with a countdown until the slave actually has to change SDA: the address
+ * and data ACKs and the bits of a read.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "softi2c.h"
+
+// 10 samples per SCL period at 100 kHz. Standard mode only, fast mode
+// SCL high time is shorter than a sample.
+#define SI2C_DMA_SAMPLE_HZ (1000000)
+// Decoded at half and full, 128 us of bus time each
+#define SI2C_DMA_SAMPLES (256)
+#define SI2C_DMA_BUSES (2)
+
+typedef enum {
+    SD_IDLE,
+    SD_ADDR,
+    SD_WRITE,
+    SD_READ,
+    SD_WAIT_STOP
+} SI2C_DMA_STATE;
+
+typedef struct {
+    uint32_t bus_id; // Below SI2C_DMA_BUSES
+    uint32_t gpio; // All buses on the port given to si2c_dma_start()
+    uint32_t sda_pin;
+    uint32_t scl_pin;
+    SI2C_READ_CB read_cb;
+    SI2C_WRITE_CB write_cb;
+    SI2C_STOP_CB stop_cb;
+    SI2C_DMA_STATE state;
+    uint32_t level; // SCL and SDA in the last decoded sample
+    uint32_t bits; // SCL rising edges in the current byte, 8 = ACK clock next
+    uint32_t wait; // SCL falling edges until the interrupt has work to do
+    bool synced; // A START or STOP reset wait since the DMA interrupt began
+    bool read_last;
+    uint8_t addr;
+    uint8_t data;
+} SI2C_DMA_CONTEXT;
+
+void si2c_dma_init(SI2C_DMA_CONTEXT *context);
+void si2c_dma_start(uint32_t gpio);
+// Call from the EXTI handler on every SCL falling edge
+void si2c_dma_scl_irq(SI2C_DMA_CONTEXT *context);
+// Decode the samples taken since the last call, for every bus
+void si2c_dma_poll(void);
+
+// Building blocks, exposed for the host tests
+void si2c_dma_decode(SI2C_DMA_CONTEXT *context, const uint16_t *samples,
+        uint32_t count);
+void si2c_dma_falling(SI2C_DMA_CONTEXT *context);
@@ -0,0 +1,76 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Soft I2C slave trace. Build with -D SI2C_TRACE to log every ISR entry
+ * into a ring buffer, otherwise the hooks compile to nothing. The ISR is
+ * the only producer and the main loop (or a debugger) the only consumer,
+ * so head and tail each have a single writer and no locking is needed.
+ */
+#pragma once
+
+#include <stdint.h>
+
+// Number of records, power of 2
+#define SI2C_TRACE_SIZE (256)
+
+typedef enum {
+    TR_EDGE = 0,       // ISR entry, state before processing the edge
+    TR_START = 1,
+    TR_STOP = 2,
+    TR_UPDATE_REQ = 3, // A setpoint or enable bit changed, rpm_update_req set
+    TR_START_REQ = 4   // start_req set
+} SI2C_TRACE_EVENT;
+
+typedef struct {
+    uint32_t time; // Low word of mtime, SystemCoreClock / 4
+    uint8_t bus;
+    uint8_t state;
+    uint8_t pin;
+    uint8_t event;
+} SI2C_TRACE_RECORD;
+
+// Layout is fixed so a memory dump can be decoded on the host
+typedef struct {
+    volatile uint32_t head; // Free running, written by the ISR only
+    volatile uint32_t tail; // Free running, written by the reader only
+    volatile uint32_t dropped;
+    SI2C_TRACE_RECORD records[SI2C_TRACE_SIZE];
+} SI2C_TRACE_RING;
+
+#ifdef SI2C_TRACE
+
+#include "gd32vf103.h"
+
+extern SI2C_TRACE_RING si2c_trace_ring;
+
+static inline void si2c_trace_log(uint32_t bus, uint32_t state, uint32_t pin,
+        SI2C_TRACE_EVENT event) {
+    uint32_t head = si2c_trace_ring.head;
+    if (head - si2c_trace_ring.tail >= SI2C_TRACE_SIZE) {
+        // Reader fell behind, keep the old records
+        si2c_trace_ring.dropped++;
+        return;
+    }
+    SI2C_TRACE_RECORD *record =
+            &si2c_trace_ring.records[head & (SI2C_TRACE_SIZE - 1)];
+    record->time = (uint32_t)get_timer_value();
+    record->bus = bus;
+    record->state = state;
+    record->pin = pin;
+    record->event = event;
+    // Record must be complete before the reader can see it
+    __asm__ volatile ("" ::: "memory");
+    si2c_trace_ring.head = head + 1;
+}
+
+void si2c_trace_reset(void);
+bool si2c_trace_read(SI2C_TRACE_RECORD *record);
+
+#define SI2C_TRACE_LOG(bus, state, pin, event) \
+        si2c_trace_log((bus), (state), (pin), (event))
+
+#else
+
+#define SI2C_TRACE_LOG(bus, state, pin, event) do { } while (0)
+
+#endif
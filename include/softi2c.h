@@ -10,6 +10,28 @@ typedef void (*SI2C_READ_CB)(uint32_t bus_id, uint8_t addr, uint8_t *byte,
         bool *last);
 typedef void (*SI2C_STOP_CB)(uint32_t bus_id, uint8_t addr);
 
+// Build with -D SI2C_WRITE_BEHIND to have the data ACK edge only store the
+// byte. The ISR hands a write over as a whole on the edge ending it, a STOP
+// or repeated START, or whenever the buffer fills up. It then raises
+// flush_line, an EXTI line with only the software trigger on it, whose
+// handler calls si2c_flush() at a level below the slave ISR. stop_cb comes
+// after the bytes of the write it ends. Anything the handler has not got to
+// yet is passed on by the ISR before the next read byte or hand over, so the
+// callbacks still see every transaction in order. With flush_line 0 the ISR
+// passes the bytes on itself, on the edge ending the write.
+#define SI2C_TXN_SIZE (34) // SMBus block write: command, count, 32 bytes
+
+// Build with -D SI2C_STRETCH to stretch the clock. SCL becomes an open
+// drain output, and it is held low while read_cb or write_cb runs on a
+// falling edge. The master then waits for the slave however long the
+// callback takes. The stretch can only start once the ISR is in, so the
+// interrupt latency still has to fit in the SCL low time.
+
+// 8-bit address byte, R/W in bit 0: fan controllers 0x50-0x57, PCA9536 0x41
+static inline bool si2c_addr_match(uint8_t addr) {
+    return ((addr & 0xf8) == 0xa0) || ((addr & 0xfe) == 0x82);
+}
+
 typedef enum {
     ST_IDLE = 0,
     ST_ADDR = 1,
@@ -36,12 +58,39 @@ typedef struct {
     SI2C_READ_CB read_cb;
     SI2C_WRITE_CB write_cb;
     SI2C_STOP_CB stop_cb;
+    // SDA direction switch, control word bits precomputed by si2c_init
+    volatile uint32_t *sda_ctl;
+    uint32_t sda_ctl_mask;
+    uint32_t sda_ctl_out;
+    uint32_t sda_ctl_in;
     SI2C_STATE state;
     uint32_t count;
     bool read_last;
     uint8_t addr;
     uint8_t data;
+    // SCL edges found with SCL already back at the other level: the ISR
+    // came in too late and bits were lost, the transaction is corrupt
+    uint32_t late;
+#ifdef SI2C_WRITE_BEHIND
+    uint32_t flush_line;
+    // Write coming in, into txn[txn_buf]. The other buffer holds the one
+    // handed over: flush_len bytes for flush_addr, flush_pos of them passed
+    // on so far, and stop_cb behind them if it ended in a STOP.
+    uint32_t txn_len;
+    uint32_t txn_buf;
+    uint8_t txn[2][SI2C_TXN_SIZE];
+    volatile bool flush_busy;
+    uint32_t flush_len;
+    uint32_t flush_pos;
+    uint8_t flush_addr;
+    bool flush_stop;
+#endif
 } SI2C_CONTEXT;
 
 void si2c_init(SI2C_CONTEXT *context);
 void si2c_process(SI2C_CONTEXT *context, SI2C_PIN pin);
+#ifdef SI2C_WRITE_BEHIND
+// Pass on what the ISR handed over, from the handler of flush_line. Each
+// callback runs with interrupts off, the ISR never comes in halfway.
+void si2c_flush(SI2C_CONTEXT *context);
+#endif
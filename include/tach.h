@@ -0,0 +1,17 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Fan tach count <-> RPM
+ */
+#pragma once
+
+#include <stdint.h>
+
+// RPM = TACH_RPM_K / tach count, and the other way round
+#define TACH_RPM_K (81920 * 60)
+
+// A count or RPM of 0 (no reading, fan stopped) converts to 0
+uint32_t tach_to_rpm(uint32_t tach);
+// Same results from a seed table, one Newton step and a multiply
+uint32_t tach_to_rpm_recip(uint32_t tach);
+uint32_t rpm_to_tach(uint32_t rpm);
@@ -3,9 +3,14 @@
  */
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 //#define LARGE_UI
 #define SMALL_UI
 
 void ui_init(void);
+void ui_disp_char(size_t x, size_t y, char c);
+void ui_disp_string(size_t x, size_t y, char *str);
 void ui_disp_num(size_t x, size_t y, uint32_t num);
 void ui_disp_hex(size_t x, size_t y, uint32_t num);
\ No newline at end of file
@@ -0,0 +1,70 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Host shim of the GD32VF103 SDK. Only what the firmware actually uses is
+ * provided. Registers are backed by plain memory, peripherals that need
+ * behaviour (GPIO levels, EXTI edge detection, I2C and SPI masters, timers,
+ * DMA) are modelled in the native_*.c files. See native.h for the test
+ * harness API.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {DISABLE = 0, ENABLE = !DISABLE} EventStatus, ControlStatus;
+typedef enum {FALSE = 0, TRUE = !FALSE} bool;
+typedef enum {RESET = 0, SET = 1, MAX = 0X7FFFFFFF} FlagStatus;
+typedef enum {ERROR = 0, SUCCESS = !ERROR} ErrStatus;
+
+#define BIT(x)          ((uint32_t)((uint32_t)0x01U << (x)))
+#define BITS(start, end) ((0xFFFFFFFFUL << (start)) & \
+        (0xFFFFFFFFUL >> (31U - (uint32_t)(end))))
+
+typedef enum {
+    CLIC_INT_TMR = 7,
+    EXTI0_IRQn = 25,
+    EXTI1_IRQn = 26,
+    EXTI2_IRQn = 27,
+    EXTI3_IRQn = 28,
+    EXTI4_IRQn = 29,
+    DMA0_Channel0_IRQn = 30,
+    DMA0_Channel1_IRQn = 31,
+    DMA0_Channel2_IRQn = 32,
+    DMA0_Channel3_IRQn = 33,
+    DMA0_Channel4_IRQn = 34,
+    DMA0_Channel5_IRQn = 35,
+    DMA0_Channel6_IRQn = 36,
+    EXTI5_9_IRQn = 42,
+    TIMER0_UP_IRQn = 44,
+    TIMER1_IRQn = 47,
+    TIMER2_IRQn = 48,
+    TIMER3_IRQn = 49,
+    I2C0_EV_IRQn = 50,
+    I2C0_ER_IRQn = 51,
+    I2C1_EV_IRQn = 52,
+    I2C1_ER_IRQn = 53,
+    SPI0_IRQn = 54,
+    SPI1_IRQn = 55,
+    EXTI10_15_IRQn = 59,
+    TIMER4_IRQn = 69,
+    TIMER5_IRQn = 73,
+    TIMER6_IRQn = 74,
+    DMA1_Channel0_IRQn = 75,
+    DMA1_Channel1_IRQn = 76,
+    DMA1_Channel2_IRQn = 77,
+    DMA1_Channel3_IRQn = 78,
+    DMA1_Channel4_IRQn = 79,
+    ECLIC_NUM_INTERRUPTS = 87
+} IRQn_Type;
+
+extern uint32_t SystemCoreClock;
+
+#include "n200_func.h"
+#include "gd32vf103_rcu.h"
+#include "gd32vf103_gpio.h"
+#include "gd32vf103_exti.h"
+#include "gd32vf103_i2c.h"
+#include "gd32vf103_dma.h"
+#include "gd32vf103_timer.h"
+#include "gd32vf103_spi.h"
@@ -0,0 +1,138 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * DMA channels move data when their request line fires (see
+ * native_dma_request), with the SDK's counter, circular mode and flag
+ * semantics. Addresses are host pointers, so they are uintptr_t here
+ * where the SDK has uint32_t; cast with (uintptr_t) in shared code.
+ */
+#pragma once
+
+#include "gd32vf103.h"
+
+#define DMA0 (0U)
+#define DMA1 (1U)
+#define NATIVE_DMA_PERIPHS (2U)
+#define NATIVE_DMA_CHANNELS (7U)
+
+typedef enum {
+    DMA_CH0 = 0,
+    DMA_CH1,
+    DMA_CH2,
+    DMA_CH3,
+    DMA_CH4,
+    DMA_CH5,
+    DMA_CH6
+} dma_channel_enum;
+
+typedef struct {
+    volatile uint32_t ctl;
+    volatile uint32_t cnt;
+    volatile uintptr_t paddr;
+    volatile uintptr_t maddr;
+    // Transfer count the channel was started with, reload value
+    uint32_t number;
+} native_dma_channel_t;
+
+typedef struct {
+    volatile uint32_t intf;
+    native_dma_channel_t ch[NATIVE_DMA_CHANNELS];
+} native_dma_t;
+
+extern native_dma_t native_dma[NATIVE_DMA_PERIPHS];
+
+#define DMA_INTF(dmax)         (native_dma[(dmax)].intf)
+#define DMA_CHCTL(dmax, chx)   (native_dma[(dmax)].ch[(chx)].ctl)
+#define DMA_CHCNT(dmax, chx)   (native_dma[(dmax)].ch[(chx)].cnt)
+#define DMA_CHPADDR(dmax, chx) (native_dma[(dmax)].ch[(chx)].paddr)
+#define DMA_CHMADDR(dmax, chx) (native_dma[(dmax)].ch[(chx)].maddr)
+
+// DMA_CHxCTL
+#define DMA_CHXCTL_CHEN   BIT(0)
+#define DMA_CHXCTL_FTFIE  BIT(1)
+#define DMA_CHXCTL_HTFIE  BIT(2)
+#define DMA_CHXCTL_ERRIE  BIT(3)
+#define DMA_CHXCTL_DIR    BIT(4)
+#define DMA_CHXCTL_CMEN   BIT(5)
+#define DMA_CHXCTL_PNAGA  BIT(6)
+#define DMA_CHXCTL_MNAGA  BIT(7)
+#define DMA_CHXCTL_PWIDTH BITS(8, 9)
+#define DMA_CHXCTL_MWIDTH BITS(10, 11)
+#define DMA_CHXCTL_PRIO   BITS(12, 13)
+#define DMA_CHXCTL_M2M    BIT(14)
+
+// Flags, shifted by 4 * channel in DMA_INTF
+#define DMA_FLAG_G   BIT(0)
+#define DMA_FLAG_FTF BIT(1)
+#define DMA_FLAG_HTF BIT(2)
+#define DMA_FLAG_ERR BIT(3)
+#define DMA_INT_FLAG_G   DMA_FLAG_G
+#define DMA_INT_FLAG_FTF DMA_FLAG_FTF
+#define DMA_INT_FLAG_HTF DMA_FLAG_HTF
+#define DMA_INT_FLAG_ERR DMA_FLAG_ERR
+
+#define DMA_INT_FTF DMA_CHXCTL_FTFIE
+#define DMA_INT_HTF DMA_CHXCTL_HTFIE
+#define DMA_INT_ERR DMA_CHXCTL_ERRIE
+
+#define DMA_PERIPHERAL_TO_MEMORY ((uint8_t)0x00U)
+#define DMA_MEMORY_TO_PERIPHERAL ((uint8_t)0x01U)
+
+#define DMA_PERIPHERAL_WIDTH_8BIT  ((uint32_t)0x00000000U)
+#define DMA_PERIPHERAL_WIDTH_16BIT ((uint32_t)0x00000100U)
+#define DMA_PERIPHERAL_WIDTH_32BIT ((uint32_t)0x00000200U)
+#define DMA_MEMORY_WIDTH_8BIT      ((uint32_t)0x00000000U)
+#define DMA_MEMORY_WIDTH_16BIT     ((uint32_t)0x00000400U)
+#define DMA_MEMORY_WIDTH_32BIT     ((uint32_t)0x00000800U)
+
+#define DMA_PRIORITY_LOW         ((uint32_t)0x00000000U)
+#define DMA_PRIORITY_MEDIUM      ((uint32_t)0x00001000U)
+#define DMA_PRIORITY_HIGH        ((uint32_t)0x00002000U)
+#define DMA_PRIORITY_ULTRA_HIGH  ((uint32_t)0x00003000U)
+
+#define DMA_PERIPH_INCREASE_DISABLE ((uint8_t)0x00U)
+#define DMA_PERIPH_INCREASE_ENABLE  ((uint8_t)0x01U)
+#define DMA_MEMORY_INCREASE_DISABLE ((uint8_t)0x00U)
+#define DMA_MEMORY_INCREASE_ENABLE  ((uint8_t)0x01U)
+
+typedef struct {
+    uintptr_t periph_addr;
+    uint32_t periph_width;
+    uintptr_t memory_addr;
+    uint32_t memory_width;
+    uint32_t number;
+    uint32_t priority;
+    uint8_t periph_inc;
+    uint8_t memory_inc;
+    uint8_t direction;
+} dma_parameter_struct;
+
+void dma_deinit(uint32_t dma_periph, dma_channel_enum channelx);
+void dma_struct_para_init(dma_parameter_struct *init_struct);
+void dma_init(uint32_t dma_periph, dma_channel_enum channelx,
+        dma_parameter_struct *init_struct);
+void dma_circulation_enable(uint32_t dma_periph, dma_channel_enum channelx);
+void dma_circulation_disable(uint32_t dma_periph, dma_channel_enum channelx);
+void dma_memory_to_memory_disable(uint32_t dma_periph,
+        dma_channel_enum channelx);
+void dma_channel_enable(uint32_t dma_periph, dma_channel_enum channelx);
+void dma_channel_disable(uint32_t dma_periph, dma_channel_enum channelx);
+void dma_periph_address_config(uint32_t dma_periph, dma_channel_enum channelx,
+        uintptr_t address);
+void dma_memory_address_config(uint32_t dma_periph, dma_channel_enum channelx,
+        uintptr_t address);
+void dma_transfer_number_config(uint32_t dma_periph, dma_channel_enum channelx,
+        uint32_t number);
+uint32_t dma_transfer_number_get(uint32_t dma_periph, dma_channel_enum channelx);
+FlagStatus dma_flag_get(uint32_t dma_periph, dma_channel_enum channelx,
+        uint32_t flag);
+void dma_flag_clear(uint32_t dma_periph, dma_channel_enum channelx,
+        uint32_t flag);
+FlagStatus dma_interrupt_flag_get(uint32_t dma_periph,
+        dma_channel_enum channelx, uint32_t flag);
+void dma_interrupt_flag_clear(uint32_t dma_periph, dma_channel_enum channelx,
+        uint32_t flag);
+void dma_interrupt_enable(uint32_t dma_periph, dma_channel_enum channelx,
+        uint32_t source);
+void dma_interrupt_disable(uint32_t dma_periph, dma_channel_enum channelx,
+        uint32_t source);
@@ -0,0 +1,62 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * EXTI_PD is write-1-to-clear. It is exposed through an accessor that
+ * returns the pending bits with reserved bit 31 set as a read marker, so a
+ * later write (which never carries bit 31) can be told apart from a read.
+ * Always mask EXTI_PD reads with the lines of interest.
+ *
+ * A bit set in EXTI_SWIEV keeps the pending bit of an enabled line set
+ * until it is cleared again, on the next pass of native_exti_run().
+ */
+#pragma once
+
+#include "gd32vf103.h"
+
+typedef struct {
+    volatile uint32_t inten;
+    volatile uint32_t even;
+    volatile uint32_t rten;
+    volatile uint32_t ften;
+    volatile uint32_t swiev;
+    // Real pending bits and the cell handed out by native_exti_pd()
+    uint32_t pd;
+    volatile uint32_t pd_cell;
+} native_exti_t;
+
+extern native_exti_t native_exti;
+
+#define NATIVE_EXTI_PD_READ_MARK (0x80000000U)
+
+volatile uint32_t *native_exti_pd(void);
+
+#define EXTI_INTEN (native_exti.inten)
+#define EXTI_EVEN  (native_exti.even)
+#define EXTI_RTEN  (native_exti.rten)
+#define EXTI_FTEN  (native_exti.ften)
+#define EXTI_SWIEV (native_exti.swiev)
+#define EXTI_PD    (*native_exti_pd())
+
+typedef enum {
+    EXTI_0 = BIT(0),
+    EXTI_1 = BIT(1),
+    EXTI_2 = BIT(2),
+    EXTI_3 = BIT(3),
+    EXTI_4 = BIT(4),
+    EXTI_5 = BIT(5),
+    EXTI_6 = BIT(6),
+    EXTI_7 = BIT(7),
+    EXTI_8 = BIT(8),
+    EXTI_9 = BIT(9),
+    EXTI_10 = BIT(10),
+    EXTI_11 = BIT(11),
+    EXTI_12 = BIT(12),
+    EXTI_13 = BIT(13),
+    EXTI_14 = BIT(14),
+    EXTI_15 = BIT(15)
+} exti_line_enum;
+
+FlagStatus exti_flag_get(exti_line_enum linex);
+void exti_flag_clear(exti_line_enum linex);
+FlagStatus exti_interrupt_flag_get(exti_line_enum linex);
+void exti_interrupt_flag_clear(exti_line_enum linex);
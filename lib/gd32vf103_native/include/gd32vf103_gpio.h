@@ -0,0 +1,120 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * GPIO ports are indices into native_gpio[] rather than bus addresses.
+ * Write-only / read-computed registers (BOP, BC, ISTAT, OCTL) go through
+ * accessors so the port model sees every access in program order.
+ */
+#pragma once
+
+#include "gd32vf103.h"
+
+#define GPIOA (0U)
+#define GPIOB (1U)
+#define GPIOC (2U)
+#define GPIOD (3U)
+#define GPIOE (4U)
+#define NATIVE_GPIO_PORTS (5U)
+
+typedef struct {
+    volatile uint32_t ctl0;
+    volatile uint32_t ctl1;
+    volatile uint32_t octl;
+    volatile uint32_t lock;
+    // Pending write cells for the write-only registers
+    volatile uint32_t bop;
+    volatile uint32_t bc;
+    // Value returned by the last ISTAT read
+    volatile uint32_t istat;
+    // Level driven onto the pins from outside (1 = released / high)
+    uint32_t ext;
+    // Output masks decoded from the CTL values they were computed for
+    uint32_t mode_ctl0;
+    uint32_t mode_ctl1;
+    uint32_t pp_mask;
+    uint32_t od_mask;
+    // Open drain outputs the port pulls low through OCTL, and the simulated
+    // time a BOP or BC write last let each pin go
+    uint32_t held;
+    uint64_t release_ns[16];
+} native_gpio_t;
+
+extern native_gpio_t native_gpio[NATIVE_GPIO_PORTS];
+
+volatile uint32_t *native_gpio_istat(uint32_t gpio_periph);
+volatile uint32_t *native_gpio_octl(uint32_t gpio_periph);
+volatile uint32_t *native_gpio_bop(uint32_t gpio_periph);
+volatile uint32_t *native_gpio_bc(uint32_t gpio_periph);
+
+#define GPIO_CTL0(gpiox)  (native_gpio[(gpiox)].ctl0)
+#define GPIO_CTL1(gpiox)  (native_gpio[(gpiox)].ctl1)
+#define GPIO_ISTAT(gpiox) (*native_gpio_istat(gpiox))
+#define GPIO_OCTL(gpiox)  (*native_gpio_octl(gpiox))
+#define GPIO_BOP(gpiox)   (*native_gpio_bop(gpiox))
+#define GPIO_BC(gpiox)    (*native_gpio_bc(gpiox))
+#define GPIO_LOCK(gpiox)  (native_gpio[(gpiox)].lock)
+
+#define GPIO_PIN_0   BIT(0)
+#define GPIO_PIN_1   BIT(1)
+#define GPIO_PIN_2   BIT(2)
+#define GPIO_PIN_3   BIT(3)
+#define GPIO_PIN_4   BIT(4)
+#define GPIO_PIN_5   BIT(5)
+#define GPIO_PIN_6   BIT(6)
+#define GPIO_PIN_7   BIT(7)
+#define GPIO_PIN_8   BIT(8)
+#define GPIO_PIN_9   BIT(9)
+#define GPIO_PIN_10  BIT(10)
+#define GPIO_PIN_11  BIT(11)
+#define GPIO_PIN_12  BIT(12)
+#define GPIO_PIN_13  BIT(13)
+#define GPIO_PIN_14  BIT(14)
+#define GPIO_PIN_15  BIT(15)
+#define GPIO_PIN_ALL BITS(0, 15)
+
+// Same encoding as the SDK: bit 4 = output, bits 3:2 = CNF, bits 7:5 = pull
+#define GPIO_MODE_AIN         ((uint8_t)0x00U)
+#define GPIO_MODE_IN_FLOATING ((uint8_t)0x04U)
+#define GPIO_MODE_IPD         ((uint8_t)0x28U)
+#define GPIO_MODE_IPU         ((uint8_t)0x48U)
+#define GPIO_MODE_OUT_OD      ((uint8_t)0x14U)
+#define GPIO_MODE_OUT_PP      ((uint8_t)0x10U)
+#define GPIO_MODE_AF_OD       ((uint8_t)0x1CU)
+#define GPIO_MODE_AF_PP       ((uint8_t)0x18U)
+
+#define GPIO_OSPEED_10MHZ     ((uint8_t)0x01U)
+#define GPIO_OSPEED_2MHZ      ((uint8_t)0x02U)
+#define GPIO_OSPEED_50MHZ     ((uint8_t)0x03U)
+
+#define GPIO_MODE_SET(n, mode) ((uint32_t)((uint32_t)(mode) << (4U * (n))))
+#define GPIO_MODE_MASK(n)      (0xFU << (4U * (n)))
+
+#define GPIO_PORT_SOURCE_GPIOA ((uint8_t)0x00U)
+#define GPIO_PORT_SOURCE_GPIOB ((uint8_t)0x01U)
+#define GPIO_PORT_SOURCE_GPIOC ((uint8_t)0x02U)
+#define GPIO_PORT_SOURCE_GPIOD ((uint8_t)0x03U)
+#define GPIO_PORT_SOURCE_GPIOE ((uint8_t)0x04U)
+
+#define GPIO_PIN_SOURCE_0  ((uint8_t)0x00U)
+#define GPIO_PIN_SOURCE_1  ((uint8_t)0x01U)
+#define GPIO_PIN_SOURCE_2  ((uint8_t)0x02U)
+#define GPIO_PIN_SOURCE_3  ((uint8_t)0x03U)
+#define GPIO_PIN_SOURCE_4  ((uint8_t)0x04U)
+#define GPIO_PIN_SOURCE_5  ((uint8_t)0x05U)
+#define GPIO_PIN_SOURCE_6  ((uint8_t)0x06U)
+#define GPIO_PIN_SOURCE_7  ((uint8_t)0x07U)
+#define GPIO_PIN_SOURCE_8  ((uint8_t)0x08U)
+#define GPIO_PIN_SOURCE_9  ((uint8_t)0x09U)
+#define GPIO_PIN_SOURCE_10 ((uint8_t)0x0AU)
+#define GPIO_PIN_SOURCE_11 ((uint8_t)0x0BU)
+#define GPIO_PIN_SOURCE_12 ((uint8_t)0x0CU)
+#define GPIO_PIN_SOURCE_13 ((uint8_t)0x0DU)
+#define GPIO_PIN_SOURCE_14 ((uint8_t)0x0EU)
+#define GPIO_PIN_SOURCE_15 ((uint8_t)0x0FU)
+
+void gpio_init(uint32_t gpio_periph, uint32_t mode, uint32_t speed, uint32_t pin);
+void gpio_bit_set(uint32_t gpio_periph, uint32_t pin);
+void gpio_bit_reset(uint32_t gpio_periph, uint32_t pin);
+FlagStatus gpio_input_bit_get(uint32_t gpio_periph, uint32_t pin);
+FlagStatus gpio_output_bit_get(uint32_t gpio_periph, uint32_t pin);
+void gpio_exti_source_select(uint8_t output_port, uint8_t output_pin);
@@ -0,0 +1,170 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Behavioural model of the I2C master. Each SDK call starts a bus phase
+ * against the attached native_i2c_device models, the phase completes once
+ * simulated time has moved past its wire time (see native_advance). Event
+ * and error interrupts and the TX/RX DMA requests are raised on completion.
+ * A hung slave stalls the bus until SCL (PB6 / PB10 as GPIO) is clocked.
+ */
+#pragma once
+
+#include "gd32vf103.h"
+
+#define I2C0 (0U)
+#define I2C1 (1U)
+#define NATIVE_I2C_PERIPHS (2U)
+
+typedef struct native_i2c_device native_i2c_device;
+
+typedef enum {
+    NATIVE_I2C_EVENT_NONE,
+    NATIVE_I2C_EVENT_START,
+    NATIVE_I2C_EVENT_ADDR,
+    NATIVE_I2C_EVENT_TX,
+    NATIVE_I2C_EVENT_RX,
+    NATIVE_I2C_EVENT_STOP
+} native_i2c_event;
+
+typedef struct {
+    volatile uint32_t ctl0;
+    volatile uint32_t ctl1;
+    volatile uint32_t stat0;
+    volatile uint32_t stat1;
+    volatile uint32_t data;
+    uint32_t clkspeed;
+    uint32_t dutycyc;
+    // Model state
+    native_i2c_device *devices;
+    native_i2c_device *active;
+    bool reading;
+    uint8_t shift; // Address or data byte on the wire
+    bool stop_req; // STOP once the byte being received is in
+    // Bus phase in flight and the simulated time it completes at
+    native_i2c_event event;
+    uint64_t event_ns;
+    // SCL clocks until a hung slave lets go of SDA, no phase completes
+    // meanwhile
+    uint32_t stuck_clocks;
+    bool scl_level;
+    uint64_t wire_ns;
+    uint32_t transactions;
+    uint32_t bytes;
+} native_i2c_t;
+
+extern native_i2c_t native_i2c[NATIVE_I2C_PERIPHS];
+
+#define I2C_CTL0(i2cx)  (native_i2c[(i2cx)].ctl0)
+#define I2C_CTL1(i2cx)  (native_i2c[(i2cx)].ctl1)
+#define I2C_STAT0(i2cx) (native_i2c[(i2cx)].stat0)
+#define I2C_STAT1(i2cx) (native_i2c[(i2cx)].stat1)
+#define I2C_DATA(i2cx)  (native_i2c[(i2cx)].data)
+
+// I2C_CTL0
+#define I2C_CTL0_I2CEN  BIT(0)
+#define I2C_CTL0_START  BIT(8)
+#define I2C_CTL0_STOP   BIT(9)
+#define I2C_CTL0_ACKEN  BIT(10)
+#define I2C_CTL0_POAP   BIT(11)
+#define I2C_CTL0_SRESET BIT(15)
+
+// I2C_CTL1
+#define I2C_CTL1_ERRIE  BIT(8)
+#define I2C_CTL1_EVIE   BIT(9)
+#define I2C_CTL1_BUFIE  BIT(10)
+#define I2C_CTL1_DMAON  BIT(11)
+#define I2C_CTL1_DMALST BIT(12)
+
+// I2C_STAT0
+#define I2C_STAT0_SBSEND  BIT(0)
+#define I2C_STAT0_ADDSEND BIT(1)
+#define I2C_STAT0_BTC     BIT(2)
+#define I2C_STAT0_RBNE    BIT(6)
+#define I2C_STAT0_TBE     BIT(7)
+#define I2C_STAT0_BERR    BIT(8)
+#define I2C_STAT0_LOSTARB BIT(9)
+#define I2C_STAT0_AERR    BIT(10)
+
+// I2C_STAT1
+#define I2C_STAT1_MASTER  BIT(0)
+#define I2C_STAT1_I2CBSY  BIT(1)
+#define I2C_STAT1_TR      BIT(2)
+
+// Flags: bit position in STAT0, or 0x100 + bit position in STAT1
+typedef enum {
+    I2C_FLAG_SBSEND = 0,
+    I2C_FLAG_ADDSEND = 1,
+    I2C_FLAG_BTC = 2,
+    I2C_FLAG_RBNE = 6,
+    I2C_FLAG_TBE = 7,
+    I2C_FLAG_BERR = 8,
+    I2C_FLAG_LOSTARB = 9,
+    I2C_FLAG_AERR = 10,
+    I2C_FLAG_MASTER = 0x100,
+    I2C_FLAG_I2CBSY = 0x101,
+    I2C_FLAG_TR = 0x102
+} i2c_flag_enum;
+
+// Interrupt sources, the I2C_CTL1 enable bit
+typedef enum {
+    I2C_INT_ERR = I2C_CTL1_ERRIE,
+    I2C_INT_EV = I2C_CTL1_EVIE,
+    I2C_INT_BUF = I2C_CTL1_BUFIE
+} i2c_interrupt_enum;
+
+// Interrupt flags, same bit positions as the STAT0 flags
+typedef enum {
+    I2C_INT_FLAG_SBSEND = I2C_FLAG_SBSEND,
+    I2C_INT_FLAG_ADDSEND = I2C_FLAG_ADDSEND,
+    I2C_INT_FLAG_BTC = I2C_FLAG_BTC,
+    I2C_INT_FLAG_RBNE = I2C_FLAG_RBNE,
+    I2C_INT_FLAG_TBE = I2C_FLAG_TBE,
+    I2C_INT_FLAG_BERR = I2C_FLAG_BERR,
+    I2C_INT_FLAG_LOSTARB = I2C_FLAG_LOSTARB,
+    I2C_INT_FLAG_AERR = I2C_FLAG_AERR
+} i2c_interrupt_flag_enum;
+
+#define I2C_DMA_ON  I2C_CTL1_DMAON
+#define I2C_DMA_OFF ((uint32_t)0x00000000U)
+#define I2C_DMALST_ON  I2C_CTL1_DMALST
+#define I2C_DMALST_OFF ((uint32_t)0x00000000U)
+
+#define I2C_DTCY_2      ((uint32_t)0x00000000U)
+#define I2C_DTCY_16_9   I2C_CTL0_POAP
+
+#define I2C_I2CMODE_ENABLE    ((uint32_t)0x00000000U)
+#define I2C_ADDFORMAT_7BITS   ((uint32_t)0x00000000U)
+
+#define I2C_ACK_ENABLE        ((uint32_t)0x00000001U)
+#define I2C_ACK_DISABLE       ((uint32_t)0x00000000U)
+
+#define I2C_ACKPOS_CURRENT    ((uint32_t)0x00000000U)
+#define I2C_ACKPOS_NEXT       I2C_CTL0_POAP
+
+#define I2C_TRANSMITTER       ((uint32_t)0xFFFFFFFEU)
+#define I2C_RECEIVER          ((uint32_t)0x00000001U)
+
+void i2c_deinit(uint32_t i2c_periph);
+void i2c_clock_config(uint32_t i2c_periph, uint32_t clkspeed, uint32_t dutycyc);
+void i2c_mode_addr_config(uint32_t i2c_periph, uint32_t mode,
+        uint32_t addformat, uint32_t addr);
+void i2c_enable(uint32_t i2c_periph);
+void i2c_disable(uint32_t i2c_periph);
+void i2c_ack_config(uint32_t i2c_periph, uint32_t ack);
+void i2c_ackpos_config(uint32_t i2c_periph, uint32_t pos);
+void i2c_start_on_bus(uint32_t i2c_periph);
+void i2c_stop_on_bus(uint32_t i2c_periph);
+void i2c_master_addressing(uint32_t i2c_periph, uint32_t addr,
+        uint32_t trandirection);
+void i2c_data_transmit(uint32_t i2c_periph, uint8_t data);
+uint8_t i2c_data_receive(uint32_t i2c_periph);
+FlagStatus i2c_flag_get(uint32_t i2c_periph, i2c_flag_enum flag);
+void i2c_flag_clear(uint32_t i2c_periph, i2c_flag_enum flag);
+void i2c_interrupt_enable(uint32_t i2c_periph, i2c_interrupt_enum interrupt);
+void i2c_interrupt_disable(uint32_t i2c_periph, i2c_interrupt_enum interrupt);
+FlagStatus i2c_interrupt_flag_get(uint32_t i2c_periph,
+        i2c_interrupt_flag_enum int_flag);
+void i2c_interrupt_flag_clear(uint32_t i2c_periph,
+        i2c_interrupt_flag_enum int_flag);
+void i2c_dma_enable(uint32_t i2c_periph, uint32_t dmastate);
+void i2c_dma_last_transfer_config(uint32_t i2c_periph, uint32_t dmalast);
@@ -0,0 +1,30 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ */
+#pragma once
+
+#include "gd32vf103.h"
+
+typedef enum {
+    RCU_GPIOA,
+    RCU_GPIOB,
+    RCU_GPIOC,
+    RCU_GPIOD,
+    RCU_GPIOE,
+    RCU_AF,
+    RCU_DMA0,
+    RCU_DMA1,
+    RCU_I2C0,
+    RCU_I2C1,
+    RCU_SPI0,
+    RCU_SPI1,
+    RCU_TIMER1,
+    RCU_TIMER2,
+    RCU_TIMER4,
+    RCU_TIMER5,
+    RCU_TIMER6,
+    RCU_PERIPH_NUM
+} rcu_periph_enum;
+
+void rcu_periph_clock_enable(rcu_periph_enum periph);
+void rcu_periph_clock_disable(rcu_periph_enum periph);
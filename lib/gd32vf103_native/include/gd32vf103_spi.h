@@ -0,0 +1,101 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * SPI master model, transmit only. Bytes written by the CPU go out at once,
+ * bytes fed by the TX DMA request take their wire time in simulated time
+ * (see native_advance). Whatever goes out is handed to the attached
+ * native_spi_device.
+ */
+#pragma once
+
+#include "gd32vf103.h"
+
+#define SPI0 (0U)
+#define SPI1 (1U)
+#define NATIVE_SPI_PERIPHS (2U)
+
+typedef struct native_spi_device native_spi_device;
+
+typedef struct {
+    volatile uint32_t ctl0;
+    volatile uint32_t ctl1;
+    volatile uint32_t stat;
+    volatile uint32_t data;
+    volatile uint32_t crcpoly;
+    // Model state
+    native_spi_device *device;
+    bool streaming; // TX DMA request active
+    uint64_t next_ns; // Simulated time the byte on the wire is out
+    uint64_t busy_ns; // Wire time of everything sent
+    uint32_t bytes;
+    uint32_t dma_bytes;
+} native_spi_t;
+
+extern native_spi_t native_spi[NATIVE_SPI_PERIPHS];
+
+#define SPI_CTL0(spix) (native_spi[(spix)].ctl0)
+#define SPI_CTL1(spix) (native_spi[(spix)].ctl1)
+#define SPI_STAT(spix) (native_spi[(spix)].stat)
+#define SPI_DATA(spix) (native_spi[(spix)].data)
+
+// SPI_CTL0
+#define SPI_CTL0_CKPH   BIT(0)
+#define SPI_CTL0_CKPL   BIT(1)
+#define SPI_CTL0_MSTMOD BIT(2)
+#define SPI_CTL0_PSC    BITS(3, 5)
+#define SPI_CTL0_SPIEN  BIT(6)
+#define SPI_CTL0_LF     BIT(7)
+#define SPI_CTL0_SWNSS  BIT(8)
+#define SPI_CTL0_SWNSSEN BIT(9)
+#define SPI_CTL0_FF16   BIT(11)
+
+// SPI_CTL1
+#define SPI_CTL1_DMAREN BIT(0)
+#define SPI_CTL1_DMATEN BIT(1)
+
+// SPI_STAT
+#define SPI_STAT_RBNE  BIT(0)
+#define SPI_STAT_TBE   BIT(1)
+#define SPI_STAT_TRANS BIT(7)
+
+#define SPI_FLAG_RBNE  SPI_STAT_RBNE
+#define SPI_FLAG_TBE   SPI_STAT_TBE
+#define SPI_FLAG_TRANS SPI_STAT_TRANS
+
+#define SPI_DMA_TRANSMIT ((uint8_t)0x00U)
+#define SPI_DMA_RECEIVE  ((uint8_t)0x01U)
+
+#define SPI_TRANSMODE_FULLDUPLEX ((uint32_t)0x00000000U)
+#define SPI_MASTER               (SPI_CTL0_MSTMOD | SPI_CTL0_SWNSS)
+#define SPI_FRAMESIZE_8BIT       ((uint32_t)0x00000000U)
+#define SPI_CK_PL_HIGH_PH_2EDGE  (SPI_CTL0_CKPL | SPI_CTL0_CKPH)
+#define SPI_NSS_SOFT             SPI_CTL0_SWNSSEN
+#define SPI_ENDIAN_MSB           ((uint32_t)0x00000000U)
+
+// PCLK divided by 2 << n
+#define CTL0_PSC(regval) (BITS(3, 5) & ((uint32_t)(regval) << 3))
+#define SPI_PSC_2   CTL0_PSC(0)
+#define SPI_PSC_4   CTL0_PSC(1)
+#define SPI_PSC_8   CTL0_PSC(2)
+#define SPI_PSC_16  CTL0_PSC(3)
+
+typedef struct {
+    uint32_t device_mode;
+    uint32_t trans_mode;
+    uint32_t frame_size;
+    uint32_t nss;
+    uint32_t endian;
+    uint32_t clock_polarity_phase;
+    uint32_t prescale;
+} spi_parameter_struct;
+
+void spi_struct_para_init(spi_parameter_struct *spi_struct);
+void spi_init(uint32_t spi_periph, spi_parameter_struct *spi_struct);
+void spi_enable(uint32_t spi_periph);
+void spi_disable(uint32_t spi_periph);
+void spi_crc_polynomial_set(uint32_t spi_periph, uint16_t crc_poly);
+void spi_dma_enable(uint32_t spi_periph, uint8_t dma);
+void spi_dma_disable(uint32_t spi_periph, uint8_t dma);
+void spi_i2s_data_transmit(uint32_t spi_periph, uint16_t data);
+uint16_t spi_i2s_data_receive(uint32_t spi_periph);
+FlagStatus spi_i2s_flag_get(uint32_t spi_periph, uint32_t flag);
@@ -0,0 +1,77 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Timers count in simulated time (see native_advance). Only the update
+ * event is modelled: it sets UPIF, raises the interrupt and fires the
+ * update DMA request when those are enabled.
+ */
+#pragma once
+
+#include "gd32vf103.h"
+
+#define TIMER0 (0U)
+#define TIMER1 (1U)
+#define TIMER2 (2U)
+#define TIMER3 (3U)
+#define TIMER4 (4U)
+#define TIMER5 (5U)
+#define TIMER6 (6U)
+#define NATIVE_TIMERS (7U)
+
+typedef struct {
+    volatile uint32_t ctl0;
+    volatile uint32_t dmainten;
+    volatile uint32_t intf;
+    volatile uint32_t cnt;
+    volatile uint32_t psc;
+    volatile uint32_t car;
+    // Timer clock ticks since the last update event
+    uint64_t ticks;
+} native_timer_t;
+
+extern native_timer_t native_timer[NATIVE_TIMERS];
+
+#define TIMER_CTL0(timerx)     (native_timer[(timerx)].ctl0)
+#define TIMER_DMAINTEN(timerx) (native_timer[(timerx)].dmainten)
+#define TIMER_INTF(timerx)     (native_timer[(timerx)].intf)
+#define TIMER_CNT(timerx)      (native_timer[(timerx)].cnt)
+#define TIMER_PSC(timerx)      (native_timer[(timerx)].psc)
+#define TIMER_CAR(timerx)      (native_timer[(timerx)].car)
+
+#define TIMER_CTL0_CEN       BIT(0)
+#define TIMER_DMAINTEN_UPIE  BIT(0)
+#define TIMER_DMAINTEN_UPDEN BIT(8)
+#define TIMER_INTF_UPIF      BIT(0)
+
+#define TIMER_INT_UP      TIMER_DMAINTEN_UPIE
+#define TIMER_INT_FLAG_UP TIMER_INT_UP
+#define TIMER_FLAG_UP     TIMER_INTF_UPIF
+#define TIMER_DMA_UPD     ((uint16_t)TIMER_DMAINTEN_UPDEN)
+
+#define TIMER_COUNTER_EDGE ((uint16_t)0x0000U)
+#define TIMER_COUNTER_UP   ((uint16_t)0x0000U)
+#define TIMER_CKDIV_DIV1   ((uint16_t)0x0000U)
+
+typedef struct {
+    uint16_t prescaler;
+    uint16_t alignedmode;
+    uint16_t counterdirection;
+    uint32_t period;
+    uint16_t clockdivision;
+    uint8_t repetitioncounter;
+} timer_parameter_struct;
+
+void timer_deinit(uint32_t timer_periph);
+void timer_struct_para_init(timer_parameter_struct *initpara);
+void timer_init(uint32_t timer_periph, timer_parameter_struct *initpara);
+void timer_enable(uint32_t timer_periph);
+void timer_disable(uint32_t timer_periph);
+void timer_autoreload_value_config(uint32_t timer_periph, uint32_t autoreload);
+void timer_counter_value_config(uint32_t timer_periph, uint16_t counter);
+uint32_t timer_counter_read(uint32_t timer_periph);
+void timer_dma_enable(uint32_t timer_periph, uint16_t dma);
+void timer_dma_disable(uint32_t timer_periph, uint16_t dma);
+void timer_interrupt_enable(uint32_t timer_periph, uint32_t interrupt);
+void timer_interrupt_disable(uint32_t timer_periph, uint32_t interrupt);
+FlagStatus timer_interrupt_flag_get(uint32_t timer_periph, uint32_t interrupt);
+void timer_interrupt_flag_clear(uint32_t timer_periph, uint32_t interrupt);
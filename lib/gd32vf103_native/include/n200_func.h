@@ -0,0 +1,28 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Host shim of the Nuclei N200 core helpers (ECLIC, machine timer)
+ */
+#pragma once
+
+#include <stdint.h>
+#include "n200_timer.h"
+
+#define ECLIC_PRIGROUP_LEVEL0_PRIO4 0
+#define ECLIC_PRIGROUP_LEVEL1_PRIO3 1
+#define ECLIC_PRIGROUP_LEVEL2_PRIO2 2
+#define ECLIC_PRIGROUP_LEVEL3_PRIO1 3
+#define ECLIC_PRIGROUP_LEVEL4_PRIO0 4
+
+void eclic_global_interrupt_enable(void);
+void eclic_global_interrupt_disable(void);
+void eclic_priority_group_set(uint32_t prigroup);
+void eclic_irq_enable(uint32_t source, uint8_t level, uint8_t priority);
+void eclic_irq_disable(uint32_t source);
+
+// mtime runs at SystemCoreClock / 4 in simulated time
+uint64_t get_timer_value(void);
+
+// Sleeps in simulated time until an interrupt is taken or becomes pending
+void native_wfi(void);
+#define __WFI() native_wfi()
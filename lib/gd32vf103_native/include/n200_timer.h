@@ -0,0 +1,17 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Host shim of the N200 machine timer registers. mtime itself is not kept
+ * here, get_timer_value() derives it from simulated time. A write to
+ * mtimecmp takes effect at the next step of simulated time.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define TIMER_MSIP 0xFFC
+#define TIMER_MTIMECMP 0x8
+#define TIMER_MTIME 0x0
+
+extern volatile uint32_t native_mtimer[4];
+#define TIMER_CTRL_ADDR ((uintptr_t)native_mtimer)
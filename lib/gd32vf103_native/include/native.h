@@ -0,0 +1,208 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Test harness API of the host shim. Lets host code drive pins from the
+ * outside, run the interrupt handlers the way the ECLIC would, attach I2C
+ * and SPI device models to the master peripherals and bit-bang the SMC side
+ * of the soft I2C buses.
+ */
+#pragma once
+
+#include <stdio.h>
+#include "gd32vf103.h"
+
+// Core
+
+typedef struct {
+    uint32_t irq_count;     // Interrupt handler invocations
+    uint64_t irq_ns;        // Host time spent inside handlers
+    uint64_t irq_ns_max;    // Longest single handler invocation
+    uint32_t stuck;         // Dispatch loops abandoned, handler never cleared
+} native_stats_t;
+
+extern native_stats_t native_stats;
+
+void native_reset(void);
+void native_stats_reset(void);
+uint64_t native_now_ns(void);
+// Call an interrupt handler if its source is enabled, with accounting
+bool native_irq_call(IRQn_Type irq, void (*handler)(void));
+// An interrupt came in while they were globally disabled
+bool native_irq_pending(void);
+// ECLIC level an interrupt was enabled with, -1 when disabled. Handlers are
+// still called one after the other, levels are not modelled beyond this.
+int native_irq_level(IRQn_Type irq);
+// Simulated time the last handler that would have held off an interrupt of
+// this level returned, one at the same level or above. Time spent in lower
+// ones would have been preempted.
+uint64_t native_irq_busy_ns(int level);
+
+// Interrupt handlers, weak defaults unless the firmware provides them
+void eclic_mtip_handler(void);
+void EXTI0_IRQHandler(void);
+void EXTI1_IRQHandler(void);
+void EXTI2_IRQHandler(void);
+void EXTI3_IRQHandler(void);
+void EXTI4_IRQHandler(void);
+void EXTI5_9_IRQHandler(void);
+void EXTI10_15_IRQHandler(void);
+void I2C0_EV_IRQHandler(void);
+void I2C0_ER_IRQHandler(void);
+void I2C1_EV_IRQHandler(void);
+void I2C1_ER_IRQHandler(void);
+void TIMER0_UP_IRQHandler(void);
+void TIMER1_IRQHandler(void);
+void TIMER2_IRQHandler(void);
+void TIMER3_IRQHandler(void);
+void TIMER4_IRQHandler(void);
+void TIMER5_IRQHandler(void);
+void TIMER6_IRQHandler(void);
+void DMA0_Channel0_IRQHandler(void);
+void DMA0_Channel1_IRQHandler(void);
+void DMA0_Channel2_IRQHandler(void);
+void DMA0_Channel3_IRQHandler(void);
+void DMA0_Channel4_IRQHandler(void);
+void DMA0_Channel5_IRQHandler(void);
+void DMA0_Channel6_IRQHandler(void);
+void DMA1_Channel0_IRQHandler(void);
+void DMA1_Channel1_IRQHandler(void);
+void DMA1_Channel2_IRQHandler(void);
+void DMA1_Channel3_IRQHandler(void);
+void DMA1_Channel4_IRQHandler(void);
+
+// Simulated time, only moves when the harness advances it or the firmware
+// sleeps in __WFI() or delay_1ms(). Timers, I2C bus phases and SPI DMA
+// transfers run in it, everything else in the shim is instantaneous.
+extern uint64_t native_sim_ns;
+void native_advance(uint64_t ns);
+// Simulated time of the next timer update, I2C bus phase, SPI DMA flag or
+// mtimecmp match, UINT64_MAX when nothing is scheduled
+uint64_t native_next_event_ns(void);
+
+// GPIO / EXTI
+
+// Drive pins from outside: bits of mask take the value in level
+void native_gpio_drive(uint32_t gpio_periph, uint32_t mask, uint32_t level);
+// Resulting pin level, taking outputs of the port itself into account
+uint32_t native_gpio_level(uint32_t gpio_periph);
+// Latch new edges into EXTI_PD and run pending EXTI handlers until idle
+void native_exti_run(void);
+// Bring a peripheral register up to date before something other than the
+// CPU (DMA) reads it through its address
+void native_periph_read(volatile void *reg);
+
+// DMA
+
+// One hardware request on a channel: moves a single data item if enabled
+void native_dma_request(uint32_t dma_periph, uint32_t channelx);
+
+// I2C master devices
+
+struct native_i2c_device {
+    native_i2c_device *next;
+    uint8_t addr; // 7-bit address
+    bool (*start)(native_i2c_device *dev, bool read); // Return ACK
+    bool (*write)(native_i2c_device *dev, uint8_t byte); // Return ACK
+    uint8_t (*read)(native_i2c_device *dev);
+    void (*stop)(native_i2c_device *dev);
+    // Once addressed, hold SDA low until this many SCL clocks came by, like
+    // a slave that lost track of the master. 0 = well behaved.
+    uint32_t hang;
+};
+
+void native_i2c_attach(uint32_t i2c_periph, native_i2c_device *dev);
+
+// Fan controller chip behind the I2C masters. Speaks the register protocol
+// fanslave emulates: bit 7 of the register byte selects block mode, block
+// writes carry a count, block reads return the count in register 0x00 first.
+typedef enum {
+    NATIVE_FANCHIP_IDLE,
+    NATIVE_FANCHIP_SINGLE,
+    NATIVE_FANCHIP_BLOCK_COUNT,
+    NATIVE_FANCHIP_BLOCK_RW
+} native_fanchip_state;
+
+typedef struct {
+    native_i2c_device dev;
+    native_fanchip_state state;
+    uint8_t ptr;
+    uint8_t regs[256];
+    uint32_t reg_writes;
+    uint32_t reg_reads;
+} native_fanchip;
+
+void native_fanchip_init(native_fanchip *chip, uint8_t addr);
+
+// SPI devices
+
+struct native_spi_device {
+    void (*byte)(native_spi_device *dev, uint8_t byte);
+};
+
+void native_spi_attach(uint32_t spi_periph, native_spi_device *dev);
+
+// ST7735 controller of the Longan Nano LCD on SPI0, CS on PB2, DC on PB0.
+// Holds the RGB565 pixels the panel would show, addressed the way the
+// controller sees them (the firmware adds LCD_OFFSET_X/Y).
+#define NATIVE_LCD_COLS (132)
+#define NATIVE_LCD_ROWS (162)
+
+typedef struct {
+    native_spi_device dev;
+    uint8_t cmd;
+    uint32_t param; // Bytes received since the command
+    uint16_t xs, xe, ys, ye; // Window set by CASET / RASET
+    uint16_t x, y; // Write pointer inside the window
+    uint8_t hi; // First byte of the pixel being written
+    uint16_t ram[NATIVE_LCD_ROWS][NATIVE_LCD_COLS];
+    uint32_t pixels; // Pixels written
+    uint32_t ramwr; // RAMWR commands
+} native_lcd;
+
+void native_lcd_init(native_lcd *lcd);
+
+// Bit-banged SMBus master (SMC side of a soft I2C bus)
+//
+// Pin changes follow a fixed schedule of three slots per bit: SDA, SCL up,
+// SCL down. An interrupt handler that advances simulated time is still
+// running when the master gets to its next edge. The master waits for SCL
+// to come back up when the slave holds it low, like a real master does for
+// clock stretching. An SCL edge due while the slave is still busy, without
+// SCL being held, is counted in late.
+
+// Slot length after init, about 100 kHz SCL as recorded from the SMC
+#define NATIVE_SMBUS_EDGE_NS (2500)
+
+typedef struct {
+    uint32_t gpio;
+    uint32_t scl_pin;
+    uint32_t sda_pin;
+    uint32_t edges; // Pin transitions driven by the master
+    uint32_t period_ns; // Slot length
+    uint64_t edge_ns; // Scheduled time of the last one
+    uint64_t busy_ns; // Simulated time the slave was done with it
+    uint32_t late; // SCL edges made while the slave was still busy
+    uint64_t stretch_ns; // Time SCL was held low past a scheduled edge
+    // Optional VCD recording of the resulting bus levels
+    FILE *vcd;
+    uint64_t vcd_ns;
+    uint32_t vcd_level;
+} native_smbus;
+
+void native_smbus_init(native_smbus *bus, uint32_t gpio, uint32_t scl_pin,
+        uint32_t sda_pin);
+// SCL frequency. SCL is high for one slot and low for two, 400 kHz gives
+// 833 ns tHIGH and 1667 ns tLOW against fast mode minimums of 600 / 1300.
+void native_smbus_speed(native_smbus *bus, uint32_t hz);
+// Record the bus as a logic analyzer would see it, slave drive included
+void native_smbus_record(native_smbus *bus, FILE *fp, const char *scl_name,
+        const char *sda_name);
+void native_smbus_start(native_smbus *bus);
+void native_smbus_stop(native_smbus *bus);
+bool native_smbus_write_byte(native_smbus *bus, uint8_t byte);
+uint8_t native_smbus_read_byte(native_smbus *bus, bool ack);
+// Complete transactions, return TRUE if every byte was ACKed
+bool native_smbus_write(native_smbus *bus, uint8_t addr, const uint8_t *buf,
+        size_t size);
+bool native_smbus_read(native_smbus *bus, uint8_t addr, uint8_t reg,
+        uint8_t *buf, size_t size);
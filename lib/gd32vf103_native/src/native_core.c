@@ -0,0 +1,212 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Core of the host shim: reset, ECLIC, machine timer and handler accounting
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <string.h>
+#include <time.h>
+#include "gd32vf103.h"
+#include "native.h"
+
+uint32_t SystemCoreClock = 108000000;
+
+native_stats_t native_stats;
+volatile uint32_t native_mtimer[4];
+
+// Bail out of a machine timer handler that never moves mtimecmp
+#define MTIP_MAX_DISPATCH (64)
+// Level bits with ECLIC_PRIGROUP_LEVEL3_PRIO1
+#define ECLIC_LEVELS (8)
+
+static bool eclic_global_enabled;
+static bool eclic_enabled[ECLIC_NUM_INTERRUPTS];
+static uint8_t eclic_level[ECLIC_NUM_INTERRUPTS];
+// Taken while interrupts were globally disabled, run on enable
+static void (*eclic_pending[ECLIC_NUM_INTERRUPTS])(void);
+// Simulated time a handler at each level or above last returned
+static uint64_t eclic_busy_ns[ECLIC_LEVELS];
+
+void native_gpio_reset(void);
+void native_i2c_reset(void);
+void native_dma_reset(void);
+void native_timer_reset(void);
+void native_spi_reset(void);
+
+// Default handlers, the firmware overrides the ones it uses
+__attribute__((weak)) void eclic_mtip_handler(void) {}
+__attribute__((weak)) void EXTI0_IRQHandler(void) {}
+__attribute__((weak)) void EXTI1_IRQHandler(void) {}
+__attribute__((weak)) void EXTI2_IRQHandler(void) {}
+__attribute__((weak)) void EXTI3_IRQHandler(void) {}
+__attribute__((weak)) void EXTI4_IRQHandler(void) {}
+__attribute__((weak)) void EXTI5_9_IRQHandler(void) {}
+__attribute__((weak)) void EXTI10_15_IRQHandler(void) {}
+__attribute__((weak)) void I2C0_EV_IRQHandler(void) {}
+__attribute__((weak)) void I2C0_ER_IRQHandler(void) {}
+__attribute__((weak)) void I2C1_EV_IRQHandler(void) {}
+__attribute__((weak)) void I2C1_ER_IRQHandler(void) {}
+__attribute__((weak)) void TIMER0_UP_IRQHandler(void) {}
+__attribute__((weak)) void TIMER1_IRQHandler(void) {}
+__attribute__((weak)) void TIMER2_IRQHandler(void) {}
+__attribute__((weak)) void TIMER3_IRQHandler(void) {}
+__attribute__((weak)) void TIMER4_IRQHandler(void) {}
+__attribute__((weak)) void TIMER5_IRQHandler(void) {}
+__attribute__((weak)) void TIMER6_IRQHandler(void) {}
+__attribute__((weak)) void DMA0_Channel0_IRQHandler(void) {}
+__attribute__((weak)) void DMA0_Channel1_IRQHandler(void) {}
+__attribute__((weak)) void DMA0_Channel2_IRQHandler(void) {}
+__attribute__((weak)) void DMA0_Channel3_IRQHandler(void) {}
+__attribute__((weak)) void DMA0_Channel4_IRQHandler(void) {}
+__attribute__((weak)) void DMA0_Channel5_IRQHandler(void) {}
+__attribute__((weak)) void DMA0_Channel6_IRQHandler(void) {}
+__attribute__((weak)) void DMA1_Channel0_IRQHandler(void) {}
+__attribute__((weak)) void DMA1_Channel1_IRQHandler(void) {}
+__attribute__((weak)) void DMA1_Channel2_IRQHandler(void) {}
+__attribute__((weak)) void DMA1_Channel3_IRQHandler(void) {}
+__attribute__((weak)) void DMA1_Channel4_IRQHandler(void) {}
+
+void native_reset(void) {
+    eclic_global_enabled = FALSE;
+    memset(eclic_enabled, 0, sizeof(eclic_enabled));
+    memset(eclic_level, 0, sizeof(eclic_level));
+    memset(eclic_pending, 0, sizeof(eclic_pending));
+    memset(eclic_busy_ns, 0, sizeof(eclic_busy_ns));
+    // Compare at the far end, nothing fires before the firmware sets it
+    native_mtimer[2] = native_mtimer[3] = 0xffffffff;
+    native_gpio_reset();
+    native_i2c_reset();
+    native_dma_reset();
+    native_timer_reset();
+    native_spi_reset();
+    native_stats_reset();
+}
+
+void native_stats_reset(void) {
+    memset(&native_stats, 0, sizeof(native_stats));
+}
+
+uint64_t native_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+bool native_irq_call(IRQn_Type irq, void (*handler)(void)) {
+    if (!eclic_enabled[irq])
+        return FALSE;
+    if (!eclic_global_enabled) {
+        eclic_pending[irq] = handler;
+        return FALSE;
+    }
+
+    uint64_t start = native_now_ns();
+    handler();
+    uint64_t elapsed = native_now_ns() - start;
+
+    native_stats.irq_count++;
+    native_stats.irq_ns += elapsed;
+    if (elapsed > native_stats.irq_ns_max)
+        native_stats.irq_ns_max = elapsed;
+    // Held off everything at its own level and below
+    for (int level = 0; (level <= eclic_level[irq]) && (level < ECLIC_LEVELS);
+            level++)
+        eclic_busy_ns[level] = native_sim_ns;
+    return TRUE;
+}
+
+int native_irq_level(IRQn_Type irq) {
+    return eclic_enabled[irq] ? eclic_level[irq] : -1;
+}
+
+uint64_t native_irq_busy_ns(int level) {
+    if (level < 0)
+        level = 0;
+    if (level >= ECLIC_LEVELS)
+        level = ECLIC_LEVELS - 1;
+    return eclic_busy_ns[level];
+}
+
+bool native_irq_pending(void) {
+    for (int i = 0; i < ECLIC_NUM_INTERRUPTS; i++)
+        if (eclic_pending[i] && eclic_enabled[i])
+            return TRUE;
+    return FALSE;
+}
+
+static void eclic_run_pending(void) {
+    for (int i = 0; i < ECLIC_NUM_INTERRUPTS; i++) {
+        void (*handler)(void) = eclic_pending[i];
+        if (!handler || !eclic_enabled[i])
+            continue;
+        eclic_pending[i] = NULL;
+        native_irq_call(i, handler);
+    }
+}
+
+void eclic_global_interrupt_enable(void) {
+    eclic_global_enabled = TRUE;
+    eclic_run_pending();
+}
+
+void eclic_global_interrupt_disable(void) {
+    eclic_global_enabled = FALSE;
+}
+
+void eclic_priority_group_set(uint32_t prigroup) {
+    (void)prigroup;
+}
+
+void eclic_irq_enable(uint32_t source, uint8_t level, uint8_t priority) {
+    (void)priority;
+    if (source < ECLIC_NUM_INTERRUPTS) {
+        eclic_enabled[source] = TRUE;
+        eclic_level[source] = level;
+    }
+    if (eclic_global_enabled)
+        eclic_run_pending();
+}
+
+void eclic_irq_disable(uint32_t source) {
+    if (source < ECLIC_NUM_INTERRUPTS)
+        eclic_enabled[source] = FALSE;
+}
+
+uint64_t get_timer_value(void) {
+    return native_sim_ns * (SystemCoreClock / 4 / 1000) / 1000000;
+}
+
+static uint64_t mtimecmp(void) {
+    return ((uint64_t)native_mtimer[3] << 32) | native_mtimer[2];
+}
+
+uint64_t native_mtip_next_ns(void) {
+    uint64_t hz = SystemCoreClock / 4;
+    uint64_t cmp = mtimecmp();
+
+    if (!eclic_enabled[CLIC_INT_TMR] || (cmp / hz >= 1000000000ull))
+        return UINT64_MAX;
+    uint64_t ns = cmp / hz * 1000000000ull +
+            ((cmp % hz) * 1000000000ull + hz - 1) / hz;
+    // Already due: taken by native_mtip_run() or pending, not a future event
+    return (ns > native_sim_ns) ? ns : UINT64_MAX;
+}
+
+void native_mtip_run(void) {
+    // Level triggered, pending for as long as mtime is past mtimecmp
+    for (int i = 0; i < MTIP_MAX_DISPATCH; i++) {
+        if (get_timer_value() < mtimecmp())
+            return;
+        if (!native_irq_call(CLIC_INT_TMR, eclic_mtip_handler))
+            return;
+    }
+    native_stats.stuck++;
+}
+
+void rcu_periph_clock_enable(rcu_periph_enum periph) {
+    (void)periph;
+}
+
+void rcu_periph_clock_disable(rcu_periph_enum periph) {
+    (void)periph;
+}
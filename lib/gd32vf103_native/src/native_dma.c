@@ -0,0 +1,191 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * DMA channel model
+ */
+#include <string.h>
+#include "gd32vf103.h"
+#include "native.h"
+
+native_dma_t native_dma[NATIVE_DMA_PERIPHS];
+
+static const IRQn_Type dma_irq[NATIVE_DMA_PERIPHS][NATIVE_DMA_CHANNELS] = {
+    {DMA0_Channel0_IRQn, DMA0_Channel1_IRQn, DMA0_Channel2_IRQn,
+            DMA0_Channel3_IRQn, DMA0_Channel4_IRQn, DMA0_Channel5_IRQn,
+            DMA0_Channel6_IRQn},
+    {DMA1_Channel0_IRQn, DMA1_Channel1_IRQn, DMA1_Channel2_IRQn,
+            DMA1_Channel3_IRQn, DMA1_Channel4_IRQn}
+};
+
+static void (*const dma_handler[NATIVE_DMA_PERIPHS][NATIVE_DMA_CHANNELS])(void) = {
+    {DMA0_Channel0_IRQHandler, DMA0_Channel1_IRQHandler,
+            DMA0_Channel2_IRQHandler, DMA0_Channel3_IRQHandler,
+            DMA0_Channel4_IRQHandler, DMA0_Channel5_IRQHandler,
+            DMA0_Channel6_IRQHandler},
+    {DMA1_Channel0_IRQHandler, DMA1_Channel1_IRQHandler,
+            DMA1_Channel2_IRQHandler, DMA1_Channel3_IRQHandler,
+            DMA1_Channel4_IRQHandler}
+};
+
+void native_dma_reset(void) {
+    memset(native_dma, 0, sizeof(native_dma));
+}
+
+void native_dma_request(uint32_t dma_periph, uint32_t channelx) {
+    native_dma_channel_t *ch = &native_dma[dma_periph].ch[channelx];
+    uint32_t ctl = ch->ctl;
+
+    if (!(ctl & DMA_CHXCTL_CHEN) || (ch->cnt == 0))
+        return;
+
+    uint32_t pwidth = 1u << ((ctl & DMA_CHXCTL_PWIDTH) >> 8);
+    uint32_t mwidth = 1u << ((ctl & DMA_CHXCTL_MWIDTH) >> 10);
+    uint32_t index = ch->number - ch->cnt;
+    uintptr_t paddr = ch->paddr + ((ctl & DMA_CHXCTL_PNAGA) ? index * pwidth : 0);
+    uintptr_t maddr = ch->maddr + ((ctl & DMA_CHXCTL_MNAGA) ? index * mwidth : 0);
+    uint32_t value = 0;
+
+    // Little endian both sides, narrower destinations take the low bytes
+    if (ctl & DMA_CHXCTL_DIR) {
+        memcpy(&value, (const void *)maddr, mwidth);
+        memcpy((void *)paddr, &value, pwidth);
+    }
+    else {
+        native_periph_read((volatile void *)paddr);
+        memcpy(&value, (const void *)paddr, pwidth);
+        memcpy((void *)maddr, &value, mwidth);
+    }
+
+    uint32_t flags = 0;
+    ch->cnt--;
+    if (ch->cnt == ch->number / 2)
+        flags |= DMA_FLAG_HTF;
+    if (ch->cnt == 0) {
+        flags |= DMA_FLAG_FTF;
+        if (ctl & DMA_CHXCTL_CMEN)
+            ch->cnt = ch->number;
+    }
+    if (!flags)
+        return;
+
+    native_dma[dma_periph].intf |= (flags | DMA_FLAG_G) << (channelx * 4);
+    if (((flags & DMA_FLAG_HTF) && (ctl & DMA_CHXCTL_HTFIE)) ||
+            ((flags & DMA_FLAG_FTF) && (ctl & DMA_CHXCTL_FTFIE)))
+        native_irq_call(dma_irq[dma_periph][channelx],
+                dma_handler[dma_periph][channelx]);
+}
+
+void dma_deinit(uint32_t dma_periph, dma_channel_enum channelx) {
+    memset(&native_dma[dma_periph].ch[channelx], 0,
+            sizeof(native_dma_channel_t));
+    native_dma[dma_periph].intf &= ~(0xfu << (channelx * 4));
+}
+
+void dma_struct_para_init(dma_parameter_struct *init_struct) {
+    memset(init_struct, 0, sizeof(*init_struct));
+}
+
+void dma_init(uint32_t dma_periph, dma_channel_enum channelx,
+        dma_parameter_struct *init_struct) {
+    native_dma_channel_t *ch = &native_dma[dma_periph].ch[channelx];
+    uint32_t ctl = ch->ctl;
+
+    ch->paddr = init_struct->periph_addr;
+    ch->maddr = init_struct->memory_addr;
+    ch->cnt = init_struct->number & 0xffff;
+    ch->number = ch->cnt;
+
+    ctl &= ~(DMA_CHXCTL_PWIDTH | DMA_CHXCTL_MWIDTH | DMA_CHXCTL_PRIO |
+            DMA_CHXCTL_PNAGA | DMA_CHXCTL_MNAGA | DMA_CHXCTL_DIR);
+    ctl |= init_struct->periph_width | init_struct->memory_width |
+            init_struct->priority;
+    if (init_struct->periph_inc == DMA_PERIPH_INCREASE_ENABLE)
+        ctl |= DMA_CHXCTL_PNAGA;
+    if (init_struct->memory_inc == DMA_MEMORY_INCREASE_ENABLE)
+        ctl |= DMA_CHXCTL_MNAGA;
+    if (init_struct->direction == DMA_MEMORY_TO_PERIPHERAL)
+        ctl |= DMA_CHXCTL_DIR;
+    ch->ctl = ctl;
+}
+
+void dma_circulation_enable(uint32_t dma_periph, dma_channel_enum channelx) {
+    DMA_CHCTL(dma_periph, channelx) |= DMA_CHXCTL_CMEN;
+}
+
+void dma_circulation_disable(uint32_t dma_periph, dma_channel_enum channelx) {
+    DMA_CHCTL(dma_periph, channelx) &= ~DMA_CHXCTL_CMEN;
+}
+
+void dma_memory_to_memory_disable(uint32_t dma_periph,
+        dma_channel_enum channelx) {
+    DMA_CHCTL(dma_periph, channelx) &= ~DMA_CHXCTL_M2M;
+}
+
+void dma_channel_enable(uint32_t dma_periph, dma_channel_enum channelx) {
+    DMA_CHCTL(dma_periph, channelx) |= DMA_CHXCTL_CHEN;
+}
+
+void dma_channel_disable(uint32_t dma_periph, dma_channel_enum channelx) {
+    DMA_CHCTL(dma_periph, channelx) &= ~DMA_CHXCTL_CHEN;
+}
+
+void dma_periph_address_config(uint32_t dma_periph, dma_channel_enum channelx,
+        uintptr_t address) {
+    DMA_CHPADDR(dma_periph, channelx) = address;
+}
+
+void dma_memory_address_config(uint32_t dma_periph, dma_channel_enum channelx,
+        uintptr_t address) {
+    DMA_CHMADDR(dma_periph, channelx) = address;
+}
+
+// Like the hardware, only takes effect while the channel is disabled
+void dma_transfer_number_config(uint32_t dma_periph, dma_channel_enum channelx,
+        uint32_t number) {
+    native_dma_channel_t *ch = &native_dma[dma_periph].ch[channelx];
+    if (ch->ctl & DMA_CHXCTL_CHEN)
+        return;
+    ch->cnt = number & 0xffff;
+    ch->number = ch->cnt;
+}
+
+uint32_t dma_transfer_number_get(uint32_t dma_periph, dma_channel_enum channelx) {
+    return DMA_CHCNT(dma_periph, channelx);
+}
+
+FlagStatus dma_flag_get(uint32_t dma_periph, dma_channel_enum channelx,
+        uint32_t flag) {
+    return (DMA_INTF(dma_periph) & (flag << (channelx * 4))) ? SET : RESET;
+}
+
+// Clearing the global flag clears all flags of the channel
+void dma_flag_clear(uint32_t dma_periph, dma_channel_enum channelx,
+        uint32_t flag) {
+    if (flag & DMA_FLAG_G)
+        flag = DMA_FLAG_G | DMA_FLAG_FTF | DMA_FLAG_HTF | DMA_FLAG_ERR;
+    DMA_INTF(dma_periph) &= ~(flag << (channelx * 4));
+}
+
+FlagStatus dma_interrupt_flag_get(uint32_t dma_periph,
+        dma_channel_enum channelx, uint32_t flag) {
+    uint32_t ctl = DMA_CHCTL(dma_periph, channelx);
+    uint32_t enabled = flag & (((ctl & DMA_CHXCTL_FTFIE) ? DMA_FLAG_FTF : 0) |
+            ((ctl & DMA_CHXCTL_HTFIE) ? DMA_FLAG_HTF : 0) |
+            ((ctl & DMA_CHXCTL_ERRIE) ? DMA_FLAG_ERR : 0) | DMA_FLAG_G);
+    return (DMA_INTF(dma_periph) & (enabled << (channelx * 4))) ? SET : RESET;
+}
+
+void dma_interrupt_flag_clear(uint32_t dma_periph, dma_channel_enum channelx,
+        uint32_t flag) {
+    dma_flag_clear(dma_periph, channelx, flag);
+}
+
+void dma_interrupt_enable(uint32_t dma_periph, dma_channel_enum channelx,
+        uint32_t source) {
+    DMA_CHCTL(dma_periph, channelx) |= source;
+}
+
+void dma_interrupt_disable(uint32_t dma_periph, dma_channel_enum channelx,
+        uint32_t source) {
+    DMA_CHCTL(dma_periph, channelx) &= ~source;
+}
@@ -0,0 +1,258 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * GPIO port and EXTI model
+ */
+#include <string.h>
+#include "gd32vf103.h"
+#include "native.h"
+
+// Bail out of a dispatch loop whose handler never clears its pending bits
+#define EXTI_MAX_DISPATCH (64)
+
+native_gpio_t native_gpio[NATIVE_GPIO_PORTS];
+native_exti_t native_exti;
+
+static uint8_t exti_source[16];
+static uint32_t exti_ports;
+static uint32_t exti_level;
+
+// Only the cell handed out last can hold an unapplied write
+static native_gpio_t *pending_port;
+static uint64_t pending_ns; // When the CPU wrote it
+static bool pending_pd;
+
+static uint32_t exti_lines_level(void);
+static uint32_t port_level(native_gpio_t *port);
+void native_i2c_pins(uint32_t gpio_periph, uint32_t level);
+
+void native_gpio_reset(void) {
+    memset(native_gpio, 0, sizeof(native_gpio));
+    for (int i = 0; i < NATIVE_GPIO_PORTS; i++) {
+        // Floating inputs, nothing driven from outside
+        native_gpio[i].ctl0 = 0x44444444;
+        native_gpio[i].ctl1 = 0x44444444;
+        native_gpio[i].ext = 0xffff;
+    }
+    memset(&native_exti, 0, sizeof(native_exti));
+    native_exti.pd_cell = NATIVE_EXTI_PD_READ_MARK;
+    memset(exti_source, 0, sizeof(exti_source));
+    exti_ports = BIT(GPIOA);
+    pending_port = NULL;
+    pending_pd = FALSE;
+    exti_level = exti_lines_level();
+}
+
+// Apply register writes that went through the accessors since last time
+static void native_sync(void) {
+    native_gpio_t *port = pending_port;
+    if (port) {
+        if (port->bop) {
+            uint32_t set = port->bop & 0xffff;
+            uint32_t clr = (port->bop >> 16) & ~set;
+            port->octl = (port->octl | set) & ~clr;
+            port->bop = 0;
+        }
+        if (port->bc) {
+            port->octl &= ~(port->bc & 0xffff);
+            port->bc = 0;
+        }
+        pending_port = NULL;
+        // Bit-banged clocks reach a hung I2C slave
+        native_i2c_pins(port - native_gpio, port_level(port));
+        uint32_t held = port->od_mask & ~port->octl & 0xffff;
+        uint32_t released = port->held & ~held;
+        for (int i = 0; released; i++, released >>= 1)
+            if (released & 0x01)
+                port->release_ns[i] = pending_ns;
+        port->held = held;
+    }
+    if (pending_pd) {
+        if (!(native_exti.pd_cell & NATIVE_EXTI_PD_READ_MARK))
+            native_exti.pd &= ~native_exti.pd_cell;
+        native_exti.pd_cell = native_exti.pd | NATIVE_EXTI_PD_READ_MARK;
+        pending_pd = FALSE;
+    }
+}
+
+static void port_decode(native_gpio_t *port) {
+    port->pp_mask = 0;
+    port->od_mask = 0;
+    for (int pin = 0; pin < 16; pin++) {
+        uint32_t ctl = (pin < 8) ? port->ctl0 : port->ctl1;
+        uint32_t mode = (ctl >> ((pin & 7) * 4)) & 0xf;
+        if ((mode & 0x3) == 0)
+            continue; // Input
+        if ((mode >> 2) == 0)
+            port->pp_mask |= BIT(pin);
+        else if ((mode >> 2) == 1)
+            port->od_mask |= BIT(pin);
+        // Alternate function outputs are not modelled, the pin follows ext
+    }
+    port->mode_ctl0 = port->ctl0;
+    port->mode_ctl1 = port->ctl1;
+}
+
+static uint32_t port_level(native_gpio_t *port) {
+    if ((port->ctl0 != port->mode_ctl0) || (port->ctl1 != port->mode_ctl1))
+        port_decode(port);
+    return ((port->ext & ~port->pp_mask) & (port->octl | ~port->od_mask) &
+            0xffff) | (port->octl & port->pp_mask);
+}
+
+static uint32_t exti_lines_level(void) {
+    uint32_t levels[NATIVE_GPIO_PORTS];
+    uint32_t level = 0;
+    for (int i = 0; i < NATIVE_GPIO_PORTS; i++)
+        if (exti_ports & BIT(i))
+            levels[i] = port_level(&native_gpio[i]);
+    for (int line = 0; line < 16; line++)
+        level |= levels[exti_source[line]] & BIT(line);
+    return level;
+}
+
+volatile uint32_t *native_gpio_istat(uint32_t gpio_periph) {
+    native_sync();
+    native_gpio[gpio_periph].istat = port_level(&native_gpio[gpio_periph]);
+    return &native_gpio[gpio_periph].istat;
+}
+
+volatile uint32_t *native_gpio_octl(uint32_t gpio_periph) {
+    native_sync();
+    return &native_gpio[gpio_periph].octl;
+}
+
+volatile uint32_t *native_gpio_bop(uint32_t gpio_periph) {
+    native_sync();
+    pending_port = &native_gpio[gpio_periph];
+    pending_ns = native_sim_ns;
+    return &native_gpio[gpio_periph].bop;
+}
+
+volatile uint32_t *native_gpio_bc(uint32_t gpio_periph) {
+    native_sync();
+    pending_port = &native_gpio[gpio_periph];
+    pending_ns = native_sim_ns;
+    return &native_gpio[gpio_periph].bc;
+}
+
+volatile uint32_t *native_exti_pd(void) {
+    native_sync();
+    pending_pd = TRUE;
+    return &native_exti.pd_cell;
+}
+
+void native_periph_read(volatile void *reg) {
+    for (int i = 0; i < NATIVE_GPIO_PORTS; i++) {
+        if (reg == &native_gpio[i].istat) {
+            native_gpio_istat(i);
+            return;
+        }
+    }
+}
+
+void native_gpio_drive(uint32_t gpio_periph, uint32_t mask, uint32_t level) {
+    native_gpio[gpio_periph].ext =
+            (native_gpio[gpio_periph].ext & ~mask) | (level & mask);
+    native_exti_run();
+}
+
+uint32_t native_gpio_level(uint32_t gpio_periph) {
+    native_sync();
+    return port_level(&native_gpio[gpio_periph]);
+}
+
+void native_exti_run(void) {
+    for (int i = 0; i < EXTI_MAX_DISPATCH; i++) {
+        native_sync();
+        uint32_t level = exti_lines_level();
+        uint32_t changed = level ^ exti_level;
+        exti_level = level;
+        native_exti.pd |= (changed & level & native_exti.rten) |
+                (changed & ~level & native_exti.ften) |
+                (native_exti.swiev & native_exti.inten);
+        native_exti.pd_cell = native_exti.pd | NATIVE_EXTI_PD_READ_MARK;
+
+        uint32_t pending = native_exti.pd & native_exti.inten;
+        bool called = FALSE;
+        if (pending & EXTI_0)
+            called |= native_irq_call(EXTI0_IRQn, EXTI0_IRQHandler);
+        if (pending & EXTI_1)
+            called |= native_irq_call(EXTI1_IRQn, EXTI1_IRQHandler);
+        if (pending & EXTI_2)
+            called |= native_irq_call(EXTI2_IRQn, EXTI2_IRQHandler);
+        if (pending & EXTI_3)
+            called |= native_irq_call(EXTI3_IRQn, EXTI3_IRQHandler);
+        if (pending & EXTI_4)
+            called |= native_irq_call(EXTI4_IRQn, EXTI4_IRQHandler);
+        if (pending & 0x03e0)
+            called |= native_irq_call(EXTI5_9_IRQn, EXTI5_9_IRQHandler);
+        if (pending & 0xfc00)
+            called |= native_irq_call(EXTI10_15_IRQn, EXTI10_15_IRQHandler);
+        if (!called)
+            return;
+    }
+    native_stats.stuck++;
+}
+
+void gpio_init(uint32_t gpio_periph, uint32_t mode, uint32_t speed, uint32_t pin) {
+    uint32_t temp_mode = mode & 0x0fU;
+    uint32_t reg;
+
+    if (mode & 0x10U)
+        temp_mode |= speed;
+
+    for (uint32_t i = 0; i < 16; i++) {
+        if (!((1U << i) & pin))
+            continue;
+        volatile uint32_t *ctl = (i < 8) ?
+                &GPIO_CTL0(gpio_periph) : &GPIO_CTL1(gpio_periph);
+        reg = *ctl;
+        reg &= ~GPIO_MODE_MASK(i & 7);
+        reg |= GPIO_MODE_SET(i & 7, temp_mode);
+        if (mode == GPIO_MODE_IPD)
+            GPIO_BC(gpio_periph) = (1U << i);
+        else if (mode == GPIO_MODE_IPU)
+            GPIO_BOP(gpio_periph) = (1U << i);
+        *ctl = reg;
+    }
+}
+
+void gpio_bit_set(uint32_t gpio_periph, uint32_t pin) {
+    GPIO_BOP(gpio_periph) = pin;
+}
+
+void gpio_bit_reset(uint32_t gpio_periph, uint32_t pin) {
+    GPIO_BC(gpio_periph) = pin;
+}
+
+FlagStatus gpio_input_bit_get(uint32_t gpio_periph, uint32_t pin) {
+    return (GPIO_ISTAT(gpio_periph) & pin) ? SET : RESET;
+}
+
+FlagStatus gpio_output_bit_get(uint32_t gpio_periph, uint32_t pin) {
+    return (GPIO_OCTL(gpio_periph) & pin) ? SET : RESET;
+}
+
+void gpio_exti_source_select(uint8_t output_port, uint8_t output_pin) {
+    exti_source[output_pin & 0x0f] = output_port;
+    exti_ports = 0;
+    for (int line = 0; line < 16; line++)
+        exti_ports |= BIT(exti_source[line]);
+}
+
+FlagStatus exti_flag_get(exti_line_enum linex) {
+    return (EXTI_PD & linex) ? SET : RESET;
+}
+
+void exti_flag_clear(exti_line_enum linex) {
+    EXTI_PD = linex;
+}
+
+FlagStatus exti_interrupt_flag_get(exti_line_enum linex) {
+    return ((EXTI_PD & linex) && (EXTI_INTEN & linex)) ? SET : RESET;
+}
+
+void exti_interrupt_flag_clear(exti_line_enum linex) {
+    EXTI_PD = linex;
+}
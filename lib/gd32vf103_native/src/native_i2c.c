@@ -0,0 +1,433 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * I2C master model and the fan controller chip device model
+ */
+#include <string.h>
+#include "gd32vf103.h"
+#include "native.h"
+
+native_i2c_t native_i2c[NATIVE_I2C_PERIPHS];
+
+void native_i2c_reset(void) {
+    memset(native_i2c, 0, sizeof(native_i2c));
+}
+
+void native_i2c_attach(uint32_t i2c_periph, native_i2c_device *dev) {
+    dev->next = native_i2c[i2c_periph].devices;
+    native_i2c[i2c_periph].devices = dev;
+}
+
+// DMA0 channels serving the TX and RX requests of each I2C
+static const uint8_t i2c_dma_tx[NATIVE_I2C_PERIPHS] = {DMA_CH5, DMA_CH3};
+static const uint8_t i2c_dma_rx[NATIVE_I2C_PERIPHS] = {DMA_CH6, DMA_CH4};
+
+static const IRQn_Type i2c_ev_irq[NATIVE_I2C_PERIPHS] = {
+    I2C0_EV_IRQn, I2C1_EV_IRQn
+};
+static const IRQn_Type i2c_er_irq[NATIVE_I2C_PERIPHS] = {
+    I2C0_ER_IRQn, I2C1_ER_IRQn
+};
+static void (*const i2c_ev_handler[NATIVE_I2C_PERIPHS])(void) = {
+    I2C0_EV_IRQHandler, I2C1_EV_IRQHandler
+};
+static void (*const i2c_er_handler[NATIVE_I2C_PERIPHS])(void) = {
+    I2C0_ER_IRQHandler, I2C1_ER_IRQHandler
+};
+
+// SCL / SDA of each I2C, all on GPIOB
+static const uint32_t i2c_scl_pin[NATIVE_I2C_PERIPHS] = {
+    GPIO_PIN_6, GPIO_PIN_10
+};
+static const uint32_t i2c_sda_pin[NATIVE_I2C_PERIPHS] = {
+    GPIO_PIN_7, GPIO_PIN_11
+};
+
+// A slave holds SDA low: the phase in flight never completes and nothing
+// new gets onto the bus until SCL has been clocked enough
+static void i2c_hang(uint32_t i2c_periph, uint32_t clocks) {
+    native_i2c_t *i2c = &native_i2c[i2c_periph];
+    i2c->stuck_clocks = clocks;
+    i2c->scl_level = (native_gpio_level(GPIOB) & i2c_scl_pin[i2c_periph]) != 0;
+    i2c->event = NATIVE_I2C_EVENT_NONE;
+    i2c->active = NULL;
+    native_gpio[GPIOB].ext &= ~i2c_sda_pin[i2c_periph];
+}
+
+// Called with the new pin levels whenever the CPU wrote to a GPIO port
+void native_i2c_pins(uint32_t gpio_periph, uint32_t level) {
+    if (gpio_periph != GPIOB)
+        return;
+    for (uint32_t i = 0; i < NATIVE_I2C_PERIPHS; i++) {
+        native_i2c_t *i2c = &native_i2c[i];
+        bool scl = (level & i2c_scl_pin[i]) != 0;
+        if (i2c->stuck_clocks && scl && !i2c->scl_level &&
+                (--i2c->stuck_clocks == 0))
+            native_gpio[GPIOB].ext |= i2c_sda_pin[i];
+        i2c->scl_level = scl;
+    }
+}
+
+// Start a bus phase of a number of SCL periods, accounting its wire time
+static void i2c_schedule(native_i2c_t *i2c, native_i2c_event event,
+        uint32_t bits) {
+    uint32_t speed = i2c->clkspeed ? i2c->clkspeed : 100000;
+    uint64_t ns = (uint64_t)bits * 1000000000ull / speed;
+    if (i2c->stuck_clocks)
+        return;
+    // A START waits for the STOP still going out
+    uint64_t from = (i2c->event == NATIVE_I2C_EVENT_STOP) ?
+            i2c->event_ns : native_sim_ns;
+    i2c->event = event;
+    i2c->event_ns = from + ns;
+    i2c->wire_ns += ns;
+}
+
+static void i2c_stop(native_i2c_t *i2c) {
+    if (i2c->active)
+        i2c->active->stop(i2c->active);
+    i2c->active = NULL;
+    i2c->reading = FALSE;
+    i2c->stop_req = FALSE;
+    // Received data stays readable, the bus is busy until the STOP is out
+    i2c->stat0 &= I2C_STAT0_RBNE;
+    i2c->stat1 &= I2C_STAT1_I2CBSY;
+    i2c_schedule(i2c, NATIVE_I2C_EVENT_STOP, 1);
+}
+
+static bool i2c_dma_ready(uint32_t channel) {
+    return (DMA_CHCTL(DMA0, channel) & DMA_CHXCTL_CHEN) &&
+            (DMA_CHCNT(DMA0, channel) != 0);
+}
+
+// TBE and RBNE raise DMA requests instead of interrupts while DMAON is set
+static void i2c_dma(uint32_t i2c_periph) {
+    native_i2c_t *i2c = &native_i2c[i2c_periph];
+    if (!(i2c->ctl1 & I2C_CTL1_DMAON) || (i2c->stat0 & I2C_STAT0_ADDSEND))
+        return;
+
+    if ((i2c->stat0 & I2C_STAT0_TBE) && (i2c->active != NULL) &&
+            !i2c->reading && i2c_dma_ready(i2c_dma_tx[i2c_periph])) {
+        native_dma_request(DMA0, i2c_dma_tx[i2c_periph]);
+        i2c_data_transmit(i2c_periph, i2c->data);
+    }
+    else if ((i2c->stat0 & I2C_STAT0_RBNE) &&
+            i2c_dma_ready(i2c_dma_rx[i2c_periph])) {
+        i2c->stat0 &= ~(I2C_STAT0_RBNE | I2C_STAT0_BTC);
+        native_dma_request(DMA0, i2c_dma_rx[i2c_periph]);
+        // DMALST: the byte of the last transfer is NACKed, nothing follows
+        bool more = (DMA_CHCNT(DMA0, i2c_dma_rx[i2c_periph]) != 0) ||
+                !(i2c->ctl1 & I2C_CTL1_DMALST);
+        if (more && (i2c->active != NULL) && i2c->reading &&
+                !i2c->stop_req && (i2c->event == NATIVE_I2C_EVENT_NONE))
+            i2c_schedule(i2c, NATIVE_I2C_EVENT_RX, 9);
+    }
+}
+
+static void i2c_irq(uint32_t i2c_periph) {
+    native_i2c_t *i2c = &native_i2c[i2c_periph];
+    uint32_t ev = i2c->stat0 &
+            (I2C_STAT0_SBSEND | I2C_STAT0_ADDSEND | I2C_STAT0_BTC);
+    uint32_t buf = i2c->stat0 & (I2C_STAT0_TBE | I2C_STAT0_RBNE);
+    uint32_t err = i2c->stat0 &
+            (I2C_STAT0_BERR | I2C_STAT0_LOSTARB | I2C_STAT0_AERR);
+
+    if ((i2c->ctl1 & I2C_CTL1_EVIE) &&
+            (ev || (buf && (i2c->ctl1 & I2C_CTL1_BUFIE))))
+        native_irq_call(i2c_ev_irq[i2c_periph], i2c_ev_handler[i2c_periph]);
+    if ((i2c->ctl1 & I2C_CTL1_ERRIE) && err)
+        native_irq_call(i2c_er_irq[i2c_periph], i2c_er_handler[i2c_periph]);
+}
+
+static void i2c_complete(uint32_t i2c_periph) {
+    native_i2c_t *i2c = &native_i2c[i2c_periph];
+    native_i2c_event event = i2c->event;
+    native_i2c_device *dev;
+
+    i2c->event = NATIVE_I2C_EVENT_NONE;
+    switch (event) {
+    case NATIVE_I2C_EVENT_START:
+        i2c->stat0 |= I2C_STAT0_SBSEND;
+        break;
+    case NATIVE_I2C_EVENT_ADDR:
+        dev = i2c->devices;
+        while ((dev != NULL) && (dev->addr != ((i2c->shift >> 1) & 0x7f)))
+            dev = dev->next;
+        if ((dev != NULL) && dev->hang) {
+            i2c_hang(i2c_periph, dev->hang);
+            break;
+        }
+        if ((dev == NULL) || !dev->start(dev, i2c->reading)) {
+            i2c->active = NULL;
+            i2c->stat0 |= I2C_STAT0_AERR;
+            break;
+        }
+        i2c->active = dev;
+        i2c->stat0 |= I2C_STAT0_ADDSEND;
+        if (i2c->reading) {
+            i2c->stat1 &= ~I2C_STAT1_TR;
+        }
+        else {
+            i2c->stat1 |= I2C_STAT1_TR;
+            i2c->stat0 |= I2C_STAT0_TBE;
+        }
+        break;
+    case NATIVE_I2C_EVENT_TX:
+        if (i2c->active == NULL)
+            break;
+        i2c->bytes++;
+        if (!i2c->active->write(i2c->active, i2c->shift))
+            i2c->stat0 |= I2C_STAT0_AERR;
+        else
+            i2c->stat0 |= I2C_STAT0_TBE | I2C_STAT0_BTC;
+        break;
+    case NATIVE_I2C_EVENT_RX:
+        if (i2c->active == NULL)
+            break;
+        i2c->data = i2c->active->read(i2c->active);
+        i2c->stat0 |= I2C_STAT0_RBNE | I2C_STAT0_BTC;
+        i2c->bytes++;
+        if (i2c->stop_req)
+            i2c_stop(i2c);
+        break;
+    case NATIVE_I2C_EVENT_STOP:
+        i2c->stat1 = 0;
+        break;
+    default:
+        break;
+    }
+    i2c_dma(i2c_periph);
+    i2c_irq(i2c_periph);
+}
+
+// Simulated time the next bus phase completes at, UINT64_MAX for none
+uint64_t native_i2c_next_ns(void) {
+    uint64_t next = UINT64_MAX;
+    for (uint32_t i = 0; i < NATIVE_I2C_PERIPHS; i++)
+        if ((native_i2c[i].event != NATIVE_I2C_EVENT_NONE) &&
+                (native_i2c[i].event_ns < next))
+            next = native_i2c[i].event_ns;
+    return next;
+}
+
+// Complete the earliest bus phase that is due, FALSE if there is none
+bool native_i2c_run(void) {
+    uint32_t due = NATIVE_I2C_PERIPHS;
+    for (uint32_t i = 0; i < NATIVE_I2C_PERIPHS; i++)
+        if ((native_i2c[i].event != NATIVE_I2C_EVENT_NONE) &&
+                (native_i2c[i].event_ns <= native_sim_ns) &&
+                ((due == NATIVE_I2C_PERIPHS) ||
+                (native_i2c[i].event_ns < native_i2c[due].event_ns)))
+            due = i;
+    if (due == NATIVE_I2C_PERIPHS)
+        return FALSE;
+    i2c_complete(due);
+    return TRUE;
+}
+
+void i2c_deinit(uint32_t i2c_periph) {
+    native_i2c_t *i2c = &native_i2c[i2c_periph];
+    native_i2c_device *devices = i2c->devices;
+    uint64_t wire_ns = i2c->wire_ns;
+    uint32_t transactions = i2c->transactions;
+    uint32_t bytes = i2c->bytes;
+    uint32_t stuck_clocks = i2c->stuck_clocks;
+    bool scl_level = i2c->scl_level;
+
+    // The bus itself is not reset along with the peripheral
+    memset(i2c, 0, sizeof(*i2c));
+    i2c->devices = devices;
+    i2c->stuck_clocks = stuck_clocks;
+    i2c->scl_level = scl_level;
+    i2c->wire_ns = wire_ns;
+    i2c->transactions = transactions;
+    i2c->bytes = bytes;
+}
+
+void i2c_clock_config(uint32_t i2c_periph, uint32_t clkspeed, uint32_t dutycyc) {
+    native_i2c[i2c_periph].clkspeed = clkspeed;
+    native_i2c[i2c_periph].dutycyc = dutycyc;
+}
+
+void i2c_mode_addr_config(uint32_t i2c_periph, uint32_t mode,
+        uint32_t addformat, uint32_t addr) {
+    (void)i2c_periph;
+    (void)mode;
+    (void)addformat;
+    (void)addr;
+}
+
+void i2c_enable(uint32_t i2c_periph) {
+    I2C_CTL0(i2c_periph) |= I2C_CTL0_I2CEN;
+}
+
+void i2c_disable(uint32_t i2c_periph) {
+    I2C_CTL0(i2c_periph) &= ~I2C_CTL0_I2CEN;
+}
+
+void i2c_ack_config(uint32_t i2c_periph, uint32_t ack) {
+    if (ack == I2C_ACK_ENABLE)
+        I2C_CTL0(i2c_periph) |= I2C_CTL0_ACKEN;
+    else
+        I2C_CTL0(i2c_periph) &= ~I2C_CTL0_ACKEN;
+}
+
+void i2c_ackpos_config(uint32_t i2c_periph, uint32_t pos) {
+    I2C_CTL0(i2c_periph) = (I2C_CTL0(i2c_periph) & ~I2C_CTL0_POAP) | pos;
+}
+
+void i2c_start_on_bus(uint32_t i2c_periph) {
+    native_i2c_t *i2c = &native_i2c[i2c_periph];
+    if (!(i2c->stat1 & I2C_STAT1_MASTER))
+        i2c->transactions++;
+    i2c->stat1 |= I2C_STAT1_I2CBSY | I2C_STAT1_MASTER;
+    i2c_schedule(i2c, NATIVE_I2C_EVENT_START, 1);
+}
+
+void i2c_stop_on_bus(uint32_t i2c_periph) {
+    native_i2c_t *i2c = &native_i2c[i2c_periph];
+    if (i2c->event == NATIVE_I2C_EVENT_RX)
+        i2c->stop_req = TRUE;
+    else
+        i2c_stop(i2c);
+}
+
+void i2c_master_addressing(uint32_t i2c_periph, uint32_t addr,
+        uint32_t trandirection) {
+    native_i2c_t *i2c = &native_i2c[i2c_periph];
+    i2c->stat0 &= ~I2C_STAT0_SBSEND;
+    i2c->reading = (trandirection == I2C_RECEIVER);
+    i2c->shift = (addr & 0xfe) | (i2c->reading ? 1 : 0);
+    i2c_schedule(i2c, NATIVE_I2C_EVENT_ADDR, 9);
+}
+
+void i2c_data_transmit(uint32_t i2c_periph, uint8_t data) {
+    native_i2c_t *i2c = &native_i2c[i2c_periph];
+    if ((i2c->active == NULL) || i2c->reading)
+        return;
+    i2c->shift = data;
+    i2c->stat0 &= ~(I2C_STAT0_TBE | I2C_STAT0_BTC);
+    i2c_schedule(i2c, NATIVE_I2C_EVENT_TX, 9);
+}
+
+uint8_t i2c_data_receive(uint32_t i2c_periph) {
+    native_i2c_t *i2c = &native_i2c[i2c_periph];
+    uint8_t val = i2c->data;
+    i2c->stat0 &= ~(I2C_STAT0_RBNE | I2C_STAT0_BTC);
+    // With ACK still enabled the master clocks in the next byte
+    if ((i2c->active != NULL) && i2c->reading && !i2c->stop_req &&
+            (i2c->ctl0 & I2C_CTL0_ACKEN) &&
+            (i2c->event == NATIVE_I2C_EVENT_NONE))
+        i2c_schedule(i2c, NATIVE_I2C_EVENT_RX, 9);
+    return val;
+}
+
+FlagStatus i2c_flag_get(uint32_t i2c_periph, i2c_flag_enum flag) {
+    uint32_t reg = (flag & 0x100) ?
+            native_i2c[i2c_periph].stat1 : native_i2c[i2c_periph].stat0;
+    return (reg & BIT(flag & 0x1f)) ? SET : RESET;
+}
+
+void i2c_flag_clear(uint32_t i2c_periph, i2c_flag_enum flag) {
+    native_i2c_t *i2c = &native_i2c[i2c_periph];
+    if (flag & 0x100) {
+        i2c->stat1 &= ~BIT(flag & 0x1f);
+        return;
+    }
+    i2c->stat0 &= ~BIT(flag & 0x1f);
+    if (flag != I2C_FLAG_ADDSEND)
+        return;
+    // Clearing ADDSEND releases SCL, a receiver clocks in the first byte
+    if (i2c->reading && (i2c->active != NULL))
+        i2c_schedule(i2c, NATIVE_I2C_EVENT_RX, 9);
+    else
+        i2c_dma(i2c_periph);
+}
+
+void i2c_interrupt_enable(uint32_t i2c_periph, i2c_interrupt_enum interrupt) {
+    I2C_CTL1(i2c_periph) |= interrupt;
+}
+
+void i2c_interrupt_disable(uint32_t i2c_periph, i2c_interrupt_enum interrupt) {
+    I2C_CTL1(i2c_periph) &= ~(uint32_t)interrupt;
+}
+
+FlagStatus i2c_interrupt_flag_get(uint32_t i2c_periph,
+        i2c_interrupt_flag_enum int_flag) {
+    uint32_t enable;
+    if ((int_flag == I2C_INT_FLAG_TBE) || (int_flag == I2C_INT_FLAG_RBNE))
+        enable = I2C_CTL1_EVIE | I2C_CTL1_BUFIE;
+    else if (int_flag >= I2C_INT_FLAG_BERR)
+        enable = I2C_CTL1_ERRIE;
+    else
+        enable = I2C_CTL1_EVIE;
+    if ((I2C_CTL1(i2c_periph) & enable) != enable)
+        return RESET;
+    return i2c_flag_get(i2c_periph, (i2c_flag_enum)int_flag);
+}
+
+void i2c_interrupt_flag_clear(uint32_t i2c_periph,
+        i2c_interrupt_flag_enum int_flag) {
+    i2c_flag_clear(i2c_periph, (i2c_flag_enum)int_flag);
+}
+
+void i2c_dma_enable(uint32_t i2c_periph, uint32_t dmastate) {
+    I2C_CTL1(i2c_periph) = (I2C_CTL1(i2c_periph) & ~I2C_CTL1_DMAON) |
+            dmastate;
+}
+
+void i2c_dma_last_transfer_config(uint32_t i2c_periph, uint32_t dmalast) {
+    I2C_CTL1(i2c_periph) = (I2C_CTL1(i2c_periph) & ~I2C_CTL1_DMALST) |
+            dmalast;
+}
+
+static bool fanchip_start(native_i2c_device *dev, bool read) {
+    (void)dev;
+    (void)read;
+    return TRUE;
+}
+
+static bool fanchip_write(native_i2c_device *dev, uint8_t byte) {
+    native_fanchip *chip = (native_fanchip *)dev;
+    switch (chip->state) {
+    case NATIVE_FANCHIP_IDLE:
+        chip->ptr = byte & 0x7f;
+        chip->state = (byte & 0x80) ?
+                NATIVE_FANCHIP_BLOCK_COUNT : NATIVE_FANCHIP_SINGLE;
+        break;
+    case NATIVE_FANCHIP_BLOCK_COUNT:
+        // Count is implied by the length of the transfer
+        chip->state = NATIVE_FANCHIP_BLOCK_RW;
+        break;
+    case NATIVE_FANCHIP_SINGLE:
+    case NATIVE_FANCHIP_BLOCK_RW:
+        chip->regs[chip->ptr++] = byte;
+        chip->reg_writes++;
+        break;
+    }
+    return TRUE;
+}
+
+static uint8_t fanchip_read(native_i2c_device *dev) {
+    native_fanchip *chip = (native_fanchip *)dev;
+    if (chip->state == NATIVE_FANCHIP_BLOCK_COUNT) {
+        chip->state = NATIVE_FANCHIP_BLOCK_RW;
+        return chip->regs[0x00];
+    }
+    chip->reg_reads++;
+    return chip->regs[chip->ptr++];
+}
+
+static void fanchip_stop(native_i2c_device *dev) {
+    native_fanchip *chip = (native_fanchip *)dev;
+    chip->state = NATIVE_FANCHIP_IDLE;
+}
+
+void native_fanchip_init(native_fanchip *chip, uint8_t addr) {
+    memset(chip, 0, sizeof(*chip));
+    chip->dev.addr = addr;
+    chip->dev.start = fanchip_start;
+    chip->dev.write = fanchip_write;
+    chip->dev.read = fanchip_read;
+    chip->dev.stop = fanchip_stop;
+}
@@ -0,0 +1,187 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Bit-banged SMBus master, plays the SMC against the soft I2C slave.
+ * Every pin change runs the EXTI model, so the slave ISR sees the same
+ * sequence of edges it would on the board.
+ */
+#include "gd32vf103.h"
+#include "native.h"
+
+// Slave reaction to a master edge shows up this much later in recordings
+#define SMBUS_SLAVE_DELAY_NS (100)
+
+static void smbus_record_bits(native_smbus *bus, uint32_t bits, uint64_t ns) {
+    uint32_t changed = bits ^ bus->vcd_level;
+    if (!changed)
+        return;
+    fprintf(bus->vcd, "#%llu\n", (unsigned long long)ns);
+    if (changed & 0x01)
+        fprintf(bus->vcd, "%u!\n", bits & 0x01);
+    if (changed & 0x02)
+        fprintf(bus->vcd, "%u\"\n", (bits >> 1) & 0x01);
+    bus->vcd_level = bits;
+}
+
+// Log the master edge on pin first, then the slave's response to it
+static void smbus_record(native_smbus *bus, uint32_t pin) {
+    uint32_t level = native_gpio_level(bus->gpio);
+    uint32_t bits = ((level & bus->scl_pin) ? 0x01 : 0) |
+            ((level & bus->sda_pin) ? 0x02 : 0);
+    uint32_t first = (pin == bus->scl_pin) ? 0x01 : 0x02;
+
+    bus->vcd_ns += bus->period_ns;
+    smbus_record_bits(bus, (bus->vcd_level & ~first) | (bits & first),
+            bus->vcd_ns);
+    smbus_record_bits(bus, bits, bus->vcd_ns + SMBUS_SLAVE_DELAY_NS);
+}
+
+// Level of the slave ISR taking the SCL edges
+static int smbus_level(native_smbus *bus) {
+    uint32_t line = __builtin_ctz(bus->scl_pin);
+    if (line < 5)
+        return native_irq_level((IRQn_Type)(EXTI0_IRQn + line));
+    return native_irq_level((line < 10) ? EXTI5_9_IRQn : EXTI10_15_IRQn);
+}
+
+static void smbus_set(native_smbus *bus, uint32_t pin, bool high) {
+    native_gpio_t *port = &native_gpio[bus->gpio];
+    if (((port->ext & pin) != 0) == (high != 0)) {
+        // The data slot of a bit passes with SDA left as it was
+        if (pin == bus->sda_pin)
+            bus->edge_ns += bus->period_ns;
+        return;
+    }
+
+    uint64_t due = bus->edge_ns + bus->period_ns;
+    // Time moved on outside a handler, the bus was idle
+    if ((native_sim_ns > due) && (native_sim_ns > bus->busy_ns))
+        due = native_sim_ns;
+    if (pin == bus->scl_pin) {
+        // Apply the slave's last pin writes before looking at them
+        native_gpio_level(bus->gpio);
+        uint64_t release = port->release_ns[__builtin_ctz(pin)];
+        if (high && (release > due)) {
+            bus->stretch_ns += release - due;
+            due = release;
+        }
+        else if (bus->busy_ns > due) {
+            bus->late++;
+        }
+    }
+    if (native_sim_ns < due)
+        native_advance(due - native_sim_ns);
+
+    bus->edges++;
+    bus->edge_ns = due;
+    native_gpio_drive(bus->gpio, pin, high ? pin : 0);
+    // Handlers below the slave would have let it in for the next edge
+    bus->busy_ns = native_irq_busy_ns(smbus_level(bus));
+    if (bus->vcd)
+        smbus_record(bus, pin);
+}
+
+static bool smbus_sda(native_smbus *bus) {
+    return (native_gpio_level(bus->gpio) & bus->sda_pin) ? TRUE : FALSE;
+}
+
+void native_smbus_init(native_smbus *bus, uint32_t gpio, uint32_t scl_pin,
+        uint32_t sda_pin) {
+    bus->gpio = gpio;
+    bus->scl_pin = scl_pin;
+    bus->sda_pin = sda_pin;
+    bus->edges = 0;
+    bus->period_ns = NATIVE_SMBUS_EDGE_NS;
+    bus->edge_ns = native_sim_ns;
+    bus->busy_ns = native_sim_ns;
+    bus->late = 0;
+    bus->stretch_ns = 0;
+    bus->vcd = NULL;
+    smbus_set(bus, sda_pin, TRUE);
+    smbus_set(bus, scl_pin, TRUE);
+}
+
+void native_smbus_speed(native_smbus *bus, uint32_t hz) {
+    bus->period_ns = 1000000000 / (3 * hz);
+}
+
+void native_smbus_record(native_smbus *bus, FILE *fp, const char *scl_name,
+        const char *sda_name) {
+    bus->vcd = fp;
+    bus->vcd_ns = 0;
+    bus->vcd_level = 0x03;
+    fprintf(fp, "$timescale 1ns $end\n");
+    fprintf(fp, "$scope module smbus $end\n");
+    fprintf(fp, "$var wire 1 ! %s $end\n", scl_name);
+    fprintf(fp, "$var wire 1 \" %s $end\n", sda_name);
+    fprintf(fp, "$upscope $end\n$enddefinitions $end\n");
+    fprintf(fp, "#0\n$dumpvars\n1!\n1\"\n$end\n");
+}
+
+// Also used as repeated start, in which case SCL is low on entry
+void native_smbus_start(native_smbus *bus) {
+    smbus_set(bus, bus->sda_pin, TRUE);
+    smbus_set(bus, bus->scl_pin, TRUE);
+    smbus_set(bus, bus->sda_pin, FALSE);
+    smbus_set(bus, bus->scl_pin, FALSE);
+}
+
+void native_smbus_stop(native_smbus *bus) {
+    smbus_set(bus, bus->sda_pin, FALSE);
+    smbus_set(bus, bus->scl_pin, TRUE);
+    smbus_set(bus, bus->sda_pin, TRUE);
+}
+
+bool native_smbus_write_byte(native_smbus *bus, uint8_t byte) {
+    for (int i = 7; i >= 0; i--) {
+        smbus_set(bus, bus->sda_pin, (byte >> i) & 0x01);
+        smbus_set(bus, bus->scl_pin, TRUE);
+        smbus_set(bus, bus->scl_pin, FALSE);
+    }
+    // Release SDA and clock in the ACK
+    smbus_set(bus, bus->sda_pin, TRUE);
+    smbus_set(bus, bus->scl_pin, TRUE);
+    bool ack = !smbus_sda(bus);
+    smbus_set(bus, bus->scl_pin, FALSE);
+    return ack;
+}
+
+uint8_t native_smbus_read_byte(native_smbus *bus, bool ack) {
+    uint8_t byte = 0;
+    smbus_set(bus, bus->sda_pin, TRUE);
+    for (int i = 0; i < 8; i++) {
+        smbus_set(bus, bus->scl_pin, TRUE);
+        byte = (byte << 1) | smbus_sda(bus);
+        smbus_set(bus, bus->scl_pin, FALSE);
+    }
+    smbus_set(bus, bus->sda_pin, !ack);
+    smbus_set(bus, bus->scl_pin, TRUE);
+    smbus_set(bus, bus->scl_pin, FALSE);
+    smbus_set(bus, bus->sda_pin, TRUE);
+    return byte;
+}
+
+bool native_smbus_write(native_smbus *bus, uint8_t addr, const uint8_t *buf,
+        size_t size) {
+    native_smbus_start(bus);
+    bool ack = native_smbus_write_byte(bus, addr << 1);
+    for (size_t i = 0; ack && (i < size); i++)
+        ack = native_smbus_write_byte(bus, buf[i]);
+    native_smbus_stop(bus);
+    return ack;
+}
+
+bool native_smbus_read(native_smbus *bus, uint8_t addr, uint8_t reg,
+        uint8_t *buf, size_t size) {
+    native_smbus_start(bus);
+    bool ack = native_smbus_write_byte(bus, addr << 1) &&
+            native_smbus_write_byte(bus, reg);
+    if (ack) {
+        native_smbus_start(bus);
+        ack = native_smbus_write_byte(bus, (addr << 1) | 0x01);
+    }
+    for (size_t i = 0; ack && (i < size); i++)
+        buf[i] = native_smbus_read_byte(bus, i != size - 1);
+    native_smbus_stop(bus);
+    return ack;
+}
@@ -0,0 +1,196 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * SPI master model and the ST7735 LCD controller model
+ */
+#include <string.h>
+#include "gd32vf103.h"
+#include "native.h"
+
+native_spi_t native_spi[NATIVE_SPI_PERIPHS];
+
+// DMA0 channel serving the TX request of each SPI
+static const uint8_t spi_dma_tx[NATIVE_SPI_PERIPHS] = {DMA_CH2, DMA_CH4};
+
+void native_spi_reset(void) {
+    memset(native_spi, 0, sizeof(native_spi));
+    for (uint32_t i = 0; i < NATIVE_SPI_PERIPHS; i++)
+        native_spi[i].stat = SPI_STAT_TBE;
+}
+
+void native_spi_attach(uint32_t spi_periph, native_spi_device *dev) {
+    native_spi[spi_periph].device = dev;
+}
+
+// Time a byte takes on the wire, SPI0 runs off the 108 MHz APB2
+static uint64_t spi_byte_ns(native_spi_t *spi) {
+    uint32_t div = 2u << ((spi->ctl0 & SPI_CTL0_PSC) >> 3);
+    return 8ull * div * 1000000000ull / SystemCoreClock;
+}
+
+static void spi_out(native_spi_t *spi, uint8_t byte) {
+    spi->bytes++;
+    spi->busy_ns += spi_byte_ns(spi);
+    if (spi->device)
+        spi->device->byte(spi->device, byte);
+}
+
+static bool spi_tx_ready(uint32_t spi_periph) {
+    native_spi_t *spi = &native_spi[spi_periph];
+    uint32_t ch = spi_dma_tx[spi_periph];
+    return (spi->ctl0 & SPI_CTL0_SPIEN) && (spi->ctl1 & SPI_CTL1_DMATEN) &&
+            (DMA_CHCTL(DMA0, ch) & DMA_CHXCTL_CHEN) &&
+            (DMA_CHCNT(DMA0, ch) != 0);
+}
+
+// Simulated time of the next byte that sets a DMA flag, UINT64_MAX for none.
+// The bytes in between go out whenever time passes them.
+uint64_t native_spi_next_ns(void) {
+    uint64_t next = UINT64_MAX;
+    for (uint32_t i = 0; i < NATIVE_SPI_PERIPHS; i++) {
+        native_spi_t *spi = &native_spi[i];
+        if (!spi->streaming) {
+            if (!spi_tx_ready(i))
+                continue;
+            spi->streaming = TRUE;
+            spi->next_ns = native_sim_ns + spi_byte_ns(spi);
+        }
+        uint32_t ch = spi_dma_tx[i];
+        uint32_t cnt = DMA_CHCNT(DMA0, ch);
+        uint32_t half = native_dma[DMA0].ch[ch].number / 2;
+        uint32_t left = (cnt > half) ? cnt - half : cnt;
+        uint64_t ns = spi->next_ns + (left - 1) * spi_byte_ns(spi);
+        if (ns < next)
+            next = ns;
+    }
+    return next;
+}
+
+// Send the DMA fed bytes that are due by now
+void native_spi_run(void) {
+    for (uint32_t i = 0; i < NATIVE_SPI_PERIPHS; i++) {
+        native_spi_t *spi = &native_spi[i];
+        while (spi->streaming && (spi->next_ns <= native_sim_ns)) {
+            if (!spi_tx_ready(i)) {
+                spi->streaming = FALSE;
+                break;
+            }
+            native_dma_request(DMA0, spi_dma_tx[i]);
+            spi->dma_bytes++;
+            spi_out(spi, spi->data & 0xff);
+            spi->next_ns += spi_byte_ns(spi);
+        }
+        if (spi->streaming && !spi_tx_ready(i))
+            spi->streaming = FALSE;
+    }
+}
+
+void spi_struct_para_init(spi_parameter_struct *spi_struct) {
+    memset(spi_struct, 0, sizeof(*spi_struct));
+}
+
+void spi_init(uint32_t spi_periph, spi_parameter_struct *spi_struct) {
+    SPI_CTL0(spi_periph) = spi_struct->device_mode | spi_struct->trans_mode |
+            spi_struct->frame_size | spi_struct->nss | spi_struct->endian |
+            spi_struct->clock_polarity_phase | spi_struct->prescale;
+}
+
+void spi_enable(uint32_t spi_periph) {
+    SPI_CTL0(spi_periph) |= SPI_CTL0_SPIEN;
+}
+
+void spi_disable(uint32_t spi_periph) {
+    SPI_CTL0(spi_periph) &= ~SPI_CTL0_SPIEN;
+}
+
+void spi_crc_polynomial_set(uint32_t spi_periph, uint16_t crc_poly) {
+    native_spi[spi_periph].crcpoly = crc_poly;
+}
+
+void spi_dma_enable(uint32_t spi_periph, uint8_t dma) {
+    SPI_CTL1(spi_periph) |= (dma == SPI_DMA_TRANSMIT) ?
+            SPI_CTL1_DMATEN : SPI_CTL1_DMAREN;
+}
+
+void spi_dma_disable(uint32_t spi_periph, uint8_t dma) {
+    SPI_CTL1(spi_periph) &= ~((dma == SPI_DMA_TRANSMIT) ?
+            SPI_CTL1_DMATEN : SPI_CTL1_DMAREN);
+}
+
+// The CPU only feeds single bytes and waits for each, no wire time passes
+void spi_i2s_data_transmit(uint32_t spi_periph, uint16_t data) {
+    native_spi_t *spi = &native_spi[spi_periph];
+    spi->data = data;
+    spi_out(spi, data & 0xff);
+    spi->stat |= SPI_STAT_RBNE;
+}
+
+uint16_t spi_i2s_data_receive(uint32_t spi_periph) {
+    native_spi[spi_periph].stat &= ~SPI_STAT_RBNE;
+    return 0xff;
+}
+
+FlagStatus spi_i2s_flag_get(uint32_t spi_periph, uint32_t flag) {
+    uint32_t stat = native_spi[spi_periph].stat;
+    // Busy while the TX DMA still has bytes to feed
+    if (spi_tx_ready(spi_periph))
+        stat |= SPI_STAT_TRANS;
+    return (stat & flag) ? SET : RESET;
+}
+
+static void lcd_byte(native_spi_device *dev, uint8_t byte) {
+    native_lcd *lcd = (native_lcd *)dev;
+    uint32_t level = native_gpio_level(GPIOB);
+
+    if (level & GPIO_PIN_2)
+        return;
+    if (!(level & GPIO_PIN_0)) {
+        lcd->cmd = byte;
+        lcd->param = 0;
+        if (byte == 0x2c) {
+            lcd->x = lcd->xs;
+            lcd->y = lcd->ys;
+            lcd->ramwr++;
+        }
+        return;
+    }
+
+    uint32_t param = lcd->param++;
+    switch (lcd->cmd) {
+    case 0x2a:
+    case 0x2b: {
+        uint16_t *reg = (lcd->cmd == 0x2a) ? &lcd->xs : &lcd->ys;
+        if (param >= 4)
+            break;
+        // Start then end, big endian
+        reg += param / 2;
+        *reg = (param & 1) ? ((*reg & 0xff00) | byte) : (byte << 8);
+        break;
+    }
+    case 0x2c:
+        if (!(param & 1)) {
+            lcd->hi = byte;
+            break;
+        }
+        if ((lcd->y < NATIVE_LCD_ROWS) && (lcd->x < NATIVE_LCD_COLS))
+            lcd->ram[lcd->y][lcd->x] = (lcd->hi << 8) | byte;
+        lcd->pixels++;
+        // Wraps around inside the window
+        if (++lcd->x > lcd->xe) {
+            lcd->x = lcd->xs;
+            if (++lcd->y > lcd->ye)
+                lcd->y = lcd->ys;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void native_lcd_init(native_lcd *lcd) {
+    memset(lcd, 0, sizeof(*lcd));
+    lcd->dev.byte = lcd_byte;
+    lcd->xe = NATIVE_LCD_COLS - 1;
+    lcd->ye = NATIVE_LCD_ROWS - 1;
+    native_spi_attach(SPI0, &lcd->dev);
+}
@@ -0,0 +1,224 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Timer model and simulated time
+ */
+#include <string.h>
+#include "gd32vf103.h"
+#include "native.h"
+
+// Time __WFI() sleeps for when nothing is scheduled
+#define NATIVE_WFI_IDLE_NS (1000000)
+
+native_timer_t native_timer[NATIVE_TIMERS];
+uint64_t native_sim_ns;
+
+uint64_t native_i2c_next_ns(void);
+bool native_i2c_run(void);
+uint64_t native_spi_next_ns(void);
+void native_spi_run(void);
+uint64_t native_mtip_next_ns(void);
+void native_mtip_run(void);
+
+// Update event DMA request of each timer
+static const struct {
+    uint8_t dma;
+    uint8_t ch;
+} timer_up_dma[NATIVE_TIMERS] = {
+    [TIMER0] = {DMA0, DMA_CH4},
+    [TIMER1] = {DMA0, DMA_CH1},
+    [TIMER2] = {DMA0, DMA_CH2},
+    [TIMER3] = {DMA0, DMA_CH6},
+    [TIMER4] = {DMA1, DMA_CH1},
+    [TIMER5] = {DMA1, DMA_CH2},
+    [TIMER6] = {DMA1, DMA_CH3}
+};
+
+static const IRQn_Type timer_irq[NATIVE_TIMERS] = {
+    TIMER0_UP_IRQn, TIMER1_IRQn, TIMER2_IRQn, TIMER3_IRQn, TIMER4_IRQn,
+    TIMER5_IRQn, TIMER6_IRQn
+};
+
+static void (*const timer_handler[NATIVE_TIMERS])(void) = {
+    TIMER0_UP_IRQHandler, TIMER1_IRQHandler, TIMER2_IRQHandler,
+    TIMER3_IRQHandler, TIMER4_IRQHandler, TIMER5_IRQHandler,
+    TIMER6_IRQHandler
+};
+
+void native_timer_reset(void) {
+    memset(native_timer, 0, sizeof(native_timer));
+    native_sim_ns = 0;
+}
+
+static void timer_update(uint32_t timer_periph) {
+    native_timer_t *timer = &native_timer[timer_periph];
+    timer->intf |= TIMER_INTF_UPIF;
+    if (timer->dmainten & TIMER_DMAINTEN_UPDEN)
+        native_dma_request(timer_up_dma[timer_periph].dma,
+                timer_up_dma[timer_periph].ch);
+    if (timer->dmainten & TIMER_DMAINTEN_UPIE)
+        native_irq_call(timer_irq[timer_periph], timer_handler[timer_periph]);
+}
+
+// Timers run off the 108 MHz core clock (APB1 x2 and APB2)
+static uint64_t sim_ticks(uint64_t ns) {
+    return ns * (SystemCoreClock / 1000000) / 1000;
+}
+
+// Move the timers to an absolute simulated time
+static void timer_run(uint64_t to) {
+    uint64_t elapsed = sim_ticks(to) - sim_ticks(native_sim_ns);
+    native_sim_ns = to;
+
+    for (uint32_t i = 0; i < NATIVE_TIMERS; i++) {
+        native_timer_t *timer = &native_timer[i];
+        if (!(timer->ctl0 & TIMER_CTL0_CEN))
+            continue;
+        uint64_t period = (uint64_t)(timer->psc + 1) * (timer->car + 1);
+        timer->ticks += elapsed;
+        while (timer->ticks >= period) {
+            timer->ticks -= period;
+            timer_update(i);
+            // The handler may have stopped or reprogrammed the timer
+            if (!(timer->ctl0 & TIMER_CTL0_CEN))
+                break;
+            period = (uint64_t)(timer->psc + 1) * (timer->car + 1);
+        }
+        timer->cnt = (timer->ticks / (timer->psc + 1)) & 0xffff;
+    }
+}
+
+void native_advance(uint64_t ns) {
+    uint64_t target = native_sim_ns + ns;
+
+    // Stop at every I2C bus phase, SPI DMA flag and mtimecmp match on the
+    // way, the handlers start the next
+    for (;;) {
+        native_mtip_run();
+        uint64_t next = native_i2c_next_ns();
+        uint64_t spi = native_spi_next_ns();
+        uint64_t mtip = native_mtip_next_ns();
+        if (spi < next)
+            next = spi;
+        if (mtip < next)
+            next = mtip;
+        if (next > target)
+            next = target;
+        if (next > native_sim_ns)
+            timer_run(next);
+        native_mtip_run();
+        native_spi_run();
+        if (!native_i2c_run() && (next == target))
+            break;
+    }
+}
+
+uint64_t native_next_event_ns(void) {
+    uint64_t next = native_i2c_next_ns();
+    uint64_t spi = native_spi_next_ns();
+    uint64_t mtip = native_mtip_next_ns();
+    uint32_t mhz = SystemCoreClock / 1000000;
+
+    if (spi < next)
+        next = spi;
+    if (mtip < next)
+        next = mtip;
+    for (uint32_t i = 0; i < NATIVE_TIMERS; i++) {
+        native_timer_t *timer = &native_timer[i];
+        if (!(timer->ctl0 & TIMER_CTL0_CEN) || !(timer->dmainten &
+                (TIMER_DMAINTEN_UPIE | TIMER_DMAINTEN_UPDEN)))
+            continue;
+        uint64_t period = (uint64_t)(timer->psc + 1) * (timer->car + 1);
+        uint64_t ns = ((period - timer->ticks) * 1000 + mhz - 1) / mhz;
+        if (native_sim_ns + ns < next)
+            next = native_sim_ns + ns;
+    }
+    return next;
+}
+
+void native_wfi(void) {
+    uint32_t irqs = native_stats.irq_count;
+
+    while ((native_stats.irq_count == irqs) && !native_irq_pending()) {
+        uint64_t next = native_next_event_ns();
+        if (next == UINT64_MAX) {
+            // Nothing could ever wake the core, return like a tick would
+            native_advance(NATIVE_WFI_IDLE_NS);
+            return;
+        }
+        native_advance((next > native_sim_ns) ? next - native_sim_ns : 1);
+    }
+}
+
+// Stands in for systick.c, which busy-waits on mtime
+void delay_1ms(uint32_t count) {
+    native_advance((uint64_t)count * 1000000);
+}
+
+void timer_deinit(uint32_t timer_periph) {
+    memset(&native_timer[timer_periph], 0, sizeof(native_timer_t));
+}
+
+void timer_struct_para_init(timer_parameter_struct *initpara) {
+    initpara->prescaler = 0;
+    initpara->alignedmode = TIMER_COUNTER_EDGE;
+    initpara->counterdirection = TIMER_COUNTER_UP;
+    initpara->period = 65535;
+    initpara->clockdivision = TIMER_CKDIV_DIV1;
+    initpara->repetitioncounter = 0;
+}
+
+void timer_init(uint32_t timer_periph, timer_parameter_struct *initpara) {
+    native_timer_t *timer = &native_timer[timer_periph];
+    timer->psc = initpara->prescaler;
+    timer->car = initpara->period & 0xffff;
+    timer->cnt = 0;
+    timer->ticks = 0;
+}
+
+void timer_enable(uint32_t timer_periph) {
+    TIMER_CTL0(timer_periph) |= TIMER_CTL0_CEN;
+}
+
+void timer_disable(uint32_t timer_periph) {
+    TIMER_CTL0(timer_periph) &= ~TIMER_CTL0_CEN;
+}
+
+void timer_autoreload_value_config(uint32_t timer_periph, uint32_t autoreload) {
+    TIMER_CAR(timer_periph) = autoreload & 0xffff;
+}
+
+void timer_counter_value_config(uint32_t timer_periph, uint16_t counter) {
+    native_timer_t *timer = &native_timer[timer_periph];
+    timer->cnt = counter;
+    timer->ticks = (uint64_t)counter * (timer->psc + 1);
+}
+
+uint32_t timer_counter_read(uint32_t timer_periph) {
+    return TIMER_CNT(timer_periph);
+}
+
+void timer_dma_enable(uint32_t timer_periph, uint16_t dma) {
+    TIMER_DMAINTEN(timer_periph) |= dma;
+}
+
+void timer_dma_disable(uint32_t timer_periph, uint16_t dma) {
+    TIMER_DMAINTEN(timer_periph) &= ~(uint32_t)dma;
+}
+
+void timer_interrupt_enable(uint32_t timer_periph, uint32_t interrupt) {
+    TIMER_DMAINTEN(timer_periph) |= interrupt;
+}
+
+void timer_interrupt_disable(uint32_t timer_periph, uint32_t interrupt) {
+    TIMER_DMAINTEN(timer_periph) &= ~interrupt;
+}
+
+FlagStatus timer_interrupt_flag_get(uint32_t timer_periph, uint32_t interrupt) {
+    return ((TIMER_INTF(timer_periph) & interrupt) &&
+            (TIMER_DMAINTEN(timer_periph) & interrupt)) ? SET : RESET;
+}
+
+void timer_interrupt_flag_clear(uint32_t timer_periph, uint32_t interrupt) {
+    TIMER_INTF(timer_periph) &= ~interrupt;
+}
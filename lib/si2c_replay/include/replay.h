@@ -0,0 +1,77 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Replay of logic analyzer captures (VCD or CSV) through the host shim.
+ * Every captured SCL/SDA transition is driven onto the soft I2C pins, so
+ * the firmware ISR runs exactly as it would on the bus the trace came from.
+ */
+#pragma once
+
+#include "gd32vf103.h"
+
+#define REPLAY_MAX_BUSES (2)
+#define REPLAY_MAX_IDS (REPLAY_MAX_BUSES * 2)
+#define REPLAY_MAX_COLUMNS (32)
+#define REPLAY_LINE_MAX (1024)
+
+typedef enum {
+    REPLAY_UNKNOWN,
+    REPLAY_VCD,
+    REPLAY_CSV
+} replay_format;
+
+typedef struct {
+    // Signal names in the capture, NULL if the bus is not captured
+    const char *scl_name;
+    const char *sda_name;
+    // Where the signals go
+    uint32_t gpio;
+    uint32_t scl_pin;
+    uint32_t sda_pin;
+    // Bus activity as seen in the capture
+    uint64_t starts;
+    uint64_t stops;
+    // SCL rising edges where the slave pulled SDA low but the capture had
+    // it high, i.e. the emulation answered differently from the real chip
+    uint64_t conflicts;
+    // Current captured level, bit 0 = SCL, bit 1 = SDA
+    uint32_t level;
+} replay_bus;
+
+typedef struct {
+    replay_bus bus[REPLAY_MAX_BUSES];
+    uint32_t buses;
+    // Called after the changes of every timestamp have been applied
+    void (*step_cb)(void *arg);
+    void *step_arg;
+
+    replay_format format;
+    uint64_t edges;     // Pin transitions driven
+    uint64_t steps;     // Timestamps with at least one transition
+    double time;        // Last timestamp, seconds
+
+    // Parser state
+    char line[REPLAY_LINE_MAX];
+    size_t line_len;
+    double timescale;
+    int command;
+    int field;
+    char var_id[16];
+    bool vector;
+    int ids;
+    char id[REPLAY_MAX_IDS][16];
+    uint8_t id_signal[REPLAY_MAX_IDS];
+    int columns;
+    int8_t col_signal[REPLAY_MAX_COLUMNS];
+    // Changes of the current timestamp, bit 0 = SCL, bit 1 = SDA
+    uint32_t pend_mask[REPLAY_MAX_BUSES];
+    uint32_t pend_level[REPLAY_MAX_BUSES];
+} replay;
+
+// Buses must be set up (names, gpio, pins) before replay_begin
+void replay_begin(replay *r);
+// Feed capture data, may be split anywhere
+void replay_feed(replay *r, const char *data, size_t len);
+void replay_end(replay *r);
+// Convenience wrapper around begin/feed/end, returns FALSE on I/O error
+bool replay_file(replay *r, const char *path);
@@ -0,0 +1,33 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Host decoder for the soft I2C trace ring (see si2c_trace.h). Works on
+ * records drained at run time or on a raw memory dump of si2c_trace_ring,
+ * e.g. from gdb: dump binary value trace.bin si2c_trace_ring
+ */
+#pragma once
+
+#include <stdio.h>
+#include "gd32vf103.h"
+#include "si2c_trace.h"
+
+// mtime runs at SystemCoreClock / 4
+#define TRACE_DEFAULT_CLOCK (27000000)
+
+typedef struct {
+    FILE *fp;
+    uint32_t clock;
+    bool started;
+    uint32_t last_time;
+    uint64_t ticks; // Since the first record
+    uint64_t records;
+} trace_decoder;
+
+void trace_decode_begin(trace_decoder *dec, FILE *fp, uint32_t clock);
+// One line per record, times are relative to the first record
+void trace_decode_record(trace_decoder *dec, const SI2C_TRACE_RECORD *record);
+// Decodes the records between tail and head, returns FALSE if the dump is
+// too short to be a ring
+bool trace_decode_dump(trace_decoder *dec, const void *dump, size_t len);
+const char *trace_state_name(uint32_t state);
+const char *trace_event_name(uint32_t event);
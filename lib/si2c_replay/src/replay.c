@@ -0,0 +1,336 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * VCD and CSV capture replay. Input is consumed line by line from a
+ * streaming buffer so captures of any length replay in constant memory.
+ * All changes sharing a timestamp are driven together, like the pins
+ * would change together on the bus.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gd32vf103.h"
+#include "native.h"
+#include "replay.h"
+
+#define SIG_SCL (0x01)
+#define SIG_SDA (0x02)
+
+enum {
+    CMD_NONE,
+    CMD_TIMESCALE,
+    CMD_VAR,
+    CMD_SKIP
+};
+
+// Signal index for a name: bus * 2 + (0 = SCL, 1 = SDA), -1 if unused
+static int replay_signal(replay *r, const char *name) {
+    for (uint32_t i = 0; i < r->buses; i++) {
+        if (r->bus[i].scl_name && !strcmp(r->bus[i].scl_name, name))
+            return i * 2;
+        if (r->bus[i].sda_name && !strcmp(r->bus[i].sda_name, name))
+            return i * 2 + 1;
+    }
+    return -1;
+}
+
+static void replay_set(replay *r, int signal, int value) {
+    uint32_t bit = (signal & 1) ? SIG_SDA : SIG_SCL;
+    uint32_t idx = signal >> 1;
+    r->pend_mask[idx] |= bit;
+    if (value)
+        r->pend_level[idx] |= bit;
+    else
+        r->pend_level[idx] &= ~bit;
+}
+
+static void replay_flush(replay *r) {
+    bool stepped = FALSE;
+
+    // Let running timers (DMA sampling of the bus) see the time in between
+    uint64_t ns = (uint64_t)(r->time * 1e9);
+    if (ns > native_sim_ns)
+        native_advance(ns - native_sim_ns);
+
+    for (uint32_t i = 0; i < r->buses; i++) {
+        replay_bus *bus = &r->bus[i];
+        uint32_t level = (bus->level & ~r->pend_mask[i]) |
+                (r->pend_level[i] & r->pend_mask[i]);
+        uint32_t changed = level ^ bus->level;
+        r->pend_mask[i] = 0;
+        if (!changed)
+            continue;
+
+        // Bus conditions as captured, only when SCL is held high
+        if ((bus->level & level & SIG_SCL) && (changed == SIG_SDA)) {
+            if (level & SIG_SDA)
+                bus->stops++;
+            else
+                bus->starts++;
+        }
+
+        uint32_t mask = 0;
+        uint32_t pins = 0;
+        if (changed & SIG_SCL) {
+            mask |= bus->scl_pin;
+            r->edges++;
+        }
+        if (changed & SIG_SDA) {
+            mask |= bus->sda_pin;
+            r->edges++;
+        }
+        if (level & SIG_SCL)
+            pins |= bus->scl_pin;
+        if (level & SIG_SDA)
+            pins |= bus->sda_pin;
+        bus->level = level;
+        native_gpio_drive(bus->gpio, mask, pins);
+
+        if ((changed & level & SIG_SCL) && (level & SIG_SDA) &&
+                !(native_gpio_level(bus->gpio) & bus->sda_pin))
+            bus->conflicts++;
+        stepped = TRUE;
+    }
+
+    if (stepped) {
+        r->steps++;
+        if (r->step_cb)
+            r->step_cb(r->step_arg);
+    }
+}
+
+static double replay_unit(const char *s) {
+    while (*s == ' ' || (*s >= '0' && *s <= '9'))
+        s++;
+    if (!strncmp(s, "ms", 2)) return 1e-3;
+    if (!strncmp(s, "us", 2)) return 1e-6;
+    if (!strncmp(s, "ns", 2)) return 1e-9;
+    if (!strncmp(s, "ps", 2)) return 1e-12;
+    if (!strncmp(s, "fs", 2)) return 1e-15;
+    return 1.0;
+}
+
+static void replay_vcd_token(replay *r, char *tok) {
+    if (r->command != CMD_NONE) {
+        if (!strcmp(tok, "$end")) {
+            r->command = CMD_NONE;
+        }
+        else if (r->command == CMD_TIMESCALE) {
+            // "1ns" or "1 ns"
+            if (*tok >= '0' && *tok <= '9')
+                r->timescale = atof(tok);
+            r->timescale *= replay_unit(tok);
+            if (r->timescale == 0)
+                r->timescale = 1e-9;
+        }
+        else if (r->command == CMD_VAR) {
+            // $var <type> <size> <id> <reference> [index] $end
+            if (r->field == 2) {
+                strncpy(r->var_id, tok, sizeof(r->var_id) - 1);
+                r->var_id[sizeof(r->var_id) - 1] = '\0';
+            }
+            else if (r->field == 3) {
+                int signal = replay_signal(r, tok);
+                if ((signal >= 0) && (r->ids < REPLAY_MAX_IDS)) {
+                    strcpy(r->id[r->ids], r->var_id);
+                    r->id_signal[r->ids++] = signal;
+                }
+            }
+            r->field++;
+        }
+        return;
+    }
+
+    char c = tok[0];
+    if (c == '$') {
+        if (!strcmp(tok, "$timescale")) {
+            r->command = CMD_TIMESCALE;
+            r->timescale = 0;
+        }
+        else if (!strcmp(tok, "$var")) {
+            r->command = CMD_VAR;
+            r->field = 0;
+        }
+        else if (strcmp(tok, "$dumpvars") && strcmp(tok, "$dumpall") &&
+                strcmp(tok, "$dumpon") && strcmp(tok, "$dumpoff") &&
+                strcmp(tok, "$end")) {
+            // $scope, $comment, $enddefinitions...
+            r->command = CMD_SKIP;
+        }
+        return;
+    }
+
+    if (c == '#') {
+        replay_flush(r);
+        r->time = (double)strtoull(tok + 1, NULL, 10) * r->timescale;
+        return;
+    }
+
+    int value;
+    const char *id;
+    if (r->vector) {
+        // Identifier following a vector value, value was stored in field
+        value = r->field;
+        id = tok;
+        r->vector = FALSE;
+    }
+    else if (c == 'b' || c == 'B') {
+        r->vector = TRUE;
+        r->field = tok[strlen(tok) - 1] == '1';
+        return;
+    }
+    else if (c == 'r' || c == 'R') {
+        r->vector = TRUE;
+        r->field = atof(tok + 1) != 0;
+        return;
+    }
+    else {
+        value = (c == '1');
+        id = tok + 1;
+    }
+
+    for (int i = 0; i < r->ids; i++) {
+        if ((r->id[i][0] == id[0]) && !strcmp(r->id[i], id)) {
+            replay_set(r, r->id_signal[i], value);
+            break;
+        }
+    }
+}
+
+static void replay_vcd_line(replay *r, char *line) {
+    char *tok = strtok(line, " \t");
+    while (tok) {
+        replay_vcd_token(r, tok);
+        tok = strtok(NULL, " \t");
+    }
+}
+
+static char *replay_csv_field(char **s) {
+    char *field = *s;
+    char *end = strchr(field, ',');
+    if (end) {
+        *end = '\0';
+        *s = end + 1;
+    }
+    else {
+        *s = NULL;
+    }
+    // Trim blanks and quotes
+    while (*field == ' ' || *field == '"')
+        field++;
+    size_t len = strlen(field);
+    while (len && (field[len - 1] == ' ' || field[len - 1] == '"'))
+        field[--len] = '\0';
+    return field;
+}
+
+static void replay_csv_line(replay *r, char *line) {
+    char *s = line;
+
+    if (r->columns == 0) {
+        // Header, first column is the time in seconds
+        while (s && (r->columns < REPLAY_MAX_COLUMNS)) {
+            char *name = replay_csv_field(&s);
+            r->col_signal[r->columns] =
+                    (r->columns == 0) ? -1 : replay_signal(r, name);
+            r->columns++;
+        }
+        return;
+    }
+
+    r->time = atof(replay_csv_field(&s));
+    for (int col = 1; s && (col < r->columns); col++) {
+        char *field = replay_csv_field(&s);
+        if (r->col_signal[col] >= 0)
+            replay_set(r, r->col_signal[col], field[0] == '1');
+    }
+    replay_flush(r);
+}
+
+static void replay_line(replay *r, char *line) {
+    if (r->format == REPLAY_UNKNOWN) {
+        while (*line == ' ' || *line == '\t')
+            line++;
+        if (*line == '\0')
+            return;
+        r->format = (*line == '$') ? REPLAY_VCD : REPLAY_CSV;
+    }
+
+    if (r->format == REPLAY_VCD)
+        replay_vcd_line(r, line);
+    else
+        replay_csv_line(r, line);
+}
+
+void replay_begin(replay *r) {
+    r->format = REPLAY_UNKNOWN;
+    r->edges = 0;
+    r->steps = 0;
+    r->time = 0;
+    r->line_len = 0;
+    r->timescale = 1e-9;
+    r->command = CMD_NONE;
+    r->vector = FALSE;
+    r->ids = 0;
+    r->columns = 0;
+
+    for (uint32_t i = 0; i < r->buses; i++) {
+        replay_bus *bus = &r->bus[i];
+        bus->starts = 0;
+        bus->stops = 0;
+        bus->conflicts = 0;
+        bus->level = SIG_SCL | SIG_SDA;
+        r->pend_mask[i] = 0;
+        r->pend_level[i] = 0;
+        native_gpio_drive(bus->gpio, bus->scl_pin | bus->sda_pin,
+                bus->scl_pin | bus->sda_pin);
+    }
+}
+
+void replay_feed(replay *r, const char *data, size_t len) {
+    while (len) {
+        const char *nl = memchr(data, '\n', len);
+        size_t chunk = nl ? (size_t)(nl - data) : len;
+        size_t room = REPLAY_LINE_MAX - 1 - r->line_len;
+        size_t copy = (chunk < room) ? chunk : room;
+
+        memcpy(r->line + r->line_len, data, copy);
+        r->line_len += copy;
+        if (!nl)
+            return;
+
+        if (r->line_len && r->line[r->line_len - 1] == '\r')
+            r->line_len--;
+        r->line[r->line_len] = '\0';
+        replay_line(r, r->line);
+        r->line_len = 0;
+        data += chunk + 1;
+        len -= chunk + 1;
+    }
+}
+
+void replay_end(replay *r) {
+    if (r->line_len) {
+        r->line[r->line_len] = '\0';
+        replay_line(r, r->line);
+        r->line_len = 0;
+    }
+    replay_flush(r);
+}
+
+bool replay_file(replay *r, const char *path) {
+    static char buf[1 << 16];
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return FALSE;
+
+    replay_begin(r);
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+        replay_feed(r, buf, len);
+    replay_end(r);
+
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok ? TRUE : FALSE;
+}
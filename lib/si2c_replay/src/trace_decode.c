@@ -0,0 +1,83 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ */
+#include <stdio.h>
+#include <string.h>
+#include "gd32vf103.h"
+#include "softi2c.h"
+#include "si2c_trace.h"
+#include "trace_decode.h"
+
+static const char *state_names[] = {
+    [ST_IDLE] = "IDLE",
+    [ST_ADDR] = "ADDR",
+    [ST_ADDR_ACK] = "ADDR_ACK",
+    [ST_READ_PREPARE] = "READ_PREPARE",
+    [ST_READ] = "READ",
+    [ST_READ_ACK] = "READ_ACK",
+    [ST_WRITE_PREPARE] = "WRITE_PREPARE",
+    [ST_WRITE] = "WRITE",
+    [ST_WRITE_ACK] = "WRITE_ACK",
+    [ST_WAIT_STOP] = "WAIT_STOP"
+};
+
+static const char *event_names[] = {
+    [TR_EDGE] = "edge",
+    [TR_START] = "START",
+    [TR_STOP] = "STOP",
+    [TR_UPDATE_REQ] = "rpm_update_req",
+    [TR_START_REQ] = "start_req"
+};
+
+const char *trace_state_name(uint32_t state) {
+    if (state >= sizeof(state_names) / sizeof(state_names[0]))
+        return "?";
+    return state_names[state];
+}
+
+const char *trace_event_name(uint32_t event) {
+    if (event >= sizeof(event_names) / sizeof(event_names[0]))
+        return "?";
+    return event_names[event];
+}
+
+void trace_decode_begin(trace_decoder *dec, FILE *fp, uint32_t clock) {
+    memset(dec, 0, sizeof(*dec));
+    dec->fp = fp;
+    dec->clock = clock;
+}
+
+void trace_decode_record(trace_decoder *dec, const SI2C_TRACE_RECORD *record) {
+    if (dec->started)
+        dec->ticks += (uint32_t)(record->time - dec->last_time);
+    dec->started = TRUE;
+    dec->last_time = record->time;
+    dec->records++;
+
+    fprintf(dec->fp, "%12.3f us  bus%u  ", dec->ticks * 1e6 / dec->clock,
+            record->bus);
+    if ((record->event == TR_UPDATE_REQ) || (record->event == TR_START_REQ))
+        fprintf(dec->fp, "%s\n", trace_event_name(record->event));
+    else
+        fprintf(dec->fp, "%s  %-13s %s\n",
+                (record->pin == PIN_SDA) ? "SDA" : "SCL",
+                trace_state_name(record->state),
+                trace_event_name(record->event));
+}
+
+bool trace_decode_dump(trace_decoder *dec, const void *dump, size_t len) {
+    SI2C_TRACE_RING ring;
+
+    if (len < sizeof(ring))
+        return FALSE;
+    memcpy(&ring, dump, sizeof(ring));
+    uint32_t count = ring.head - ring.tail;
+    if (count > SI2C_TRACE_SIZE)
+        return FALSE;
+    for (uint32_t i = 0; i < count; i++)
+        trace_decode_record(dec,
+                &ring.records[(ring.tail + i) & (SI2C_TRACE_SIZE - 1)]);
+    if (ring.dropped)
+        fprintf(dec->fp, "%u records dropped\n", ring.dropped);
+    return TRUE;
+}
@@ -0,0 +1,117 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ */
+#include <stdint.h>
+#include "curve.h"
+
+// Inputs are split into buckets by their top bits, each remembers the first
+// segment that reaches into it. A lookup starts there and scans forward past
+// the breakpoints inside the bucket, at most CURVE_POINTS steps when they all
+// crowd into one, none when the bucket holds no breakpoint.
+#define CURVE_BUCKET_SHIFT (12)
+#define CURVE_BUCKETS (0x10000 >> CURVE_BUCKET_SHIFT)
+// Flat segment before the first breakpoint and after the last one
+#define CURVE_SEGS (CURVE_POINTS + 1)
+
+typedef struct {
+    uint32_t end;   // First input past the segment
+    uint16_t in;    // Segment start
+    uint16_t out;
+    uint32_t slope; // Output per input, fixed point with shift bits
+    uint8_t shift;  // As many as fit, a segment can span the whole range
+} CURVE_SEG;
+
+typedef struct {
+    uint8_t bucket[CURVE_BUCKETS];
+    CURVE_SEG seg[CURVE_SEGS];
+} CURVE_MAP;
+
+// 160 bytes a map, about 4.5 kB for both ways of every channel. Built from
+// the breakpoints at run time as curve_set() can replace a curve, so they
+// live in RAM rather than flash.
+static CURVE_MAP curve_fwd[CURVE_CHANNELS];
+static CURVE_MAP curve_bwd[CURVE_CHANNELS];
+
+// Fan chip count = host count * 5 - 1000 on every channel, edit per channel
+// for other fans
+static const CURVE_POINT curve_default[] = {
+    {200, 0}, {13307, 65535}
+};
+
+static void curve_build(CURVE_MAP *map, const CURVE_POINT *points,
+        uint32_t count, int swap) {
+    CURVE_SEG *seg = map->seg;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t in = swap ? points[i].out : points[i].in;
+        uint16_t out = swap ? points[i].in : points[i].out;
+        seg->end = in;
+        seg++;
+        seg->in = in;
+        seg->out = out;
+        seg->slope = 0;
+        seg->shift = 0;
+        if (i + 1 < count) {
+            uint32_t dx = (swap ? points[i + 1].out : points[i + 1].in) - in;
+            uint32_t dy = (swap ? points[i + 1].in : points[i + 1].out) - out;
+            uint32_t shift = 32;
+            while ((((uint64_t)dy << shift) + dx / 2) / dx > 0xffffffff)
+                shift--;
+            seg->slope = (((uint64_t)dy << shift) + dx / 2) / dx;
+            seg->shift = shift;
+        }
+    }
+    seg->end = 0x10000;
+    // Input below the first breakpoint
+    map->seg[0].in = map->seg[1].in;
+    map->seg[0].out = map->seg[1].out;
+    map->seg[0].slope = 0;
+    map->seg[0].shift = 0;
+
+    uint32_t s = 0;
+    for (uint32_t b = 0; b < CURVE_BUCKETS; b++) {
+        while ((b << CURVE_BUCKET_SHIFT) >= map->seg[s].end)
+            s++;
+        map->bucket[b] = s;
+    }
+}
+
+static uint32_t curve_map(const CURVE_MAP *map, uint32_t val) {
+    if (val > 0xffff)
+        val = 0xffff;
+    const CURVE_SEG *seg = &map->seg[map->bucket[val >> CURVE_BUCKET_SHIFT]];
+    // Bounded, the last segment ends past any input
+    while (val >= seg->end)
+        seg++;
+    // The flat segment before the curve starts past val
+    uint32_t dx = (val > seg->in) ? val - seg->in : 0;
+    uint32_t out = seg->out + (((uint64_t)dx * seg->slope +
+            ((1ull << seg->shift) >> 1)) >> seg->shift);
+    return (out > 0xffff) ? 0xffff : out;
+}
+
+int curve_set(uint32_t channel, const CURVE_POINT *points, uint32_t count) {
+    if ((channel >= CURVE_CHANNELS) || (count < 2) || (count > CURVE_POINTS))
+        return -1;
+    for (uint32_t i = 1; i < count; i++)
+        if ((points[i].in <= points[i - 1].in) ||
+                (points[i].out <= points[i - 1].out))
+            return -1;
+    curve_build(&curve_fwd[channel], points, count, 0);
+    curve_build(&curve_bwd[channel], points, count, 1);
+    return 0;
+}
+
+void curve_init(void) {
+    for (uint32_t i = 0; i < CURVE_CHANNELS; i++)
+        curve_set(i, curve_default,
+                sizeof(curve_default) / sizeof(curve_default[0]));
+}
+
+uint32_t curve_forward(uint32_t channel, uint32_t val) {
+    return curve_map(&curve_fwd[channel], val);
+}
+
+uint32_t curve_backward(uint32_t channel, uint32_t val) {
+    return curve_map(&curve_bwd[channel], val);
+}
@@ -0,0 +1,144 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ */
+#include <stdint.h>
+#include "gd32vf103.h"
+#include "gd32vf103_timer.h"
+#include "fanslave.h"
+#include "fanmaster.h"
+#include "curve.h"
+#include "fanctl.h"
+#include "irq_level.h"
+
+#define FANCTL_TIMER (TIMER4)
+#define FANCTL_CHANNELS (14)
+// Timer counts at 10 kHz
+#define FANCTL_TIMER_HZ (10000)
+// Bound of the integral, in tach counts, so a fan that cannot get there
+// does not wind it up forever
+#define FANCTL_I_MAX (0x2000)
+#define FANCTL_TACH_MIN (1)
+#define FANCTL_TACH_MAX (0xffff)
+
+// Tuned on first order fan models with a 0.5 s time constant, 20% either
+// side of their setpoint: within 2% in 0.8 s, about 2% overshoot. The tach
+// readings are too coarse for the derivative to help.
+FANCTL_GAINS fanctl_gains = {384, 51, 0};
+volatile uint32_t fanctl_update_req;
+
+typedef struct {
+    int32_t integ; // Scaled by 256
+    int32_t prev_err;
+    bool valid; // Had a reading last period
+    uint32_t gen; // Request generation the target is for
+    uint32_t target;
+} FANCTL_STATE;
+
+static FANCTL_STATE fanctl_state[FANCTL_CHANNELS];
+// Bit per channel whose setpoint moved since fanctl_take_changed()
+static volatile uint32_t fanctl_changed;
+
+void fanctl_init(void) {
+    timer_parameter_struct timer_init_struct;
+
+    for (int i = 0; i < FANCTL_CHANNELS; i++) {
+        fanctl_state[i].integ = 0;
+        fanctl_state[i].prev_err = 0;
+        fanctl_state[i].valid = FALSE;
+        // No request seen yet, the first period converts them all
+        fanctl_state[i].gen = ~0u;
+    }
+    fanctl_update_req = 0;
+    fanctl_changed = 0;
+
+    rcu_periph_clock_enable(RCU_TIMER4);
+    timer_deinit(FANCTL_TIMER);
+    timer_struct_para_init(&timer_init_struct);
+    timer_init_struct.prescaler = SystemCoreClock / FANCTL_TIMER_HZ - 1;
+    timer_init_struct.period = FANCTL_TIMER_HZ / FANCTL_HZ - 1;
+    timer_init(FANCTL_TIMER, &timer_init_struct);
+    timer_interrupt_enable(FANCTL_TIMER, TIMER_INT_UP);
+
+    eclic_global_interrupt_enable();
+    eclic_irq_enable(TIMER4_IRQn, IRQ_LEVEL_DEFAULT, 0);
+}
+
+uint32_t fanctl_take_changed(void) {
+    return __atomic_exchange_n(&fanctl_changed, 0, __ATOMIC_SEQ_CST);
+}
+
+void fanctl_start(void) {
+    timer_enable(FANCTL_TIMER);
+}
+
+void fanctl_stop(void) {
+    timer_disable(FANCTL_TIMER);
+}
+
+static uint32_t fanctl_channel(FANCTL_STATE *s, uint32_t target,
+        uint32_t actual, bool failed) {
+    // Nothing to go by, hold the curve setpoint and start over once the
+    // readings are back
+    if (failed || (actual == 0) || (target == 0)) {
+        s->integ = 0;
+        s->valid = FALSE;
+        return target;
+    }
+
+    int32_t err = (int32_t)target - (int32_t)actual;
+    if (!s->valid)
+        s->prev_err = err;
+    s->valid = TRUE;
+
+    int32_t integ = s->integ + fanctl_gains.ki * err;
+    if (integ > (FANCTL_I_MAX << 8))
+        integ = FANCTL_I_MAX << 8;
+    else if (integ < -(FANCTL_I_MAX << 8))
+        integ = -(FANCTL_I_MAX << 8);
+
+    int32_t out = (int32_t)target + ((fanctl_gains.kp * err + integ +
+            fanctl_gains.kd * (err - s->prev_err)) >> 8);
+    s->prev_err = err;
+
+    // Keep the integral where it was while the output is pinned and the
+    // error pushes further out
+    if (out > FANCTL_TACH_MAX) {
+        out = FANCTL_TACH_MAX;
+        if (err > 0)
+            integ = s->integ;
+    }
+    else if (out < FANCTL_TACH_MIN) {
+        out = FANCTL_TACH_MIN;
+        if (err < 0)
+            integ = s->integ;
+    }
+    s->integ = integ;
+    return out;
+}
+
+// Control period, only flagged here. The PID runs from the main loop, on
+// the same level as everything else the slave ISR has to preempt.
+void TIMER4_IRQHandler(void) {
+    timer_interrupt_flag_clear(FANCTL_TIMER, TIMER_INT_FLAG_UP);
+    fanctl_update_req = 1;
+}
+
+void fanctl_run(void) {
+    FS_REQUEST request;
+
+    fanslave_get_request(&request);
+    for (int i = 0; i < FANCTL_CHANNELS; i++) {
+        FANCTL_STATE *s = &fanctl_state[i];
+        // Through the curve only when the host moved it
+        if (s->gen != request.gen[i]) {
+            s->gen = request.gen[i];
+            s->target = curve_forward(i, request.tach[i]);
+        }
+        uint32_t out = fanctl_channel(s, s->target, fm_actual_tach[i],
+                (fm_failed >> i) & 1);
+        if (out != fm_requested_tach[i]) {
+            fm_requested_tach[i] = out;
+            fanctl_changed |= 1u << i;
+        }
+    }
+}
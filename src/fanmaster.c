@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include "gd32vf103_gpio.h"
 #include "gd32vf103_i2c.h"
+#include "fm_i2c.h"
 #include "fanmaster.h"
 
 // PB6: I2C0_SCL
@@ -11,100 +12,83 @@
 // PB10: I2C1_SCL
 // PB11: I2C1_SDA
 
+// Bus clocks, standard mode unless a bus is known to take more. Fast mode
+// is opt-in per bus with -D FANMASTER_I2Cn_SPEED=400000, for the chips and
+// wiring on that bus to be checked first. It takes I2C_DTCY_2 (tLOW:tHIGH
+// 2:1) or I2C_DTCY_16_9, standard mode only I2C_DTCY_2.
+#ifndef FANMASTER_I2C0_SPEED
+#define FANMASTER_I2C0_SPEED (100000)
+#endif
+#ifndef FANMASTER_I2C0_DUTY
+#define FANMASTER_I2C0_DUTY  (I2C_DTCY_2)
+#endif
+#ifndef FANMASTER_I2C1_SPEED
+#define FANMASTER_I2C1_SPEED (100000)
+#endif
+#ifndef FANMASTER_I2C1_DUTY
+#define FANMASTER_I2C1_DUTY  (I2C_DTCY_2)
+#endif
+
 #define ENABLED_SENSORS (7)
+// Update periods a chip sits out after a failed transaction before it is
+// tried again, a dead fan board then costs a timeout every so often only.
+// Counted down by the tach read, every period has exactly one.
+#define FANMASTER_BACKOFF (16)
 
 uint32_t fm_requested_tach[14];
 uint32_t fm_actual_tach[14];
+uint32_t fm_failed;
+volatile uint32_t fm_tach_req;
+
+static uint8_t fm_backoff[ENABLED_SENSORS];
+
+// Both channels of a chip in one block transaction instead of one each
+bool fm_burst = TRUE;
+
+// One transaction per fan channel, or per chip in burst mode, for each
+// kind of update
+typedef struct {
+    FM_I2C_XFER xfer;
+    uint8_t buf[6];
+    uint32_t channel; // First channel covered
+    uint32_t channels;
+} FANMASTER_XFER;
+
+static FANMASTER_XFER fm_set_xfer[ENABLED_SENSORS * 2];
+static FANMASTER_XFER fm_get_xfer[ENABLED_SENSORS * 2];
+// Reads of the last tach update still out, plus one held while queuing
+static volatile uint32_t fm_get_pending;
+
+static uint32_t fanmaster_chip_i2c(int chip) {
+    return (chip < 4) ? I2C0 : I2C1;
+}
 
-void fanmaster_i2c_init(uint32_t i2c) {
-    i2c_clock_config(i2c, 100000, I2C_DTCY_2);
-    i2c_mode_addr_config(i2c, I2C_I2CMODE_ENABLE, I2C_ADDFORMAT_7BITS, 0x00);
-    i2c_enable(i2c);
-    i2c_ack_config(i2c, I2C_ACK_ENABLE);
+static uint8_t fanmaster_chip_addr(int chip) {
+    return 3 - chip % 4 + 0x50;
 }
 
 void fanmaster_i2c_send(uint32_t i2c, uint8_t addr, uint8_t *buf, uint32_t size) {
-    // wait until I2C bus is idle
-    while(i2c_flag_get(i2c, I2C_FLAG_I2CBSY));
-    // send a start condition to I2C bus
-    i2c_start_on_bus(i2c);
-    // wait until SBSEND bit is set
-    while(!i2c_flag_get(i2c, I2C_FLAG_SBSEND));
-    // send slave address to I2C bus
-    i2c_master_addressing(i2c, addr << 1, I2C_TRANSMITTER);
-    // wait until ADDSEND bit is set
-    while(!i2c_flag_get(i2c, I2C_FLAG_ADDSEND));
-    // clear ADDSEND bit
-    i2c_flag_clear(i2c, I2C_FLAG_ADDSEND);
-    // wait until the transmit data buffer is empty
-    while(!i2c_flag_get(i2c, I2C_FLAG_TBE));
-
-    for(int i = 0; i < size; i++){
-        // data transmission
-        i2c_data_transmit(i2c, buf[i]);
-        // wait until the TBE bit is set
-        while(!i2c_flag_get(i2c, I2C_FLAG_TBE));
-    }
-
-    // send a stop condition to I2C bus
-    i2c_stop_on_bus(i2c);
-    // wait until stop condition generate
-    while(I2C_CTL0(i2c)&0x0200);
+    FM_I2C_XFER xfer = {
+        .addr = addr,
+        .tx = buf,
+        .tx_size = size
+    };
+
+    fm_i2c_submit(i2c, &xfer);
+    fm_i2c_wait();
 }
 
 void fanmaster_i2c_read(uint32_t i2c, uint8_t addr, uint8_t reg, uint8_t *buf, uint32_t size) {
-    // wait until I2C bus is idle
-    while(i2c_flag_get(i2c, I2C_FLAG_I2CBSY));
-    // send a start condition to I2C bus
-    i2c_start_on_bus(i2c);
-    // wait until SBSEND bit is set
-    while(!i2c_flag_get(i2c, I2C_FLAG_SBSEND));
-    // send slave address to I2C bus
-    i2c_master_addressing(i2c, addr << 1, I2C_TRANSMITTER);
-    // wait until ADDSEND bit is set
-    while(!i2c_flag_get(i2c, I2C_FLAG_ADDSEND));
-    // clear ADDSEND bit
-    i2c_flag_clear(i2c, I2C_FLAG_ADDSEND);
-    // wait until the transmit data buffer is empty
-    while(!i2c_flag_get(i2c, I2C_FLAG_TBE));
-
-    // send register index
-    i2c_data_transmit(i2c, reg);
-    // wait until the TBE bit is set
-    while(!i2c_flag_get(i2c, I2C_FLAG_TBE));
-
-    // send a repeated start
-    i2c_start_on_bus(i2c);
-
-    // wait until SBSEND bit is set
-    while(!i2c_flag_get(i2c, I2C_FLAG_SBSEND));
-    // send slave address to I2C bus
-    i2c_master_addressing(i2c, addr << 1, I2C_RECEIVER);
-    // wait until ADDSEND bit is set
-    while(!i2c_flag_get(i2c, I2C_FLAG_ADDSEND));
-    // clear ADDSEND bit
-    i2c_flag_clear(i2c, I2C_FLAG_ADDSEND);
-    // Wait until the last data byte is received into the shift register
-    while(!i2c_flag_get(i2c, I2C_FLAG_BTC));
-
-    for (int i = 0; i < size; i++) {
-        // wait until the RBNE bit is set
-        while(!i2c_flag_get(i2c, I2C_FLAG_RBNE));
-        // read a data from I2C_DATA
-        buf[i] = i2c_data_receive(i2c);
-        if (i == size - 2) {
-            // disable ACK before clearing ADDSEND bit
-            i2c_ack_config(i2c, I2C_ACK_DISABLE);
-        }
-    }
-
-    // send a stop condition
-    i2c_stop_on_bus(i2c);
-    // wait until stop condition generate
-    while(I2C_CTL0(i2c)&0x0200);
-    i2c_ackpos_config(i2c, I2C_ACKPOS_CURRENT);
-    // enable acknowledge
-    i2c_ack_config(i2c, I2C_ACK_ENABLE);
+    FM_I2C_XFER xfer = {
+        .addr = addr,
+        .tx = &reg,
+        .tx_size = 1,
+        .rx = buf,
+        .rx_size = size
+    };
+
+    fm_i2c_submit(i2c, &xfer);
+    fm_i2c_wait();
 }
 
 void fanmaster_init(void) {
@@ -115,8 +99,19 @@ void fanmaster_init(void) {
     gpio_init(GPIOB, GPIO_MODE_AF_OD, GPIO_OSPEED_50MHZ, GPIO_PIN_6 | GPIO_PIN_7);
     gpio_init(GPIOB, GPIO_MODE_AF_OD, GPIO_OSPEED_50MHZ, GPIO_PIN_10 | GPIO_PIN_11);
 
-    fanmaster_i2c_init(I2C0);
-    fanmaster_i2c_init(I2C1);
+    fm_i2c_init(I2C0, FANMASTER_I2C0_SPEED, FANMASTER_I2C0_DUTY);
+    fm_i2c_init(I2C1, FANMASTER_I2C1_SPEED, FANMASTER_I2C1_DUTY);
+
+    fm_failed = 0;
+    fm_tach_req = 0;
+    fm_get_pending = 0;
+    for (int i = 0; i < ENABLED_SENSORS; i++)
+        fm_backoff[i] = 0;
+    // Nothing in flight yet
+    for (int i = 0; i < ENABLED_SENSORS * 2; i++) {
+        fm_set_xfer[i].xfer.status = FM_I2C_DONE;
+        fm_get_xfer[i].xfer.status = FM_I2C_DONE;
+    }
 }
 
 void fanmaster_start(void) {
@@ -134,9 +129,9 @@ void fanmaster_start(void) {
         sendbuf[1] = 0x01;
         fanmaster_i2c_send(i2c, addr, sendbuf, 2);
 
-        // Set Read count
+        // Set Read count, both tachs in one block read
         sendbuf[0] = 0x00;
-        sendbuf[1] = 0x02;
+        sendbuf[1] = 0x04;
         fanmaster_i2c_send(i2c, addr, sendbuf, 2);
 
         // Set mode
@@ -161,41 +156,148 @@ void fanmaster_start(void) {
     fanmaster_set_tach();
 }
 
-void fanmaster_set_tach(void) {
-    uint8_t sendbuf[4];
+// Track chips that stopped answering, called on completion of every update
+static void fanmaster_xfer_done(FM_I2C_XFER *xfer) {
+    FANMASTER_XFER *x = (FANMASTER_XFER *)xfer;
+    uint32_t mask = ((1u << x->channels) - 1) << x->channel;
 
-    for (int i = 0; i < ENABLED_SENSORS; i++) {
-        uint32_t i2c = (i < 4) ? I2C0 : I2C1;
-        uint32_t addr = 3 - i % 4 + 0x50;
+    if (xfer->status == FM_I2C_DONE) {
+        fm_failed &= ~mask;
+    }
+    else {
+        fm_failed |= mask;
+        fm_backoff[x->channel / 2] = FANMASTER_BACKOFF;
+    }
+}
 
-        sendbuf[0] = 0xaa;
-        sendbuf[1] = 0x02;
-        sendbuf[2] = fm_requested_tach[i * 2] & 0xff;
-        sendbuf[3] = (fm_requested_tach[i * 2] >> 8) & 0xff;
+// Sleep until the transactions of the last update of one kind are over,
+// their buffers get reused. The other kind stays queued behind them.
+static void fanmaster_wait_xfers(FANMASTER_XFER *x) {
+    for (int i = 0; i < ENABLED_SENSORS * 2; i++)
+        fm_i2c_wait_xfer(&x[i].xfer);
+}
+
+// Whether a failed chip still has to sit this tach read out, one period
+// less to go if so
+static bool fanmaster_skip(int chip) {
+    if (fm_backoff[chip] == 0)
+        return FALSE;
+    fm_backoff[chip]--;
+    return TRUE;
+}
 
-        fanmaster_i2c_send(i2c, addr, sendbuf, 4);
+// Block write of the 16-bit setpoints from 0x2a (channel 0) or 0x2c
+static void fanmaster_queue_set(FANMASTER_XFER *x, uint32_t channel,
+        uint32_t channels) {
+    x->buf[0] = 0xaa + (channel & 1) * 2;
+    x->buf[1] = channels * 2;
+    for (uint32_t i = 0; i < channels; i++) {
+        x->buf[2 + i * 2] = fm_requested_tach[channel + i] & 0xff;
+        x->buf[3 + i * 2] = (fm_requested_tach[channel + i] >> 8) & 0xff;
+    }
+    x->channel = channel;
+    x->channels = channels;
+    x->xfer.addr = fanmaster_chip_addr(channel / 2);
+    x->xfer.tx = x->buf;
+    x->xfer.tx_size = 2 + channels * 2;
+    x->xfer.rx_size = 0;
+    x->xfer.done_cb = fanmaster_xfer_done;
+    fm_i2c_submit(fanmaster_chip_i2c(channel / 2), &x->xfer);
+}
 
-        sendbuf[0] = 0xac;
-        sendbuf[2] = fm_requested_tach[i * 2 + 1] & 0xff;
-        sendbuf[3] = (fm_requested_tach[i * 2 + 1] >> 8) & 0xff;
+void fanmaster_set_tach_async(void) {
+    fanmaster_set_tach_mask_async((1u << (ENABLED_SENSORS * 2)) - 1);
+}
 
-        fanmaster_i2c_send(i2c, addr, sendbuf, 4);
+void fanmaster_set_tach_mask_async(uint32_t mask) {
+    fanmaster_wait_xfers(fm_set_xfer);
+
+    // Chips that did not take their last setpoints get them again
+    mask |= fm_failed;
+    for (int i = 0; i < ENABLED_SENSORS * 2; i += 2) {
+        if (!(mask & (3u << i)))
+            continue;
+        // Backoff only looked at, the tach read of the period counts it
+        if (fm_backoff[i / 2])
+            continue;
+        if (fm_burst) {
+            fanmaster_queue_set(&fm_set_xfer[i], i, 2);
+        }
+        else {
+            if (mask & (1u << i))
+                fanmaster_queue_set(&fm_set_xfer[i], i, 1);
+            if (mask & (2u << i))
+                fanmaster_queue_set(&fm_set_xfer[i + 1], i + 1, 1);
+        }
     }
 }
 
-void fanmaster_get_tach(void) {
-    uint8_t recvbuf[3];
+// The last read of an update flags the whole reading as in
+static void fanmaster_get_retire(void) {
+    if (__atomic_sub_fetch(&fm_get_pending, 1, __ATOMIC_SEQ_CST) == 0)
+        fm_tach_req = 1;
+}
 
-    for (int i = 0; i < ENABLED_SENSORS; i++) {
-        uint32_t i2c = (i < 4) ? I2C0 : I2C1;
-        uint32_t addr = 3 - i % 4 + 0x50;
+static void fanmaster_get_done(FM_I2C_XFER *xfer) {
+    FANMASTER_XFER *x = (FANMASTER_XFER *)xfer;
+    fanmaster_xfer_done(xfer);
+    // buf[1] is the block count
+    if (xfer->status == FM_I2C_DONE) {
+        for (uint32_t i = 0; i < x->channels; i++)
+            fm_actual_tach[x->channel + i] =
+                    x->buf[2 + i * 2] | ((uint32_t)x->buf[3 + i * 2] << 8);
+    }
+    fanmaster_get_retire();
+}
 
-        fanmaster_i2c_read(i2c, addr, 0xca, recvbuf, 3);
-        fm_actual_tach[i * 2] = 
-                ((recvbuf[1] & 0xff) | ((recvbuf[2] << 8) & 0xff00));
+// Block read of the 16-bit tachs from 0x4a (channel 0) or 0x4c
+static void fanmaster_queue_get(FANMASTER_XFER *x, uint32_t channel,
+        uint32_t channels) {
+    x->buf[0] = 0xca + (channel & 1) * 2;
+    x->channel = channel;
+    x->channels = channels;
+    x->xfer.addr = fanmaster_chip_addr(channel / 2);
+    x->xfer.tx = x->buf;
+    x->xfer.tx_size = 1;
+    x->xfer.rx = &x->buf[1];
+    x->xfer.rx_size = 1 + channels * 2;
+    x->xfer.done_cb = fanmaster_get_done;
+    __atomic_add_fetch(&fm_get_pending, 1, __ATOMIC_SEQ_CST);
+    fm_i2c_submit(fanmaster_chip_i2c(channel / 2), &x->xfer);
+}
+
+void fanmaster_get_tach_async(void) {
+    fanmaster_wait_xfers(fm_get_xfer);
 
-        fanmaster_i2c_read(i2c, addr, 0xcc, recvbuf, 3);
-        fm_actual_tach[i * 2 + 1] = 
-                ((recvbuf[1] & 0xff) | ((recvbuf[2] << 8) & 0xff00));
+    fm_get_pending = 1;
+    for (int i = 0; i < ENABLED_SENSORS * 2; i += 2) {
+        if (fanmaster_skip(i / 2))
+            continue;
+        if (fm_burst) {
+            fanmaster_queue_get(&fm_get_xfer[i], i, 2);
+        }
+        else {
+            fanmaster_queue_get(&fm_get_xfer[i], i, 1);
+            fanmaster_queue_get(&fm_get_xfer[i + 1], i + 1, 1);
+        }
     }
-}
\ No newline at end of file
+    fanmaster_get_retire();
+}
+
+bool fanmaster_busy(void) {
+    return fm_i2c_busy(I2C0) || fm_i2c_busy(I2C1);
+}
+
+void fanmaster_wait(void) {
+    fm_i2c_wait();
+}
+
+void fanmaster_set_tach(void) {
+    fanmaster_set_tach_async();
+    fanmaster_wait();
+}
+
+void fanmaster_get_tach(void) {
+    fanmaster_get_tach_async();
+    fanmaster_wait();
+}
@@ -2,10 +2,14 @@
  * Released under MIT license 
  */
 #include <stdlib.h>
+#include <string.h>
 #include "gd32vf103_gpio.h"
 #include "gd32vf103_rcu.h"
 #include "softi2c.h"
+#include "si2c_dma.h"
+#include "si2c_trace.h"
 #include "fanslave.h"
+#include "irq_level.h"
 
 // Why GD decides to define it as UPPER CASE opposed to lower case in stdc?
 #define true TRUE
@@ -19,15 +23,51 @@ typedef enum {
     FS_INVALID // Wait for STOP condition to reset
 } FANSLAVE_STATE;
 
+#define FS_CHIPS (7)
+
+// Registers with more to them than being stored and read back
+#define FS_REG_READ_COUNT (0x00)
+#define FS_REG_ENABLE     (0x07)
+#define FS_REG_TACH0_LO   (0x2a) // Setpoints, low byte held until the high
+#define FS_REG_TACH0_HI   (0x2b)
+#define FS_REG_TACH1_LO   (0x2c)
+#define FS_REG_TACH1_HI   (0x2d)
+#define FS_REG_START      (0x3c)
+#define FS_REG_ACTUAL     (0x4a) // 0x4a - 0x4d, tach readback
+
+typedef enum {
+    FX_NONE = 0,
+    FX_READ_ONLY,
+    FX_ENABLE,
+    FX_TACH0,
+    FX_TACH1,
+    FX_START
+} FANSLAVE_EFFECT;
+
+// What a write to each register does besides landing in the register map
+static const uint8_t fs_reg_effect[256] = {
+    [FS_REG_ENABLE] = FX_ENABLE,
+    [FS_REG_TACH0_HI] = FX_TACH0,
+    [FS_REG_TACH1_HI] = FX_TACH1,
+    [FS_REG_START] = FX_START,
+    [FS_REG_ACTUAL] = FX_READ_ONLY,
+    [FS_REG_ACTUAL + 1] = FX_READ_ONLY,
+    [FS_REG_ACTUAL + 2] = FX_READ_ONLY,
+    [FS_REG_ACTUAL + 3] = FX_READ_ONLY
+};
+
 typedef struct {
     // IO related
     FANSLAVE_STATE state;
-    uint8_t addr;
-    uint32_t read_count;
+    uint8_t addr; // Register pointer, block transfers run on past 0x7f
     uint32_t cur_count;
     // Device related
     uint32_t id_base;
-    uint8_t temp; // for 16 bit values
+    // Tach readback was copied into the map for this transaction, so the
+    // bytes of a value never come from two readings
+    bool latched;
+    // Register map, every byte read is served from here
+    uint8_t regs[256];
 } FANSLAVE_CONTEXT;
 
 #define SI2C0_GPIO    (GPIOB)
@@ -36,18 +76,40 @@ typedef struct {
 #define SI2C1_GPIO    (GPIOB)
 #define SI2C1_SCL_PIN (GPIO_PIN_14)
 #define SI2C1_SDA_PIN (GPIO_PIN_15)
+// Software trigger only, PA4 stays with whoever uses it
+#define SI2C_FLUSH_LINE (EXTI_4)
 
+// SI2C_DMA selects the oversampling receiver over the per-edge one
+#ifdef SI2C_DMA
+static SI2C_DMA_CONTEXT si2c0;
+static SI2C_DMA_CONTEXT si2c1;
+#else
 static SI2C_CONTEXT si2c0;
 static SI2C_CONTEXT si2c1;
+#endif
 
-static FANSLAVE_CONTEXT fs_context[7];
+static FANSLAVE_CONTEXT fs_context[FS_CHIPS];
 
 volatile uint32_t start_req;
 volatile uint32_t rpm_update_req;
 
-bool fs_enabled[14];
-uint32_t fs_requested_tach[14];
-uint32_t fs_actual_tach[14];
+bool fs_enabled[FS_CHANNELS];
+uint32_t fs_requested_tach[FS_CHANNELS];
+
+// Bumped by the slave ISR on every change of fs_requested_tach and
+// fs_enabled, by the flush handler with interrupts off in write-behind
+// mode. Either runs to completion over whoever reads them, a reader that
+// saw it move during its copy just copies again.
+static volatile uint32_t fs_request_seq;
+// Per channel count of changes, and a bit per channel changed since the
+// main loop last took them. Only the ISR sets bits, the main loop takes
+// them in one atomic swap, so none is lost in between.
+static uint32_t fs_generation[FS_CHANNELS];
+static volatile uint32_t fs_dirty;
+// Tach readback as last published. The ISR serves the buffer fs_actual_idx
+// points to, fanslave_set_actual() fills the other one and flips it.
+static uint16_t fs_actual_buf[2][FS_CHANNELS];
+static volatile uint32_t fs_actual_idx;
 
 // Callback from SI2C driver
 static void fanslave_si2c_write(uint32_t bus_id, uint8_t addr, uint8_t byte);
@@ -60,17 +122,26 @@ static void fanslave_read_byte(FANSLAVE_CONTEXT *context, uint8_t *byte, bool *l
 static void fanslave_stop(FANSLAVE_CONTEXT *context);
 // Actual device register RW handler
 static void fanslave_write_reg(FANSLAVE_CONTEXT *context, uint8_t reg, uint8_t val);
-static uint8_t fanslave_read_reg(FANSLAVE_CONTEXT *context, uint8_t reg);
+static void fanslave_latch(FANSLAVE_CONTEXT *context);
 
 void fanslave_init(void) {
     start_req = 0;
     rpm_update_req = 0;
 
-    for (int i = 0; i < 7; i++) {
+    for (int i = 0; i < FS_CHIPS; i++) {
         fs_context[i].state = FS_IDLE;
-        fs_context[i].read_count = 0;
         fs_context[i].id_base = i * 2;
+        fs_context[i].latched = false;
+        memset(fs_context[i].regs, 0, sizeof(fs_context[i].regs));
+    }
+    for (int i = 0; i < FS_CHANNELS; i++) {
+        fs_actual_buf[0][i] = 0;
+        fs_actual_buf[1][i] = 0;
     }
+    fs_actual_idx = 0;
+    for (int i = 0; i < FS_CHANNELS; i++)
+        fs_generation[i] = 0;
+    fs_dirty = 0;
 
     si2c0.gpio = SI2C0_GPIO;
     si2c0.scl_pin = SI2C0_SCL_PIN;
@@ -87,6 +158,10 @@ void fanslave_init(void) {
     si2c1.read_cb = fanslave_si2c_read;
     si2c1.write_cb = fanslave_si2c_write;
     si2c1.stop_cb = fanslave_si2c_stop;
+#if defined(SI2C_WRITE_BEHIND) && !defined(SI2C_DMA)
+    si2c0.flush_line = SI2C_FLUSH_LINE;
+    si2c1.flush_line = SI2C_FLUSH_LINE;
+#endif
 
     rcu_periph_clock_enable(RCU_GPIOA);
     rcu_periph_clock_enable(RCU_GPIOB);
@@ -94,48 +169,152 @@ void fanslave_init(void) {
 
     eclic_global_interrupt_enable();
     eclic_priority_group_set(ECLIC_PRIGROUP_LEVEL3_PRIO1);
-    eclic_irq_enable(EXTI10_15_IRQn, 1, 1);
+    // Preempts every other interrupt, see irq_level.h
+    eclic_irq_enable(EXTI10_15_IRQn, IRQ_LEVEL_SLAVE, 1);
+#if defined(SI2C_WRITE_BEHIND) && !defined(SI2C_DMA)
+    eclic_irq_enable(EXTI4_IRQn, IRQ_LEVEL_FLUSH, 1);
+#endif
 
     gpio_exti_source_select(GPIO_PORT_SOURCE_GPIOB, GPIO_PIN_SOURCE_12);
     gpio_exti_source_select(GPIO_PORT_SOURCE_GPIOB, GPIO_PIN_SOURCE_13);
     gpio_exti_source_select(GPIO_PORT_SOURCE_GPIOB, GPIO_PIN_SOURCE_14);
     gpio_exti_source_select(GPIO_PORT_SOURCE_GPIOB, GPIO_PIN_SOURCE_15);
 
+#ifdef SI2C_DMA
+    si2c_dma_init(&si2c0);
+    si2c_dma_init(&si2c1);
+    si2c_dma_start(SI2C0_GPIO);
+#else
     si2c_init(&si2c0);
     si2c_init(&si2c1);
+#endif
+}
+
+void fanslave_get_request(FS_REQUEST *request) {
+    uint32_t seq;
+
+    do {
+        seq = fs_request_seq;
+        // Keep the copy between the two reads of the counter
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        for (int i = 0; i < FS_CHANNELS; i++) {
+            request->tach[i] = fs_requested_tach[i];
+            request->enabled[i] = fs_enabled[i];
+            request->gen[i] = fs_generation[i];
+        }
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    } while (seq != fs_request_seq);
+}
+
+uint32_t fanslave_take_dirty(void) {
+    return __atomic_exchange_n(&fs_dirty, 0, __ATOMIC_SEQ_CST);
+}
+
+// Single writer outside the ISR: the buffer not being served is ours until
+// the flip, and the ISR copies out of the served one in one go
+void fanslave_set_actual(const uint32_t tach[FS_CHANNELS]) {
+    uint32_t back = fs_actual_idx ^ 1;
+
+    for (int i = 0; i < FS_CHANNELS; i++)
+        fs_actual_buf[back][i] = tach[i];
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    fs_actual_idx = back;
 }
 
+// Time from an SCL edge to the handler, in cycles at 108 MHz. Estimated
+// from the instruction counts; SI2C_TRACE timestamps every entry on the
+// board. The worst case is the sum of three parts:
+// - Entry, about 50: irq_entry saving the caller-saved registers, the
+//   pending lines read and cleared, the call into si2c_process(). Its
+//   GPIO_ISTAT read samples SDA and the GPIO writes driving it come next.
+// - The other bus, up to about 100: both buses share this vector at the
+//   same level, and an edge of one waits out a handler of the other. Its
+//   worst is a falling edge that fetches a read byte. Nothing else is on
+//   IRQ_LEVEL_SLAVE. With SI2C_DMA the DMA1 channel 2 ISR is, but the
+//   DMA receiver is standard mode only.
+// - Interrupts off, the longest one running: sched_every() about 120
+//   (at start only), sched_step() about 70, fm_i2c_wait() and
+//   fm_i2c_wait_xfer() about 20, lcd_wait() about 10. With
+//   SI2C_WRITE_BEHIND, si2c_flush() also turns interrupts off for about
+//   60 around each write callback. If a new write ends before the flush
+//   handler has caught up, the ISR passes on what is left itself, up to
+//   SI2C_TXN_SIZE callbacks.
+// That comes to about 270 cycles, 2.5 us.
+//
+// In standard mode (100 kHz) the budget is 432 cycles for a rising edge,
+// where SDA must be sampled within tHIGH 4.0 us. A falling edge that
+// drives SDA has 372 cycles: tLOW 4.7 us, less a 1 us rise time and
+// tSU;DAT 250 ns. Both fit.
+//
+// In fast mode (400 kHz) the budget would be 64 cycles for a rising edge
+// (tHIGH 600 ns) and 97 for a falling edge (tLOW 1.3 us, less 300 ns
+// rise time and 100 ns setup). Only entry fits, so the slave supports
+// standard mode only. An SMC clocking faster gets missed edges.
+// The handler also has to be out before the next SCL edge. SI2C_STRETCH
+// covers the callbacks on falling edges, SI2C_WRITE_BEHIND moves the
+// write callbacks below this level.
+//
+// One read of the pending lines per entry, cleared in one write. Edges that
+// come in while they are handled leave the interrupt pending for another
+// entry. With SCL and SDA of a bus both pending, SCL goes first like it
+// did when the flags were checked one by one.
+#define SI2C0_LINES (SI2C0_SCL_PIN | SI2C0_SDA_PIN)
+#define SI2C1_LINES (SI2C1_SCL_PIN | SI2C1_SDA_PIN)
+
+#ifdef SI2C_DMA
 void EXTI10_15_IRQHandler(void) {
-    if (exti_interrupt_flag_get(SI2C0_SCL_PIN)) {
-        exti_interrupt_flag_clear(SI2C0_SCL_PIN);
-        si2c_process(&si2c0, PIN_SCL);
-    }
+    uint32_t pending = EXTI_PD & EXTI_INTEN & (SI2C0_SCL_PIN | SI2C1_SCL_PIN);
+    EXTI_PD = pending;
 
-    if (exti_interrupt_flag_get(SI2C0_SDA_PIN)) {
-        exti_interrupt_flag_clear(SI2C0_SDA_PIN);
-        si2c_process(&si2c0, PIN_SDA);
-    }
+    if (pending & SI2C0_SCL_PIN)
+        si2c_dma_scl_irq(&si2c0);
+    if (pending & SI2C1_SCL_PIN)
+        si2c_dma_scl_irq(&si2c1);
+}
+#else
+// An SCL handler that stops watching SDA also drops an SDA edge pending
+// alongside, the same as a flag check behind it would have
+static inline void fanslave_dispatch(SI2C_CONTEXT *context, uint32_t pending) {
+    if (pending & context->scl_pin)
+        si2c_process(context, PIN_SCL);
+    if (pending & context->sda_pin & EXTI_INTEN)
+        si2c_process(context, PIN_SDA);
+}
 
-    if (exti_interrupt_flag_get(SI2C1_SCL_PIN)) {
-        exti_interrupt_flag_clear(SI2C1_SCL_PIN);
-        si2c_process(&si2c1, PIN_SCL);
-    }
+void EXTI10_15_IRQHandler(void) {
+    uint32_t pending = EXTI_PD & EXTI_INTEN & (SI2C0_LINES | SI2C1_LINES);
+    EXTI_PD = pending;
 
-    if (exti_interrupt_flag_get(SI2C1_SDA_PIN)) {
-        exti_interrupt_flag_clear(SI2C1_SDA_PIN);
-        si2c_process(&si2c1, PIN_SDA);
-    }
+    if (pending & SI2C0_LINES)
+        fanslave_dispatch(&si2c0, pending);
+    if (pending & SI2C1_LINES)
+        fanslave_dispatch(&si2c1, pending);
 }
 
+#ifdef SI2C_WRITE_BEHIND
+// Writes the slave ISR handed over, below it. Trigger cleared first, a
+// write handed over while the handler runs raises it again.
+void EXTI4_IRQHandler(void) {
+    EXTI_PD = SI2C_FLUSH_LINE;
+    EXTI_SWIEV &= ~ SI2C_FLUSH_LINE;
+    si2c_flush(&si2c0);
+    si2c_flush(&si2c1);
+}
+#endif
+#endif
+
 static FANSLAVE_CONTEXT *fanslave_id_to_context(uint32_t bus_id, uint8_t addr) {
     addr >>= 1;
     addr -= 0x50;
-    uint32_t idx = bus_id * 4 + 3 - addr;
     // 0x53 -> 0
     // 0x52 -> 1
     // 0x51 -> 2
     // 0x50 -> 3
-    if (idx > 7)
+    // Bus 1 only has 0x53 - 0x51, 0x54 - 0x57 are nobody on either
+    if (addr > 3)
+        return NULL;
+    uint32_t idx = bus_id * 4 + 3 - addr;
+    if (idx >= FS_CHIPS)
         return NULL;
     return &(fs_context[idx]);
 }
@@ -170,6 +349,8 @@ static void fanslave_si2c_stop(uint32_t bus_id, uint8_t addr) {
 static void fanslave_write_byte(FANSLAVE_CONTEXT *context, uint8_t byte) {
     switch (context->state) {
     case FS_IDLE:
+        // New register pointer, a read behind it takes a fresh reading
+        context->latched = false;
         context->addr = byte & 0x7f;
         if (byte & 0x80) {
             // Block operation
@@ -201,6 +382,9 @@ static void fanslave_write_byte(FANSLAVE_CONTEXT *context, uint8_t byte) {
 }
 
 static void fanslave_read_byte(FANSLAVE_CONTEXT *context, uint8_t *byte, bool *last) {
+    if (!context->latched)
+        fanslave_latch(context);
+
     switch (context->state) {
     case FS_IDLE:
         // Read at IDLE state??
@@ -208,13 +392,13 @@ static void fanslave_read_byte(FANSLAVE_CONTEXT *context, uint8_t *byte, bool *l
         *last = true;
         break;
     case FS_SINGLE:
-        *byte = fanslave_read_reg(context, context->addr);
+        *byte = context->regs[context->addr];
         *last = true;
         context->state = FS_INVALID;
         break;
     case FS_BLOCK_COUNT:
-        *byte = context->read_count;
-        context->cur_count = context->read_count;
+        *byte = context->regs[FS_REG_READ_COUNT];
+        context->cur_count = context->regs[FS_REG_READ_COUNT];
         if (context->cur_count == 0) {
             *last = true;    
             context->state = FS_INVALID;
@@ -225,7 +409,7 @@ static void fanslave_read_byte(FANSLAVE_CONTEXT *context, uint8_t *byte, bool *l
         }
         break;
     case FS_BLOCK_RW:
-        *byte = fanslave_read_reg(context, context->addr);
+        *byte = context->regs[context->addr];
         context->addr++;
         context->cur_count --;
         if (context->cur_count == 0) {
@@ -244,55 +428,77 @@ static void fanslave_read_byte(FANSLAVE_CONTEXT *context, uint8_t *byte, bool *l
 
 static void fanslave_stop(FANSLAVE_CONTEXT *context) {
     context->state = FS_IDLE;
+    context->latched = false;
+}
+
+// A channel of the chip got a new value, pass it on right away
+static void fanslave_changed(FANSLAVE_CONTEXT *context, uint32_t channel) {
+    // Only the trace looks at which bus it came from
+    (void)context;
+    fs_generation[channel]++;
+    fs_dirty |= 1u << channel;
+    fs_request_seq++;
+    rpm_update_req = 1;
+    SI2C_TRACE_LOG(context->id_base >= 8, 0, PIN_SDA, TR_UPDATE_REQ);
+}
+
+static void fanslave_set_tach(FANSLAVE_CONTEXT *context, uint32_t index,
+        uint32_t tach) {
+    uint32_t channel = context->id_base + index;
+    if (fs_requested_tach[channel] == tach)
+        return;
+    fs_requested_tach[channel] = tach;
+    fanslave_changed(context, channel);
+}
+
+static void fanslave_set_enabled(FANSLAVE_CONTEXT *context, uint32_t index,
+        bool enabled) {
+    uint32_t channel = context->id_base + index;
+    if (fs_enabled[channel] == enabled)
+        return;
+    fs_enabled[channel] = enabled;
+    fanslave_changed(context, channel);
 }
 
 static void fanslave_write_reg(FANSLAVE_CONTEXT *context, uint8_t reg, uint8_t val) {
-    if (reg == 0x00) {
-        context->read_count = val;
-    }
-    else if (reg == 0x07) {
-        fs_enabled[context->id_base] = !!(val & 0x40);
-        fs_enabled[context->id_base + 1] = !!(val & 0x80);
-    }
-    else if (reg == 0x2a) {
-        context->temp = val;
-    }
-    else if (reg == 0x2b) {
-        fs_requested_tach[context->id_base] = ((uint32_t)val << 8) | 
-                ((uint32_t)context->temp & 0xfful);
-    }
-    else if (reg == 0x2c) {
-        context->temp = val;
-    }
-    else if (reg == 0x2d) {
-        fs_requested_tach[context->id_base + 1] = ((uint32_t)val << 8) | 
-                ((uint32_t)context->temp & 0xfful);
+    uint8_t effect = fs_reg_effect[reg];
 
-        if (context->id_base == 12) {
-            rpm_update_req = 1;
-            GPIO_BOP(GPIOA) = 0x01;
-        }
-    }
-    else if (reg == 0x3c) {
+    if (effect == FX_READ_ONLY)
+        return;
+    context->regs[reg] = val;
+
+    switch (effect) {
+    case FX_ENABLE:
+        fanslave_set_enabled(context, 0, !!(val & 0x40));
+        fanslave_set_enabled(context, 1, !!(val & 0x80));
+        break;
+    case FX_TACH0:
+        fanslave_set_tach(context, 0, ((uint32_t)val << 8) |
+                context->regs[FS_REG_TACH0_LO]);
+        break;
+    case FX_TACH1:
+        fanslave_set_tach(context, 1, ((uint32_t)val << 8) |
+                context->regs[FS_REG_TACH1_LO]);
+        break;
+    case FX_START:
         if (context->id_base == 12) {
             start_req = 1;
-            GPIO_BOP(GPIOA) = 0x02;
+            SI2C_TRACE_LOG(1, 0, PIN_SDA, TR_START_REQ);
         }
+        break;
+    default:
+        break;
     }
 }
 
-static uint8_t fanslave_read_reg(FANSLAVE_CONTEXT *context, uint8_t reg) {
-    if (reg == 0x4a) {
-        return fs_actual_tach[context->id_base] & 0xff;
-    }
-    else if (reg == 0x4b) {
-        return (fs_actual_tach[context->id_base] >> 8) & 0xff;
-    }
-    else if (reg == 0x4c) {
-        return fs_actual_tach[context->id_base + 1] & 0xff;
-    }
-    else if (reg == 0x4d) {
-        return (fs_actual_tach[context->id_base + 1] >> 8) & 0xff;
-    }
-    return 0x00;
-}
\ No newline at end of file
+// Tach readback as last published into the map, once per transaction
+static void fanslave_latch(FANSLAVE_CONTEXT *context) {
+    const uint16_t *actual = fs_actual_buf[fs_actual_idx];
+    uint8_t *regs = &context->regs[FS_REG_ACTUAL];
+
+    regs[0] = actual[context->id_base] & 0xff;
+    regs[1] = actual[context->id_base] >> 8;
+    regs[2] = actual[context->id_base + 1] & 0xff;
+    regs[3] = actual[context->id_base + 1] >> 8;
+    context->latched = true;
+}
@@ -0,0 +1,426 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ */
+#include <stdlib.h>
+#include "gd32vf103_gpio.h"
+#include "gd32vf103_i2c.h"
+#include "gd32vf103_dma.h"
+#include "gd32vf103_rcu.h"
+#include "gd32vf103_timer.h"
+#include "fm_i2c.h"
+#include "irq_level.h"
+
+#ifndef __WFI
+#define __WFI() __asm__ volatile ("wfi")
+#endif
+
+#define FM_I2C_BUSES (2)
+
+// Longest a transaction may take from its START, the longest one (a 6 byte
+// burst write) is under 1 ms at 100 kHz
+#define FM_I2C_TIMEOUT_MS (2)
+// Further attempts after a timeout, bus error or lost arbitration. A NACK
+// is final, the chip is not there.
+#define FM_I2C_RETRIES (1)
+// Ticks every millisecond while transactions are queued to check deadlines,
+// and every half SCL period at 100 kHz while a bus is being recovered
+#define FM_I2C_TIMER (TIMER6)
+#define FM_I2C_TICK_US (1000)
+#define FM_I2C_RECOVER_TICK_US (5)
+// SCL pulses to clock a stuck slave through the rest of its byte, the STOP
+// after them starts at this recovery step
+#define FM_I2C_RECOVER_CLOCKS (9)
+#define FM_I2C_RECOVER_STOP (FM_I2C_RECOVER_CLOCKS * 2 + 1)
+
+typedef struct {
+    uint32_t i2c;
+    dma_channel_enum tx_ch;
+    dma_channel_enum rx_ch;
+    IRQn_Type ev_irq;
+    IRQn_Type er_irq;
+    IRQn_Type rx_irq;
+    uint32_t scl_pin; // On GPIOB
+    uint32_t sda_pin;
+    uint32_t speed;
+    uint32_t duty;
+    uint64_t deadline; // mtime the head of the queue has to be done by
+    FM_I2C_XFER *head;
+    FM_I2C_XFER *tail;
+    bool reading; // Phase of the transaction at the head of the queue
+    uint32_t recover; // Next bus recovery step, 0 = not recovering
+    FM_I2C_STATUS recover_status; // The head is retried for this after
+} FM_I2C_BUS;
+
+// I2C0 TX/RX on DMA0 channel 5/6, I2C1 on channel 3/4. fm_i2c_init() sets
+// speed and duty, the queue starts out empty.
+static FM_I2C_BUS fm_i2c_bus[FM_I2C_BUSES] = {
+    {I2C0, DMA_CH5, DMA_CH6, I2C0_EV_IRQn, I2C0_ER_IRQn, DMA0_Channel6_IRQn,
+            GPIO_PIN_6, GPIO_PIN_7, 0, 0, 0, NULL, NULL, FALSE, 0, FM_I2C_PENDING},
+    {I2C1, DMA_CH3, DMA_CH4, I2C1_EV_IRQn, I2C1_ER_IRQn, DMA0_Channel4_IRQn,
+            GPIO_PIN_10, GPIO_PIN_11, 0, 0, 0, NULL, NULL, FALSE, 0, FM_I2C_PENDING}
+};
+
+static FM_I2C_BUS *fm_i2c_get_bus(uint32_t i2c) {
+    return &fm_i2c_bus[(i2c == I2C0) ? 0 : 1];
+}
+
+// Keep the interrupts of one bus off while its queue is modified. The
+// deadline timer retires transactions of both buses, it goes off as well.
+static void fm_i2c_lock(FM_I2C_BUS *bus) {
+    eclic_irq_disable(bus->ev_irq);
+    eclic_irq_disable(bus->er_irq);
+    eclic_irq_disable(bus->rx_irq);
+    eclic_irq_disable(TIMER6_IRQn);
+}
+
+static void fm_i2c_unlock(FM_I2C_BUS *bus) {
+    eclic_irq_enable(bus->ev_irq, IRQ_LEVEL_DEFAULT, 0);
+    eclic_irq_enable(bus->er_irq, IRQ_LEVEL_DEFAULT, 0);
+    eclic_irq_enable(bus->rx_irq, IRQ_LEVEL_DEFAULT, 0);
+    eclic_irq_enable(TIMER6_IRQn, IRQ_LEVEL_DEFAULT, 0);
+}
+
+static void fm_i2c_dma_config(FM_I2C_BUS *bus, dma_channel_enum ch,
+        uint8_t *buf, uint32_t size, uint8_t direction) {
+    dma_parameter_struct dma_init_struct;
+
+    dma_channel_disable(DMA0, ch);
+    dma_struct_para_init(&dma_init_struct);
+    dma_init_struct.periph_addr = (uintptr_t)&I2C_DATA(bus->i2c);
+    dma_init_struct.periph_width = DMA_PERIPHERAL_WIDTH_8BIT;
+    dma_init_struct.periph_inc = DMA_PERIPH_INCREASE_DISABLE;
+    dma_init_struct.memory_addr = (uintptr_t)buf;
+    dma_init_struct.memory_width = DMA_MEMORY_WIDTH_8BIT;
+    dma_init_struct.memory_inc = DMA_MEMORY_INCREASE_ENABLE;
+    dma_init_struct.number = size;
+    dma_init_struct.priority = DMA_PRIORITY_HIGH;
+    dma_init_struct.direction = direction;
+    dma_init(DMA0, ch, &dma_init_struct);
+    dma_circulation_disable(DMA0, ch);
+    dma_memory_to_memory_disable(DMA0, ch);
+    dma_channel_enable(DMA0, ch);
+}
+
+static void fm_i2c_begin(FM_I2C_BUS *bus) {
+    bus->reading = (bus->head->tx_size == 0);
+    bus->deadline = get_timer_value() +
+            FM_I2C_TIMEOUT_MS * (SystemCoreClock / 4000);
+    timer_enable(FM_I2C_TIMER);
+    i2c_start_on_bus(bus->i2c);
+}
+
+// Put the peripheral and DMA back to how a transaction expects them
+static void fm_i2c_cleanup(FM_I2C_BUS *bus) {
+    i2c_dma_enable(bus->i2c, I2C_DMA_OFF);
+    i2c_dma_last_transfer_config(bus->i2c, I2C_DMALST_OFF);
+    i2c_ack_config(bus->i2c, I2C_ACK_ENABLE);
+    dma_channel_disable(DMA0, bus->tx_ch);
+    dma_channel_disable(DMA0, bus->rx_ch);
+}
+
+// Retire the head of the queue and start the next transaction
+static void fm_i2c_done(FM_I2C_BUS *bus, FM_I2C_STATUS status) {
+    FM_I2C_XFER *xfer = bus->head;
+
+    fm_i2c_cleanup(bus);
+
+    bus->head = xfer->next;
+    if (bus->head == NULL)
+        bus->tail = NULL;
+    xfer->status = status;
+    if (xfer->done_cb)
+        xfer->done_cb(xfer);
+    if (bus->head != NULL)
+        fm_i2c_begin(bus);
+}
+
+// Start the head of the queue over, or give up on it
+static void fm_i2c_retry(FM_I2C_BUS *bus, FM_I2C_STATUS status) {
+    FM_I2C_XFER *xfer = bus->head;
+
+    if (xfer->tries >= FM_I2C_RETRIES) {
+        fm_i2c_done(bus, status);
+        return;
+    }
+    xfer->tries++;
+    fm_i2c_cleanup(bus);
+    fm_i2c_begin(bus);
+}
+
+static void fm_i2c_setup(FM_I2C_BUS *bus) {
+    uint32_t i2c = bus->i2c;
+
+    i2c_clock_config(i2c, bus->speed, bus->duty);
+    i2c_mode_addr_config(i2c, I2C_I2CMODE_ENABLE, I2C_ADDFORMAT_7BITS, 0x00);
+    i2c_enable(i2c);
+    i2c_ack_config(i2c, I2C_ACK_ENABLE);
+    i2c_interrupt_enable(i2c, I2C_INT_EV);
+    i2c_interrupt_enable(i2c, I2C_INT_ERR);
+}
+
+// Tick the deadline timer every us microseconds, starting over from now
+static void fm_i2c_tick(uint32_t us) {
+    timer_autoreload_value_config(FM_I2C_TIMER, us - 1);
+    timer_counter_value_config(FM_I2C_TIMER, 0);
+    timer_enable(FM_I2C_TIMER);
+}
+
+// A slave that lost track of the master keeps SDA low until it has
+// clocked out the rest of its byte. Reset the peripheral and hand the pins
+// to fm_i2c_recover_step(), which the timer runs every half SCL period:
+// SCL is pulsed up to 9 times until SDA is released, then a STOP goes out
+// and the head of the queue is retried. No interrupt ever waits on the bus.
+static void fm_i2c_recover(FM_I2C_BUS *bus, FM_I2C_STATUS status) {
+    uint32_t pins = bus->scl_pin | bus->sda_pin;
+
+    fm_i2c_cleanup(bus);
+    i2c_deinit(bus->i2c);
+
+    GPIO_BOP(GPIOB) = pins;
+    gpio_init(GPIOB, GPIO_MODE_OUT_OD, GPIO_OSPEED_50MHZ, pins);
+    bus->recover = 1;
+    bus->recover_status = status;
+    fm_i2c_tick(FM_I2C_RECOVER_TICK_US);
+}
+
+static void fm_i2c_recover_step(FM_I2C_BUS *bus) {
+    uint32_t step = bus->recover++;
+
+    // SCL low on odd steps for as long as SDA is held, high on even ones
+    if (step < FM_I2C_RECOVER_STOP) {
+        if (!(step & 1)) {
+            GPIO_BOP(GPIOB) = bus->scl_pin;
+            return;
+        }
+        if (!(GPIO_ISTAT(GPIOB) & bus->sda_pin)) {
+            GPIO_BC(GPIOB) = bus->scl_pin;
+            return;
+        }
+        step = FM_I2C_RECOVER_STOP;
+        bus->recover = step + 1;
+    }
+
+    switch (step - FM_I2C_RECOVER_STOP) {
+    case 0:
+        // SDA rises while SCL is high
+        GPIO_BC(GPIOB) = bus->scl_pin;
+        GPIO_BC(GPIOB) = bus->sda_pin;
+        break;
+    case 1:
+        GPIO_BOP(GPIOB) = bus->scl_pin;
+        break;
+    case 2:
+        GPIO_BOP(GPIOB) = bus->sda_pin;
+        break;
+    default:
+        gpio_init(GPIOB, GPIO_MODE_AF_OD, GPIO_OSPEED_50MHZ,
+                bus->scl_pin | bus->sda_pin);
+        fm_i2c_setup(bus);
+        bus->recover = 0;
+        fm_i2c_retry(bus, bus->recover_status);
+        break;
+    }
+}
+
+void fm_i2c_init(uint32_t i2c, uint32_t speed, uint32_t duty) {
+    FM_I2C_BUS *bus = fm_i2c_get_bus(i2c);
+    timer_parameter_struct timer_init_struct;
+
+    bus->head = NULL;
+    bus->tail = NULL;
+    bus->recover = 0;
+    bus->speed = speed;
+    bus->duty = duty;
+
+    rcu_periph_clock_enable(RCU_DMA0);
+    fm_i2c_setup(bus);
+    // Only the end of a read is signalled by the DMA, writes end on BTC
+    dma_interrupt_enable(DMA0, bus->rx_ch, DMA_INT_FTF);
+
+    // Deadline checks, started along with a transaction
+    rcu_periph_clock_enable(RCU_TIMER6);
+    timer_deinit(FM_I2C_TIMER);
+    timer_struct_para_init(&timer_init_struct);
+    timer_init_struct.prescaler = SystemCoreClock / 1000000 - 1;
+    timer_init_struct.period = FM_I2C_TICK_US - 1;
+    timer_init(FM_I2C_TIMER, &timer_init_struct);
+    timer_interrupt_enable(FM_I2C_TIMER, TIMER_INT_UP);
+
+    eclic_global_interrupt_enable();
+    fm_i2c_unlock(bus);
+}
+
+void fm_i2c_submit(uint32_t i2c, FM_I2C_XFER *xfer) {
+    FM_I2C_BUS *bus = fm_i2c_get_bus(i2c);
+
+    xfer->next = NULL;
+    xfer->tries = 0;
+    xfer->status = FM_I2C_PENDING;
+
+    fm_i2c_lock(bus);
+    if (bus->tail == NULL) {
+        bus->head = xfer;
+        bus->tail = xfer;
+        fm_i2c_begin(bus);
+    }
+    else {
+        bus->tail->next = xfer;
+        bus->tail = xfer;
+    }
+    fm_i2c_unlock(bus);
+}
+
+bool fm_i2c_busy(uint32_t i2c) {
+    return fm_i2c_get_bus(i2c)->head != NULL;
+}
+
+void fm_i2c_wait(void) {
+    // A completion between the check and the WFI stays pending and wakes it
+    eclic_global_interrupt_disable();
+    while (fm_i2c_busy(I2C0) || fm_i2c_busy(I2C1)) {
+        __WFI();
+        eclic_global_interrupt_enable();
+        eclic_global_interrupt_disable();
+    }
+    eclic_global_interrupt_enable();
+}
+
+void fm_i2c_wait_xfer(FM_I2C_XFER *xfer) {
+    eclic_global_interrupt_disable();
+    while (xfer->status == FM_I2C_PENDING) {
+        __WFI();
+        eclic_global_interrupt_enable();
+        eclic_global_interrupt_disable();
+    }
+    eclic_global_interrupt_enable();
+}
+
+static void fm_i2c_event(FM_I2C_BUS *bus) {
+    FM_I2C_XFER *xfer = bus->head;
+    uint32_t i2c = bus->i2c;
+
+    if (xfer == NULL)
+        return;
+
+    if (i2c_interrupt_flag_get(i2c, I2C_INT_FLAG_SBSEND)) {
+        i2c_master_addressing(i2c, xfer->addr << 1,
+                bus->reading ? I2C_RECEIVER : I2C_TRANSMITTER);
+    }
+    else if (i2c_interrupt_flag_get(i2c, I2C_INT_FLAG_ADDSEND)) {
+        // DMA is set up before ADDSEND is cleared and the bus moves on
+        if (bus->reading) {
+            fm_i2c_dma_config(bus, bus->rx_ch, xfer->rx, xfer->rx_size,
+                    DMA_PERIPHERAL_TO_MEMORY);
+            if (xfer->rx_size == 1)
+                i2c_ack_config(i2c, I2C_ACK_DISABLE);
+            else
+                i2c_dma_last_transfer_config(i2c, I2C_DMALST_ON);
+        }
+        else {
+            fm_i2c_dma_config(bus, bus->tx_ch, (uint8_t *)xfer->tx,
+                    xfer->tx_size, DMA_MEMORY_TO_PERIPHERAL);
+        }
+        i2c_dma_enable(i2c, I2C_DMA_ON);
+        i2c_interrupt_flag_clear(i2c, I2C_INT_FLAG_ADDSEND);
+    }
+    else if (i2c_interrupt_flag_get(i2c, I2C_INT_FLAG_BTC) && !bus->reading) {
+        // Last byte of the write is out
+        i2c_dma_enable(i2c, I2C_DMA_OFF);
+        dma_channel_disable(DMA0, bus->tx_ch);
+        if (xfer->rx_size) {
+            bus->reading = TRUE;
+            i2c_start_on_bus(i2c);
+        }
+        else {
+            i2c_stop_on_bus(i2c);
+            fm_i2c_done(bus, FM_I2C_DONE);
+        }
+    }
+}
+
+static void fm_i2c_error(FM_I2C_BUS *bus) {
+    uint32_t i2c = bus->i2c;
+    bool nack = FALSE;
+    bool berr = FALSE;
+
+    if (i2c_interrupt_flag_get(i2c, I2C_INT_FLAG_AERR)) {
+        i2c_interrupt_flag_clear(i2c, I2C_INT_FLAG_AERR);
+        nack = TRUE;
+    }
+    if (i2c_interrupt_flag_get(i2c, I2C_INT_FLAG_BERR)) {
+        i2c_interrupt_flag_clear(i2c, I2C_INT_FLAG_BERR);
+        berr = TRUE;
+    }
+    if (i2c_interrupt_flag_get(i2c, I2C_INT_FLAG_LOSTARB))
+        i2c_interrupt_flag_clear(i2c, I2C_INT_FLAG_LOSTARB);
+
+    if (bus->head == NULL)
+        return;
+    if (nack) {
+        i2c_stop_on_bus(i2c);
+        fm_i2c_done(bus, FM_I2C_NACK);
+        return;
+    }
+    // Lost arbitration already left the bus to the other master, after a
+    // misplaced START/STOP nobody knows what state the bus is in
+    if (berr)
+        fm_i2c_recover(bus, FM_I2C_ERROR);
+    else
+        fm_i2c_retry(bus, FM_I2C_ERROR);
+}
+
+// All bytes of a read are in
+static void fm_i2c_rx_done(FM_I2C_BUS *bus) {
+    dma_interrupt_flag_clear(DMA0, bus->rx_ch, DMA_INT_FLAG_G);
+    if (bus->head == NULL)
+        return;
+    i2c_stop_on_bus(bus->i2c);
+    fm_i2c_done(bus, FM_I2C_DONE);
+}
+
+void I2C0_EV_IRQHandler(void) {
+    fm_i2c_event(&fm_i2c_bus[0]);
+}
+
+void I2C0_ER_IRQHandler(void) {
+    fm_i2c_error(&fm_i2c_bus[0]);
+}
+
+void I2C1_EV_IRQHandler(void) {
+    fm_i2c_event(&fm_i2c_bus[1]);
+}
+
+void I2C1_ER_IRQHandler(void) {
+    fm_i2c_error(&fm_i2c_bus[1]);
+}
+
+void DMA0_Channel6_IRQHandler(void) {
+    fm_i2c_rx_done(&fm_i2c_bus[0]);
+}
+
+void DMA0_Channel4_IRQHandler(void) {
+    fm_i2c_rx_done(&fm_i2c_bus[1]);
+}
+
+// Deadline check and bus recovery, stops itself once both queues are empty
+void TIMER6_IRQHandler(void) {
+    uint64_t now = get_timer_value();
+    bool busy = FALSE;
+    bool recovering = FALSE;
+
+    timer_interrupt_flag_clear(FM_I2C_TIMER, TIMER_INT_FLAG_UP);
+    for (int i = 0; i < FM_I2C_BUSES; i++) {
+        FM_I2C_BUS *bus = &fm_i2c_bus[i];
+        if (bus->recover)
+            fm_i2c_recover_step(bus);
+        else if ((bus->head != NULL) && ((int64_t)(now - bus->deadline) >= 0))
+            fm_i2c_recover(bus, FM_I2C_TIMEOUT);
+        busy |= (bus->head != NULL);
+        recovering |= (bus->recover != 0);
+    }
+    // Back to deadline checks once no bus needs stepping
+    if (!recovering)
+        timer_autoreload_value_config(FM_I2C_TIMER, FM_I2C_TICK_US - 1);
+    if (!busy)
+        timer_disable(FM_I2C_TIMER);
+}
@@ -5,13 +5,55 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 #include "gd32vf103_gpio.h"
 #include "gd32vf103_spi.h"
 #include "gd32vf103_rcu.h"
 #include "systick.h"
+#include "irq_level.h"
 #include "lcd.h"
 
-uint16_t framebuffer[LCD_WIDTH * LCD_HEIGHT];
+#ifndef __WFI
+#define __WFI() __asm__ volatile ("wfi")
+#endif
+
+uint8_t framebuffer[LCD_STRIDE * LCD_HEIGHT];
+
+// Byte swapped the way the panel takes them
+static uint16_t lcd_palette[LCD_COLORS];
+
+// RGB565 bands fed to the DMA in turn, one gets filled while the other goes
+// out. At least a full row.
+#define LCD_BAND_PIXELS (4 * LCD_WIDTH)
+
+static uint16_t lcd_band[2][LCD_BAND_PIXELS];
+static uint32_t lcd_band_len[2];
+static int lcd_band_next;
+
+// Rectangles with at most this many blank pixels between them are merged.
+// Across, enough to join the glyphs of one string past their blank column.
+// Down, only ones that touch: the 3 blank rows between two lines of text
+// cost more bytes than the 11 command bytes of another window.
+#define LCD_DIRTY_GAP_X (2)
+#define LCD_DIRTY_GAP_Y (0)
+#define LCD_DIRTY_MAX (16)
+
+typedef struct {
+    uint16_t x1, y1, x2, y2;
+} LCD_RECT;
+
+// Areas changed since the last flush
+static LCD_RECT lcd_dirty[LCD_DIRTY_MAX];
+static int lcd_dirty_count;
+
+// Frame going out by DMA, and the mtime it started at
+static volatile bool lcd_flushing;
+static uint64_t lcd_flush_start;
+// Rectangles of that frame and how far it got
+static LCD_RECT lcd_flush_rect[LCD_DIRTY_MAX];
+static int lcd_flush_count;
+static int lcd_flush_index;
+static uint16_t lcd_flush_row;
 
 static void lcd_select(void) {
     gpio_bit_reset(GPIOB, GPIO_PIN_2);
@@ -65,18 +107,161 @@ static void lcd_send_word(uint16_t word) {
     lcd_send_byte(word);
 }
 
-static void lcd_send_buffer() {
+static uint32_t lcd_rect_area(uint16_t x1, uint16_t y1, uint16_t x2,
+        uint16_t y2) {
+    return (uint32_t)(x2 - x1 + 1) * (y2 - y1 + 1);
+}
+
+static void lcd_rect_union(LCD_RECT *r, const LCD_RECT *o) {
+    if (o->x1 < r->x1) r->x1 = o->x1;
+    if (o->y1 < r->y1) r->y1 = o->y1;
+    if (o->x2 > r->x2) r->x2 = o->x2;
+    if (o->y2 > r->y2) r->y2 = o->y2;
+}
+
+static bool lcd_rect_near(const LCD_RECT *r, const LCD_RECT *o) {
+    return (o->x1 <= r->x2 + LCD_DIRTY_GAP_X + 1) &&
+            (r->x1 <= o->x2 + LCD_DIRTY_GAP_X + 1) &&
+            (o->y1 <= r->y2 + LCD_DIRTY_GAP_Y + 1) &&
+            (r->y1 <= o->y2 + LCD_DIRTY_GAP_Y + 1);
+}
+
+void lcd_mark_dirty(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2) {
+    LCD_RECT rect = {x1, y1, x2, y2};
+
+    // Swallow every rectangle that touches, the grown one may touch more
+    for (int i = 0; i < lcd_dirty_count; i++) {
+        if (!lcd_rect_near(&rect, &lcd_dirty[i]))
+            continue;
+        lcd_rect_union(&rect, &lcd_dirty[i]);
+        lcd_dirty[i] = lcd_dirty[--lcd_dirty_count];
+        i = -1;
+    }
+    if (lcd_dirty_count < LCD_DIRTY_MAX) {
+        lcd_dirty[lcd_dirty_count++] = rect;
+        return;
+    }
+
+    // Out of slots, grow the one that gets the least bigger
+    int best = 0;
+    uint32_t best_cost = UINT32_MAX;
+    for (int i = 0; i < lcd_dirty_count; i++) {
+        LCD_RECT u = lcd_dirty[i];
+        lcd_rect_union(&u, &rect);
+        uint32_t cost = lcd_rect_area(u.x1, u.y1, u.x2, u.y2) -
+                lcd_rect_area(lcd_dirty[i].x1, lcd_dirty[i].y1,
+                lcd_dirty[i].x2, lcd_dirty[i].y2);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = i;
+        }
+    }
+    lcd_rect_union(&lcd_dirty[best], &rect);
+}
+
+static uint16_t lcd_swap(uint16_t v) {
+    return (v >> 8) | (v << 8);
+}
+
+void lcd_set_palette(uint8_t index, uint16_t color) {
+    if (lcd_palette[index] == lcd_swap(color))
+        return;
+    lcd_palette[index] = lcd_swap(color);
+    lcd_mark_dirty(0, 0, LCD_WIDTH - 1, LCD_HEIGHT - 1);
+}
+
+uint16_t lcd_get_palette(uint8_t index) {
+    return lcd_swap(lcd_palette[index]);
+}
+
+void lcd_clear(uint8_t index) {
+    uint8_t v = 0;
+    for (int i = 0; i < LCD_PPB; i++)
+        v = (v << LCD_BPP) | index;
+    memset(framebuffer, v, sizeof(framebuffer));
+    lcd_mark_dirty(0, 0, LCD_WIDTH - 1, LCD_HEIGHT - 1);
+}
+
+// Expand as many rows of the rectangle being sent as fit into band i
+static void lcd_expand_band(int i) {
+    LCD_RECT *r = &lcd_flush_rect[lcd_flush_index];
+    uint32_t width = r->x2 - r->x1 + 1;
+    uint16_t *dst = lcd_band[i];
+    uint32_t len = 0;
+
+    while ((lcd_flush_row <= r->y2) && (len + width <= LCD_BAND_PIXELS)) {
+        const uint8_t *src = &framebuffer[lcd_flush_row * LCD_STRIDE];
+        for (uint32_t x = r->x1; x <= r->x2; x++) {
+            uint32_t shift = (LCD_PPB - 1 - x % LCD_PPB) * LCD_BPP;
+            *dst++ = lcd_palette[(src[x / LCD_PPB] >> shift) &
+                    (LCD_COLORS - 1)];
+        }
+        len += width;
+        lcd_flush_row++;
+    }
+    lcd_band_len[i] = len;
+}
+
+// DMA the band expanded last, then fill the other one while it goes out
+static void lcd_send_band(void) {
+    int i = lcd_band_next;
+
+    dma_memory_address_config(DMA0, DMA_CH2, (uintptr_t)lcd_band[i]);
+    dma_transfer_number_config(DMA0, DMA_CH2, lcd_band_len[i] * 2);
+    dma_channel_enable(DMA0, DMA_CH2);
+    lcd_band_next = i ^ 1;
+    lcd_expand_band(lcd_band_next);
+}
+
+static void lcd_send_rect(void) {
+    LCD_RECT *r = &lcd_flush_rect[lcd_flush_index];
+
+    // Drop what came in while the DMA was sending, so RBNE tracks the
+    // command bytes again
+    spi_i2s_data_receive(SPI0);
+    lcd_set_window(r->x1, r->y1, r->x2, r->y2);
     lcd_mode_data();
-    dma_transfer_number_config(DMA0, DMA_CH2, sizeof(framebuffer) - 1);
     lcd_select();
-    dma_channel_enable(DMA0, DMA_CH2);
+    lcd_flush_row = r->y1;
+    lcd_band_next = 0;
+    lcd_expand_band(0);
+    lcd_send_band();
+}
+
+// Take the dirty rectangles and start sending them, the channel 2
+// interrupt works through the rest
+static void lcd_send_buffer(void) {
+    for (int i = 0; i < lcd_dirty_count; i++)
+        lcd_flush_rect[i] = lcd_dirty[i];
+    lcd_flush_count = lcd_dirty_count;
+    lcd_flush_index = 0;
+    lcd_dirty_count = 0;
+
+    lcd_flushing = TRUE;
+    lcd_flush_start = get_timer_value();
     spi_dma_enable(SPI0, SPI_DMA_TRANSMIT);
-    while(!dma_flag_get(DMA0, DMA_CH2, DMA_FLAG_FTF));
-    dma_flag_clear(DMA0, DMA_CH2, DMA_FLAG_FTF);
+    lcd_send_rect();
+}
+
+// Last byte of a band handed to the SPI. Expanding the next band and
+// setting the next window take thousands of cycles, the slave preempts
+// them from its own level.
+void DMA0_Channel2_IRQHandler(void) {
+    dma_interrupt_flag_clear(DMA0, DMA_CH2, DMA_INT_FLAG_G);
+    dma_channel_disable(DMA0, DMA_CH2);
+    if (lcd_band_len[lcd_band_next]) {
+        lcd_send_band();
+        return;
+    }
+    // Rectangle done once the last byte is out, within a byte time
     while (spi_i2s_flag_get(SPI0, SPI_FLAG_TRANS));
     lcd_deselect();
+    if (++lcd_flush_index < lcd_flush_count) {
+        lcd_send_rect();
+        return;
+    }
     spi_dma_disable(SPI0, SPI_DMA_TRANSMIT);
-    dma_channel_disable(DMA0, DMA_CH2);
+    lcd_flushing = FALSE;
 }
 
 void lcd_init(void) {
@@ -112,19 +297,22 @@ void lcd_init(void) {
     dma_deinit(DMA0, DMA_CH2);
     dma_struct_para_init(&dma_init_struct);
 
-    dma_init_struct.periph_addr  = (uint32_t)&SPI_DATA(SPI0);
-    dma_init_struct.memory_addr  = (uint32_t)framebuffer;
+    dma_init_struct.periph_addr  = (uintptr_t)&SPI_DATA(SPI0);
+    dma_init_struct.memory_addr  = (uintptr_t)lcd_band[0];
     dma_init_struct.direction    = DMA_MEMORY_TO_PERIPHERAL;
     dma_init_struct.memory_width = DMA_MEMORY_WIDTH_8BIT;
     dma_init_struct.periph_width = DMA_PERIPHERAL_WIDTH_8BIT;
     dma_init_struct.priority     = DMA_PRIORITY_LOW;
-    dma_init_struct.number       = (uint32_t)sizeof(framebuffer);
+    dma_init_struct.number       = (uint32_t)sizeof(lcd_band[0]);
     dma_init_struct.periph_inc   = DMA_PERIPH_INCREASE_DISABLE;
     dma_init_struct.memory_inc   = DMA_MEMORY_INCREASE_ENABLE;
     dma_init(DMA0, DMA_CH2, &dma_init_struct);
  
     dma_circulation_disable(DMA0, DMA_CH2);
     dma_memory_to_memory_disable(DMA0, DMA_CH2);
+    dma_interrupt_enable(DMA0, DMA_CH2, DMA_INT_FTF);
+    eclic_global_interrupt_enable();
+    eclic_irq_enable(DMA0_Channel2_IRQn, IRQ_LEVEL_DEFAULT, 0);
 
     // Enable SPI
 	spi_crc_polynomial_set(SPI0,7);
@@ -238,6 +426,8 @@ void lcd_init(void) {
 	lcd_send_cmd(0x29);	// Display On
 
     lcd_set_window(0, 0, LCD_WIDTH - 1, LCD_HEIGHT - 1);
+    // Panel RAM is random after reset, the first frame goes out in full
+    lcd_mark_dirty(0, 0, LCD_WIDTH - 1, LCD_HEIGHT - 1);
 }
 
 void lcd_set_window(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2) {
@@ -251,5 +441,27 @@ void lcd_set_window(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2) {
 }
 
 void lcd_update(void) {
-    lcd_send_buffer();
+    lcd_wait();
+    if (lcd_dirty_count)
+        lcd_send_buffer();
+}
+
+bool lcd_busy(void) {
+    return lcd_flushing;
+}
+
+bool lcd_ready(void) {
+    return !lcd_flushing && (get_timer_value() - lcd_flush_start >=
+            LCD_FRAME_MS * (SystemCoreClock / 4000));
+}
+
+void lcd_wait(void) {
+    // A completion between the check and the WFI stays pending and wakes it
+    eclic_global_interrupt_disable();
+    while (lcd_flushing) {
+        __WFI();
+        eclic_global_interrupt_enable();
+        eclic_global_interrupt_disable();
+    }
+    eclic_global_interrupt_enable();
 }
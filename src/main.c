@@ -9,11 +9,24 @@
 #include "ui.h"
 #include "fanslave.h"
 #include "fanmaster.h"
+#include "tach.h"
+#include "curve.h"
+#include "fanctl.h"
+#include "sched.h"
 
 #define LED_PIN GPIO_PIN_13
 #define LED_GPIO_PORT GPIOC
 #define LED_GPIO_CLK RCU_GPIOC
 
+// Task rates, control runs at FANCTL_HZ off its own timer
+#define TELEMETRY_MS (100)
+#define DISPLAY_MS (100)
+#define LED_MS (500)
+
+static int telemetry_task;
+static int display_task;
+static int ui_stale;
+
 void led_init()
 {
     rcu_periph_clock_enable(LED_GPIO_CLK);
@@ -31,12 +44,103 @@ void led_toggle() {
     toggle = !toggle;
 }
 
-uint32_t curve_forward(uint32_t val) {
-    return (val * 5 - 1000);
+// Channels whose request changed since they were last drawn
+static uint32_t req_dirty = (1u << FS_CHANNELS) - 1;
+// SET / ACT RPM on screen, redrawn only when they move
+static uint32_t set_shown[FS_CHANNELS];
+static uint32_t act_shown[FS_CHANNELS];
+
+static void draw_changed(uint32_t x, uint32_t y, uint32_t *shown,
+        uint32_t tach) {
+    uint32_t rpm = tach_to_rpm(tach);
+    if (rpm != *shown) {
+        *shown = rpm;
+        ui_disp_num(x, y, rpm);
+    }
+}
+
+// Draw what changed in the REQ / SET / ACT columns
+static void draw_rpm(void) {
+    FS_REQUEST request;
+    uint32_t dirty = req_dirty;
+
+    req_dirty = 0;
+    fanslave_get_request(&request);
+
+#ifdef LARGE_UI
+    if (dirty & 1)
+        ui_disp_num(13, 0, tach_to_rpm(request.tach[0]));
+    draw_changed(13, 16, &set_shown[0], fm_requested_tach[0]);
+    draw_changed(13, 16, &act_shown[0], fm_actual_tach[0]);
+#else
+    for (int i = 0; i < 14; i++) {
+        // Requested RPM
+        if (dirty & (1u << i))
+            ui_disp_num(0, i * 10 + 13, tach_to_rpm(request.tach[i]));
+        // Set RPM
+        draw_changed(28, i * 10 + 13, &set_shown[i], fm_requested_tach[i]);
+        // Actual RPM
+        draw_changed(56, i * 10 + 13, &act_shown[i], fm_actual_tach[i]);
+    }
+#endif
+}
+
+// A control period starts with a fresh tach reading
+static void period_run(void) {
+    fanmaster_get_tach_async();
+}
+
+// All readings in, setpoints from the control loop out
+static void control_run(void) {
+    fanctl_run();
+    fanmaster_set_tach_mask_async(fanctl_take_changed());
+}
+
+// The SMC writes the start register again later on. Only the first write
+// starts the chips, the ones after it would reset them under the loop.
+static void start_run(void) {
+    static int started = 0;
+
+    if (started)
+        return;
+    started = 1;
+    fanmaster_start();
+    fanmaster_get_tach();
+    fanctl_start();
+    sched_every(telemetry_task, TELEMETRY_MS);
+}
+
+// Report back RPM, as of the last reading
+static void telemetry_run(void) {
+    uint32_t tach[FS_CHANNELS];
+
+    for (int i = 0; i < 14; i++) {
+        tach[i] = curve_backward(i, fm_actual_tach[i]);
+    }
+    fanslave_set_actual(tach);
+    ui_stale = 1;
 }
 
-uint32_t curve_backward(uint32_t val) {
-    return (val + 1000) / 5;
+// New requests go on screen right away, the control loop picks them up by
+// their generation at its next period
+static void request_run(void) {
+    req_dirty |= fanslave_take_dirty();
+    ui_stale = 1;
+    sched_post(display_task);
+}
+
+// The display never holds up the control path: a redraw that finds the LCD
+// busy waits for the next turn, updates that came in meanwhile are folded in
+static void display_run(void) {
+    if (ui_stale && lcd_ready()) {
+        ui_stale = 0;
+        draw_rpm();
+        lcd_update();
+    }
+}
+
+static void led_run(void) {
+    led_toggle();
 }
 
 /*!
@@ -47,79 +151,38 @@ uint32_t curve_backward(uint32_t val) {
 */
 int main(void)
 {
+    uint32_t tach[FS_CHANNELS];
+
     led_init();
 
     lcd_init();
 
+    curve_init();
+
     fanmaster_init();
 
     fanslave_init();
 
+    fanctl_init();
+
     for (int i = 0; i < 14; i++) {
-        fs_actual_tach[i] = 0x0ccc; // set some default placeholder
+        tach[i] = 0x0ccc; // set some default placeholder
+        set_shown[i] = act_shown[i] = ~0u;
     }
+    fanslave_set_actual(tach);
 
     ui_init();
     lcd_update();
 
-    while (start_req == 0);
-    start_req = 0;
-    GPIO_BC(GPIOA) = 0x02;
-    fanmaster_start();
-
-    while(1){
-        led_toggle();
-
-        if (rpm_update_req == 1) {
-            rpm_update_req = 0;
-            GPIO_BC(GPIOA) = 0x01;
-            
-            // Requested RPM
-#ifdef LARGE_UI
-            uint32_t rpm = 81920 * 60 / fs_requested_tach[0];
-            ui_disp_num(13, 0, rpm);
-#else
-            for (int i = 0; i < 14; i++) {
-                uint32_t rpm = 81920 * 60 / fs_requested_tach[i];
-                ui_disp_num(0, i * 10 + 13, rpm);
-                //ui_disp_hex(0, i * 10 + 13, fs_requested_tach[i]);
-            }
-#endif
-
-            // Set RPM
-            for (int i = 0; i < 14; i++) {
-                fm_requested_tach[i] = curve_forward(fs_requested_tach[i]);
-            }
-            fanmaster_set_tach();
-#ifdef LARGE_UI 
-            rpm = 81920 * 60 / fm_requested_tach[0];
-            ui_disp_num(13, 16, rpm);
-#else
-            for (int i = 0; i < 14; i++) {
-                uint32_t rpm = 81920 * 60 / fm_requested_tach[i];
-                ui_disp_num(28, i * 10 + 13, rpm);
-            }
-#endif
-
-            // Actual RPM
-            fanmaster_get_tach();
-#ifdef LARGE_UI
-            rpm = 81920 * 60 / fm_actual_tach[0];
-            ui_disp_num(13, 16, rpm);
-#else
-            for (int i = 0; i < 14; i++) {
-                uint32_t rpm = 81920 * 60 / fm_actual_tach[i];
-                ui_disp_num(56, i * 10 + 13, rpm);
-                //ui_disp_hex(56, i * 10 + 13, fm_actual_tach[i]);
-            }
-#endif
-
-            // Report back RPM
-            for (int i = 0; i < 14; i++) {
-                fs_actual_tach[i] = curve_backward(fm_actual_tach[i]);
-            }
-
-            lcd_update();
-        }
-    }
+    sched_init();
+    sched_add(control_run, &fm_tach_req);
+    sched_add(period_run, &fanctl_update_req);
+    sched_add(start_run, &start_req);
+    telemetry_task = sched_add(telemetry_run, NULL);
+    sched_add(request_run, &rpm_update_req);
+    display_task = sched_add(display_run, NULL);
+    sched_every(display_task, DISPLAY_MS);
+    sched_every(sched_add(led_run, NULL), LED_MS);
+
+    sched_run();
 }
@@ -0,0 +1,147 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ */
+#include <stdint.h>
+#include "gd32vf103.h"
+#include "n200_timer.h"
+#include "sched.h"
+#include "irq_level.h"
+
+#ifndef __WFI
+#define __WFI() __asm__ volatile ("wfi")
+#endif
+
+// mtime counts at SystemCoreClock / 4
+#define SCHED_TICKS_MS (SystemCoreClock / 4000)
+#define SCHED_NEVER (UINT64_MAX)
+
+typedef struct {
+    SCHED_FUNC func;
+    volatile uint32_t *flag;
+    volatile uint32_t own_flag;
+    uint32_t period; // mtime ticks, 0 = no timer
+    uint64_t due;
+} SCHED_TASK;
+
+SCHED_STATS sched_stats;
+
+static SCHED_TASK sched_tasks[SCHED_TASKS];
+static int sched_count;
+
+// mtimecmp is two words on RV32. Park the low word at the top first so no
+// mix of old and new halves ever matches early.
+static void sched_set_compare(uint64_t when) {
+    volatile uint32_t *cmp =
+            (volatile uint32_t *)(TIMER_CTRL_ADDR + TIMER_MTIMECMP);
+    cmp[0] = 0xffffffff;
+    cmp[1] = when >> 32;
+    cmp[0] = when & 0xffffffff;
+}
+
+// Next timer to expire, timers due by now get their flag set and move on
+static uint64_t sched_timers(uint64_t now) {
+    uint64_t next = SCHED_NEVER;
+
+    for (int i = 0; i < sched_count; i++) {
+        SCHED_TASK *task = &sched_tasks[i];
+        if (!task->period)
+            continue;
+        if (task->due <= now) {
+            *task->flag = 1;
+            task->due += task->period;
+            // Periods missed while the core was held up are dropped
+            if (task->due <= now)
+                task->due = now + task->period;
+        }
+        if (task->due < next)
+            next = task->due;
+    }
+    return next;
+}
+
+void eclic_mtip_handler(void) {
+    sched_set_compare(sched_timers(get_timer_value()));
+}
+
+void sched_init(void) {
+    sched_count = 0;
+    sched_set_compare(SCHED_NEVER);
+    sched_stats_reset();
+
+    eclic_global_interrupt_enable();
+    eclic_irq_enable(CLIC_INT_TMR, IRQ_LEVEL_DEFAULT, 0);
+}
+
+int sched_add(SCHED_FUNC func, volatile uint32_t *flag) {
+    if (sched_count == SCHED_TASKS)
+        return -1;
+    SCHED_TASK *task = &sched_tasks[sched_count];
+    task->func = func;
+    task->own_flag = 0;
+    task->flag = flag ? flag : &task->own_flag;
+    task->period = 0;
+    return sched_count++;
+}
+
+void sched_every(int id, uint32_t period_ms) {
+    SCHED_TASK *task = &sched_tasks[id];
+
+    eclic_global_interrupt_disable();
+    uint64_t now = get_timer_value();
+    task->period = period_ms * SCHED_TICKS_MS;
+    task->due = now + task->period;
+    sched_set_compare(sched_timers(now));
+    eclic_global_interrupt_enable();
+}
+
+void sched_post(int id) {
+    *sched_tasks[id].flag = 1;
+}
+
+static SCHED_TASK *sched_ready(void) {
+    for (int i = 0; i < sched_count; i++)
+        if (*sched_tasks[i].flag)
+            return &sched_tasks[i];
+    return NULL;
+}
+
+void sched_step(void) {
+    SCHED_TASK *task = sched_ready();
+
+    if (task) {
+        // A flag set again while the task runs makes it run once more
+        *task->flag = 0;
+        task->func();
+        sched_stats.runs[task - sched_tasks]++;
+        return;
+    }
+
+    // A flag set between the check and the WFI leaves its interrupt
+    // pending, which wakes it
+    eclic_global_interrupt_disable();
+    if (!sched_ready()) {
+        uint64_t start = get_timer_value();
+        __WFI();
+        sched_stats.idle += get_timer_value() - start;
+        sched_stats.wakeups++;
+    }
+    eclic_global_interrupt_enable();
+}
+
+void sched_run(void) {
+    for (;;)
+        sched_step();
+}
+
+void sched_stats_reset(void) {
+    for (int i = 0; i < SCHED_TASKS; i++)
+        sched_stats.runs[i] = 0;
+    sched_stats.idle = 0;
+    sched_stats.wakeups = 0;
+    sched_stats.start = get_timer_value();
+}
+
+uint32_t sched_idle_permille(void) {
+    uint64_t total = get_timer_value() - sched_stats.start;
+    return total ? (uint32_t)(sched_stats.idle * 1000 / total) : 0;
+}
@@ -0,0 +1,265 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ */
+#include <stdint.h>
+#include "gd32vf103_gpio.h"
+#include "gd32vf103_rcu.h"
+#include "gd32vf103_dma.h"
+#include "gd32vf103_timer.h"
+#include "si2c_dma.h"
+#include "irq_level.h"
+
+// TIMER5 update requests are served by DMA1 channel 2
+#define SI2C_DMA_TIMER   (TIMER5)
+#define SI2C_DMA_PERIPH  (DMA1)
+#define SI2C_DMA_CHANNEL (DMA_CH2)
+
+// Indexed by bus_id
+static SI2C_DMA_CONTEXT *si2c_dma_bus[SI2C_DMA_BUSES];
+static uint16_t si2c_dma_samples[SI2C_DMA_SAMPLES];
+static uint32_t si2c_dma_pos;
+
+void si2c_dma_init(SI2C_DMA_CONTEXT *context) {
+    context->state = SD_IDLE;
+    context->level = context->scl_pin | context->sda_pin;
+    context->bits = 0;
+    context->wait = 1;
+    context->synced = FALSE;
+    si2c_dma_bus[context->bus_id] = context;
+
+    gpio_init(context->gpio, GPIO_MODE_IPU, GPIO_OSPEED_50MHZ,
+            context->scl_pin);
+    GPIO_BOP(context->gpio) = context->sda_pin;
+    gpio_init(context->gpio, GPIO_MODE_OUT_OD, GPIO_OSPEED_50MHZ,
+            context->sda_pin);
+
+    // SDA is only ever looked at through the samples
+    EXTI_INTEN &= ~ context->sda_pin;
+
+    // Configure SCL line to trigger on falling edge, enabled
+    EXTI_RTEN &= ~ context->scl_pin;
+    EXTI_FTEN |= context->scl_pin;
+    EXTI_PD = context->scl_pin;
+    EXTI_INTEN |= context->scl_pin;
+}
+
+void si2c_dma_start(uint32_t gpio) {
+    dma_parameter_struct dma_init_struct;
+    timer_parameter_struct timer_init_struct;
+
+    rcu_periph_clock_enable(RCU_DMA1);
+    rcu_periph_clock_enable(RCU_TIMER5);
+
+    si2c_dma_pos = 0;
+    dma_deinit(SI2C_DMA_PERIPH, SI2C_DMA_CHANNEL);
+    dma_struct_para_init(&dma_init_struct);
+    dma_init_struct.periph_addr = (uintptr_t)&GPIO_ISTAT(gpio);
+    dma_init_struct.periph_width = DMA_PERIPHERAL_WIDTH_16BIT;
+    dma_init_struct.periph_inc = DMA_PERIPH_INCREASE_DISABLE;
+    dma_init_struct.memory_addr = (uintptr_t)si2c_dma_samples;
+    dma_init_struct.memory_width = DMA_MEMORY_WIDTH_16BIT;
+    dma_init_struct.memory_inc = DMA_MEMORY_INCREASE_ENABLE;
+    dma_init_struct.number = SI2C_DMA_SAMPLES;
+    dma_init_struct.priority = DMA_PRIORITY_ULTRA_HIGH;
+    dma_init_struct.direction = DMA_PERIPHERAL_TO_MEMORY;
+    dma_init(SI2C_DMA_PERIPH, SI2C_DMA_CHANNEL, &dma_init_struct);
+    dma_circulation_enable(SI2C_DMA_PERIPH, SI2C_DMA_CHANNEL);
+    dma_memory_to_memory_disable(SI2C_DMA_PERIPH, SI2C_DMA_CHANNEL);
+    dma_interrupt_enable(SI2C_DMA_PERIPH, SI2C_DMA_CHANNEL,
+            DMA_INT_HTF | DMA_INT_FTF);
+    dma_channel_enable(SI2C_DMA_PERIPH, SI2C_DMA_CHANNEL);
+
+    // Same level as the EXTI, the two never preempt each other
+    eclic_irq_enable(DMA1_Channel2_IRQn, IRQ_LEVEL_SLAVE, 1);
+
+    timer_deinit(SI2C_DMA_TIMER);
+    timer_struct_para_init(&timer_init_struct);
+    timer_init_struct.prescaler = 0;
+    timer_init_struct.period = SystemCoreClock / SI2C_DMA_SAMPLE_HZ - 1;
+    timer_init(SI2C_DMA_TIMER, &timer_init_struct);
+    timer_dma_enable(SI2C_DMA_TIMER, TIMER_DMA_UPD);
+    timer_enable(SI2C_DMA_TIMER);
+}
+
+// Falling edges to skip after a START or STOP showed up in the samples,
+// counted from the last sample as the edges before it got their interrupt
+static void si2c_dma_resync(SI2C_DMA_CONTEXT *context, uint32_t scl) {
+    if (((context->state == SD_ADDR) || (context->state == SD_WRITE)) &&
+            (context->bits < 8))
+        context->wait = 8 - context->bits + (scl ? 1 : 0);
+    else
+        context->wait = 1;
+}
+
+static void si2c_dma_rising(SI2C_DMA_CONTEXT *context, uint32_t sda) {
+    switch (context->state) {
+    case SD_ADDR:
+        if (context->bits == 8) {
+            // Our own ACK
+            context->state = (context->addr & 0x01) ? SD_READ : SD_WRITE;
+            context->bits = 0;
+            context->data = 0;
+            break;
+        }
+        context->addr = (context->addr << 1) | sda;
+        context->bits ++;
+        if ((context->bits == 8) && !si2c_addr_match(context->addr))
+            context->state = SD_WAIT_STOP;
+        break;
+    case SD_WRITE:
+        if (context->bits == 8) {
+            context->bits = 0;
+            context->data = 0;
+            break;
+        }
+        context->data = (context->data << 1) | sda;
+        context->bits ++;
+        if (context->bits == 8)
+            context->write_cb(context->bus_id, context->addr, context->data);
+        break;
+    case SD_READ:
+        if (context->bits != 8) {
+            context->bits ++;
+            break;
+        }
+        // ACK from the master, NACK or nothing left ends the read
+        if (sda || context->read_last)
+            context->state = SD_WAIT_STOP;
+        context->bits = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+void si2c_dma_decode(SI2C_DMA_CONTEXT *context, const uint16_t *samples,
+        uint32_t count) {
+    uint32_t mask = context->scl_pin | context->sda_pin;
+    uint32_t level = context->level;
+    bool resync = FALSE;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t sample = samples[i] & mask;
+        // Most samples repeat the previous one
+        if (sample == level)
+            continue;
+        uint32_t changed = sample ^ level;
+        uint32_t scl = sample & context->scl_pin;
+        uint32_t sda = (sample & context->sda_pin) ? 1 : 0;
+        level = sample;
+
+        if (changed & context->scl_pin) {
+            if (scl)
+                si2c_dma_rising(context, sda);
+            continue;
+        }
+        // Data changes while SCL is low are none of our business
+        if (!scl)
+            continue;
+        if (sda) {
+            // STOP condition, always reset the FSM
+            if (context->state != SD_IDLE)
+                context->stop_cb(context->bus_id, context->addr);
+            context->state = SD_IDLE;
+        }
+        else {
+            // (Repeated) START condition, go to address phase
+            context->state = SD_ADDR;
+            context->bits = 0;
+            context->addr = 0;
+        }
+        resync = TRUE;
+    }
+    context->level = level;
+    if (resync) {
+        context->synced = TRUE;
+        si2c_dma_resync(context, level & context->scl_pin);
+    }
+}
+
+void si2c_dma_falling(SI2C_DMA_CONTEXT *context) {
+    switch (context->state) {
+    case SD_ADDR:
+    case SD_WRITE:
+        if (context->bits == 8) {
+            // Send ACK, released on the next falling edge
+            GPIO_BC(context->gpio) = context->sda_pin;
+            context->wait = 1;
+        }
+        else {
+            GPIO_BOP(context->gpio) = context->sda_pin;
+            context->wait = 8 - context->bits;
+        }
+        break;
+    case SD_READ:
+        if (context->bits == 0)
+            context->read_cb(context->bus_id, context->addr,
+                    &(context->data), &(context->read_last));
+        if ((context->bits == 8) ||
+                (context->data & (0x80 >> context->bits)))
+            GPIO_BOP(context->gpio) = context->sda_pin;
+        else
+            GPIO_BC(context->gpio) = context->sda_pin;
+        context->wait = 1;
+        break;
+    default:
+        GPIO_BOP(context->gpio) = context->sda_pin;
+        context->wait = 1;
+        break;
+    }
+}
+
+void si2c_dma_poll(void) {
+    uint32_t end = SI2C_DMA_SAMPLES -
+            dma_transfer_number_get(SI2C_DMA_PERIPH, SI2C_DMA_CHANNEL);
+    if (end == SI2C_DMA_SAMPLES)
+        end = 0;
+
+    while (si2c_dma_pos != end) {
+        uint32_t stop = (end > si2c_dma_pos) ? end : SI2C_DMA_SAMPLES;
+        for (uint32_t i = 0; i < SI2C_DMA_BUSES; i++)
+            if (si2c_dma_bus[i])
+                si2c_dma_decode(si2c_dma_bus[i],
+                        &si2c_dma_samples[si2c_dma_pos], stop - si2c_dma_pos);
+        si2c_dma_pos = (stop == SI2C_DMA_SAMPLES) ? 0 : stop;
+    }
+}
+
+void si2c_dma_scl_irq(SI2C_DMA_CONTEXT *context) {
+    if (--context->wait)
+        return;
+    // Catch up with the bus, then drive SDA for the coming bit
+    si2c_dma_poll();
+    si2c_dma_falling(context);
+}
+
+// An SCL edge can come in just before this interrupt and wait behind it at
+// the same level. A resync would count it as handled and its interrupt would
+// then take one edge off wait again, so it is taken over here instead.
+void DMA1_Channel2_IRQHandler(void) {
+    uint32_t scl_pins = 0;
+    uint32_t pending;
+
+    dma_interrupt_flag_clear(SI2C_DMA_PERIPH, SI2C_DMA_CHANNEL, DMA_INT_FLAG_G);
+    for (uint32_t i = 0; i < SI2C_DMA_BUSES; i++) {
+        if (si2c_dma_bus[i]) {
+            scl_pins |= si2c_dma_bus[i]->scl_pin;
+            si2c_dma_bus[i]->synced = FALSE;
+        }
+    }
+    pending = EXTI_PD & EXTI_INTEN & scl_pins;
+    EXTI_PD = pending;
+
+    si2c_dma_poll();
+
+    for (uint32_t i = 0; i < SI2C_DMA_BUSES; i++) {
+        SI2C_DMA_CONTEXT *context = si2c_dma_bus[i];
+        if (!context || !(pending & context->scl_pin))
+            continue;
+        // SCL stays low far longer than any handler here, low in the last
+        // sample means the edge made it into the samples the resync used
+        if (context->synced && !(context->level & context->scl_pin))
+            continue;
+        si2c_dma_scl_irq(context);
+    }
+}
@@ -0,0 +1,28 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ */
+#include "gd32vf103.h"
+#include "si2c_trace.h"
+
+#ifdef SI2C_TRACE
+
+SI2C_TRACE_RING si2c_trace_ring;
+
+void si2c_trace_reset(void) {
+    si2c_trace_ring.tail = si2c_trace_ring.head;
+    si2c_trace_ring.dropped = 0;
+}
+
+// Consumer side, call from the main loop only
+bool si2c_trace_read(SI2C_TRACE_RECORD *record) {
+    uint32_t tail = si2c_trace_ring.tail;
+    if (tail == si2c_trace_ring.head)
+        return FALSE;
+    __asm__ volatile ("" ::: "memory");
+    *record = si2c_trace_ring.records[tail & (SI2C_TRACE_SIZE - 1)];
+    __asm__ volatile ("" ::: "memory");
+    si2c_trace_ring.tail = tail + 1;
+    return TRUE;
+}
+
+#endif
@@ -5,229 +5,391 @@
 #include "gd32vf103_gpio.h"
 #include "gd32vf103_rcu.h"
 #include "softi2c.h"
+#include "si2c_trace.h"
+
+// EXTI edges a pin is watched on, none = interrupt disabled
+#define EDGE_NONE    (0x00)
+#define EDGE_RISING  (0x01)
+#define EDGE_FALLING (0x02)
+#define EDGE_BOTH    (EDGE_RISING | EDGE_FALLING)
+
+// Handles an SCL edge with the sampled SDA level, returns the next state
+typedef SI2C_STATE (*SI2C_HANDLER)(SI2C_CONTEXT *context, uint32_t sda);
+
+typedef struct {
+    SI2C_HANDLER handler;
+    uint8_t scl_edge;
+    uint8_t sda_edge;
+    uint8_t start; // (Repeated) START accepted
+} SI2C_STATE_DESC;
+
+static SI2C_STATE si2c_st_addr(SI2C_CONTEXT *context, uint32_t sda);
+static SI2C_STATE si2c_st_addr_ack(SI2C_CONTEXT *context, uint32_t sda);
+static SI2C_STATE si2c_st_read_prepare(SI2C_CONTEXT *context, uint32_t sda);
+static SI2C_STATE si2c_st_read(SI2C_CONTEXT *context, uint32_t sda);
+static SI2C_STATE si2c_st_read_ack(SI2C_CONTEXT *context, uint32_t sda);
+static SI2C_STATE si2c_st_write_prepare(SI2C_CONTEXT *context, uint32_t sda);
+static SI2C_STATE si2c_st_write(SI2C_CONTEXT *context, uint32_t sda);
+static SI2C_STATE si2c_st_write_ack(SI2C_CONTEXT *context, uint32_t sda);
+
+// SCL interrupts only while a transaction is addressed to us, SDA is not
+// watched while we drive it for a read
+static const SI2C_STATE_DESC si2c_states[] = {
+    [ST_IDLE] =          {NULL, EDGE_NONE, EDGE_FALLING, 1},
+    [ST_ADDR] =          {si2c_st_addr, EDGE_RISING, EDGE_BOTH, 0},
+    [ST_ADDR_ACK] =      {si2c_st_addr_ack, EDGE_FALLING, EDGE_BOTH, 0},
+    [ST_READ_PREPARE] =  {si2c_st_read_prepare, EDGE_FALLING, EDGE_NONE, 0},
+    [ST_READ] =          {si2c_st_read, EDGE_FALLING, EDGE_NONE, 0},
+    [ST_READ_ACK] =      {si2c_st_read_ack, EDGE_FALLING, EDGE_NONE, 0},
+    [ST_WRITE_PREPARE] = {si2c_st_write_prepare, EDGE_FALLING, EDGE_BOTH, 0},
+    [ST_WRITE] =         {si2c_st_write, EDGE_RISING, EDGE_BOTH, 1},
+    [ST_WRITE_ACK] =     {si2c_st_write_ack, EDGE_FALLING, EDGE_BOTH, 0},
+    [ST_WAIT_STOP] =     {NULL, EDGE_NONE, EDGE_BOTH, 0}
+};
+
+// Same as gpio_init() with GPIO_MODE_OUT_OD, without the per pin loop
+static inline void si2c_sda_output(SI2C_CONTEXT *context) {
+    *context->sda_ctl = (*context->sda_ctl & ~context->sda_ctl_mask) |
+            context->sda_ctl_out;
+}
+
+// Same as gpio_init() with GPIO_MODE_IPU, caller sets OCTL for the pull-up
+static inline void si2c_sda_input(SI2C_CONTEXT *context) {
+    *context->sda_ctl = (*context->sda_ctl & ~context->sda_ctl_mask) |
+            context->sda_ctl_in;
+}
 
 void si2c_init(SI2C_CONTEXT *context) {
     context->state = ST_IDLE;
+    context->late = 0;
+#ifdef SI2C_WRITE_BEHIND
+    context->txn_len = 0;
+    context->txn_buf = 0;
+    context->flush_busy = FALSE;
+#endif
 
+#ifdef SI2C_STRETCH
+    // Released until a callback holds it, the input and EXTI keep working
+    GPIO_BOP(context->gpio) = context->scl_pin;
+    gpio_init(context->gpio, GPIO_MODE_OUT_OD, GPIO_OSPEED_50MHZ,
+            context->scl_pin);
+    gpio_init(context->gpio, GPIO_MODE_IPU, GPIO_OSPEED_50MHZ,
+            context->sda_pin);
+#else
     gpio_init(context->gpio, GPIO_MODE_IPU, GPIO_OSPEED_50MHZ,
             context->scl_pin | context->sda_pin);
+#endif
 
-    // Debug
-    gpio_init(GPIOA, GPIO_MODE_OUT_PP, GPIO_OSPEED_50MHZ, 
-            GPIO_PIN_0 | GPIO_PIN_1 | GPIO_PIN_2 | GPIO_PIN_3);
+    uint32_t sda = 0;
+    while (!(context->sda_pin & (1u << sda)))
+        sda++;
+    context->sda_ctl = (sda < 8) ?
+            &GPIO_CTL0(context->gpio) : &GPIO_CTL1(context->gpio);
+    context->sda_ctl_mask = GPIO_MODE_MASK(sda & 7);
+    context->sda_ctl_out = GPIO_MODE_SET(sda & 7,
+            (GPIO_MODE_OUT_OD & 0x0f) | GPIO_OSPEED_50MHZ);
+    context->sda_ctl_in = GPIO_MODE_SET(sda & 7, GPIO_MODE_IPU & 0x0f);
 
     // Configure SDA line to trigger on falling edge, enabled
     EXTI_INTEN |= context->sda_pin;
     EXTI_RTEN &= ~ context->sda_pin;
     EXTI_FTEN |= context->sda_pin;
 
-    // Configure SCL line to trigger on falling edge, disabled
+    // Configure SCL line to trigger on rising edge, disabled
     EXTI_INTEN &= ~ context->scl_pin;
-    EXTI_RTEN &= ~ context->scl_pin;
-    EXTI_FTEN |= context->scl_pin;
+    EXTI_RTEN |= context->scl_pin;
+    EXTI_FTEN &= ~ context->scl_pin;
 
     // Clear interrupt pending flags
     EXTI_PD = context->sda_pin;
     EXTI_PD = context->scl_pin;
-}
 
-void si2c_process(SI2C_CONTEXT *context, SI2C_PIN pin) {
-    static int dbg_toggle = 0;
+#ifdef SI2C_WRITE_BEHIND
+    // Flush line on the software trigger alone, enabled
+    if (context->flush_line) {
+        EXTI_RTEN &= ~ context->flush_line;
+        EXTI_FTEN &= ~ context->flush_line;
+        EXTI_SWIEV &= ~ context->flush_line;
+        EXTI_PD = context->flush_line;
+        EXTI_INTEN |= context->flush_line;
+    }
+#endif
+}
 
-    if (dbg_toggle) {
-        dbg_toggle = 0;
-        GPIO_BC(GPIOA) = 0x08;
+// Edge bits are left alone when the interrupt gets disabled, a stale
+// pending flag is dropped when it gets enabled again
+static void si2c_exti_config(uint32_t pin, uint32_t from, uint32_t to) {
+    if (to == EDGE_NONE) {
+        EXTI_INTEN &= ~ pin;
+        return;
     }
-    else {
-        dbg_toggle = 1;
-        GPIO_BOP(GPIOA) = 0x08;
+    if (to & EDGE_RISING)
+        EXTI_RTEN |= pin;
+    else
+        EXTI_RTEN &= ~ pin;
+    if (to & EDGE_FALLING)
+        EXTI_FTEN |= pin;
+    else
+        EXTI_FTEN &= ~ pin;
+    if (from == EDGE_NONE) {
+        EXTI_PD = pin;
+        EXTI_INTEN |= pin;
     }
+}
 
-    if (pin == PIN_SDA)
-        GPIO_BC(GPIOA) = 0x04;
+#ifdef SI2C_WRITE_BEHIND
+// Pass on the next byte handed over, or the STOP behind the last one.
+// Returns FALSE once there is nothing left.
+static bool si2c_flush_step(SI2C_CONTEXT *context) {
+    if (!context->flush_busy)
+        return FALSE;
+    if (context->flush_pos < context->flush_len) {
+        uint8_t byte = context->txn[context->txn_buf ^ 1][context->flush_pos];
+        context->flush_pos++;
+        context->write_cb(context->bus_id, context->flush_addr, byte);
+        return TRUE;
+    }
+    if (context->flush_stop)
+        context->stop_cb(context->bus_id, context->flush_addr);
+    context->flush_busy = FALSE;
+    return FALSE;
+}
+
+// From the ISR, for what the flush handler has not got to yet. Nothing can
+// come in between, the handler only ever stops between two callbacks.
+static void si2c_drain(SI2C_CONTEXT *context) {
+    while (si2c_flush_step(context))
+        ;
+}
+
+void si2c_flush(SI2C_CONTEXT *context) {
+    bool more;
+
+    do {
+        eclic_global_interrupt_disable();
+        more = si2c_flush_step(context);
+        eclic_global_interrupt_enable();
+    } while (more);
+}
+
+// The write received so far goes to the flush handler, the buffer it was
+// in becomes the one handed over
+static void si2c_hand_over(SI2C_CONTEXT *context, bool stop) {
+    si2c_drain(context);
+    context->flush_len = context->txn_len;
+    context->flush_pos = 0;
+    context->flush_addr = context->addr;
+    context->flush_stop = stop;
+    context->txn_buf ^= 1;
+    context->txn_len = 0;
+    context->flush_busy = TRUE;
+    if (context->flush_line)
+        EXTI_SWIEV |= context->flush_line;
     else
-        GPIO_BOP(GPIOA) = 0x04;
+        si2c_drain(context);
+}
+#endif
 
-    // Stop condition, always reset the FSM
-    if (pin == PIN_SDA) {
-        if ((gpio_input_bit_get(context->gpio, context->sda_pin) == 1) &&
-                (gpio_input_bit_get(context->gpio, context->scl_pin) == 1)) {
-            // SDA goes high when SCL is high 
-            context->state = ST_IDLE;
-            // Trigger on falling edge for start condition
-            EXTI_RTEN &= ~ context->sda_pin;
-            EXTI_FTEN |= context->sda_pin;
-            // Tell the handler function
-            context->stop_cb(context->bus_id, context->addr);
-            // Debug
-            GPIO_BC(GPIOA) = 0x01;
-            GPIO_BC(GPIOA) = 0x02;
-            //GPIO_BC(GPIOA) = 0x04;
-            //GPIO_BC(GPIOA) = 0x08;
-        }
-        else if (((context->state == ST_IDLE) || (context->state == ST_WRITE)) &&
-                (gpio_input_bit_get(context->gpio, context->sda_pin) == 0) &&
-                (gpio_input_bit_get(context->gpio, context->scl_pin) == 1)) {
-            // SDA goes low when SCL is high
-            // Start condition met, go to address phase.
-            EXTI_FTEN &= ~ context->scl_pin;
-            EXTI_RTEN |= context->scl_pin;
-            EXTI_PD = context->scl_pin;
-            EXTI_INTEN |= context->scl_pin;
+static void si2c_enter(SI2C_CONTEXT *context, SI2C_STATE next) {
+    const SI2C_STATE_DESC *from = &si2c_states[context->state];
+    const SI2C_STATE_DESC *to = &si2c_states[next];
 
-            // Configure the SDA interrupt to monitor STOP condition or repeated
-            // START condition
-            EXTI_FTEN |= context->sda_pin;
-            EXTI_RTEN |= context->sda_pin;
-            //EXTI_INTEN &= ~context->sda_pin;
+    context->state = next;
+    if (from->scl_edge != to->scl_edge)
+        si2c_exti_config(context->scl_pin, from->scl_edge, to->scl_edge);
+    if (from->sda_edge != to->sda_edge)
+        si2c_exti_config(context->sda_pin, from->sda_edge, to->sda_edge);
+}
 
-            context->count = 0;
-            context->state = ST_ADDR;
+// Keep SCL low over callback work on a falling edge, it is low already
+static inline void si2c_scl_hold(SI2C_CONTEXT *context) {
+#ifdef SI2C_STRETCH
+    GPIO_BC(context->gpio) = context->scl_pin;
+#else
+    (void)context;
+#endif
+}
 
-            GPIO_BOP(GPIOA) = 0x01;
-            GPIO_BC(GPIOA) = 0x02;
-            //GPIO_BC(GPIOA) = 0x04;
-        }
+static inline void si2c_scl_release(SI2C_CONTEXT *context) {
+#ifdef SI2C_STRETCH
+    GPIO_BOP(context->gpio) = context->scl_pin;
+#else
+    (void)context;
+#endif
+}
 
-        return;
-    }
+// Next byte to send, done on an edge ahead of the one driving its first
+// bit. Only bytes that go out are fetched, the same as fetching on the
+// first bit edge.
+static inline void si2c_read_fetch(SI2C_CONTEXT *context) {
+    si2c_scl_hold(context);
+#ifdef SI2C_WRITE_BEHIND
+    // The register pointer a write before set has to be in
+    si2c_drain(context);
+#endif
+    context->read_cb(context->bus_id, context->addr,
+            &(context->data), &(context->read_last));
+    si2c_scl_release(context);
+}
 
-    // Make sure we are getting what we expected:
-    if (EXTI_FTEN & context->scl_pin) {
-        // Expecting a falling edge
-        if (gpio_input_bit_get(context->gpio, context->scl_pin) != 0)
-            return;
-    }
-    else if (EXTI_RTEN & context->scl_pin) {
-        if (gpio_input_bit_get(context->gpio, context->scl_pin) != 1)
-            return;
+static SI2C_STATE si2c_st_addr(SI2C_CONTEXT *context, uint32_t sda) {
+    context->addr = (context->addr << 1) | sda;
+    context->count ++;
+    if (context->count != 8)
+        return ST_ADDR;
+    // Address received, match address and send ack
+    if (si2c_addr_match(context->addr))
+        return ST_ADDR_ACK;
+    // Address failed to match
+    return ST_WAIT_STOP;
+}
+
+static SI2C_STATE si2c_st_addr_ack(SI2C_CONTEXT *context, uint32_t sda) {
+    (void)sda;
+    // Send ACK
+    GPIO_BC(context->gpio) = context->sda_pin;
+    si2c_sda_output(context);
+    if (!(context->addr & 0x01))
+        return ST_WRITE_PREPARE;
+    // The ACK is out, fetch the first byte now so the next edge only has
+    // to drive it
+    si2c_read_fetch(context);
+    return ST_READ_PREPARE;
+}
+
+static SI2C_STATE si2c_st_read_prepare(SI2C_CONTEXT *context, uint32_t sda) {
+    // Byte fetched on the ACK edge before. The first bit goes to OCTL
+    // before SDA is made an output. After the address ACK it already is
+    // one, driving the ACK low, and the bit goes straight onto the bus.
+    // After the master's ACK of a read byte it is an input, and the bit
+    // picks the pull-up or pull-down for a moment until the switch right
+    // after.
+    context->count = 0;
+    SI2C_STATE next = si2c_st_read(context, sda);
+    si2c_sda_output(context);
+    return next;
+}
+
+static SI2C_STATE si2c_st_read(SI2C_CONTEXT *context, uint32_t sda) {
+    (void)sda;
+    if (context->data & 0x80)
+        GPIO_BOP(context->gpio) = context->sda_pin;
+    else
+        GPIO_BC(context->gpio) = context->sda_pin;
+    context->count ++;
+    context->data <<= 1;
+    // Release bus on next falling edge
+    return (context->count == 8) ? ST_READ_ACK : ST_READ;
+}
+
+static SI2C_STATE si2c_st_read_ack(SI2C_CONTEXT *context, uint32_t sda) {
+    (void)sda;
+    GPIO_BOP(context->gpio) = context->sda_pin;
+    si2c_sda_input(context);
+    // NACK if there are no more bytes to send
+    if (context->read_last)
+        return ST_WAIT_STOP;
+    // The master takes the whole ACK bit, fetch the next byte meanwhile
+    si2c_read_fetch(context);
+    return ST_READ_PREPARE;
+}
+
+static SI2C_STATE si2c_st_write_prepare(SI2C_CONTEXT *context, uint32_t sda) {
+    (void)sda;
+    // At this cycle (triggered by falling edge)
+    // The master is supposed to put out data on the data bus
+    // But we will wait till the next rising edge to sample it
+    GPIO_BOP(context->gpio) = context->sda_pin;
+    si2c_sda_input(context);
+    context->count = 0;
+    context->data = 0;
+    return ST_WRITE;
+}
+
+static SI2C_STATE si2c_st_write(SI2C_CONTEXT *context, uint32_t sda) {
+    context->data = (context->data << 1) | sda;
+    context->count ++;
+    // Acknowledge on the next falling edge once the byte is in
+    return (context->count == 8) ? ST_WRITE_ACK : ST_WRITE;
+}
+
+static SI2C_STATE si2c_st_write_ack(SI2C_CONTEXT *context, uint32_t sda) {
+    (void)sda;
+    GPIO_BC(context->gpio) = context->sda_pin;
+    si2c_sda_output(context);
+#ifdef SI2C_WRITE_BEHIND
+    if (context->txn_len == SI2C_TXN_SIZE) {
+        si2c_scl_hold(context);
+        si2c_hand_over(context, FALSE);
+        si2c_scl_release(context);
     }
+    context->txn[context->txn_buf][context->txn_len++] = context->data;
+#else
+    si2c_scl_hold(context);
+    context->write_cb(context->bus_id, context->addr, context->data);
+    si2c_scl_release(context);
+#endif
+    // Need to wait for a stop or next byte
+    return ST_WRITE_PREPARE;
+}
+
+void si2c_process(SI2C_CONTEXT *context, SI2C_PIN pin) {
+    SI2C_TRACE_LOG(context->bus_id, context->state, pin, TR_EDGE);
+
+    // Both lines in one sample
+    uint32_t istat = GPIO_ISTAT(context->gpio);
+    uint32_t scl = istat & context->scl_pin;
+    uint32_t sda = (istat & context->sda_pin) ? 1 : 0;
+    const SI2C_STATE_DESC *desc = &si2c_states[context->state];
 
-    // Main FSM
-    switch (context->state) {
-    case ST_IDLE:
-        // Start condition handled before
-        break;
-    case ST_ADDR:
-        context->addr |= gpio_input_bit_get(context->gpio, context->sda_pin);
-        context->count ++;
-        if (context->count == 8) {
-            // Address received, match address and send ack
-            if (((context->addr & 0xf8) == 0xa0) || ((context->addr & 0xfe) == 0x82)) {
-                // Address matched
-                context->state = ST_ADDR_ACK;
-                // Set to falling edge trigger
-                EXTI_RTEN &= ~ context->scl_pin;
-                EXTI_FTEN |= context->scl_pin;
+    if (pin == PIN_SDA) {
+        // Data changes while SCL is low are none of our business
+        if (!scl)
+            return;
+        if (sda) {
+            // SDA goes high when SCL is high
+            // Stop condition, always reset the FSM
+            si2c_enter(context, ST_IDLE);
+#ifdef SI2C_WRITE_BEHIND
+            // Tell the handler function, after the write it ends
+            if (context->txn_len) {
+                si2c_hand_over(context, TRUE);
             }
             else {
-                // Address failed to match
-                context->state = ST_WAIT_STOP;
-                // Disable interrupt for SCL line
-                //EXTI_INTEN &= ~ context->scl_pin;
+                si2c_drain(context);
+                context->stop_cb(context->bus_id, context->addr);
             }
+#else
+            // Tell the handler function
+            context->stop_cb(context->bus_id, context->addr);
+#endif
+            SI2C_TRACE_LOG(context->bus_id, context->state, pin, TR_STOP);
         }
-        else {
-            context->addr <<= 1;
-        }
-        break;
-    case ST_ADDR_ACK:
-        // Send ACK
-        GPIO_BC(context->gpio) = context->sda_pin;
-        gpio_init(context->gpio, GPIO_MODE_OUT_OD, GPIO_OSPEED_50MHZ, 
-                context->sda_pin);
-        if (context->addr & 0x01) {
-            // Read
-            // Prepare the data, 
-            // the next falling edge should give ample time to prepare the data
-            // So hold off for now
-            context->state = ST_READ_PREPARE;
-        }
-        else {
-            // Write
-            context->state = ST_WRITE_PREPARE;
-        }
-        break;
-    case ST_READ_PREPARE:
-        context->read_cb(context->bus_id, context->addr,
-                &(context->data), &(context->read_last));
-        EXTI_INTEN &= ~ context->sda_pin;
-        GPIO_BOP(context->gpio) = context->sda_pin;
-        gpio_init(context->gpio, GPIO_MODE_OUT_OD, GPIO_OSPEED_50MHZ, 
-                context->sda_pin);
-        context->state = ST_READ;
-        context->count = 0;
-        __attribute__((fallthrough));
-    case ST_READ:
-        if (context->data & 0x80)
-            GPIO_BOP(context->gpio) = context->sda_pin;
-        else
-            GPIO_BC(context->gpio) = context->sda_pin;
-        context->count ++;
-        context->data <<= 1;
-        if (context->count == 8) {
-            // Release bus on next falling edge
-            context->state = ST_READ_ACK;
-        }
-        break;
-    case ST_READ_ACK:
-        gpio_init(context->gpio, GPIO_MODE_IPU, GPIO_OSPEED_50MHZ, 
-                context->sda_pin);
-        if (context->read_last) {
-            // NACK, no more bytes to send
-            //GPIO_BOP(context->gpio) = context->sda_pin;
-            EXTI_INTEN |= context->sda_pin;
-            context->state = ST_WAIT_STOP;
-        }
-        else {
-            // ACK, more bytes to send
-            //GPIO_BC(context->gpio) = context->sda_pin;
-            context->state = ST_READ_PREPARE;
-        }
-        break;
-    case ST_WRITE_PREPARE:
-        // At this cycle (triggered by falling edge)
-        // The master is supposed to put out data on the data bus
-        // But we will wait till the next rising edge to sample it
-        gpio_init(context->gpio, GPIO_MODE_IPU, GPIO_OSPEED_50MHZ,
-                context->sda_pin);
-        EXTI_FTEN &= ~ context->scl_pin;
-        EXTI_RTEN |= context->scl_pin;
-        context->state = ST_WRITE;
-        context->count = 0;
-        context->data = 0;
-        break;
-    case ST_WRITE:
-        context->data |= gpio_input_bit_get(context->gpio, context->sda_pin);
-        context->count ++;
-        if (context->count == 8) {
-            // Data reception finished
-            context->state = ST_WRITE_ACK;
-            // Set to falling edge trigger
-            EXTI_RTEN &= ~ context->scl_pin;
-            EXTI_FTEN |= context->scl_pin;
-        }
-        else {
-            context->data <<= 1;
+        else if (desc->start) {
+            // SDA goes low when SCL is high
+            // Start condition met, go to address phase.
+#ifdef SI2C_WRITE_BEHIND
+            // A repeated START ends the write before it
+            if (context->txn_len)
+                si2c_hand_over(context, FALSE);
+#endif
+            context->count = 0;
+            context->addr = 0;
+            si2c_enter(context, ST_ADDR);
+            SI2C_TRACE_LOG(context->bus_id, context->state, pin, TR_START);
         }
-        break;
-    case ST_WRITE_ACK:
-        GPIO_BC(context->gpio) = context->sda_pin;
-        gpio_init(context->gpio, GPIO_MODE_OUT_OD, GPIO_OSPEED_50MHZ, 
-                context->sda_pin);
-        context->write_cb(context->bus_id, context->addr, context->data);
-        // Need to wait for a stop or next byte
-        context->state = ST_WRITE_PREPARE;
-        break;
-    case ST_WAIT_STOP:
-        // Handled before
-        break;
+        return;
+    }
+
+    // Make sure we are getting what we expected. SCL went the other way
+    // again already when the ISR was late for the edge.
+    if (!(desc->scl_edge & (scl ? EDGE_RISING : EDGE_FALLING))) {
+        if (desc->scl_edge != EDGE_NONE)
+            context->late++;
+        return;
     }
 
-    // Output FSM state via GPIO
-    uint32_t state_int = context->state;
-    GPIO_BOP(GPIOA) = (state_int & 0x01) ? 0x00000001 : 0x00010000;
-    GPIO_BOP(GPIOA) = (state_int & 0x02) ? 0x00000002 : 0x00020000;
-    //GPIO_BOP(GPIOA) = (state_int & 0x04) ? 0x00000004 : 0x00040000;
-    //GPIO_BOP(GPIOA) = (state_int & 0x08) ? 0x00000008 : 0x00080000;
+    SI2C_STATE next = desc->handler(context, sda);
+    if (next != context->state)
+        si2c_enter(context, next);
 }
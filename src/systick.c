@@ -44,6 +44,7 @@ OF SUCH DAMAGE.
 void delay_1ms(uint32_t count)
 {
     uint64_t start_mtime, delta_mtime;
+    uint64_t ticks = (uint64_t)count * (SystemCoreClock / 4000);
 
     // Don't start measuruing until we see an mtime tick
     uint64_t tmp = get_timer_value();
@@ -53,5 +54,5 @@ void delay_1ms(uint32_t count)
 
     do {
     delta_mtime = get_timer_value() - start_mtime;
-    }while(delta_mtime <(SystemCoreClock/4000.0 *count ));
+    }while(delta_mtime < ticks);
 }
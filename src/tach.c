@@ -0,0 +1,80 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ */
+#include <stdint.h>
+#include "tach.h"
+
+// Seed for 2^46 / d with d normalized to [2^15, 2^16), taken at the middle
+// of each 1/256 step, in units of 2^15. Good to 9 bits.
+#define SEED(i) ((uint16_t)((1ul << 31) / (32768 + (i) * 128 + 64)))
+#define SEED4(i) SEED(i), SEED(i + 1), SEED(i + 2), SEED(i + 3)
+#define SEED16(i) SEED4(i), SEED4(i + 4), SEED4(i + 8), SEED4(i + 12)
+#define SEED64(i) SEED16(i), SEED16(i + 16), SEED16(i + 32), SEED16(i + 48)
+
+static const uint16_t tach_seed[256] = {
+    SEED64(0), SEED64(64), SEED64(128), SEED64(192)
+};
+
+// Below this, one Newton step leaves the quotient more than one off. The
+// compiler folds these divisions.
+#define TACH_SMALL (17)
+#define SMALL(i) (TACH_RPM_K / (i))
+
+static const uint32_t tach_small[TACH_SMALL] = {
+    0, SMALL(1), SMALL(2), SMALL(3), SMALL(4), SMALL(5), SMALL(6), SMALL(7),
+    SMALL(8), SMALL(9), SMALL(10), SMALL(11), SMALL(12), SMALL(13),
+    SMALL(14), SMALL(15), SMALL(16)
+};
+
+// A plain division. tach_to_rpm_recip() below does without the divider but
+// takes seven multiply instructions on RV32IM and loses to it in bench_tach.
+uint32_t tach_to_rpm(uint32_t tach) {
+    if (tach == 0)
+        return 0;
+    // Slower than 75 RPM does not fit the 16 bit count
+    if (tach > 0xffff)
+        tach = 0xffff;
+    return TACH_RPM_K / tach;
+}
+
+uint32_t tach_to_rpm_recip(uint32_t tach) {
+    if (tach > 0xffff)
+        tach = 0xffff;
+    if (tach < TACH_SMALL)
+        return tach_small[tach];
+
+    // Normalize by compares, RV32IMAC has no count leading zeros
+    uint32_t d = tach;
+    uint32_t shift = 0;
+    if (d < 0x100) {
+        d <<= 8;
+        shift += 8;
+    }
+    if (d < 0x1000) {
+        d <<= 4;
+        shift += 4;
+    }
+    if (d < 0x4000) {
+        d <<= 2;
+        shift += 2;
+    }
+    if (d < 0x8000) {
+        d <<= 1;
+        shift += 1;
+    }
+
+    // One Newton step on y = 2^46 / d takes the seed to 18 bits
+    uint32_t y = (uint32_t)tach_seed[(d >> 7) & 0xff] << 15;
+    int64_t e = ((int64_t)1 << 46) - (int64_t)((uint64_t)d * y);
+    y += (int32_t)(((int64_t)y * (int32_t)(e >> 15)) >> 31);
+
+    // Never above the quotient and at most one below, the remainder says
+    uint32_t q = ((uint64_t)TACH_RPM_K * y) >> (46 - shift);
+    if (TACH_RPM_K - q * tach >= tach)
+        q++;
+    return q;
+}
+
+uint32_t rpm_to_tach(uint32_t rpm) {
+    return tach_to_rpm(rpm);
+}
@@ -30,6 +30,12 @@ const unsigned char ui_bg[168] = { /* 0X10,0X01,0X00,0X32,0X00,0X18, */
 #define ON_SHADOW (0x4c6e)
 #define OFF_COLOR (0x7e2f)
 #define OFF_SHADOW (0x7e70)
+// Palette indices
+#define PAL_BG (0)
+#define PAL_ON (1)
+#define PAL_ON_SHADOW (2)
+#define PAL_OFF (3)
+#define PAL_OFF_SHADOW (4)
 #define UI_WIDTH (50)
 #define UI_HEIGHT (23)
 
@@ -37,18 +43,144 @@ static void _lcd_set_pixel_large(size_t x, size_t y, bool on);
 #else
 #define BG_COLOR (0x0000)
 #define FG_COLOR (0xffff)
+// Palette indices
+#define PAL_BG (0)
+#define PAL_FG (1)
 #endif
 
-static uint16_t switch_endian_16(uint16_t v) {
-    return (((v >> 8) & 0xff) | (v << 8));
+// Characters redrawn on every update. They are kept expanded to palette
+// indices, the rest go through the font.
+static const char glyph_chars[] = "0123456789ABCDEF K";
+#define GLYPH_COUNT (sizeof(glyph_chars) - 1)
+// Slots of the characters the number formatter uses, digits are their own
+#define GLYPH_SPACE (16)
+#define GLYPH_K (17)
+
+// Cache slot + 1 by character, 0 when not cached
+static uint8_t glyph_slot[96];
+
+#ifdef LARGE_UI
+// A glyph at 3x is 315 bytes. Keep the rows as 5 bit patterns (bit n is
+// column n) and the expanded 3x rows per pattern: colour rows first, then
+// the shadow row.
+static uint8_t glyph_cache[GLYPH_COUNT][7];
+static uint8_t glyph_cells[32][2][15];
+#else
+static uint8_t glyph_cache[GLYPH_COUNT][7][5];
+#endif
+
+// Bounding box of the pixels changed by the drawing call in progress
+static size_t dirty_x1 = LCD_WIDTH, dirty_y1 = LCD_HEIGHT;
+static size_t dirty_x2, dirty_y2;
+
+static void ui_dirty(size_t x1, size_t y1, size_t x2, size_t y2) {
+    if (x1 < dirty_x1) dirty_x1 = x1;
+    if (y1 < dirty_y1) dirty_y1 = y1;
+    if (x2 > dirty_x2) dirty_x2 = x2;
+    if (y2 > dirty_y2) dirty_y2 = y2;
+}
+
+static void _lcd_set_pixel(size_t x, size_t y, uint8_t c) {
+    if (lcd_get_pixel(x, y) == c)
+        return;
+    lcd_put_pixel(x, y, c);
+    ui_dirty(x, y, x, y);
+}
+
+// Write a row of palette indices, only the span that changed is dirty
+static void ui_blit_row(size_t x, size_t y, const uint8_t *row, size_t w) {
+    size_t first = w;
+    size_t last = 0;
+    for (size_t i = 0; i < w; i++) {
+        if (lcd_get_pixel(x + i, y) == row[i])
+            continue;
+        lcd_put_pixel(x + i, y, row[i]);
+        if (first == w)
+            first = i;
+        last = i;
+    }
+    if (first < w)
+        ui_dirty(x + first, y, x + last, y);
+}
+
+// Hand the box to the LCD driver, the unchanged parts of a redraw do not
+// go out again
+static void ui_commit(void) {
+    if (dirty_x1 > dirty_x2)
+        return;
+    lcd_mark_dirty(dirty_x1, dirty_y1, dirty_x2, dirty_y2);
+    dirty_x1 = LCD_WIDTH;
+    dirty_y1 = LCD_HEIGHT;
+    dirty_x2 = dirty_y2 = 0;
+}
+
+static void ui_glyph_init(void) {
+#ifdef LARGE_UI
+    for (int m = 0; m < 32; m++) {
+        for (int xx = 0; xx < 5; xx++) {
+            bool on = (m >> xx) & 0x01;
+            uint8_t color = on ? PAL_ON : PAL_OFF;
+            uint8_t shadow = on ? PAL_ON_SHADOW : PAL_OFF_SHADOW;
+            glyph_cells[m][0][xx * 3] = color;
+            glyph_cells[m][0][xx * 3 + 1] = color;
+            glyph_cells[m][0][xx * 3 + 2] = shadow;
+            glyph_cells[m][1][xx * 3] = shadow;
+            glyph_cells[m][1][xx * 3 + 1] = shadow;
+            glyph_cells[m][1][xx * 3 + 2] = shadow;
+        }
+    }
+#endif
+    for (size_t i = 0; i < GLYPH_COUNT; i++) {
+        int c = glyph_chars[i] - 0x20;
+        glyph_slot[c] = i + 1;
+        for (int yy = 0; yy < 7; yy++) {
+#ifdef LARGE_UI
+            glyph_cache[i][yy] = 0;
+#endif
+            for (int xx = 0; xx < 5; xx++) {
+                bool on = (font[c * 5 + xx] >> yy) & 0x01;
+#ifdef LARGE_UI
+                glyph_cache[i][yy] |= on << xx;
+#else
+                glyph_cache[i][yy][xx] = on ? PAL_FG : PAL_BG;
+#endif
+            }
+        }
+    }
+}
+
+static void ui_disp_slot(size_t x, size_t y, uint8_t i) {
+#ifdef LARGE_UI
+    if (x >= UI_WIDTH)
+        return;
+    size_t w = ((UI_WIDTH - x < 5) ? UI_WIDTH - x : 5) * 3;
+    for (size_t yy = 0; (yy < 7) && (y + yy < UI_HEIGHT); yy++) {
+        uint8_t (*cells)[15] = glyph_cells[glyph_cache[i][yy]];
+        size_t px = BG_OFFSET_X + x * 3;
+        size_t py = BG_OFFSET_Y + (y + yy) * 3;
+        ui_blit_row(px, py, cells[0], w);
+        ui_blit_row(px, py + 1, cells[0], w);
+        ui_blit_row(px, py + 2, cells[1], w);
+    }
+#else
+    for (int yy = 0; yy < 7; yy++)
+        ui_blit_row(x, y + yy, glyph_cache[i][yy], 5);
+#endif
 }
 
-static void _lcd_set_pixel(size_t x, size_t y, uint16_t c) {
-    //framebuffer[y * LCD_WIDTH + x] = switch_endian_16(c);
-    framebuffer[y * LCD_WIDTH + x] = switch_endian_16(c);
+static bool ui_disp_glyph(size_t x, size_t y, char c) {
+    uint8_t i = (uint8_t)(c - 0x20);
+    if ((i >= sizeof(glyph_slot)) || !glyph_slot[i])
+        return false;
+    ui_disp_slot(x, y, glyph_slot[i] - 1);
+    return true;
 }
 
 void ui_disp_char(size_t x, size_t y, char c) {
+    if (ui_disp_glyph(x, y, c)) {
+        ui_commit();
+        return;
+    }
     c -= 0x20;
     for (int yy = 0; yy < 7; yy++) {
         for (int xx = 0; xx < 5; xx++) {
@@ -56,18 +188,19 @@ void ui_disp_char(size_t x, size_t y, char c) {
 #ifdef LARGE_UI
                 _lcd_set_pixel_large(x + xx, y + yy, 1);
 #else
-                _lcd_set_pixel(x + xx, y + yy, FG_COLOR);
+                _lcd_set_pixel(x + xx, y + yy, PAL_FG);
 #endif
             }
             else {
 #ifdef LARGE_UI
                 _lcd_set_pixel_large(x + xx, y + yy, 0);
 #else
-                _lcd_set_pixel(x + xx, y + yy, BG_COLOR);
+                _lcd_set_pixel(x + xx, y + yy, PAL_BG);
 #endif
             }
         }
     }
+    ui_commit();
 }
 
 void ui_disp_string(size_t x, size_t y, char *str) {
@@ -91,23 +224,35 @@ void ui_disp_hex(size_t x, size_t y, uint32_t num) {
     ui_disp_char(x + 18, y, hex_to_char((num) & 0xf));
 }
 
-void ui_disp_num(size_t x, size_t y, uint32_t num) {
-    if (num < 10000) {
-        // Display 4 digit number
-        ui_disp_char(x, y, num / 1000 + '0');
-        num = num % 1000;
-        ui_disp_char(x + 6, y, num / 100 + '0');
-        num = num % 100;
-        ui_disp_char(x + 12, y, num / 10 + '0');
-        num = num % 10;
-        ui_disp_char(x + 18, y, num + '0');
+// Four glyph slots for num, "1234" or "12 K" from 10000 on. Divides by
+// multiplying with the reciprocal, exact over the range used here.
+static void ui_format_num(uint32_t num, uint8_t *slot) {
+    if (num > 99999)
+        num = 99999;
+    if (num >= 10000) {
+        uint32_t k = ((num >> 3) * 8389) >> 20; // num / 1000
+        uint32_t tens = (k * 52429) >> 19;      // k / 10
+        slot[0] = tens;
+        slot[1] = k - tens * 10;
+        slot[2] = GLYPH_SPACE;
+        slot[3] = GLYPH_K;
+        return;
     }
-    else {
-        ui_disp_char(x, y, num / 10000 + '0');
-        num = num % 10000;
-        ui_disp_char(x + 6, y, num / 1000 + '0');
-        ui_disp_char(x + 12, y, ' ');
-        ui_disp_char(x + 18, y, 'K');
+    for (int i = 3; i >= 0; i--) {
+        uint32_t q = (num * 52429) >> 19;       // num / 10
+        slot[i] = num - q * 10;
+        num = q;
+    }
+}
+
+void ui_disp_num(size_t x, size_t y, uint32_t num) {
+    uint8_t slot[4];
+
+    ui_format_num(num, slot);
+    // One box per digit, a digit left alone in between is not sent
+    for (int i = 0; i < 4; i++) {
+        ui_disp_slot(x + i * 6, y, slot[i]);
+        ui_commit();
     }
 }
 
@@ -117,8 +262,8 @@ static void _lcd_set_pixel_large(size_t x, size_t y, bool on) {
     if (x >= UI_WIDTH) return;
     if (y >= UI_HEIGHT) return;
 
-    uint16_t color = (on) ? ON_COLOR : OFF_COLOR;
-    uint16_t shadow = (on) ? ON_SHADOW : OFF_SHADOW;
+    uint8_t color = (on) ? PAL_ON : PAL_OFF;
+    uint8_t shadow = (on) ? PAL_ON_SHADOW : PAL_OFF_SHADOW;
     _lcd_set_pixel(BG_OFFSET_X + x * 3,     BG_OFFSET_Y + y * 3, color);
     _lcd_set_pixel(BG_OFFSET_X + x * 3 + 1, BG_OFFSET_Y + y * 3, color);
     _lcd_set_pixel(BG_OFFSET_X + x * 3,     BG_OFFSET_Y + y * 3 + 1, color);
@@ -138,6 +283,7 @@ void ui_clear (void) {
             _lcd_set_pixel_large(i, j, 0);
         }
     }
+    ui_commit();
 }
 
 void ui_disp_bg(uint8_t *img) {
@@ -151,27 +297,34 @@ void ui_disp_bg(uint8_t *img) {
             
         }
     }
+    ui_commit();
 }
 
 void ui_init(void) {
-    for (int i = 0; i < LCD_WIDTH * LCD_HEIGHT; i++) {
-        framebuffer[i] = switch_endian_16(BG_COLOR);
-    }
+    ui_glyph_init();
+    lcd_set_palette(PAL_BG, BG_COLOR);
+    lcd_set_palette(PAL_ON, ON_COLOR);
+    lcd_set_palette(PAL_ON_SHADOW, ON_SHADOW);
+    lcd_set_palette(PAL_OFF, OFF_COLOR);
+    lcd_set_palette(PAL_OFF_SHADOW, OFF_SHADOW);
+    lcd_clear(PAL_BG);
     ui_disp_bg((uint8_t *)ui_bg);
 }
 #else
 // Small UI
 
 void ui_init(void) {
-    for (int i = 0; i < LCD_WIDTH * LCD_HEIGHT; i++) {
-        framebuffer[i] = switch_endian_16(BG_COLOR);
-    }
+    ui_glyph_init();
+    lcd_set_palette(PAL_BG, BG_COLOR);
+    lcd_set_palette(PAL_FG, FG_COLOR);
+    lcd_clear(PAL_BG);
 
     for (int i = 0; i < LCD_WIDTH; i++) {
-        _lcd_set_pixel(i, 10, FG_COLOR);
+        _lcd_set_pixel(i, 10, PAL_FG);
     }
     ui_disp_string(3, 0, "REQ");
     ui_disp_string(31, 0, "SET");
     ui_disp_string(59, 0, "ACT");
+    ui_commit();
 }
 #endif
\ No newline at end of file
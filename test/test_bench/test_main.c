@@ -0,0 +1,410 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Host micro-benchmarks. Numbers are host nanoseconds and only meaningful
+ * relative to each other, run before and after a change on the same box.
+ * Wire times come from the I2C master model and are absolute.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+#include "gd32vf103.h"
+#include "native.h"
+#include "replay.h"
+#include "softi2c.h"
+#include "fanslave.h"
+#include "fanmaster.h"
+#include "lcd.h"
+#include "ui.h"
+#include "tach.h"
+
+#define ITERATIONS (2000)
+#define CHIPS (7)
+#define FRAMES (200)
+
+static native_smbus smc;
+static native_fanchip chip[CHIPS];
+static native_fanchip pca9536;
+
+static void report(const char *fmt, ...) {
+    char buf[160];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    TEST_MESSAGE(buf);
+}
+
+static void report_isr(const char *name, uint32_t edges) {
+    report("%s: %u edges, %.1f ISR calls, %.0f ns ISR time per transaction",
+            name, edges / ITERATIONS,
+            (double)native_stats.irq_count / ITERATIONS,
+            (double)native_stats.irq_ns / ITERATIONS);
+    report("%s: %.1f ns avg, %llu ns max per ISR call", name,
+            (double)native_stats.irq_ns / native_stats.irq_count,
+            (unsigned long long)native_stats.irq_ns_max);
+}
+
+void setUp(void) {
+    native_reset();
+    fanslave_init();
+    native_smbus_init(&smc, GPIOB, GPIO_PIN_12, GPIO_PIN_13);
+
+    for (int i = 0; i < CHIPS; i++) {
+        native_fanchip_init(&chip[i], 3 - i % 4 + 0x50);
+        chip[i].regs[0x00] = 0x04;
+        native_i2c_attach((i < 4) ? I2C0 : I2C1, &chip[i].dev);
+    }
+    native_fanchip_init(&pca9536, 0x41);
+    native_i2c_attach(I2C1, &pca9536.dev);
+    fanmaster_init();
+}
+
+void tearDown(void) {
+}
+
+static void bench_slave_setpoint_write(void) {
+    uint8_t buf[] = {0xaa, 0x02, 0x00, 0x00};
+
+    native_stats_reset();
+    smc.edges = 0;
+    for (int i = 0; i < ITERATIONS; i++) {
+        buf[2] = i & 0xff;
+        buf[3] = (i >> 8) & 0xff;
+        native_smbus_write(&smc, 0x53, buf, sizeof(buf));
+    }
+
+    TEST_ASSERT_EQUAL_HEX32(ITERATIONS - 1, fs_requested_tach[0]);
+    TEST_ASSERT_EQUAL(0, native_stats.stuck);
+    report_isr("slave setpoint write", smc.edges);
+}
+
+static void bench_slave_tach_read(void) {
+    const uint8_t count[] = {0x00, 0x02};
+    uint32_t tach[FS_CHANNELS] = {0x0ccc};
+    uint8_t buf[3];
+
+    fanslave_set_actual(tach);
+    native_smbus_write(&smc, 0x53, count, sizeof(count));
+
+    native_stats_reset();
+    smc.edges = 0;
+    for (int i = 0; i < ITERATIONS; i++)
+        native_smbus_read(&smc, 0x53, 0xca, buf, sizeof(buf));
+
+    TEST_ASSERT_EQUAL_HEX8(0xcc, buf[1]);
+    TEST_ASSERT_EQUAL(0, native_stats.stuck);
+    report_isr("slave tach read", smc.edges);
+}
+
+static void ack_write_cb(uint32_t bus_id, uint8_t addr, uint8_t byte) {
+    (void)bus_id;
+    (void)addr;
+    (void)byte;
+}
+
+// Serves a register map like the fan chips do
+static uint8_t ack_regs[256];
+static uint8_t ack_reg;
+
+static void ack_read_cb(uint32_t bus_id, uint8_t addr, uint8_t *byte,
+        bool *last) {
+    (void)bus_id;
+    (void)addr;
+    *byte = ack_regs[ack_reg++];
+    *last = FALSE;
+}
+
+// ISR time of a single SCL edge entering state, SCL low and the FSM set up
+// for falling edges like it is after the 8th bit. Best of a few rounds,
+// the edges are short enough for the host to get in the way.
+static double ack_edge_ns(SI2C_CONTEXT *context, SI2C_STATE state) {
+    const int calls = ITERATIONS * 50;
+    double best = 0;
+    for (int round = 0; round < 5; round++) {
+        uint64_t start = native_now_ns();
+        for (int i = 0; i < calls; i++) {
+            context->state = state;
+            EXTI_RTEN &= ~context->scl_pin;
+            EXTI_FTEN |= context->scl_pin;
+            si2c_process(context, PIN_SCL);
+        }
+        double ns = (double)(native_now_ns() - start) / calls;
+        if (round == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+static void bench_slave_ack_edge(void) {
+    SI2C_CONTEXT context = {
+        .gpio = GPIOA,
+        .scl_pin = GPIO_PIN_8,
+        .sda_pin = GPIO_PIN_9,
+        .write_cb = ack_write_cb,
+        .read_cb = ack_read_cb
+    };
+
+    si2c_init(&context);
+    native_gpio_drive(GPIOA, context.scl_pin, 0);
+    context.addr = 0xa6;
+
+    double addr_ack = ack_edge_ns(&context, ST_ADDR_ACK);
+    double write_ack = ack_edge_ns(&context, ST_WRITE_ACK);
+    double release = ack_edge_ns(&context, ST_WRITE_PREPARE);
+    TEST_ASSERT_EQUAL(ST_WRITE, context.state);
+    report("slave ACK edge: %.1f ns address ACK, %.1f ns data ACK, "
+            "%.1f ns SDA release", addr_ack, write_ack, release);
+
+    // Read: the ACK edges hand over to the edge driving the first bit
+    context.addr = 0xa7;
+    double read_addr_ack = ack_edge_ns(&context, ST_ADDR_ACK);
+    double first_bit = ack_edge_ns(&context, ST_READ_PREPARE);
+    double read_ack = ack_edge_ns(&context, ST_READ_ACK);
+    double bit = ack_edge_ns(&context, ST_READ);
+    report("slave read edge: %.1f ns address ACK, %.1f ns first bit, "
+            "%.1f ns other bits, %.1f ns master ACK", read_addr_ack,
+            first_bit, bit, read_ack);
+}
+
+// ISR time of an edge on a line the slave watches while the bus is idle,
+// where the handler has nothing to do: interrupt entry and dispatch
+static double exti_edge_ns(uint32_t scl_pin, uint32_t sda_pin) {
+#ifdef SI2C_DMA
+    // Falling SCL edges, the receiver has no bit to drive
+    uint32_t pin = scl_pin;
+    (void)sda_pin;
+#else
+    // Falling SDA edges with SCL low, no START
+    uint32_t pin = sda_pin;
+    native_gpio_drive(GPIOB, scl_pin, 0);
+#endif
+    native_stats_reset();
+    for (int i = 0; i < ITERATIONS * 50; i++) {
+        native_gpio_drive(GPIOB, pin, 0);
+        native_gpio_drive(GPIOB, pin, pin);
+    }
+    native_gpio_drive(GPIOB, scl_pin, scl_pin);
+    TEST_ASSERT_EQUAL(ITERATIONS * 50, native_stats.irq_count);
+    return (double)native_stats.irq_ns / native_stats.irq_count;
+}
+
+static void bench_slave_exti_dispatch(void) {
+    double bus0 = exti_edge_ns(GPIO_PIN_12, GPIO_PIN_13);
+    double bus1 = exti_edge_ns(GPIO_PIN_14, GPIO_PIN_15);
+    TEST_ASSERT_EQUAL(0, native_stats.stuck);
+    report("slave EXTI dispatch: %.1f ns bus 0, %.1f ns bus 1 per edge",
+            bus0, bus1);
+}
+
+// Host ns of the longest single ISR call over a setpoint write and a tach
+// read, lowest of many runs since host noise only ever adds to it. A
+// regression measure for host builds before and after a change. It says
+// nothing about target cycles or about what an edge waits for on the
+// board; see the budget in fanslave.c.
+static void bench_slave_longest_isr(void) {
+    const uint8_t count[] = {0x00, 0x02};
+    const uint8_t set[] = {0xaa, 0x02, 0x34, 0x12};
+    uint32_t tach[FS_CHANNELS] = {0x0ccc};
+    uint64_t worst = UINT64_MAX;
+    uint8_t buf[3];
+
+    double dispatch = exti_edge_ns(GPIO_PIN_12, GPIO_PIN_13);
+    fanslave_set_actual(tach);
+    native_smbus_write(&smc, 0x53, count, sizeof(count));
+    for (int i = 0; i < ITERATIONS; i++) {
+        native_stats_reset();
+        native_smbus_write(&smc, 0x53, set, sizeof(set));
+        native_smbus_read(&smc, 0x53, 0xca, buf, sizeof(buf));
+        if (native_stats.irq_ns_max < worst)
+            worst = native_stats.irq_ns_max;
+    }
+
+    TEST_ASSERT_EQUAL_HEX8(0xcc, buf[1]);
+    TEST_ASSERT_EQUAL_HEX32(0x1234, fs_requested_tach[0]);
+    TEST_ASSERT_EQUAL(0, smc.late);
+    TEST_ASSERT_EQUAL(0, native_stats.stuck);
+    report("slave longest ISR call: %llu host ns, %.1f ns avg, "
+            "%.1fx an idle EXTI dispatch", (unsigned long long)worst,
+            (double)native_stats.irq_ns / native_stats.irq_count,
+            worst / dispatch);
+}
+
+static uint64_t master_update(const char *name) {
+    uint64_t set_ns = 0;
+    uint64_t get_ns = 0;
+
+    for (int i = 0; i < CHIPS * 2; i++)
+        fm_requested_tach[i] = 0x0ccc;
+
+    native_stats_reset();
+    native_i2c[I2C0].wire_ns = native_i2c[I2C1].wire_ns = 0;
+    native_i2c[I2C0].transactions = native_i2c[I2C1].transactions = 0;
+    for (int i = 0; i < ITERATIONS; i++) {
+        uint64_t start = native_sim_ns;
+        fanmaster_set_tach();
+        uint64_t mid = native_sim_ns;
+        fanmaster_get_tach();
+        get_ns += native_sim_ns - mid;
+        set_ns += mid - start;
+    }
+
+    uint64_t wire_ns = native_i2c[I2C0].wire_ns + native_i2c[I2C1].wire_ns;
+    uint32_t transactions =
+            native_i2c[I2C0].transactions + native_i2c[I2C1].transactions;
+    report("%s: %.1f us set_tach, %.1f us get_tach", name,
+            (double)set_ns / ITERATIONS / 1000,
+            (double)get_ns / ITERATIONS / 1000);
+    report("%s: %u transactions, %.1f us on the wire "
+            "(I2C0 %.1f us, I2C1 %.1f us)", name,
+            transactions / ITERATIONS, (double)wire_ns / ITERATIONS / 1000,
+            (double)native_i2c[I2C0].wire_ns / ITERATIONS / 1000,
+            (double)native_i2c[I2C1].wire_ns / ITERATIONS / 1000);
+    report("%s: %.1f ISR calls, %.0f ns ISR time per update", name,
+            (double)native_stats.irq_count / ITERATIONS,
+            (double)native_stats.irq_ns / ITERATIONS);
+    return wire_ns;
+}
+
+static void bench_master_update(void) {
+    fm_burst = FALSE;
+    uint64_t single_ns = master_update("master update");
+    fm_burst = TRUE;
+    uint64_t burst_ns = master_update("master burst update");
+
+    TEST_ASSERT_EQUAL_HEX8(0xcc, chip[CHIPS - 1].regs[0x2c]);
+    TEST_ASSERT_TRUE(burst_ns < single_ns);
+    report("master burst update: %.1f us less on the wire per update",
+            (double)(single_ns - burst_ns) / ITERATIONS / 1000);
+}
+
+// The main loop screen, REQ and SET steady, the last ACT digits moving
+static void draw_screen(uint32_t frame) {
+    for (int i = 0; i < 14; i++) {
+        ui_disp_num(0, i * 10 + 13, 2400);
+        ui_disp_num(28, i * 10 + 13, 2400);
+        ui_disp_num(56, i * 10 + 13, 2390 + (frame * 7 + i) % 20);
+    }
+}
+
+static void bench_lcd_update(void) {
+    native_lcd lcd;
+
+    native_lcd_init(&lcd);
+    lcd_init();
+    ui_init();
+    draw_screen(0);
+    lcd_update();
+    lcd_wait();
+
+    native_spi[SPI0].bytes = 0;
+    native_spi[SPI0].busy_ns = 0;
+    native_stats_reset();
+    for (uint32_t i = 1; i <= FRAMES; i++) {
+        draw_screen(i);
+        lcd_update();
+        lcd_wait();
+    }
+
+    uint32_t full = LCD_WIDTH * LCD_HEIGHT * 2;
+    uint32_t bytes = native_spi[SPI0].bytes / FRAMES;
+    TEST_ASSERT_TRUE(bytes < full / 8);
+    report("lcd update: %u bytes per frame (full frame %u), "
+            "%.1f us SPI busy, %.1f ISR calls", bytes, full,
+            (double)native_spi[SPI0].busy_ns / FRAMES / 1000,
+            (double)native_stats.irq_count / FRAMES);
+}
+
+static void bench_ui_render(void) {
+    ui_init();
+    draw_screen(0);
+
+    uint64_t start = native_now_ns();
+    for (uint32_t i = 1; i <= ITERATIONS; i++)
+        draw_screen(i);
+    uint64_t elapsed = native_now_ns() - start;
+
+    report("ui render: %.0f ns per update, %.1f ns per character",
+            (double)elapsed / ITERATIONS, (double)elapsed / ITERATIONS / 168);
+}
+
+// Every 16 bit count once, summed so the calls stay
+static uint64_t tach_pass(uint32_t (*convert)(uint32_t), uint32_t *sum) {
+    uint64_t start = native_now_ns();
+    for (uint32_t tach = 1; tach <= 0xffff; tach++)
+        *sum += convert(tach);
+    return native_now_ns() - start;
+}
+
+static void bench_tach(void) {
+    uint32_t div_sum = 0;
+    uint32_t recip_sum = 0;
+    uint64_t div_ns = 0;
+    uint64_t recip_ns = 0;
+
+    for (int i = 0; i < 20; i++) {
+        div_ns += tach_pass(tach_to_rpm, &div_sum);
+        recip_ns += tach_pass(tach_to_rpm_recip, &recip_sum);
+    }
+
+    TEST_ASSERT_EQUAL_UINT32(div_sum, recip_sum);
+    report("tach to rpm: %.2f ns divide, %.2f ns reciprocal per count",
+            (double)div_ns / 20 / 0xffff, (double)recip_ns / 20 / 0xffff);
+}
+
+static void bench_replay(void) {
+    uint8_t buf[] = {0xaa, 0x02, 0x00, 0x00};
+    char *trace;
+    size_t trace_len;
+    replay r;
+
+    FILE *fp = open_memstream(&trace, &trace_len);
+    native_smbus_record(&smc, fp, "SCL0", "SDA0");
+    for (int i = 0; i < ITERATIONS; i++) {
+        buf[2] = i & 0xff;
+        buf[3] = (i >> 8) & 0xff;
+        native_smbus_write(&smc, 0x53, buf, sizeof(buf));
+    }
+    fclose(fp);
+
+    native_reset();
+    fanslave_init();
+    memset(&r, 0, sizeof(r));
+    r.buses = 1;
+    r.bus[0].scl_name = "SCL0";
+    r.bus[0].sda_name = "SDA0";
+    r.bus[0].gpio = GPIOB;
+    r.bus[0].scl_pin = GPIO_PIN_12;
+    r.bus[0].sda_pin = GPIO_PIN_13;
+
+    uint64_t start = native_now_ns();
+    replay_begin(&r);
+    replay_feed(&r, trace, trace_len);
+    replay_end(&r);
+    uint64_t elapsed = native_now_ns() - start;
+    free(trace);
+
+    TEST_ASSERT_EQUAL(ITERATIONS, r.bus[0].stops);
+    report("replay: %llu edges, %.2f M edges/s, %.1fx real time",
+            (unsigned long long)r.edges, r.edges * 1e3 / elapsed,
+            r.time * 1e9 / elapsed);
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(bench_slave_setpoint_write);
+    RUN_TEST(bench_slave_tach_read);
+    RUN_TEST(bench_slave_ack_edge);
+    RUN_TEST(bench_slave_exti_dispatch);
+    RUN_TEST(bench_slave_longest_isr);
+    RUN_TEST(bench_master_update);
+    RUN_TEST(bench_lcd_update);
+    RUN_TEST(bench_ui_render);
+    RUN_TEST(bench_tach);
+    RUN_TEST(bench_replay);
+    return UNITY_END();
+}
@@ -0,0 +1,85 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Fan curve lookup, forward against backward
+ */
+#include <unity.h>
+#include "curve.h"
+
+void setUp(void) {
+    curve_init();
+}
+
+void tearDown(void) {
+}
+
+static void test_default_curve(void) {
+    // The old fixed map where it did not wrap
+    for (uint32_t val = 200; val <= 13307; val++)
+        TEST_ASSERT_EQUAL_UINT32(val * 5 - 1000, curve_forward(0, val));
+    for (uint32_t val = 0; val <= 0xffff; val += 5)
+        TEST_ASSERT_EQUAL_UINT32((val + 1000) / 5, curve_backward(13, val));
+}
+
+static void test_clamped(void) {
+    TEST_ASSERT_EQUAL_UINT32(0, curve_forward(0, 0));
+    TEST_ASSERT_EQUAL_UINT32(0, curve_forward(0, 199));
+    TEST_ASSERT_EQUAL_UINT32(0xffff, curve_forward(0, 13308));
+    TEST_ASSERT_EQUAL_UINT32(0xffff, curve_forward(0, 0x12345));
+    TEST_ASSERT_EQUAL_UINT32(200, curve_backward(0, 0));
+    TEST_ASSERT_EQUAL_UINT32(13307, curve_backward(0, 0xffff));
+}
+
+// Breakpoints close together in one bucket, steep and shallow parts
+static const CURVE_POINT bent[] = {
+    {1000, 800}, {1010, 900}, {1020, 3000}, {4000, 6000},
+    {30000, 20000}, {60000, 65000}
+};
+
+static void test_round_trip(void) {
+    TEST_ASSERT_EQUAL(0, curve_set(3, bent, sizeof(bent) / sizeof(bent[0])));
+
+    for (uint32_t val = bent[0].in; val <= bent[5].in; val++) {
+        uint32_t out = curve_forward(3, val);
+        uint32_t back = curve_backward(3, out);
+        // Where the curve is flatter than 1:1 several inputs share an output
+        if (out == curve_forward(3, val + 1) || out == curve_forward(3, val - 1))
+            TEST_ASSERT_EQUAL_UINT32(out, curve_forward(3, back));
+        else
+            TEST_ASSERT_EQUAL_UINT32(val, back);
+    }
+    for (uint32_t i = 0; i < sizeof(bent) / sizeof(bent[0]); i++) {
+        TEST_ASSERT_EQUAL_UINT32(bent[i].out, curve_forward(3, bent[i].in));
+        TEST_ASSERT_EQUAL_UINT32(bent[i].in, curve_backward(3, bent[i].out));
+    }
+    // Other channels keep theirs
+    TEST_ASSERT_EQUAL_UINT32(9000, curve_forward(2, 2000));
+}
+
+static void test_rejected(void) {
+    const CURVE_POINT falling[] = {{100, 500}, {200, 400}};
+    const CURVE_POINT flat[] = {{100, 500}, {100, 600}};
+    CURVE_POINT many[CURVE_POINTS + 1];
+
+    for (int i = 0; i < CURVE_POINTS + 1; i++)
+        many[i] = (CURVE_POINT){100 * (i + 1), 100 * (i + 1)};
+    TEST_ASSERT_EQUAL(-1, curve_set(1, falling, 2));
+    TEST_ASSERT_EQUAL(-1, curve_set(1, flat, 2));
+    TEST_ASSERT_EQUAL(-1, curve_set(1, many, CURVE_POINTS + 1));
+    TEST_ASSERT_EQUAL(-1, curve_set(1, many, 1));
+    TEST_ASSERT_EQUAL(-1, curve_set(CURVE_CHANNELS, many, 2));
+    TEST_ASSERT_EQUAL_UINT32(9000, curve_forward(1, 2000));
+    TEST_ASSERT_EQUAL(0, curve_set(1, many, CURVE_POINTS));
+    TEST_ASSERT_EQUAL_UINT32(450, curve_forward(1, 450));
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_default_curve);
+    RUN_TEST(test_clamped);
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_rejected);
+    return UNITY_END();
+}
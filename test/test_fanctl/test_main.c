@@ -0,0 +1,240 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Closed loop control against first order fan models behind the real
+ * fan chip registers
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <unity.h>
+#include "gd32vf103.h"
+#include "native.h"
+#include "fanslave.h"
+#include "fanmaster.h"
+#include "curve.h"
+#include "tach.h"
+#include "fanctl.h"
+
+#define CHIPS (7)
+#define CHANNELS (CHIPS * 2)
+#define PERIOD_MS (1000 / FANCTL_HZ)
+// Host count 800 is chip count 3000 on the default curve, 1638 RPM
+#define HOST_TACH (800)
+#define TARGET (3000)
+
+typedef struct {
+    double gain; // RPM reached for the RPM a setpoint stands for
+    double tau;  // Seconds
+    double rpm_max;
+    double rpm;
+} fan_model;
+
+static native_fanchip chip[CHIPS];
+static native_fanchip pca9536;
+static fan_model fan[CHANNELS];
+static uint64_t model_ns;
+
+static void report(const char *fmt, ...) {
+    char buf[160];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    TEST_MESSAGE(buf);
+}
+
+static uint8_t fan_reg(int channel) {
+    return (channel & 1) ? 0x2c : 0x2a;
+}
+
+// Fans follow the setpoint registers, the tach registers follow the fans
+static void fan_step(void) {
+    double dt = (native_sim_ns - model_ns) * 1e-9;
+    model_ns = native_sim_ns;
+    for (int i = 0; i < CHANNELS; i++) {
+        native_fanchip *c = &chip[i / 2];
+        uint8_t reg = fan_reg(i);
+        uint32_t set = c->regs[reg] | (c->regs[reg + 1] << 8);
+        double goal = fan[i].gain * tach_to_rpm(set);
+        if (goal > fan[i].rpm_max)
+            goal = fan[i].rpm_max;
+        fan[i].rpm += (goal - fan[i].rpm) * dt / fan[i].tau;
+        uint32_t tach = (fan[i].rpm > 75) ? TACH_RPM_K / fan[i].rpm : 0xffff;
+        c->regs[reg + 0x20] = tach & 0xff;
+        c->regs[reg + 0x21] = tach >> 8;
+    }
+}
+
+// What the main loop does, with the fans moving along. Goes by simulated
+// time, which the waits for the buses inside take some of.
+static void run(uint32_t ms) {
+    uint64_t end = native_sim_ns + ms * 1000000ull;
+    while (native_sim_ns < end) {
+        uint64_t left = end - native_sim_ns;
+        native_advance((left < 1000000) ? left : 1000000);
+        if (fanctl_update_req) {
+            fanctl_update_req = 0;
+            fanmaster_get_tach_async();
+        }
+        if (fm_tach_req) {
+            fm_tach_req = 0;
+            fanctl_run();
+            fanmaster_set_tach_mask_async(fanctl_take_changed());
+        }
+        fan_step();
+    }
+}
+
+static uint32_t fan_tach(int channel) {
+    return TACH_RPM_K / fan[channel].rpm;
+}
+
+void setUp(void) {
+    native_reset();
+    for (int i = 0; i < CHIPS; i++) {
+        native_fanchip_init(&chip[i], 3 - i % 4 + 0x50);
+        native_i2c_attach((i < 4) ? I2C0 : I2C1, &chip[i].dev);
+    }
+    native_fanchip_init(&pca9536, 0x41);
+    native_i2c_attach(I2C1, &pca9536.dev);
+
+    // Mixed fans, 20% slow to 19% fast, settled on the start setpoint
+    for (int i = 0; i < CHANNELS; i++) {
+        fan[i].gain = 0.8 + 0.03 * i;
+        fan[i].tau = 0.5;
+        fan[i].rpm_max = 10000;
+        fan[i].rpm = fan[i].gain * tach_to_rpm(0x0ccc);
+    }
+    model_ns = native_sim_ns;
+
+    curve_init();
+    fanmaster_init();
+    fanctl_init();
+    fanmaster_start();
+    fan_step();
+    fanmaster_get_tach();
+    fm_tach_req = 0;
+    for (int i = 0; i < CHANNELS; i++)
+        fs_requested_tach[i] = HOST_TACH;
+}
+
+void tearDown(void) {
+    fanctl_stop();
+}
+
+static void test_open_loop_misses(void) {
+    for (int i = 0; i < CHANNELS; i++)
+        fm_requested_tach[i] = curve_forward(i, HOST_TACH);
+    fanmaster_set_tach();
+    run(3000);
+
+    // Off by the fan's own error
+    TEST_ASSERT_UINT32_WITHIN(10, TARGET / 0.8, fan_tach(0));
+    report("open loop: channel 0 at %u, channel 13 at %u for %u",
+            fan_tach(0), fan_tach(13), TARGET);
+}
+
+static void test_settles(void) {
+    uint32_t settle_ms[CHANNELS] = {0};
+    uint32_t start[CHANNELS];
+    int32_t peak[CHANNELS] = {0};
+    uint32_t worst_settle = 0;
+    double worst_overshoot = 0;
+
+    for (int i = 0; i < CHANNELS; i++)
+        start[i] = fan_tach(i);
+    fanctl_start();
+    for (uint32_t t = 0; t < 3000; t += PERIOD_MS) {
+        run(PERIOD_MS);
+        for (int i = 0; i < CHANNELS; i++) {
+            int32_t tach = fan_tach(i);
+            // Furthest past the target, in the direction the fan moved
+            int32_t past = (start[i] > TARGET) ? TARGET - tach : tach - TARGET;
+            if (past > peak[i])
+                peak[i] = past;
+            if ((tach < TARGET * 98 / 100) || (tach > TARGET * 102 / 100))
+                settle_ms[i] = t + PERIOD_MS;
+        }
+    }
+
+    for (int i = 0; i < CHANNELS; i++) {
+        double overshoot = (double)peak[i] / TARGET;
+        TEST_ASSERT_UINT32_WITHIN(TARGET / 100, TARGET, fan_tach(i));
+        if (settle_ms[i] > worst_settle)
+            worst_settle = settle_ms[i];
+        if (overshoot > worst_overshoot)
+            worst_overshoot = overshoot;
+    }
+    TEST_ASSERT_TRUE(worst_settle <= 1000);
+    TEST_ASSERT_TRUE(worst_overshoot < 0.05);
+    report("closed loop: settled to 2%% in %u ms, %.1f%% of target "
+            "overshoot, worst of %u fans", worst_settle,
+            worst_overshoot * 100, CHANNELS);
+}
+
+// Only setpoints that moved go out, a settled loop leaves the bus alone
+static void test_sends_changes(void) {
+    fanctl_start();
+    run(3000);
+
+    uint32_t every = 0;
+    uint32_t transactions = native_i2c[I2C0].transactions;
+    for (uint32_t t = 0; t < 1000; t += PERIOD_MS) {
+        run(PERIOD_MS);
+        every += 4;
+    }
+    // The tach reads go on, one per chip and period
+    uint32_t sent = native_i2c[I2C0].transactions - transactions - every;
+    TEST_ASSERT_TRUE(sent < every / 2);
+    report("settled: %u setpoint writes on I2C0 in 1 s, %u when sending "
+            "every period", sent, every);
+}
+
+static void test_no_windup(void) {
+    // Channel 0 cannot get there for a while
+    fan[0].rpm_max = 1000;
+    fanctl_start();
+    run(3000);
+    TEST_ASSERT_TRUE(fan_tach(0) > TARGET * 1.5);
+    TEST_ASSERT_EQUAL_UINT32(1, fm_requested_tach[0]);
+
+    fan[0].rpm_max = 10000;
+    uint32_t peak = fan_tach(0);
+    uint32_t settle = 0;
+    for (uint32_t t = 0; t < 3000; t += PERIOD_MS) {
+        run(PERIOD_MS);
+        if (fan_tach(0) < peak)
+            peak = fan_tach(0);
+        if ((fan_tach(0) < TARGET * 98 / 100) ||
+                (fan_tach(0) > TARGET * 102 / 100))
+            settle = t + PERIOD_MS;
+    }
+    TEST_ASSERT_UINT32_WITHIN(TARGET / 100, TARGET, fan_tach(0));
+    TEST_ASSERT_TRUE(settle <= 1500);
+    report("after saturation: settled in %u ms, peak %u for %u",
+            settle, peak, TARGET);
+}
+
+static void test_failed_chip_holds(void) {
+    // Chip 6 stops answering
+    chip[6].dev.addr = 0x7f;
+    fanctl_start();
+    run(1000);
+
+    TEST_ASSERT_EQUAL_HEX32(0x3000, fm_failed);
+    TEST_ASSERT_EQUAL_UINT32(TARGET, fm_requested_tach[12]);
+    TEST_ASSERT_EQUAL_UINT32(TARGET, fm_requested_tach[13]);
+    TEST_ASSERT_UINT32_WITHIN(TARGET / 100, TARGET, fan_tach(0));
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_open_loop_misses);
+    RUN_TEST(test_settles);
+    RUN_TEST(test_sends_changes);
+    RUN_TEST(test_no_windup);
+    RUN_TEST(test_failed_chip_holds);
+    return UNITY_END();
+}
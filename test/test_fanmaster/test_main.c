@@ -0,0 +1,276 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Real fan controller chips driven through the I2C masters
+ */
+#include <unity.h>
+#include "gd32vf103.h"
+#include "native.h"
+#include "fanmaster.h"
+
+#define CHIPS (7)
+
+static native_fanchip chip[CHIPS];
+static native_fanchip pca9536;
+
+static uint32_t chip_i2c(int i) {
+    return (i < 4) ? I2C0 : I2C1;
+}
+
+static uint16_t chip_reg16(int i, uint8_t reg) {
+    return chip[i].regs[reg] | (chip[i].regs[reg + 1] << 8);
+}
+
+void setUp(void) {
+    native_reset();
+    for (int i = 0; i < CHIPS; i++) {
+        native_fanchip_init(&chip[i], 3 - i % 4 + 0x50);
+        native_i2c_attach(chip_i2c(i), &chip[i].dev);
+    }
+    native_fanchip_init(&pca9536, 0x41);
+    native_i2c_attach(I2C1, &pca9536.dev);
+    fanmaster_init();
+}
+
+void tearDown(void) {
+}
+
+static void test_start_configures_chips(void) {
+    fanmaster_start();
+
+    for (int i = 0; i < CHIPS; i++) {
+        TEST_ASSERT_EQUAL_HEX8(0x04, chip[i].regs[0x00]);
+        TEST_ASSERT_EQUAL_HEX8(0x01, chip[i].regs[0x01]);
+        TEST_ASSERT_EQUAL_HEX8(0x44, chip[i].regs[0x03]);
+        TEST_ASSERT_EQUAL_HEX8(0x33, chip[i].regs[0x3c]);
+        TEST_ASSERT_EQUAL_HEX16(0x0ccc, chip_reg16(i, 0x2a));
+        TEST_ASSERT_EQUAL_HEX16(0x0ccc, chip_reg16(i, 0x2c));
+    }
+}
+
+static void test_set_tach(void) {
+    for (int i = 0; i < CHIPS * 2; i++)
+        fm_requested_tach[i] = 0x1000 + i * 0x111;
+
+    fanmaster_set_tach();
+
+    for (int i = 0; i < CHIPS; i++) {
+        TEST_ASSERT_EQUAL_HEX16(fm_requested_tach[i * 2], chip_reg16(i, 0x2a));
+        TEST_ASSERT_EQUAL_HEX16(fm_requested_tach[i * 2 + 1],
+                chip_reg16(i, 0x2c));
+    }
+}
+
+static void test_get_tach(void) {
+    for (int i = 0; i < CHIPS; i++) {
+        chip[i].regs[0x00] = 0x04;
+        chip[i].regs[0x4a] = i;
+        chip[i].regs[0x4b] = 0x0a;
+        chip[i].regs[0x4c] = i;
+        chip[i].regs[0x4d] = 0x0b;
+    }
+
+    fanmaster_get_tach();
+
+    for (int i = 0; i < CHIPS; i++) {
+        TEST_ASSERT_EQUAL_HEX32(0x0a00 | i, fm_actual_tach[i * 2]);
+        TEST_ASSERT_EQUAL_HEX32(0x0b00 | i, fm_actual_tach[i * 2 + 1]);
+    }
+}
+
+static void test_single_register_paths(void) {
+    for (int i = 0; i < CHIPS; i++) {
+        chip[i].regs[0x00] = 0x04;
+        chip[i].regs[0x4a] = 0x33;
+        chip[i].regs[0x4b] = 0x0e;
+        chip[i].regs[0x4c] = 0x44;
+        chip[i].regs[0x4d] = 0x0f;
+    }
+    for (int i = 0; i < CHIPS * 2; i++)
+        fm_requested_tach[i] = 0x2000 + i;
+
+    fm_burst = FALSE;
+    fanmaster_set_tach();
+    fanmaster_get_tach();
+    fm_burst = TRUE;
+
+    TEST_ASSERT_EQUAL(CHIPS * 4, native_i2c[I2C0].transactions +
+            native_i2c[I2C1].transactions);
+    for (int i = 0; i < CHIPS; i++) {
+        TEST_ASSERT_EQUAL_HEX16(0x2000 + i * 2, chip_reg16(i, 0x2a));
+        TEST_ASSERT_EQUAL_HEX16(0x2001 + i * 2, chip_reg16(i, 0x2c));
+        TEST_ASSERT_EQUAL_HEX32(0x0e33, fm_actual_tach[i * 2]);
+        TEST_ASSERT_EQUAL_HEX32(0x0f44, fm_actual_tach[i * 2 + 1]);
+    }
+}
+
+static void test_buses_run_concurrently(void) {
+    uint64_t start = native_sim_ns;
+    fanmaster_set_tach();
+    uint64_t elapsed = native_sim_ns - start;
+
+    // Both queues drain in parallel, the update takes as long as the
+    // busier bus (minus its final STOP), not the sum of both
+    uint64_t i2c0 = native_i2c[I2C0].wire_ns;
+    uint64_t i2c1 = native_i2c[I2C1].wire_ns;
+    TEST_ASSERT_TRUE(i2c0 > i2c1);
+    TEST_ASSERT_TRUE(elapsed > i2c1);
+    TEST_ASSERT_TRUE(elapsed <= i2c0);
+}
+
+static void test_async_update(void) {
+    for (int i = 0; i < CHIPS; i++) {
+        chip[i].regs[0x00] = 0x04;
+        chip[i].regs[0x4a] = 0x11;
+        chip[i].regs[0x4b] = 0x0c;
+    }
+    fm_actual_tach[0] = 0;
+
+    fanmaster_get_tach_async();
+    TEST_ASSERT_TRUE(fanmaster_busy());
+    TEST_ASSERT_EQUAL(0, fm_actual_tach[0]);
+    fanmaster_wait();
+    TEST_ASSERT_FALSE(fanmaster_busy());
+    TEST_ASSERT_EQUAL_HEX32(0x0c11, fm_actual_tach[0]);
+    TEST_ASSERT_EQUAL_HEX32(0x0c11, fm_actual_tach[12]);
+}
+
+static void test_overlapped_update(void) {
+    uint64_t start = native_sim_ns;
+
+    // The tach reads queue up behind the setpoints instead of waiting for
+    // them, only sleeping moves simulated time
+    fanmaster_set_tach_async();
+    fanmaster_get_tach_async();
+    TEST_ASSERT_EQUAL(start, native_sim_ns);
+    TEST_ASSERT_TRUE(fanmaster_busy());
+    fanmaster_wait();
+    TEST_ASSERT_EQUAL(CHIPS * 2, native_i2c[I2C0].transactions +
+            native_i2c[I2C1].transactions);
+}
+
+static void test_missing_chip(void) {
+    // Chip 5 (0x52 on I2C1) does not answer
+    native_i2c[I2C1].devices = NULL;
+    native_i2c_attach(I2C1, &chip[4].dev);
+    native_i2c_attach(I2C1, &chip[6].dev);
+    for (int i = 0; i < CHIPS; i++) {
+        chip[i].regs[0x00] = 0x04;
+        chip[i].regs[0x4c] = 0x22;
+        chip[i].regs[0x4d] = 0x0d;
+        fm_actual_tach[i * 2 + 1] = 0x1234;
+    }
+
+    fanmaster_get_tach();
+
+    TEST_ASSERT_EQUAL_HEX32(0x0d22, fm_actual_tach[9]);
+    TEST_ASSERT_EQUAL_HEX32(0x1234, fm_actual_tach[11]);
+    TEST_ASSERT_EQUAL_HEX32(0x0d22, fm_actual_tach[13]);
+    TEST_ASSERT_EQUAL_HEX32(0x0c00, fm_failed);
+}
+
+static void test_hung_chip(void) {
+    for (int i = 0; i < CHIPS; i++) {
+        chip[i].regs[0x00] = 0x04;
+        chip[i].regs[0x4a] = 0x55;
+        chip[i].regs[0x4b] = 0x0a;
+    }
+    // Chip 5 holds SDA low for 3 clocks whenever it is addressed
+    chip[5].dev.hang = 3;
+    fm_actual_tach[10] = 0x1234;
+
+    uint64_t start = native_sim_ns;
+    fanmaster_get_tach();
+    uint64_t elapsed = native_sim_ns - start;
+
+    // Two attempts, each detected within a few ms and clocked free
+    TEST_ASSERT_TRUE(elapsed < 8000000);
+    TEST_ASSERT_EQUAL(0, native_i2c[I2C1].stuck_clocks);
+    TEST_ASSERT_EQUAL_HEX32(0x0c00, fm_failed);
+    TEST_ASSERT_EQUAL_HEX32(0x1234, fm_actual_tach[10]);
+    // The other chips on the bus carry on
+    TEST_ASSERT_EQUAL_HEX32(0x0a55, fm_actual_tach[8]);
+    TEST_ASSERT_EQUAL_HEX32(0x0a55, fm_actual_tach[12]);
+
+    // Left alone for a while, then picked up again once it is fixed
+    uint32_t transactions = native_i2c[I2C1].transactions;
+    fanmaster_get_tach();
+    TEST_ASSERT_EQUAL(transactions + 2, native_i2c[I2C1].transactions);
+    chip[5].dev.hang = 0;
+    for (int i = 0; (i < 20) && fm_failed; i++)
+        fanmaster_get_tach();
+    TEST_ASSERT_EQUAL_HEX32(0, fm_failed);
+    TEST_ASSERT_EQUAL_HEX32(0x0a55, fm_actual_tach[10]);
+}
+
+// Stuck SCL clock count of I2C1 moving on, advancing in 1 us steps
+static uint64_t next_clock_ns(void) {
+    uint32_t stuck = native_i2c[I2C1].stuck_clocks;
+    while ((native_i2c[I2C1].stuck_clocks == stuck) &&
+            (native_sim_ns < 10000000))
+        native_advance(1000);
+    return native_sim_ns;
+}
+
+static void test_recovery_steps(void) {
+    // Chip 5 holds SDA low for 3 clocks whenever it is addressed
+    chip[5].dev.hang = 3;
+    fanmaster_get_tach_async();
+    next_clock_ns();
+    TEST_ASSERT_EQUAL(3, native_i2c[I2C1].stuck_clocks);
+
+    // The deadline timer clocks the bus free half an SCL period per tick,
+    // no handler busy-waits through all of it
+    uint64_t first = next_clock_ns();
+    TEST_ASSERT_EQUAL(2, native_i2c[I2C1].stuck_clocks);
+    uint64_t second = next_clock_ns();
+    TEST_ASSERT_EQUAL(1, native_i2c[I2C1].stuck_clocks);
+    TEST_ASSERT_UINT32_WITHIN(1000, 10000, (uint32_t)(second - first));
+    fanmaster_wait();
+    TEST_ASSERT_EQUAL(0, native_i2c[I2C1].stuck_clocks);
+    TEST_ASSERT_EQUAL_HEX32(0x0c00, fm_failed);
+}
+
+static void test_backoff_per_period(void) {
+    // Chip 5 (0x52 on I2C1) does not answer
+    native_i2c[I2C1].devices = NULL;
+    native_i2c_attach(I2C1, &chip[4].dev);
+    native_i2c_attach(I2C1, &chip[6].dev);
+    fanmaster_set_tach_async();
+    fanmaster_get_tach_async();
+    fanmaster_wait();
+    TEST_ASSERT_EQUAL_HEX32(0x0c00, fm_failed);
+
+    // Sits out 16 whole periods of setpoints and tach read, then both are
+    // tried again
+    int periods = 0;
+    uint32_t transactions;
+    do {
+        transactions = native_i2c[I2C1].transactions;
+        fanmaster_set_tach_async();
+        fanmaster_get_tach_async();
+        fanmaster_wait();
+        periods++;
+    } while ((native_i2c[I2C1].transactions == transactions + 4) &&
+            (periods < 40));
+    TEST_ASSERT_EQUAL(17, periods);
+    TEST_ASSERT_EQUAL(transactions + 6, native_i2c[I2C1].transactions);
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_start_configures_chips);
+    RUN_TEST(test_set_tach);
+    RUN_TEST(test_get_tach);
+    RUN_TEST(test_single_register_paths);
+    RUN_TEST(test_buses_run_concurrently);
+    RUN_TEST(test_async_update);
+    RUN_TEST(test_overlapped_update);
+    RUN_TEST(test_missing_chip);
+    RUN_TEST(test_recovery_steps);
+    RUN_TEST(test_backoff_per_period);
+    RUN_TEST(test_hung_chip);
+    return UNITY_END();
+}
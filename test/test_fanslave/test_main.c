@@ -0,0 +1,287 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Emulated fan controller chips as seen from the SMC
+ */
+#include <unity.h>
+#include "gd32vf103.h"
+#include "native.h"
+#include "fanslave.h"
+#include "fanmaster.h"
+#include "fanctl.h"
+#include "lcd.h"
+#include "sched.h"
+
+static native_smbus smc[2];
+
+void setUp(void) {
+    native_reset();
+    fanslave_init();
+    native_smbus_init(&smc[0], GPIOB, GPIO_PIN_12, GPIO_PIN_13);
+    native_smbus_init(&smc[1], GPIOB, GPIO_PIN_14, GPIO_PIN_15);
+}
+
+void tearDown(void) {
+}
+
+static void test_setpoint_block_write(void) {
+    const uint8_t lo[] = {0xaa, 0x02, 0x34, 0x12};
+    const uint8_t hi[] = {0xac, 0x02, 0x78, 0x06};
+
+    // 0x53 on bus 0 holds channels 0 and 1
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[0], 0x53, lo, sizeof(lo)));
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[0], 0x53, hi, sizeof(hi)));
+    TEST_ASSERT_EQUAL_HEX32(0x1234, fs_requested_tach[0]);
+    TEST_ASSERT_EQUAL_HEX32(0x0678, fs_requested_tach[1]);
+
+    // 0x52 on bus 1 holds channels 10 and 11
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[1], 0x52, lo, sizeof(lo)));
+    TEST_ASSERT_EQUAL_HEX32(0x1234, fs_requested_tach[10]);
+}
+
+// Every chip passes its changes on, not only the last one written
+static void test_update_per_channel(void) {
+    const uint8_t lo[] = {0xaa, 0x02, 0x34, 0x12};
+    const uint8_t hi[] = {0xac, 0x02, 0xcc, 0x0c};
+    FS_REQUEST request;
+
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[0], 0x52, lo, sizeof(lo)));
+    TEST_ASSERT_EQUAL(1, rpm_update_req);
+    TEST_ASSERT_EQUAL_HEX32(1u << 2, fanslave_take_dirty());
+    TEST_ASSERT_EQUAL_HEX32(0, fanslave_take_dirty());
+
+    // Changes pile up until taken, the same value again is no change
+    rpm_update_req = 0;
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[1], 0x51, hi, sizeof(hi)));
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[0], 0x53, hi, sizeof(hi)));
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[0], 0x52, lo, sizeof(lo)));
+    TEST_ASSERT_EQUAL(1, rpm_update_req);
+    TEST_ASSERT_EQUAL_HEX32((1u << 13) | (1u << 1), fanslave_take_dirty());
+
+    fanslave_get_request(&request);
+    TEST_ASSERT_EQUAL_HEX32(0x0ccc, request.tach[13]);
+    TEST_ASSERT_EQUAL_UINT32(1, request.gen[13]);
+    TEST_ASSERT_EQUAL_UINT32(1, request.gen[2]);
+    TEST_ASSERT_EQUAL_UINT32(0, request.gen[0]);
+
+    rpm_update_req = 0;
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[1], 0x51, hi, sizeof(hi)));
+    TEST_ASSERT_EQUAL(0, rpm_update_req);
+    TEST_ASSERT_EQUAL_HEX32(0, fanslave_take_dirty());
+}
+
+static void test_start_and_enable(void) {
+    const uint8_t start[] = {0x3c, 0x33};
+    const uint8_t enable[] = {0x07, 0x40};
+
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[0], 0x50, enable, sizeof(enable)));
+    TEST_ASSERT_TRUE(fs_enabled[6]);
+    TEST_ASSERT_FALSE(fs_enabled[7]);
+    TEST_ASSERT_EQUAL(0, start_req);
+
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[1], 0x51, start, sizeof(start)));
+    TEST_ASSERT_EQUAL(1, start_req);
+}
+
+static void test_tach_block_read(void) {
+    const uint8_t count[] = {0x00, 0x02};
+    uint32_t tach[FS_CHANNELS] = {0};
+    uint8_t buf[3];
+
+    tach[8] = 0x0abc;
+    tach[9] = 0x0def;
+    fanslave_set_actual(tach);
+
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[1], 0x53, count, sizeof(count)));
+    TEST_ASSERT_TRUE(native_smbus_read(&smc[1], 0x53, 0xca, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_HEX8(0x02, buf[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xbc, buf[1]);
+    TEST_ASSERT_EQUAL_HEX8(0x0a, buf[2]);
+
+    TEST_ASSERT_TRUE(native_smbus_read(&smc[1], 0x53, 0xcc, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_HEX8(0xef, buf[1]);
+    TEST_ASSERT_EQUAL_HEX8(0x0d, buf[2]);
+}
+
+static void test_pca9536_read(void) {
+    uint8_t buf;
+
+    TEST_ASSERT_TRUE(native_smbus_read(&smc[0], 0x41, 0x00, &buf, 1));
+    TEST_ASSERT_EQUAL_HEX8(0xfd, buf);
+}
+
+// New readings published halfway through a block read show up in the next
+static void test_tach_read_consistent(void) {
+    const uint8_t count[] = {0x00, 0x02};
+    uint32_t tach[FS_CHANNELS] = {0};
+    uint8_t buf[3];
+
+    tach[0] = 0x0111;
+    tach[1] = 0x0222;
+    fanslave_set_actual(tach);
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[0], 0x53, count, sizeof(count)));
+
+    native_smbus_start(&smc[0]);
+    TEST_ASSERT_TRUE(native_smbus_write_byte(&smc[0], 0x53 << 1));
+    TEST_ASSERT_TRUE(native_smbus_write_byte(&smc[0], 0xca));
+    native_smbus_start(&smc[0]);
+    TEST_ASSERT_TRUE(native_smbus_write_byte(&smc[0], (0x53 << 1) | 1));
+    TEST_ASSERT_EQUAL_HEX8(0x02, native_smbus_read_byte(&smc[0], TRUE));
+    TEST_ASSERT_EQUAL_HEX8(0x11, native_smbus_read_byte(&smc[0], TRUE));
+    tach[0] = 0x0f00;
+    tach[1] = 0x0e00;
+    fanslave_set_actual(tach);
+    TEST_ASSERT_EQUAL_HEX8(0x01, native_smbus_read_byte(&smc[0], FALSE));
+    native_smbus_stop(&smc[0]);
+
+    TEST_ASSERT_TRUE(native_smbus_read(&smc[0], 0x53, 0xcc, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_HEX8(0x00, buf[1]);
+    TEST_ASSERT_EQUAL_HEX8(0x0e, buf[2]);
+}
+
+static void test_request_snapshot(void) {
+    const uint8_t hi[] = {0xac, 0x02, 0x56, 0x04};
+    const uint8_t enable[] = {0x07, 0xc0};
+    FS_REQUEST request;
+
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[1], 0x52, hi, sizeof(hi)));
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[1], 0x52, enable, sizeof(enable)));
+    fanslave_get_request(&request);
+    TEST_ASSERT_EQUAL_HEX32(0x0456, request.tach[11]);
+    TEST_ASSERT_TRUE(request.enabled[10]);
+    TEST_ASSERT_TRUE(request.enabled[11]);
+    TEST_ASSERT_FALSE(request.enabled[0]);
+}
+
+// Registers read back what was written, block reads go as far as the
+// read count says
+static void test_register_map(void) {
+    const uint8_t count[] = {0x00, 0x08};
+    const uint8_t regs[] = {0xc8, 0x04, 0x11, 0x22, 0x33, 0x44};
+    const uint8_t mode[] = {0x01, 0x01};
+    uint32_t tach[FS_CHANNELS] = {0};
+    uint8_t buf[9];
+
+    tach[0] = 0x0abc;
+    tach[1] = 0x0def;
+    fanslave_set_actual(tach);
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[0], 0x53, count, sizeof(count)));
+    // The tach readback does not take writes
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[0], 0x53, regs, sizeof(regs)));
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[0], 0x53, mode, sizeof(mode)));
+
+    TEST_ASSERT_TRUE(native_smbus_read(&smc[0], 0x53, 0xc8, buf, sizeof(buf)));
+    const uint8_t expect[] = {
+        0x08, 0x11, 0x22, 0xbc, 0x0a, 0xef, 0x0d, 0x00, 0x00
+    };
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expect, buf, sizeof(buf));
+
+    TEST_ASSERT_TRUE(native_smbus_read(&smc[0], 0x53, 0x01, buf, 1));
+    TEST_ASSERT_EQUAL_HEX8(0x01, buf[0]);
+    // Other chips keep their own map
+    TEST_ASSERT_TRUE(native_smbus_read(&smc[0], 0x52, 0x01, buf, 1));
+    TEST_ASSERT_EQUAL_HEX8(0x00, buf[0]);
+}
+
+// 0x50 is the fourth chip on bus 0 but nobody on bus 1
+static void test_no_chip(void) {
+    const uint8_t lo[] = {0xaa, 0x02, 0x34, 0x12};
+
+    native_smbus_write(&smc[1], 0x50, lo, sizeof(lo));
+    TEST_ASSERT_EQUAL_HEX32(0, fanslave_take_dirty());
+    TEST_ASSERT_EQUAL(0, start_req);
+    TEST_ASSERT_EQUAL(0, rpm_update_req);
+}
+
+// The DMA receiver samples at 1 MHz, standard mode only
+#ifndef SI2C_DMA
+// The state machines keep no time of their own: with handlers that take no
+// simulated time they follow any bit time, here a quarter of the usual.
+// Says nothing about the board, where the slave is standard mode only; see
+// the budget in fanslave.c.
+static void test_short_bit_time(void) {
+    const uint8_t lo[] = {0xaa, 0x02, 0x34, 0x12};
+    uint32_t tach[FS_CHANNELS] = {0};
+    uint8_t buf[1];
+
+    tach[0] = 0x0abc;
+    fanslave_set_actual(tach);
+    native_smbus_speed(&smc[0], 400000);
+    uint64_t start = native_sim_ns;
+    TEST_ASSERT_TRUE(native_smbus_write(&smc[0], 0x53, lo, sizeof(lo)));
+    TEST_ASSERT_TRUE(native_smbus_read(&smc[0], 0x53, 0x4a, buf, 1));
+    // 2 x 5 bytes of 9 bits at 2.5 us, plus START, STOP and the repeat
+    TEST_ASSERT_TRUE(native_sim_ns - start < 2 * 5 * 9 * 2500 + 20000);
+
+    TEST_ASSERT_EQUAL_HEX32(0x1234, fs_requested_tach[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xbc, buf[0]);
+    TEST_ASSERT_EQUAL(0, smc[0].late);
+    TEST_ASSERT_EQUAL(0, native_stats.stuck);
+}
+#endif
+
+// START on both buses in the same instant, one interrupt entry for both
+static void test_start_both_buses(void) {
+    const uint8_t setpoint[] = {0xaa, 0x02, 0x21, 0x03};
+    const uint32_t scl = GPIO_PIN_12 | GPIO_PIN_14;
+    const uint32_t sda = GPIO_PIN_13 | GPIO_PIN_15;
+
+    native_stats_reset();
+    native_gpio_drive(GPIOB, sda, 0);
+    native_advance(NATIVE_SMBUS_EDGE_NS);
+    native_gpio_drive(GPIOB, scl, 0);
+    native_advance(NATIVE_SMBUS_EDGE_NS);
+#ifndef SI2C_DMA
+    TEST_ASSERT_EQUAL(1, native_stats.irq_count);
+#endif
+
+    for (int bus = 0; bus < 2; bus++) {
+        TEST_ASSERT_TRUE(native_smbus_write_byte(&smc[bus], 0x53 << 1));
+        for (size_t i = 0; i < sizeof(setpoint); i++)
+            TEST_ASSERT_TRUE(native_smbus_write_byte(&smc[bus], setpoint[i]));
+    }
+    native_smbus_stop(&smc[0]);
+    native_smbus_stop(&smc[1]);
+    TEST_ASSERT_EQUAL_HEX32(0x0321, fs_requested_tach[0]);
+    TEST_ASSERT_EQUAL_HEX32(0x0321, fs_requested_tach[8]);
+}
+
+// Nothing else the firmware enables is on the level of the slave
+static void test_slave_alone_on_top(void) {
+    int slave = native_irq_level(EXTI10_15_IRQn);
+
+    lcd_init();
+    fanmaster_init();
+    fanctl_init();
+    sched_init();
+    TEST_ASSERT_TRUE(slave > 0);
+    for (int i = 0; i < ECLIC_NUM_INTERRUPTS; i++) {
+        if ((i == EXTI10_15_IRQn) || (i == DMA1_Channel2_IRQn))
+            continue;
+        TEST_ASSERT_TRUE(native_irq_level(i) < slave);
+    }
+#ifdef SI2C_DMA
+    TEST_ASSERT_EQUAL(slave, native_irq_level(DMA1_Channel2_IRQn));
+#endif
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_setpoint_block_write);
+    RUN_TEST(test_update_per_channel);
+    RUN_TEST(test_start_and_enable);
+    RUN_TEST(test_tach_block_read);
+    RUN_TEST(test_pca9536_read);
+    RUN_TEST(test_tach_read_consistent);
+    RUN_TEST(test_request_snapshot);
+    RUN_TEST(test_register_map);
+    RUN_TEST(test_no_chip);
+#ifndef SI2C_DMA
+    RUN_TEST(test_short_bit_time);
+#endif
+    RUN_TEST(test_start_both_buses);
+    RUN_TEST(test_slave_alone_on_top);
+    return UNITY_END();
+}
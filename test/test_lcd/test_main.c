@@ -0,0 +1,189 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * LCD driver against the ST7735 model on SPI0
+ */
+#include <string.h>
+#include <unity.h>
+#include "gd32vf103.h"
+#include "native.h"
+#include "lcd.h"
+#include "ui.h"
+#include "font.h"
+
+static native_lcd lcd;
+
+// Full frame at 27 MHz SCK
+#define BYTE_NS (8 * 4 * 1000 / 108)
+#define FRAME_NS ((uint64_t)LCD_WIDTH * LCD_HEIGHT * 2 * BYTE_NS)
+
+void setUp(void) {
+    native_reset();
+    native_lcd_init(&lcd);
+    lcd_init();
+}
+
+void tearDown(void) {
+}
+
+static void assert_panel_matches(void) {
+    for (int y = 0; y < LCD_HEIGHT; y++) {
+        for (int x = 0; x < LCD_WIDTH; x++) {
+            uint16_t expected = lcd_get_palette(lcd_get_pixel(x, y));
+            TEST_ASSERT_EQUAL_HEX16(expected,
+                    lcd.ram[y + LCD_OFFSET_Y][x + LCD_OFFSET_X]);
+        }
+    }
+}
+
+static void test_update_returns_at_once(void) {
+    ui_init();
+
+    uint64_t start = native_sim_ns;
+    lcd_update();
+    TEST_ASSERT_EQUAL(start, native_sim_ns);
+    TEST_ASSERT_TRUE(lcd_busy());
+
+    lcd_wait();
+    TEST_ASSERT_FALSE(lcd_busy());
+    TEST_ASSERT_UINT32_WITHIN(BYTE_NS, FRAME_NS, native_sim_ns - start);
+    TEST_ASSERT_EQUAL(LCD_WIDTH * LCD_HEIGHT, lcd.pixels);
+    assert_panel_matches();
+}
+
+static void test_frames_stay_aligned(void) {
+    ui_init();
+    lcd_update();
+    ui_disp_num(0, 13, 1234);
+    lcd_update();
+    ui_disp_num(0, 23, 5678);
+    lcd_update();
+    lcd_wait();
+
+    // Only the digits follow the first frame
+    TEST_ASSERT_TRUE(lcd.pixels > LCD_WIDTH * LCD_HEIGHT);
+    TEST_ASSERT_TRUE(lcd.pixels <= LCD_WIDTH * LCD_HEIGHT + 2 * 23 * 7);
+    assert_panel_matches();
+}
+
+static void test_partial_update(void) {
+    ui_init();
+    lcd_update();
+    lcd_wait();
+    uint32_t pixels = lcd.pixels;
+    uint32_t ramwr = lcd.ramwr;
+
+    // Far apart, never one window for both. Narrow digits like the 1 leave
+    // more than one blank column to the next and get a window of their own.
+    ui_disp_num(0, 13, 1234);
+    ui_disp_num(50, 100, 5678);
+    uint64_t start = native_sim_ns;
+    lcd_update();
+    lcd_wait();
+
+    TEST_ASSERT_TRUE(lcd.ramwr - ramwr >= 2);
+    TEST_ASSERT_TRUE(lcd.ramwr - ramwr <= 8);
+    TEST_ASSERT_TRUE(lcd.pixels - pixels <= 2 * 23 * 7);
+    TEST_ASSERT_TRUE(native_sim_ns - start < FRAME_NS / 20);
+    assert_panel_matches();
+}
+
+static void test_adjacent_merged(void) {
+    ui_init();
+    lcd_update();
+    lcd_wait();
+    uint32_t ramwr = lcd.ramwr;
+
+    // Every character is its own box, the digits end up in one window
+    ui_disp_hex(0, 13, 0x8888);
+    lcd_update();
+    lcd_wait();
+
+    TEST_ASSERT_EQUAL(ramwr + 1, lcd.ramwr);
+    assert_panel_matches();
+}
+
+static void test_unchanged_sends_nothing(void) {
+    ui_init();
+    ui_disp_num(0, 13, 1234);
+    lcd_update();
+    lcd_wait();
+    uint32_t bytes = native_spi[SPI0].bytes;
+
+    ui_disp_num(0, 13, 1234);
+    lcd_update();
+    TEST_ASSERT_FALSE(lcd_busy());
+    TEST_ASSERT_EQUAL(bytes, native_spi[SPI0].bytes);
+}
+
+static void test_glyphs_match_font(void) {
+    // Cached and uncached characters, over both colours
+    const char *str = "0123456789ABCDEF Kxyz";
+    ui_init();
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; str[i]; i++) {
+            size_t x = (i % 12) * 6;
+            size_t y = 20 + (i / 12) * 10 + pass;
+            ui_disp_char(x, y, str[i]);
+            for (int yy = 0; yy < 7; yy++) {
+                for (int xx = 0; xx < 5; xx++) {
+                    bool on = (font[(str[i] - 0x20) * 5 + xx] >> yy) & 0x01;
+                    TEST_ASSERT_EQUAL(on ? 1 : 0,
+                            lcd_get_pixel(x + xx, y + yy));
+                }
+            }
+        }
+    }
+}
+
+// Same pixels as printing the digits
+static void assert_num(uint32_t num, const char *str) {
+    uint8_t expected[LCD_STRIDE * 7];
+
+    ui_disp_string(0, 20, (char *)str);
+    memcpy(expected, &framebuffer[20 * LCD_STRIDE], sizeof(expected));
+    ui_disp_string(0, 20, "    ");
+    ui_disp_num(0, 20, num);
+    TEST_ASSERT_EQUAL_MEMORY(expected, &framebuffer[20 * LCD_STRIDE],
+            sizeof(expected));
+}
+
+static void test_num_format(void) {
+    ui_init();
+    assert_num(0, "0000");
+    assert_num(7, "0007");
+    assert_num(2400, "2400");
+    assert_num(9999, "9999");
+    assert_num(10000, "10 K");
+    assert_num(45678, "45 K");
+    assert_num(99999, "99 K");
+    assert_num(4915200, "99 K");
+}
+
+static void test_ready_governed(void) {
+    ui_init();
+    lcd_update();
+    TEST_ASSERT_FALSE(lcd_ready());
+    lcd_wait();
+    TEST_ASSERT_FALSE(lcd_ready());
+
+    native_advance(LCD_FRAME_MS * 1000000ull - FRAME_NS - 1000);
+    TEST_ASSERT_FALSE(lcd_ready());
+    native_advance(2000);
+    TEST_ASSERT_TRUE(lcd_ready());
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_update_returns_at_once);
+    RUN_TEST(test_frames_stay_aligned);
+    RUN_TEST(test_partial_update);
+    RUN_TEST(test_adjacent_merged);
+    RUN_TEST(test_unchanged_sends_nothing);
+    RUN_TEST(test_glyphs_match_font);
+    RUN_TEST(test_num_format);
+    RUN_TEST(test_ready_governed);
+    return UNITY_END();
+}
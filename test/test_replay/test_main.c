@@ -0,0 +1,197 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Capture replay. Traces are recorded from the bit-banged master running
+ * against the live slave, then replayed into a freshly booted one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+#include "gd32vf103.h"
+#include "native.h"
+#include "replay.h"
+#include "fanslave.h"
+
+static native_smbus smc;
+static replay r;
+static char *trace;
+static size_t trace_len;
+
+static void boot(void) {
+    native_reset();
+    fanslave_init();
+    memset(fs_enabled, 0, sizeof(fs_enabled));
+    memset(fs_requested_tach, 0, sizeof(fs_requested_tach));
+    start_req = 0;
+    rpm_update_req = 0;
+}
+
+static void record_begin(void) {
+    FILE *fp = open_memstream(&trace, &trace_len);
+    native_smbus_init(&smc, GPIOB, GPIO_PIN_12, GPIO_PIN_13);
+    native_smbus_record(&smc, fp, "SCL0", "SDA0");
+}
+
+static void record_end(void) {
+    fclose(smc.vcd);
+    smc.vcd = NULL;
+}
+
+static void smc_traffic(void) {
+    const uint8_t enable[] = {0x07, 0xc0};
+    const uint8_t lo[] = {0xaa, 0x02, 0x34, 0x12};
+    const uint8_t hi[] = {0xac, 0x02, 0x78, 0x06};
+    const uint8_t count[] = {0x00, 0x02};
+    uint8_t buf[3];
+
+    native_smbus_write(&smc, 0x53, enable, sizeof(enable));
+    native_smbus_write(&smc, 0x53, lo, sizeof(lo));
+    native_smbus_write(&smc, 0x52, hi, sizeof(hi));
+    native_smbus_write(&smc, 0x53, count, sizeof(count));
+    native_smbus_read(&smc, 0x53, 0xca, buf, sizeof(buf));
+}
+
+static void replay_setup(void) {
+    memset(&r, 0, sizeof(r));
+    r.buses = 1;
+    r.bus[0].scl_name = "SCL0";
+    r.bus[0].sda_name = "SDA0";
+    r.bus[0].gpio = GPIOB;
+    r.bus[0].scl_pin = GPIO_PIN_12;
+    r.bus[0].sda_pin = GPIO_PIN_13;
+}
+
+// Feed in odd sized pieces so lines get split across calls
+static void replay_buffer(const char *data, size_t len) {
+    replay_begin(&r);
+    for (size_t i = 0; i < len; i += 7)
+        replay_feed(&r, data + i, (len - i < 7) ? len - i : 7);
+    replay_end(&r);
+}
+
+void setUp(void) {
+    boot();
+    replay_setup();
+    trace = NULL;
+}
+
+void tearDown(void) {
+    free(trace);
+}
+
+static void test_vcd_round_trip(void) {
+    record_begin();
+    smc_traffic();
+    record_end();
+
+    TEST_ASSERT_EQUAL_HEX32(0x1234, fs_requested_tach[0]);
+    TEST_ASSERT_EQUAL_HEX32(0x0678, fs_requested_tach[3]);
+    uint64_t duration = smc.vcd_ns;
+
+    boot();
+    replay_buffer(trace, trace_len);
+
+    TEST_ASSERT_EQUAL(REPLAY_VCD, r.format);
+    TEST_ASSERT_TRUE(fs_enabled[0]);
+    TEST_ASSERT_TRUE(fs_enabled[1]);
+    TEST_ASSERT_EQUAL_HEX32(0x1234, fs_requested_tach[0]);
+    TEST_ASSERT_EQUAL_HEX32(0x0678, fs_requested_tach[3]);
+    // 5 transactions, the read has a repeated start
+    TEST_ASSERT_EQUAL(6, r.bus[0].starts);
+    TEST_ASSERT_EQUAL(5, r.bus[0].stops);
+    TEST_ASSERT_EQUAL(0, r.bus[0].conflicts);
+    TEST_ASSERT_GREATER_THAN(0, native_stats.irq_count);
+    TEST_ASSERT_UINT32_WITHIN(1000, duration, (uint32_t)(r.time * 1e9));
+}
+
+// Turn the recorded VCD into a Saleae style CSV
+static char *vcd_to_csv(const char *vcd, size_t *len) {
+    char *csv;
+    FILE *fp = open_memstream(&csv, len);
+    const char *line = strstr(vcd, "$enddefinitions");
+    int scl = 1, sda = 1;
+    unsigned long long t = 0;
+
+    fprintf(fp, "Time [s], SDA0, SCL0\r\n");
+    while ((line = strchr(line, '\n')) != NULL) {
+        line++;
+        if (line[0] == '#') {
+            fprintf(fp, "%.9f, %d, %d\r\n", t * 1e-9, sda, scl);
+            t = strtoull(line + 1, NULL, 10);
+        }
+        else if (line[1] == '!') {
+            scl = line[0] == '1';
+        }
+        else if (line[1] == '"') {
+            sda = line[0] == '1';
+        }
+    }
+    fprintf(fp, "%.9f, %d, %d\r\n", t * 1e-9, sda, scl);
+    fclose(fp);
+    return csv;
+}
+
+static void test_csv(void) {
+    size_t csv_len;
+
+    record_begin();
+    smc_traffic();
+    record_end();
+    char *csv = vcd_to_csv(trace, &csv_len);
+
+    boot();
+    replay_buffer(csv, csv_len);
+    free(csv);
+
+    TEST_ASSERT_EQUAL(REPLAY_CSV, r.format);
+    TEST_ASSERT_EQUAL_HEX32(0x1234, fs_requested_tach[0]);
+    TEST_ASSERT_EQUAL_HEX32(0x0678, fs_requested_tach[3]);
+    TEST_ASSERT_EQUAL(5, r.bus[0].stops);
+    TEST_ASSERT_EQUAL(0, r.bus[0].conflicts);
+}
+
+static void test_conflict_with_silent_chip(void) {
+    const uint8_t lo[] = {0xaa, 0x02, 0x34, 0x12};
+
+    // Nobody answers while recording
+    eclic_irq_disable(EXTI10_15_IRQn);
+    record_begin();
+    native_smbus_write(&smc, 0x53, lo, sizeof(lo));
+    record_end();
+
+    boot();
+    replay_buffer(trace, trace_len);
+
+    // The address is ACKed by the emulation, the master gives up after that
+    TEST_ASSERT_EQUAL(1, r.bus[0].conflicts);
+    TEST_ASSERT_EQUAL(1, r.bus[0].stops);
+}
+
+static void test_unmapped_signals_ignored(void) {
+    const char vcd[] =
+            "$timescale 10 us $end\n"
+            "$var wire 1 # CLK $end\n"
+            "$var wire 1 ! SCL0 $end\n"
+            "$enddefinitions $end\n"
+            "#0 1# 1!\n"
+            "#1 0# 0!\n"
+            "#2 1#\n";
+
+    replay_buffer(vcd, strlen(vcd));
+
+    TEST_ASSERT_EQUAL(1, r.edges);
+    TEST_ASSERT_EQUAL(1, r.steps);
+    TEST_ASSERT_UINT32_WITHIN(1, 20, (uint32_t)(r.time * 1e6));
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_vcd_round_trip);
+    RUN_TEST(test_csv);
+    RUN_TEST(test_conflict_with_silent_chip);
+    RUN_TEST(test_unmapped_signals_ignored);
+    return UNITY_END();
+}
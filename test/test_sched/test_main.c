@@ -0,0 +1,154 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Scheduler: software timers on the machine timer, flags from interrupt
+ * handlers, priority and idle accounting
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <unity.h>
+#include "gd32vf103.h"
+#include "gd32vf103_timer.h"
+#include "native.h"
+#include "sched.h"
+
+// Hardware timer standing in for an interrupt driven event source, 1 kHz
+#define EVENT_TIMER (TIMER1)
+
+static volatile uint32_t event_req;
+static uint64_t event_ns;
+static uint64_t latency_max;
+static uint32_t fast_runs;
+static uint32_t slow_runs;
+static uint32_t order[4];
+static uint32_t order_len;
+static uint32_t busy_ms;
+static int fast_task;
+static int slow_task;
+
+static void report(const char *fmt, ...) {
+    char buf[160];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    TEST_MESSAGE(buf);
+}
+
+void TIMER1_IRQHandler(void) {
+    timer_interrupt_flag_clear(EVENT_TIMER, TIMER_INT_FLAG_UP);
+    event_ns = native_sim_ns;
+    event_req = 1;
+}
+
+static void event_run(void) {
+    uint64_t latency = native_sim_ns - event_ns;
+    if (latency > latency_max)
+        latency_max = latency;
+}
+
+static void fast_run(void) {
+    fast_runs++;
+    order[order_len++ & 3] = 0;
+}
+
+static void slow_run(void) {
+    slow_runs++;
+    order[order_len++ & 3] = 1;
+    native_advance((uint64_t)busy_ms * 1000000);
+}
+
+// Up to and including whatever is due at the end
+static void run(uint32_t ms) {
+    uint64_t end = native_sim_ns + (uint64_t)ms * 1000000;
+    while (native_sim_ns <= end)
+        sched_step();
+}
+
+void setUp(void) {
+    native_reset();
+    event_req = 0;
+    latency_max = 0;
+    fast_runs = slow_runs = 0;
+    order_len = 0;
+    busy_ms = 0;
+    sched_init();
+    fast_task = sched_add(fast_run, NULL);
+    slow_task = sched_add(slow_run, NULL);
+}
+
+void tearDown(void) {
+}
+
+static void test_timers(void) {
+    sched_every(fast_task, 10);
+    sched_every(slow_task, 25);
+    run(1000);
+
+    TEST_ASSERT_EQUAL_UINT32(100, fast_runs);
+    TEST_ASSERT_EQUAL_UINT32(40, slow_runs);
+    // Woken by the timers only
+    TEST_ASSERT_TRUE(sched_stats.wakeups <= 140);
+    TEST_ASSERT_TRUE(sched_idle_permille() > 990);
+
+    uint32_t fast = fast_runs;
+    sched_every(slow_task, 0);
+    run(100);
+    TEST_ASSERT_UINT32_WITHIN(1, fast + 10, fast_runs);
+    TEST_ASSERT_EQUAL_UINT32(40, slow_runs);
+}
+
+static void test_priority(void) {
+    sched_post(slow_task);
+    sched_post(fast_task);
+    sched_step();
+    sched_step();
+    TEST_ASSERT_EQUAL_UINT32(2, order_len);
+    TEST_ASSERT_EQUAL_UINT32(0, order[0]);
+    TEST_ASSERT_EQUAL_UINT32(1, order[1]);
+}
+
+static void test_interrupt_flag(void) {
+    timer_parameter_struct timer_init_struct;
+
+    sched_add(event_run, &event_req);
+    timer_struct_para_init(&timer_init_struct);
+    timer_init_struct.prescaler = SystemCoreClock / 1000000 - 1;
+    timer_init_struct.period = 999;
+    timer_init(EVENT_TIMER, &timer_init_struct);
+    timer_interrupt_enable(EVENT_TIMER, TIMER_INT_UP);
+    eclic_irq_enable(TIMER1_IRQn, 1, 0);
+    timer_enable(EVENT_TIMER);
+
+    run(500);
+    TEST_ASSERT_EQUAL_UINT32(500, sched_stats.runs[2]);
+    // Straight out of WFI into the task
+    TEST_ASSERT_TRUE(latency_max == 0);
+    TEST_ASSERT_EQUAL(0, native_stats.stuck);
+}
+
+static void test_idle_time(void) {
+    // 3 ms of work every 10 ms, and the timer keeps its period
+    busy_ms = 3;
+    sched_every(slow_task, 10);
+    sched_every(fast_task, 50);
+    run(1000);
+
+    TEST_ASSERT_EQUAL_UINT32(100, slow_runs);
+    TEST_ASSERT_EQUAL_UINT32(20, fast_runs);
+    uint32_t idle = sched_idle_permille();
+    TEST_ASSERT_UINT32_WITHIN(5, 700, idle);
+    report("idle %u.%u%% with 30%% load, %u wakeups", idle / 10, idle % 10,
+            sched_stats.wakeups);
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_timers);
+    RUN_TEST(test_priority);
+    RUN_TEST(test_interrupt_flag);
+    RUN_TEST(test_idle_time);
+    return UNITY_END();
+}
@@ -0,0 +1,343 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Oversampling soft I2C receiver. The decoder is fed synthetic sample
+ * buffers first, then runs on the timer and DMA models against the
+ * bit-banged SMBus master. Uses PA8/PA9 like test_softi2c.
+ */
+#include <unity.h>
+#include "gd32vf103.h"
+#include "native.h"
+#include "si2c_dma.h"
+#include "irq_level.h"
+
+#define TEST_SCL_PIN (GPIO_PIN_8)
+#define TEST_SDA_PIN (GPIO_PIN_9)
+// Some other pin of the port that keeps toggling
+#define TEST_NOISE_PIN (GPIO_PIN_0)
+
+// Samples per SCL half period, 100 kHz at 1 MHz sampling
+#define HALF_BIT (5)
+// Samples between two DMA half transfer interrupts
+#define DMA_CHUNK (SI2C_DMA_SAMPLES / 2)
+
+static SI2C_DMA_CONTEXT si2c;
+static native_smbus smc;
+
+static uint8_t written[16];
+static int written_count;
+static uint8_t read_data[16];
+static int read_index;
+static int read_size;
+static int stop_count;
+
+// Synthetic bus, the master side is driven by the test
+static uint16_t samples[4096];
+static uint32_t sample_count;
+static uint32_t decoded;
+static uint32_t master_scl;
+static uint32_t master_sda;
+static uint32_t falling_calls;
+
+static void test_write_cb(uint32_t bus_id, uint8_t addr, uint8_t byte) {
+    (void)bus_id;
+    (void)addr;
+    written[written_count++] = byte;
+}
+
+static void test_read_cb(uint32_t bus_id, uint8_t addr, uint8_t *byte,
+        bool *last) {
+    (void)bus_id;
+    (void)addr;
+    *byte = read_data[read_index++];
+    *last = (read_index == read_size);
+}
+
+static void test_stop_cb(uint32_t bus_id, uint8_t addr) {
+    (void)bus_id;
+    (void)addr;
+    stop_count++;
+}
+
+void EXTI5_9_IRQHandler(void) {
+    if (exti_interrupt_flag_get(TEST_SCL_PIN)) {
+        exti_interrupt_flag_clear(TEST_SCL_PIN);
+        si2c_dma_scl_irq(&si2c);
+    }
+}
+
+void setUp(void) {
+    native_reset();
+    written_count = 0;
+    read_index = 0;
+    read_size = 0;
+    stop_count = 0;
+
+    si2c.gpio = GPIOA;
+    si2c.scl_pin = TEST_SCL_PIN;
+    si2c.sda_pin = TEST_SDA_PIN;
+    si2c.bus_id = 0;
+    si2c.read_cb = test_read_cb;
+    si2c.write_cb = test_write_cb;
+    si2c.stop_cb = test_stop_cb;
+    si2c_dma_init(&si2c);
+
+    sample_count = 0;
+    decoded = 0;
+    master_scl = 1;
+    master_sda = 1;
+    falling_calls = 0;
+}
+
+void tearDown(void) {
+}
+
+static void sample_flush(void) {
+    si2c_dma_decode(&si2c, &samples[decoded], sample_count - decoded);
+    decoded = sample_count;
+}
+
+// Bus level as the port input register shows it, slave drive included
+static void sample_emit(void) {
+    uint32_t slave = native_gpio_level(GPIOA) & TEST_SDA_PIN;
+    for (int i = 0; i < HALF_BIT; i++) {
+        uint16_t sample = (sample_count & 1) ? TEST_NOISE_PIN : 0;
+        if (master_scl)
+            sample |= TEST_SCL_PIN;
+        if (master_sda && slave)
+            sample |= TEST_SDA_PIN;
+        samples[sample_count++] = sample;
+        if (sample_count - decoded == DMA_CHUNK)
+            sample_flush();
+    }
+}
+
+static void bus_scl(uint32_t high) {
+    if (master_scl && !high && (--si2c.wait == 0)) {
+        // What si2c_dma_scl_irq() does, on the synthetic buffer
+        sample_flush();
+        si2c_dma_falling(&si2c);
+        falling_calls++;
+    }
+    master_scl = high;
+    sample_emit();
+}
+
+static void bus_sda(uint32_t high) {
+    master_sda = high;
+    sample_emit();
+}
+
+static bool bus_sda_level(void) {
+    return (native_gpio_level(GPIOA) & TEST_SDA_PIN) ? TRUE : FALSE;
+}
+
+static void bus_start(void) {
+    bus_sda(1);
+    bus_scl(1);
+    bus_sda(0);
+    bus_scl(0);
+}
+
+static void bus_stop(void) {
+    bus_sda(0);
+    bus_scl(1);
+    bus_sda(1);
+    sample_flush();
+}
+
+static bool bus_write_byte(uint8_t byte) {
+    for (int i = 7; i >= 0; i--) {
+        bus_sda((byte >> i) & 1);
+        bus_scl(1);
+        bus_scl(0);
+    }
+    bus_sda(1);
+    bus_scl(1);
+    bool ack = !bus_sda_level();
+    bus_scl(0);
+    return ack;
+}
+
+static uint8_t bus_read_byte(bool ack) {
+    uint8_t byte = 0;
+    bus_sda(1);
+    for (int i = 0; i < 8; i++) {
+        bus_scl(1);
+        byte = (byte << 1) | (bus_sda_level() ? 1 : 0);
+        bus_scl(0);
+    }
+    bus_sda(!ack);
+    bus_scl(1);
+    bus_scl(0);
+    bus_sda(1);
+    return byte;
+}
+
+static void test_decode_write(void) {
+    bus_start();
+    TEST_ASSERT_TRUE(bus_write_byte(0xa6));
+    TEST_ASSERT_TRUE(bus_write_byte(0x12));
+    TEST_ASSERT_TRUE(bus_write_byte(0x34));
+    bus_stop();
+
+    TEST_ASSERT_EQUAL(2, written_count);
+    TEST_ASSERT_EQUAL_HEX8(0x12, written[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x34, written[1]);
+    TEST_ASSERT_EQUAL(1, stop_count);
+    TEST_ASSERT_EQUAL(SD_IDLE, si2c.state);
+    // START, then an ACK and a release per byte, out of 28 falling edges
+    TEST_ASSERT_EQUAL(7, falling_calls);
+}
+
+static void test_decode_read(void) {
+    read_data[0] = 0x5a;
+    read_data[1] = 0xc3;
+    read_size = 2;
+
+    bus_start();
+    TEST_ASSERT_TRUE(bus_write_byte(0xa7));
+    TEST_ASSERT_EQUAL_HEX8(0x5a, bus_read_byte(TRUE));
+    TEST_ASSERT_EQUAL_HEX8(0xc3, bus_read_byte(FALSE));
+    bus_stop();
+
+    TEST_ASSERT_EQUAL(2, read_index);
+    TEST_ASSERT_EQUAL(1, stop_count);
+    TEST_ASSERT_TRUE(bus_sda_level());
+}
+
+static void test_decode_address_mismatch(void) {
+    bus_start();
+    TEST_ASSERT_FALSE(bus_write_byte(0x20));
+    TEST_ASSERT_FALSE(bus_write_byte(0x00));
+    bus_stop();
+
+    TEST_ASSERT_EQUAL(0, written_count);
+    TEST_ASSERT_EQUAL(0, read_index);
+    TEST_ASSERT_EQUAL(SD_IDLE, si2c.state);
+
+    // Still answers the next transaction
+    bus_start();
+    TEST_ASSERT_TRUE(bus_write_byte(0xa0));
+    TEST_ASSERT_TRUE(bus_write_byte(0x55));
+    bus_stop();
+    TEST_ASSERT_EQUAL(1, written_count);
+    TEST_ASSERT_EQUAL_HEX8(0x55, written[0]);
+}
+
+static void test_decode_repeated_start(void) {
+    read_data[0] = 0x81;
+    read_size = 1;
+
+    // Register pointer write, then read without a STOP in between
+    bus_start();
+    TEST_ASSERT_TRUE(bus_write_byte(0xa4));
+    TEST_ASSERT_TRUE(bus_write_byte(0x4a));
+    bus_start();
+    TEST_ASSERT_TRUE(bus_write_byte(0xa5));
+    TEST_ASSERT_EQUAL_HEX8(0x81, bus_read_byte(FALSE));
+    bus_stop();
+
+    TEST_ASSERT_EQUAL(1, written_count);
+    TEST_ASSERT_EQUAL_HEX8(0x4a, written[0]);
+    TEST_ASSERT_EQUAL(1, read_index);
+    TEST_ASSERT_EQUAL(1, stop_count);
+}
+
+static void test_dma_bus(void) {
+    const uint8_t buf[] = {0x2a, 0x34, 0x12};
+    uint8_t in[2];
+
+    eclic_global_interrupt_enable();
+    eclic_irq_enable(EXTI5_9_IRQn, 1, 1);
+    gpio_exti_source_select(GPIO_PORT_SOURCE_GPIOA, GPIO_PIN_SOURCE_8);
+    gpio_exti_source_select(GPIO_PORT_SOURCE_GPIOA, GPIO_PIN_SOURCE_9);
+    si2c_dma_start(GPIOA);
+    native_smbus_init(&smc, GPIOA, TEST_SCL_PIN, TEST_SDA_PIN);
+
+    TEST_ASSERT_TRUE(native_smbus_write(&smc, 0x53, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(3, written_count);
+    TEST_ASSERT_EQUAL_HEX8(0x12, written[2]);
+
+    read_data[0] = 0xbe;
+    read_data[1] = 0xef;
+    read_size = 2;
+    TEST_ASSERT_TRUE(native_smbus_read(&smc, 0x53, 0x4a, in, sizeof(in)));
+    TEST_ASSERT_EQUAL_HEX8(0xbe, in[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xef, in[1]);
+
+    // STOPs only show up once the samples get decoded
+    native_advance(SI2C_DMA_SAMPLES * 1000);
+    TEST_ASSERT_EQUAL(2, stop_count);
+    TEST_ASSERT_EQUAL(0, native_stats.stuck);
+}
+
+// Master side driven by hand against the sampling, for edges placed on a
+// particular sample
+static void wire_at(uint64_t us, uint32_t scl, uint32_t sda) {
+    native_advance(us * 1000 - native_sim_ns);
+    native_gpio_drive(GPIOA, TEST_SCL_PIN | TEST_SDA_PIN,
+            (scl ? TEST_SCL_PIN : 0) | (sda ? TEST_SDA_PIN : 0));
+}
+
+static void test_dma_start_at_boundary(void) {
+    uint64_t us = DMA_CHUNK - 2 * HALF_BIT;
+    uint8_t addr = 0xa7;
+
+    read_data[0] = 0xff;
+    read_size = 1;
+    eclic_global_interrupt_enable();
+    eclic_irq_enable(EXTI5_9_IRQn, IRQ_LEVEL_SLAVE, 1);
+    gpio_exti_source_select(GPIO_PORT_SOURCE_GPIOA, GPIO_PIN_SOURCE_8);
+    gpio_exti_source_select(GPIO_PORT_SOURCE_GPIOA, GPIO_PIN_SOURCE_9);
+    si2c_dma_start(GPIOA);
+
+    // START, its first SCL fall one sample ahead of the half transfer
+    // interrupt. The EXTI is held off as if that one came in first.
+    wire_at(us, 1, 0);
+    eclic_irq_disable(EXTI5_9_IRQn);
+    wire_at(DMA_CHUNK - 1, 0, 0);
+    wire_at(DMA_CHUNK + 1, 0, 0);
+    TEST_ASSERT_EQUAL(SD_ADDR, si2c.state);
+    eclic_irq_enable(EXTI5_9_IRQn, IRQ_LEVEL_SLAVE, 1);
+    native_exti_run();
+    // Eight more falling edges to the ACK, the early one not counted twice
+    TEST_ASSERT_EQUAL(8, si2c.wait);
+
+    us = DMA_CHUNK + HALF_BIT;
+    for (int i = 7; i >= 0; i--) {
+        uint32_t bit = (addr >> i) & 1;
+        wire_at(us, 0, bit);
+        wire_at(us + HALF_BIT, 1, bit);
+        // Nothing pulls SDA low under the R/W bit
+        TEST_ASSERT_EQUAL(bit, bus_sda_level());
+        wire_at(us + 2 * HALF_BIT, 0, bit);
+        us += 3 * HALF_BIT;
+    }
+    wire_at(us, 0, 1);
+    wire_at(us + HALF_BIT, 1, 1);
+    TEST_ASSERT_FALSE(bus_sda_level());
+    wire_at(us + 2 * HALF_BIT, 0, 1);
+    us += 3 * HALF_BIT;
+
+    wire_at(us, 0, 0);
+    wire_at(us + HALF_BIT, 1, 0);
+    wire_at(us + 2 * HALF_BIT, 1, 1);
+    native_advance(SI2C_DMA_SAMPLES * 1000);
+    TEST_ASSERT_EQUAL(1, read_index);
+    TEST_ASSERT_EQUAL(1, stop_count);
+    TEST_ASSERT_EQUAL(0, native_stats.stuck);
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_decode_write);
+    RUN_TEST(test_decode_read);
+    RUN_TEST(test_decode_address_mismatch);
+    RUN_TEST(test_decode_repeated_start);
+    RUN_TEST(test_dma_bus);
+    RUN_TEST(test_dma_start_at_boundary);
+    return UNITY_END();
+}
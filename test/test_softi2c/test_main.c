@@ -0,0 +1,298 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Soft I2C slave against the bit-banged SMBus master. Uses PA8/PA9 so the
+ * test owns the EXTI5_9 vector and the fanslave buses stay out of the way,
+ * and EXTI3 for the write-behind flush, next to the one fanslave takes.
+ */
+#include <unity.h>
+#include "gd32vf103.h"
+#include "native.h"
+#include "softi2c.h"
+#include "irq_level.h"
+
+#define TEST_SCL_PIN (GPIO_PIN_8)
+#define TEST_SDA_PIN (GPIO_PIN_9)
+#define TEST_FLUSH_LINE (EXTI_3)
+
+static SI2C_CONTEXT si2c;
+static native_smbus smc;
+
+static uint8_t written[64];
+static int written_count;
+static uint8_t read_data[16];
+static int read_index;
+static int read_size;
+static int stop_count;
+static uint8_t stop_addr;
+static uint64_t cb_ns; // Simulated time each read / write callback takes
+static bool flushing;
+static int flushed_count; // Written bytes passed on by the flush handler
+static int written_at_read; // Written bytes in when the first read came
+
+static void test_write_cb(uint32_t bus_id, uint8_t addr, uint8_t byte) {
+    (void)bus_id;
+    (void)addr;
+    native_advance(cb_ns);
+    written[written_count++] = byte;
+    if (flushing)
+        flushed_count++;
+}
+
+static void test_read_cb(uint32_t bus_id, uint8_t addr, uint8_t *byte,
+        bool *last) {
+    (void)bus_id;
+    (void)addr;
+    native_advance(cb_ns);
+    if (read_index == 0)
+        written_at_read = written_count;
+    *byte = read_data[read_index++];
+    *last = (read_index == read_size);
+}
+
+static void test_stop_cb(uint32_t bus_id, uint8_t addr) {
+    (void)bus_id;
+    stop_addr = addr;
+    stop_count++;
+}
+
+void EXTI5_9_IRQHandler(void) {
+    if (exti_interrupt_flag_get(TEST_SCL_PIN)) {
+        exti_interrupt_flag_clear(TEST_SCL_PIN);
+        si2c_process(&si2c, PIN_SCL);
+    }
+
+    if (exti_interrupt_flag_get(TEST_SDA_PIN)) {
+        exti_interrupt_flag_clear(TEST_SDA_PIN);
+        si2c_process(&si2c, PIN_SDA);
+    }
+}
+
+#ifdef SI2C_WRITE_BEHIND
+void EXTI3_IRQHandler(void) {
+    EXTI_PD = TEST_FLUSH_LINE;
+    EXTI_SWIEV &= ~ TEST_FLUSH_LINE;
+    flushing = TRUE;
+    si2c_flush(&si2c);
+    flushing = FALSE;
+}
+#endif
+
+void setUp(void) {
+    native_reset();
+    written_count = 0;
+    read_index = 0;
+    read_size = 0;
+    stop_count = 0;
+    cb_ns = 0;
+    flushed_count = 0;
+    written_at_read = -1;
+
+    si2c.gpio = GPIOA;
+    si2c.scl_pin = TEST_SCL_PIN;
+    si2c.sda_pin = TEST_SDA_PIN;
+    si2c.bus_id = 0;
+    si2c.read_cb = test_read_cb;
+    si2c.write_cb = test_write_cb;
+    si2c.stop_cb = test_stop_cb;
+#ifdef SI2C_WRITE_BEHIND
+    si2c.flush_line = TEST_FLUSH_LINE;
+    eclic_irq_enable(EXTI3_IRQn, IRQ_LEVEL_FLUSH, 1);
+#endif
+
+    eclic_global_interrupt_enable();
+    eclic_irq_enable(EXTI5_9_IRQn, IRQ_LEVEL_SLAVE, 1);
+    gpio_exti_source_select(GPIO_PORT_SOURCE_GPIOA, GPIO_PIN_SOURCE_8);
+    gpio_exti_source_select(GPIO_PORT_SOURCE_GPIOA, GPIO_PIN_SOURCE_9);
+    si2c_init(&si2c);
+
+    native_smbus_init(&smc, GPIOA, TEST_SCL_PIN, TEST_SDA_PIN);
+}
+
+void tearDown(void) {
+}
+
+static void test_write_transaction(void) {
+    const uint8_t buf[] = {0xaa, 0x02, 0x34, 0x12};
+
+    TEST_ASSERT_TRUE(native_smbus_write(&smc, 0x52, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(sizeof(buf), written_count);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(buf, written, sizeof(buf));
+    TEST_ASSERT_EQUAL(1, stop_count);
+    TEST_ASSERT_EQUAL_HEX8(0x52 << 1, stop_addr);
+    TEST_ASSERT_EQUAL(ST_IDLE, si2c.state);
+}
+
+static void test_read_transaction(void) {
+    uint8_t buf[3];
+
+    read_data[0] = 0x02;
+    read_data[1] = 0xcc;
+    read_data[2] = 0x0c;
+    read_size = 3;
+
+    TEST_ASSERT_TRUE(native_smbus_read(&smc, 0x53, 0xca, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(1, written_count);
+    TEST_ASSERT_EQUAL_HEX8(0xca, written[0]);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(read_data, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_HEX8((0x53 << 1) | 0x01, stop_addr);
+}
+
+static void test_address_mismatch_nacks(void) {
+    const uint8_t buf[] = {0x07, 0xc0};
+
+    uint32_t irq_count = native_stats.irq_count;
+    TEST_ASSERT_FALSE(native_smbus_write(&smc, 0x2e, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(0, written_count);
+    TEST_ASSERT_EQUAL(ST_IDLE, si2c.state);
+    // SCL is not watched once the address did not match
+    TEST_ASSERT_FALSE(EXTI_INTEN & TEST_SCL_PIN);
+    TEST_ASSERT_LESS_THAN(40, native_stats.irq_count - irq_count);
+}
+
+static void test_back_to_back_transactions(void) {
+    const uint8_t buf[] = {0x2a, 0x55};
+
+    for (int i = 0; i < 4; i++) {
+        written_count = 0;
+        TEST_ASSERT_TRUE(native_smbus_write(&smc, 0x50, buf, sizeof(buf)));
+        TEST_ASSERT_EQUAL(sizeof(buf), written_count);
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(buf, written, sizeof(buf));
+    }
+    TEST_ASSERT_EQUAL(4, stop_count);
+    TEST_ASSERT_EQUAL(0, native_stats.stuck);
+}
+
+// Bytes reach the callback from the flush handler once the write is over
+// with SI2C_WRITE_BEHIND, one by one from the ISR as they come in otherwise
+static void test_write_callback_timing(void) {
+    native_smbus_start(&smc);
+    TEST_ASSERT_TRUE(native_smbus_write_byte(&smc, 0x52 << 1));
+    TEST_ASSERT_TRUE(native_smbus_write_byte(&smc, 0x2a));
+    TEST_ASSERT_TRUE(native_smbus_write_byte(&smc, 0x55));
+#ifdef SI2C_WRITE_BEHIND
+    TEST_ASSERT_EQUAL(0, written_count);
+#else
+    TEST_ASSERT_EQUAL(2, written_count);
+#endif
+    native_smbus_stop(&smc);
+    TEST_ASSERT_EQUAL(2, written_count);
+    TEST_ASSERT_EQUAL_HEX8(0x55, written[1]);
+    TEST_ASSERT_EQUAL(1, stop_count);
+#ifdef SI2C_WRITE_BEHIND
+    TEST_ASSERT_EQUAL(2, flushed_count);
+#else
+    TEST_ASSERT_EQUAL(0, flushed_count);
+#endif
+}
+
+// The register byte is in before the read behind it, even with the flush
+// handler held off the whole time
+static void test_read_after_write(void) {
+    uint8_t buf[2];
+
+    read_data[0] = 0x02;
+    read_data[1] = 0xcc;
+    read_size = 2;
+#ifdef SI2C_WRITE_BEHIND
+    eclic_irq_disable(EXTI3_IRQn);
+#endif
+    TEST_ASSERT_TRUE(native_smbus_read(&smc, 0x53, 0xca, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(1, written_at_read);
+    TEST_ASSERT_EQUAL_HEX8(0xca, written[0]);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(read_data, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL(1, stop_count);
+    TEST_ASSERT_EQUAL(0, flushed_count);
+}
+
+// More than a block write holds, nothing lost or out of order
+static void test_long_write(void) {
+    uint8_t buf[50];
+
+    for (int i = 0; i < (int)sizeof(buf); i++)
+        buf[i] = i * 7;
+    TEST_ASSERT_TRUE(native_smbus_write(&smc, 0x51, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(sizeof(buf), written_count);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(buf, written, sizeof(buf));
+}
+
+// Callbacks longer than the SCL low time. With SI2C_STRETCH the master
+// waits for them, otherwise it clocks on over a busy slave.
+static void test_slow_callbacks(void) {
+    const uint8_t buf[] = {0xaa, 0x02, 0x34, 0x12};
+    uint8_t rx[3];
+
+    cb_ns = 4 * NATIVE_SMBUS_EDGE_NS;
+    TEST_ASSERT_TRUE(native_smbus_write(&smc, 0x52, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(buf, written, sizeof(buf));
+    uint32_t write_late = smc.late;
+
+    native_advance(100000);
+    read_data[0] = 0x02;
+    read_data[1] = 0xcc;
+    read_data[2] = 0x0c;
+    read_size = 3;
+    smc.late = 0;
+    TEST_ASSERT_TRUE(native_smbus_read(&smc, 0x53, 0xca, rx, sizeof(rx)));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(read_data, rx, sizeof(rx));
+#ifdef SI2C_STRETCH
+    TEST_ASSERT_EQUAL(0, write_late);
+    TEST_ASSERT_EQUAL(0, smc.late);
+    TEST_ASSERT_TRUE(smc.stretch_ns >= cb_ns);
+#else
+#ifdef SI2C_WRITE_BEHIND
+    // Written bytes reach the callback below the slave ISR
+    TEST_ASSERT_EQUAL(0, write_late);
+#else
+    TEST_ASSERT_TRUE(write_late > 0);
+#endif
+    TEST_ASSERT_TRUE(smc.late > 0);
+    TEST_ASSERT_TRUE(smc.stretch_ns == 0);
+#endif
+    TEST_ASSERT_EQUAL(0, si2c.late);
+}
+
+// A rising edge the ISR only gets to after SCL fell again is counted
+static void test_late_isr_counted(void) {
+    native_smbus_start(&smc);
+    eclic_global_interrupt_disable();
+    native_smbus_write_byte(&smc, 0x52 << 1);
+    eclic_global_interrupt_enable();
+    native_smbus_stop(&smc);
+    TEST_ASSERT_TRUE(si2c.late > 0);
+    TEST_ASSERT_EQUAL(ST_IDLE, si2c.state);
+}
+
+// SDA ends up as input with pull-up, the other pins in CTL1 are untouched
+static void test_sda_direction_switch(void) {
+    uint8_t buf[3];
+
+    gpio_init(GPIOA, GPIO_MODE_OUT_PP, GPIO_OSPEED_2MHZ,
+            GPIO_PIN_10 | GPIO_PIN_15);
+    uint32_t ctl1 = GPIO_CTL1(GPIOA);
+
+    read_data[0] = 0x02;
+    read_data[1] = 0x00;
+    read_data[2] = 0x00;
+    read_size = 3;
+    TEST_ASSERT_TRUE(native_smbus_read(&smc, 0x53, 0xca, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_HEX32(ctl1, GPIO_CTL1(GPIOA));
+    TEST_ASSERT_TRUE(gpio_output_bit_get(GPIOA, TEST_SDA_PIN));
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_write_transaction);
+    RUN_TEST(test_read_transaction);
+    RUN_TEST(test_address_mismatch_nacks);
+    RUN_TEST(test_back_to_back_transactions);
+    RUN_TEST(test_write_callback_timing);
+    RUN_TEST(test_read_after_write);
+    RUN_TEST(test_long_write);
+    RUN_TEST(test_slow_callbacks);
+    RUN_TEST(test_late_isr_counted);
+    RUN_TEST(test_sda_direction_switch);
+    return UNITY_END();
+}
@@ -0,0 +1,52 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Tach count <-> RPM against the plain division
+ */
+#include <unity.h>
+#include "tach.h"
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+static void test_every_count(void) {
+    for (uint32_t tach = 1; tach <= 0xffff; tach++)
+        TEST_ASSERT_EQUAL_UINT32(TACH_RPM_K / tach, tach_to_rpm(tach));
+}
+
+static void test_every_count_recip(void) {
+    for (uint32_t tach = 1; tach <= 0xffff; tach++)
+        TEST_ASSERT_EQUAL_UINT32(TACH_RPM_K / tach, tach_to_rpm_recip(tach));
+    TEST_ASSERT_EQUAL_UINT32(0, tach_to_rpm_recip(0));
+    TEST_ASSERT_EQUAL_UINT32(TACH_RPM_K / 0xffff, tach_to_rpm_recip(0x10000));
+}
+
+static void test_zero(void) {
+    TEST_ASSERT_EQUAL_UINT32(0, tach_to_rpm(0));
+    TEST_ASSERT_EQUAL_UINT32(0, rpm_to_tach(0));
+}
+
+static void test_out_of_range(void) {
+    TEST_ASSERT_EQUAL_UINT32(TACH_RPM_K / 0xffff, tach_to_rpm(0x10000));
+    TEST_ASSERT_EQUAL_UINT32(TACH_RPM_K / 0xffff, rpm_to_tach(0xffffffff));
+}
+
+static void test_round_trip(void) {
+    TEST_ASSERT_EQUAL_UINT32(2400, tach_to_rpm(2048));
+    TEST_ASSERT_EQUAL_UINT32(2048, rpm_to_tach(2400));
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_every_count);
+    RUN_TEST(test_every_count_recip);
+    RUN_TEST(test_zero);
+    RUN_TEST(test_out_of_range);
+    RUN_TEST(test_round_trip);
+    return UNITY_END();
+}
@@ -0,0 +1,127 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Soft I2C trace ring, needs the trace compiled in (pio test -e native_trace)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+#include "gd32vf103.h"
+#include "native.h"
+#include "softi2c.h"
+#include "si2c_trace.h"
+#include "trace_decode.h"
+#include "fanslave.h"
+
+#ifndef SI2C_TRACE
+#error "test_trace needs -D SI2C_TRACE"
+#endif
+
+static native_smbus smc;
+
+void setUp(void) {
+    native_reset();
+    fanslave_init();
+    native_smbus_init(&smc, GPIOB, GPIO_PIN_12, GPIO_PIN_13);
+    si2c_trace_reset();
+}
+
+void tearDown(void) {
+}
+
+static void test_transaction(void) {
+    const uint8_t buf[] = {0x07, 0xc0};
+    SI2C_TRACE_RECORD record;
+    uint32_t events[5] = {0};
+    uint32_t records = 0;
+    uint32_t last_time = 0;
+
+    native_smbus_write(&smc, 0x53, buf, sizeof(buf));
+
+    while (si2c_trace_read(&record)) {
+        TEST_ASSERT_EQUAL(0, record.bus);
+        TEST_ASSERT_TRUE(record.event < 5);
+        if (records > 0)
+            TEST_ASSERT_TRUE((int32_t)(record.time - last_time) >= 0);
+        if (records == 1)
+            TEST_ASSERT_EQUAL(TR_START, record.event);
+        last_time = record.time;
+        events[record.event]++;
+        records++;
+    }
+
+    TEST_ASSERT_EQUAL(TR_STOP, record.event);
+    TEST_ASSERT_EQUAL(1, events[TR_START]);
+    TEST_ASSERT_EQUAL(1, events[TR_STOP]);
+    // At least one edge per ISR call
+    TEST_ASSERT_GREATER_OR_EQUAL(native_stats.irq_count, events[TR_EDGE]);
+    TEST_ASSERT_EQUAL(0, si2c_trace_ring.dropped);
+}
+
+static void test_update_request(void) {
+    const uint8_t buf[] = {0xac, 0x02, 0x00, 0x10};
+    SI2C_TRACE_RECORD record;
+    bool seen = FALSE;
+
+    // Last chip on the second bus
+    native_smbus_init(&smc, GPIOB, GPIO_PIN_14, GPIO_PIN_15);
+    native_smbus_write(&smc, 0x51, buf, sizeof(buf));
+
+    TEST_ASSERT_EQUAL(1, rpm_update_req);
+    while (si2c_trace_read(&record))
+        seen |= (record.event == TR_UPDATE_REQ) && (record.bus == 1);
+    TEST_ASSERT_TRUE(seen);
+}
+
+static void test_overflow_keeps_oldest(void) {
+    const uint8_t buf[] = {0xaa, 0x02, 0x34, 0x12};
+    SI2C_TRACE_RECORD record;
+
+    for (int i = 0; i < 10; i++)
+        native_smbus_write(&smc, 0x53, buf, sizeof(buf));
+
+    TEST_ASSERT_EQUAL(SI2C_TRACE_SIZE,
+            si2c_trace_ring.head - si2c_trace_ring.tail);
+    TEST_ASSERT_GREATER_THAN(0, si2c_trace_ring.dropped);
+    TEST_ASSERT_TRUE(si2c_trace_read(&record));
+    TEST_ASSERT_EQUAL(TR_EDGE, record.event);
+    TEST_ASSERT_TRUE(si2c_trace_read(&record));
+    TEST_ASSERT_EQUAL(TR_START, record.event);
+    TEST_ASSERT_EQUAL(ST_ADDR, record.state);
+}
+
+static void test_decode_dump(void) {
+    const uint8_t buf[] = {0x07, 0xc0};
+    char *text;
+    size_t len;
+    trace_decoder dec;
+
+    native_smbus_write(&smc, 0x53, buf, sizeof(buf));
+
+    FILE *fp = open_memstream(&text, &len);
+    trace_decode_begin(&dec, fp, TRACE_DEFAULT_CLOCK);
+    TEST_ASSERT_TRUE(trace_decode_dump(&dec, &si2c_trace_ring,
+            sizeof(si2c_trace_ring)));
+    TEST_ASSERT_FALSE(trace_decode_dump(&dec, &si2c_trace_ring, 8));
+    fclose(fp);
+
+    TEST_ASSERT_EQUAL(si2c_trace_ring.head - si2c_trace_ring.tail,
+            dec.records);
+    TEST_ASSERT_NOT_NULL(strstr(text, "bus0  SDA  ADDR"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "START"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "WRITE_PREPARE"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "STOP"));
+    free(text);
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_transaction);
+    RUN_TEST(test_update_request);
+    RUN_TEST(test_overflow_keeps_oldest);
+    RUN_TEST(test_decode_dump);
+    return UNITY_END();
+}
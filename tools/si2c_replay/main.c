@@ -0,0 +1,157 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Replays SMC <-> fan controller logic analyzer captures through the soft
+ * I2C slave and the fanslave register handlers on the host.
+ *
+ * Build and run with
+ *   pio run -e replay
+ *   .pio/build/replay/program [--bus0 SCL,SDA] [--bus1 SCL,SDA] capture...
+ * Signal names are the VCD references or CSV column headers, the default
+ * is SCL0,SDA0 and SCL1,SDA1. Use "-" to leave a bus out.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gd32vf103.h"
+#include "native.h"
+#include "replay.h"
+#include "fanslave.h"
+
+static uint64_t update_requests;
+static uint64_t start_requests;
+
+static void replay_step(void *arg) {
+    (void)arg;
+    // Consume the flags the way main() does
+    if (rpm_update_req) {
+        rpm_update_req = 0;
+        update_requests++;
+    }
+    if (start_req) {
+        start_req = 0;
+        start_requests++;
+    }
+}
+
+static bool parse_bus(replay_bus *bus, char *arg) {
+    if (!strcmp(arg, "-")) {
+        bus->scl_name = NULL;
+        bus->sda_name = NULL;
+        return TRUE;
+    }
+    char *comma = strchr(arg, ',');
+    if (comma == NULL)
+        return FALSE;
+    *comma = '\0';
+    bus->scl_name = arg;
+    bus->sda_name = comma + 1;
+    return TRUE;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [--bus0 SCL,SDA] [--bus1 SCL,SDA] capture...\n",
+            name);
+    exit(2);
+}
+
+static void print_report(const char *path, replay *r, uint64_t host_ns) {
+    printf("%s: %s, %.6f s captured\n", path,
+            (r->format == REPLAY_VCD) ? "VCD" : "CSV", r->time);
+    printf("  edges %llu, timestamps %llu, ISR calls %u (%.2f per edge)\n",
+            (unsigned long long)r->edges, (unsigned long long)r->steps,
+            native_stats.irq_count,
+            r->edges ? (double)native_stats.irq_count / r->edges : 0.0);
+    printf("  ISR time %.1f ns avg, %llu ns max, %.1f ns per edge\n",
+            native_stats.irq_count ?
+                    (double)native_stats.irq_ns / native_stats.irq_count : 0.0,
+            (unsigned long long)native_stats.irq_ns_max,
+            r->edges ? (double)native_stats.irq_ns / r->edges : 0.0);
+    for (uint32_t i = 0; i < r->buses; i++) {
+        replay_bus *bus = &r->bus[i];
+        if (bus->scl_name == NULL)
+            continue;
+        printf("  bus%u: %llu starts, %llu stops, %llu SDA conflicts\n", i,
+                (unsigned long long)bus->starts,
+                (unsigned long long)bus->stops,
+                (unsigned long long)bus->conflicts);
+    }
+    printf("  replay %.3f s host, %.2f M edges/s, %.1fx real time\n",
+            host_ns / 1e9, host_ns ? r->edges * 1e3 / host_ns : 0.0,
+            host_ns ? r->time * 1e9 / host_ns : 0.0);
+    printf("  update requests %llu, start requests %llu\n",
+            (unsigned long long)update_requests,
+            (unsigned long long)start_requests);
+
+    printf("  fs_enabled       ");
+    for (int i = 0; i < 14; i++)
+        printf(" %5d", fs_enabled[i]);
+    printf("\n  fs_requested_tach");
+    for (int i = 0; i < 14; i++)
+        printf(" %05x", fs_requested_tach[i]);
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    static char bus0[] = "SCL0,SDA0";
+    static char bus1[] = "SCL1,SDA1";
+    replay r;
+    uint32_t tach[FS_CHANNELS];
+    int files = 0;
+    int ret = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.buses = 2;
+    r.bus[0].gpio = GPIOB;
+    r.bus[0].scl_pin = GPIO_PIN_12;
+    r.bus[0].sda_pin = GPIO_PIN_13;
+    r.bus[1].gpio = GPIOB;
+    r.bus[1].scl_pin = GPIO_PIN_14;
+    r.bus[1].sda_pin = GPIO_PIN_15;
+    parse_bus(&r.bus[0], bus0);
+    parse_bus(&r.bus[1], bus1);
+    r.step_cb = replay_step;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--bus0") && (i + 1 < argc)) {
+            if (!parse_bus(&r.bus[0], argv[++i]))
+                usage(argv[0]);
+        }
+        else if (!strcmp(argv[i], "--bus1") && (i + 1 < argc)) {
+            if (!parse_bus(&r.bus[1], argv[++i]))
+                usage(argv[0]);
+        }
+        else if (argv[i][0] == '-') {
+            usage(argv[0]);
+        }
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--bus0") || !strcmp(argv[i], "--bus1")) {
+            i++;
+            continue;
+        }
+
+        // Every capture starts from a freshly booted controller
+        native_reset();
+        fanslave_init();
+        for (int ch = 0; ch < FS_CHANNELS; ch++)
+            tach[ch] = 0x0ccc;
+        fanslave_set_actual(tach);
+        update_requests = 0;
+        start_requests = 0;
+
+        uint64_t start = native_now_ns();
+        if (!replay_file(&r, argv[i])) {
+            fprintf(stderr, "%s: cannot read capture\n", argv[i]);
+            ret = 1;
+            continue;
+        }
+        print_report(argv[i], &r, native_now_ns() - start);
+        files++;
+    }
+
+    if (files == 0 && ret == 0)
+        usage(argv[0]);
+    return ret;
+}
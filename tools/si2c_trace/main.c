@@ -0,0 +1,66 @@
+/* Copyright 2020 Wenting Zhang
+ * Released under MIT license
+ *
+ * Decodes a memory dump of the soft I2C trace ring taken from a firmware
+ * built with -D SI2C_TRACE, e.g. from gdb:
+ *   dump binary value trace.bin si2c_trace_ring
+ *
+ * Build and run with
+ *   pio run -e trace
+ *   .pio/build/trace/program [--clock HZ] trace.bin
+ * The clock is the mtime rate, SystemCoreClock / 4 by default.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gd32vf103.h"
+#include "trace_decode.h"
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [--clock HZ] dump...\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    static uint8_t dump[sizeof(SI2C_TRACE_RING) + 1];
+    uint32_t clock = TRACE_DEFAULT_CLOCK;
+    trace_decoder dec;
+    int files = 0;
+    int ret = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--clock") && (i + 1 < argc)) {
+            clock = strtoul(argv[++i], NULL, 0);
+            if (clock == 0)
+                usage(argv[0]);
+            continue;
+        }
+        else if (argv[i][0] == '-') {
+            usage(argv[0]);
+        }
+
+        FILE *fp = fopen(argv[i], "rb");
+        if (fp == NULL) {
+            fprintf(stderr, "%s: cannot open\n", argv[i]);
+            ret = 1;
+            continue;
+        }
+        size_t len = fread(dump, 1, sizeof(dump), fp);
+        fclose(fp);
+
+        printf("%s:\n", argv[i]);
+        trace_decode_begin(&dec, stdout, clock);
+        if ((len != sizeof(SI2C_TRACE_RING)) ||
+                !trace_decode_dump(&dec, dump, len)) {
+            fprintf(stderr, "%s: not a %u byte si2c_trace_ring dump\n",
+                    argv[i], (unsigned)sizeof(SI2C_TRACE_RING));
+            ret = 1;
+            continue;
+        }
+        files++;
+    }
+
+    if (files == 0 && ret == 0)
+        usage(argv[0]);
+    return ret;
+}